@@ -1,52 +1,116 @@
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "buf_t.h"
 #include "mp-common.h"
 #include "mp-debug.h"
+#include "mp-memory.h"
 
 /*@null@*/ buf_t *buf_new(/*@null@*/ char *data, size_t size)
 {
-	buf_t *buf = malloc(sizeof(buf_t));
+	/* Fully initialized below: no need to zero */
+	buf_t *buf = zmalloc_raw(sizeof(buf_t));
 	if (NULL == buf) {
 		return (NULL);
 	}
 
-	buf->data = data;
-	buf->size = size;
 	buf->len = 0;
 
+	/* Take ownership of the given memory */
+	if (NULL != data) {
+		buf->data = data;
+		buf->size = size;
+		buf->flags = 0;
+		return (buf);
+	}
+
+	buf->data = buf->inl;
+	buf->size = BUF_INLINE_SIZE;
+	buf->flags = BUF_F_INLINE;
+	buf->data[0] = '\0';
+
+	/* One more byte for '\0' terminator */
+	if (size + 1 > BUF_INLINE_SIZE && EOK != buf_room(buf, size)) {
+		zfree(buf);
+		return (NULL);
+	}
+
+	return (buf);
+}
+
+/*@null@*/ buf_t *buf_view(const char *data, size_t len)
+{
+	buf_t *buf = NULL;
+
+	TESTP(data, NULL);
+
+	buf = zmalloc_raw(sizeof(buf_t));
+	TESTP_MES(buf, NULL, "Can't allocate buf_t");
+
+	/* Never written: BUF_F_RO is tested before any change */
+	buf->data = (char *)data;
+	buf->size = len;
+	buf->len = len;
+	buf->flags = BUF_F_RO;
 	return (buf);
 }
 
+/*@null@*/ buf_t *buf_slice(const buf_t *buf, size_t offset, size_t len)
+{
+	TESTP(buf, NULL);
+
+	if (offset > buf->len || len > buf->len - offset) {
+		DE("Slice %zu:%zu is out of buffer of %zu bytes\n", offset, len, buf->len);
+		return (NULL);
+	}
+
+	return (buf_view(buf->data + offset, len));
+}
+
 int buf_room(buf_t *buf, size_t size)
 {
-	void *tmp;
+	size_t new_size;
+	char *tmp;
+
 	if (NULL == buf || 0 == size) {
 		return (EBAD);
 	}
 
-	tmp = realloc(buf->data, buf->size + size);
+	if (buf->flags & BUF_F_RO) {
+		DE("Can't change read only buffer\n");
+		return (EBAD);
+	}
 
-	/* Case 1: realloc can't reallocate */
-	if (NULL == tmp) {
-		DE("Realloc failed\n");
+	if (size > SIZE_MAX - buf->size) {
+		DE("Size overflow\n");
 		return (EBAD);
 	}
 
-	/* Case 2: realloc succidded, new memory returned */
-	/* No need to clean the old memory - done by realloc */
-	if (NULL != tmp) {
-		buf->data = tmp;
+	/* Geometric growth: a serie of buf_add() costs amortized O(1) per byte */
+	new_size = (buf->size > SIZE_MAX / 2) ? SIZE_MAX : buf->size * 2;
+	if (new_size < buf->size + size) {
+		new_size = buf->size + size;
 	}
 
-	/* Clean newely allocated memory */
-	memset(buf->data + buf->size, 0, size);
+	/* Inline storage can't be realloc'ed: move it to heap */
+	if (buf->flags & BUF_F_INLINE) {
+		tmp = malloc(new_size);
+		if (NULL != tmp) {
+			memcpy(tmp, buf->inl, buf->len + 1);
+		}
+	} else {
+		tmp = realloc(buf->data, new_size);
+	}
 
-	/* Case 3: realloc succidded, the same pointer - we do nothing */
-	/* <Beeep> */
+	if (NULL == tmp) {
+		DE("Realloc failed\n");
+		return (EBAD);
+	}
 
-	buf->size += size;
+	buf->data = tmp;
+	buf->size = new_size;
+	buf->flags &= ~BUF_F_INLINE;
 	return (EOK);
 }
 
@@ -57,31 +121,66 @@ int buf_test_room(buf_t *buf, size_t expect)
 		return (EBAD);
 	}
 
-	if (buf->len + expect <= buf->size) {
+	if (expect > SIZE_MAX - buf->len - 1) {
+		DE("Size overflow\n");
+		return (EBAD);
+	}
+
+	/* Keep one byte for '\0' terminator */
+	if (buf->len + expect < buf->size) {
 		return (EOK);
 	}
 
-	return (buf_room(buf, expect));
+	return (buf_room(buf, buf->len + expect + 1 - buf->size));
 }
 
-int buf_free(buf_t *buf)
+char *buf_reserve(buf_t *buf, size_t size)
 {
-	if (NULL != buf->data) {
+	if (EOK != buf_test_room(buf, size)) {
+		return (NULL);
+	}
+
+	return (buf->data + buf->len);
+}
+
+int buf_commit(buf_t *buf, size_t size)
+{
+	TESTP(buf, EBAD);
+
+	if (buf->flags & BUF_F_RO || size >= buf->size - buf->len) {
+		DE("Commit of %zu bytes is out of reserved room\n", size);
 		return (EBAD);
 	}
 
-	free(buf);
+	buf->len += size;
+	buf->data[buf->len] = '\0';
 	return (EOK);
 }
 
-int buf_free_force(buf_t *buf)
+int buf_clean(buf_t *buf)
 {
-	if (NULL != buf->data) {
-		free(buf->data);
-		buf->data = NULL;
+	TESTP(buf, EBAD);
+
+	if (buf->flags & BUF_F_RO) {
+		DE("Can't change read only buffer\n");
+		return (EBAD);
 	}
 
-	return (buf_free(buf));
+	buf->len = 0;
+	buf->data[0] = '\0';
+	return (EOK);
+}
+
+int buf_free(buf_t *buf)
+{
+	TESTP(buf, EBAD);
+
+	if (0 == (buf->flags & (BUF_F_INLINE | BUF_F_RO))) {
+		TFREE(buf->data);
+	}
+
+	zfree(buf);
+	return (EOK);
 }
 
 int buf_add(buf_t *b, const char *buf, const size_t size)
@@ -98,6 +197,6 @@ int buf_add(buf_t *b, const char *buf, const size_t size)
 
 	memcpy(b->data + b->len, buf, size);
 	b->len += size;
+	b->data[b->len] = '\0';
 	return (EOK);
 }
-
@@ -1,11 +1,25 @@
 #ifndef _BUF_T_H_
 #define _BUF_T_H_
 
-/* Simple struct to hold a buffer / string and its size / lenght */
+#include <stddef.h>
+
+/* Payloads up to this size are kept inside of buf_t, no allocation needed */
+#define BUF_INLINE_SIZE 64
+
+/* buf_t flags */
+#define BUF_F_INLINE 1 /* 'data' points to 'inl' */
+#define BUF_F_RO 2     /* Slice / view: read only, the memory belongs to someone else */
+
+/* Simple struct to hold a buffer / string and its size / lenght.
+   An own buffer (not a slice or a view) always keeps '\0' after the data;
+   it is not counted in 'len', so the content can be used as C string.
+   Don't copy buf_t by value: 'data' may point inside of the struct. */
 struct buf_t_struct {
 	char *data;		/* Pointer to data */
 	size_t size;	/* Allocated size */
 	size_t len;		/* Used size */
+	unsigned int flags;
+	char inl[BUF_INLINE_SIZE]; /* Inline storage for small payloads */
 };
 
 typedef struct buf_t_struct buf_t;
@@ -13,7 +27,9 @@ typedef struct buf_t_struct buf_t;
 /**
  * 
  * @func buf_t* buf_t_alloc(char *data, size_t size)
- * @brief Allocate buf_t
+ * @brief Allocate buf_t. If 'data' is not NULL, buf_t takes
+ *  	  ownership of 'data' of allocated 'size' bytes; else
+ *  	  room for 'size' bytes reserved (inline if it fits).
  * 
  * @author se (03/04/2020)
  * 
@@ -24,11 +40,39 @@ typedef struct buf_t_struct buf_t;
  */
 extern /*@null@*/ buf_t *buf_new(/*@null@*/ char *data, size_t size);
 
+/**
+ * 
+ * @func buf_t* buf_slice(const buf_t *buf, size_t offset, size_t len)
+ * @brief Read only buf_t referencing 'len' bytes of 'buf'
+ *  	  from 'offset'; no copy. The slice must be freed
+ *  	  before 'buf' is changed or freed.
+ * 
+ * @param const buf_t* buf
+ * @param size_t offset
+ * @param size_t len
+ * 
+ * @return buf_t* 
+ */
+extern /*@null@*/ buf_t *buf_slice(const buf_t *buf, size_t offset, size_t len);
+
+/**
+ * 
+ * @func buf_t* buf_view(const char *data, size_t len)
+ * @brief Read only buf_t over foreign memory, for example
+ *  	  MQTT payload; no copy
+ * 
+ * @param const char* data
+ * @param size_t len
+ * 
+ * @return buf_t* 
+ */
+extern /*@null@*/ buf_t *buf_view(const char *data, size_t len);
+
 /**
  * 
  * @func int buf_t_free(buf_t *buf)
- * @brief Free buf_t; Returns 0 on success, -1 if buf->data != 
- *  	  NULL
+ * @brief Free buf_t and its own memory; the memory of a slice /
+ *  	  view is not touched. Returns EBAD on NULL only.
  * 
  * @author se (03/04/2020)
  * 
@@ -41,9 +85,10 @@ extern int buf_free(buf_t *buf);
 /**
  * 
  * @func int buf_room(buf_t *buf, size_t size)
- * @brief Allocate additional 'size' in the tail of buf_t; 
- *  	  content kept unchanged. The new memory will be
- *  	  cleaned.
+ * @brief Make room for at least 'size' more bytes in the
+ *  	  tail of buf_t; content kept unchanged. The buffer
+ *  	  grows at least x2, so a serie of buf_add() is
+ *  	  linear. The new memory is not cleaned.
  * 
  * @author se (06/04/2020)
  * 
@@ -71,16 +116,41 @@ extern int buf_test_room(buf_t *buf, size_t expect);
 
 /**
  * 
- * @func int buf_t_free_force(buf_t *buf)
- * @brief Free buf; if not empty, free buf->data
+ * @func char* buf_reserve(buf_t *buf, size_t size)
+ * @brief Get pointer to the tail of buf_t where at least
+ *  	  'size' bytes can be written, for example by recv().
+ *  	  Written bytes are added with buf_commit().
  * 
- * @author se (03/04/2020)
+ * @param buf_t* buf 
+ * @param size_t size 
+ * 
+ * @return char*
+ */
+extern /*@null@*/ char *buf_reserve(buf_t *buf, size_t size);
+
+/**
+ * 
+ * @func int buf_commit(buf_t *buf, size_t size)
+ * @brief Add 'size' bytes written into the reserved tail to
+ *  	  the content
+ * 
+ * @param buf_t* buf 
+ * @param size_t size 
+ * 
+ * @return int 
+ */
+extern int buf_commit(buf_t *buf, size_t size);
+
+/**
+ * 
+ * @func int buf_clean(buf_t *buf)
+ * @brief Drop the content, keep allocated memory for reuse
  * 
  * @param buf_t* buf 
  * 
  * @return int 
  */
-extern int buf_free_force(buf_t *buf);
+extern int buf_clean(buf_t *buf);
 
 /**
  * 
@@ -17,44 +17,48 @@
 #include "mp-ports.h"
 #include "mp-ssh.h"
 
+/* Encode snapshot (or its part 'key' if not NULL) and release the snapshot.
+   The snapshot is immutable, no lock or copy needed */
+static buf_t *mp_cli_snap2buf(ctl_snap_t *snap, const char *key)
+{
+	json_t *resp = NULL;
+	buf_t *buf = NULL;
+
+	TESTP_MES(snap, NULL, "No published snapshot");
+
+	resp = snap->j;
+	if (NULL != key) {
+		resp = j_find_j(snap->j, key);
+	}
+
+	if (NULL == resp) {
+		DE("Can't find '%s' in snapshot\n", key);
+	} else {
+		buf = j_2buf(resp);
+	}
+
+	ctl_snap_put(snap);
+	return (buf);
+}
+
 /* Get this machine info */
-static json_t *mp_cli_get_self_info_l()
+static buf_t *mp_cli_get_self_info()
 {
-	control_t *ctl = NULL;
 	DDD("Starting\n");
-	ctl = ctl_get();
-	return (j_dup(ctl->me));
+	return (mp_cli_snap2buf(ctl_snap_get_me(ctl_get()), NULL));
 }
 
-static json_t *mp_cli_get_ports_l()
+static buf_t *mp_cli_get_ports()
 {
-	control_t *ctl = NULL;
-	json_t *resp;
-	json_t *ports;
 	DDD("Starting\n");
-
-	ctl = ctl_get_locked();
-	ports = j_find_j(ctl->me, "ports");
-	if (NULL == ports) {
-		DE("Can't extract array 'ports'\n");
-		ctl_unlock(ctl);
-		return (NULL);
-	}
-	resp = j_dup(ports);
-	ctl_unlock(ctl);
-	return (resp);
+	return (mp_cli_snap2buf(ctl_snap_get_me(ctl_get()), "ports"));
 }
 
 /* Get list of all sources and targets */
-static json_t *mp_cli_get_list_l()
+static buf_t *mp_cli_get_list()
 {
-	control_t *ctl = NULL;
-	json_t *resp;
 	DDD("Starting\n");
-	ctl = ctl_get_locked();
-	resp = j_dup(ctl->hosts);
-	ctl_unlock(ctl);
-	return (resp);
+	return (mp_cli_snap2buf(ctl_snap_get_hosts(ctl_get()), NULL));
 }
 
 static json_t *mp_cli_ssh_forward(json_t *root)
@@ -79,9 +83,8 @@ static json_t *mp_cli_ssh_forward(json_t *root)
 	/*
 	server_ip = j_find_ref(root, JK_SSH_SERVER);
 	remote_destport_src = j_find_ref(root, JK_SSH_DESTPORT);
-	remote_destport = atoi(remote_destport_src);
-	local_listenport_str = j_find_ref(root, JK_SSH_LOCALPORT);
-	local_listenport = atoi(local_listenport_str);
+	remote_destport = ctl_port_get(root, JK_SSH_DESTPORT);
+	local_listenport = ctl_port_get(root, JK_SSH_LOCALPORT);
 	pub_key_name = j_find_ref(root, JK_SSH_PUBKEY);
 	priv_key_name = j_find_ref(root, JK_SSH_PRIVKEY);
 	username = j_find_ref(root, JK_SSH_USERNAME);
@@ -97,10 +100,10 @@ static json_t *mp_cli_ssh_forward(json_t *root)
 	rc = j_add_str(root, JK_SSH_SERVER, j_find_ref(remote_host, JK_IP_EXT));
 	TESTI_MES(rc, NULL, "can't find / add JK_IP_EXT -> JK_SSH_SERVER");
 
-	rc = j_add_str(root, JK_SSH_DESTPORT, j_find_ref(remote_host, JK_PORT_EXT));
+	rc = j_add_int(root, JK_SSH_DESTPORT, ctl_port_get(remote_host, JK_PORT_EXT));
 	TESTI_MES(rc, NULL, "can't find / add JK_PORT_EXT -> JK_SSH_DESTPORT");
 
-	rc = j_add_str(root, JK_SSH_LOCALPORT, "2222");
+	rc = j_add_int(root, JK_SSH_LOCALPORT, 2222);
 	TESTI_MES(rc, NULL, "can't add port 222 -> JK_SSH_LOCALPORT");
 
 	rc = j_add_str(root, JK_SSH_PUBKEY, "/home/se/.ssh/id_rsa.pub");
@@ -135,13 +138,14 @@ static json_t *mp_cli_openport_l(json_t *root)
 	int rc = EBAD;
 	json_t *resp = NULL;
 
-	ctl = ctl_get_locked();
+	ctl = ctl_get();
+	ctl_rlock(ctl, CTL_LOCK_MOSQ);
 	DDD("Calling send_request_to_open_port\n");
 	if (NULL != ctl->mosq) {
 		rc = send_request_to_open_port(ctl->mosq, root);
 
 	}
-	ctl_unlock(ctl);
+	ctl_unlock(ctl, CTL_LOCK_MOSQ);
 
 	resp = j_new();
 
@@ -157,7 +161,7 @@ static json_t *mp_cli_openport_l(json_t *root)
 static json_t *mp_cli_closeport_l(json_t *root)
 {
 	char *uid = NULL;
-	char *port = NULL;
+	int port = 0;
 	char *protocol = NULL;
 	control_t *ctl = NULL;
 	int rc = EBAD;
@@ -170,23 +174,27 @@ static json_t *mp_cli_closeport_l(json_t *root)
 	TESTP_MES(uid, NULL, "Not found 'uid' field");
 
 	/* Get port which should be opened in the remote client */
-	/* We mean "internal" port, for example port "22" for ssh.*/
-	port = j_find_dup(root, JK_PORT_INT);
-	TESTP_MES_GO(port, err, "Not found 'port' field");
+	/* We mean "internal" port, for example port 22 for ssh.*/
+	port = ctl_port_get(root, JK_PORT_INT);
+	if (0 == port) {
+		DE("Not found 'port' field\n");
+		goto err;
+	}
 
 	/* And this port should be opened for TCP or UDP? */
 	protocol = j_find_dup(root, JK_PROTOCOL);
-	TESTP_MES_GO(port, err, "Not found 'protocol' field");
+	TESTP_MES_GO(protocol, err, "Not found 'protocol' field");
 
-	ctl = ctl_get_locked();
+	ctl = ctl_get();
+	ctl_rlock(ctl, CTL_LOCK_MOSQ);
 	DDD("Calling send_request_to_open_port\n");
 	if (NULL != ctl->mosq) {
 		rc = send_request_to_close_port(ctl->mosq, uid, port, protocol);
 	}
-	ctl_unlock(ctl);
+	ctl_unlock(ctl, CTL_LOCK_MOSQ);
 
 	resp = j_new();
-	TESTP_MES_GO(port, err, "Can't allocate JSON object");
+	TESTP_MES_GO(resp, err, "Can't allocate JSON object");
 
 	if (EOK == rc) {
 		if (EOK != j_add_str(resp, JK_STATUS, JV_OK)) DE("Can't add 'status'\n");
@@ -196,23 +204,33 @@ static json_t *mp_cli_closeport_l(json_t *root)
 
 err:
 	TFREE(uid);
-	TFREE(port);
 	TFREE(protocol);
 	return (resp);
 }
 
-static json_t *mp_cli_parse_command(json_t *root)
+/* Encode response object into text buffer and remove the object */
+static buf_t *mp_cli_resp2buf(json_t *resp)
+{
+	buf_t *buf = NULL;
+
+	TESTP_MES(resp, NULL, "Can't create JSON object for respond");
+	buf = j_2buf(resp);
+	j_rm(resp);
+	return (buf);
+}
+
+static buf_t *mp_cli_parse_command(json_t *root)
 {
 	TESTP_MES(root, NULL, "Got NULL");
 
 	if (EOK == j_test(root, JK_COMMAND, JV_TYPE_ME)) {
 		DD("Found 'me' command\n");
-		return (mp_cli_get_self_info_l());
+		return (mp_cli_get_self_info());
 	}
 
 	if (EOK == j_test(root, JK_COMMAND, JV_COMMAND_LIST)) {
 		DD("Found 'list' command\n");
-		return (mp_cli_get_list_l());
+		return (mp_cli_get_list());
 	}
 
 	if (EOK == j_test(root, JK_COMMAND, JV_TYPE_CONNECT)) {
@@ -228,23 +246,34 @@ static json_t *mp_cli_parse_command(json_t *root)
 	if (EOK == j_test(root, JK_COMMAND, JV_TYPE_OPENPORT)) {
 		DD("Found 'openport' command\n");
 		j_print(root, "root");
-		return (mp_cli_openport_l(root));
+		return (mp_cli_resp2buf(mp_cli_openport_l(root)));
 	}
 
 	if (EOK == j_test(root, JK_COMMAND, JV_TYPE_CLOSEPORT)) {
 		DD("Found 'closeport' command\n");
-		return (mp_cli_closeport_l(root));
+		return (mp_cli_resp2buf(mp_cli_closeport_l(root)));
+	}
+
+	/* Batch requests are built by mp-shell and sent as is, like 'openport' */
+	if (EOK == j_test(root, JK_COMMAND, JV_TYPE_OPENPORTS) || EOK == j_test(root, JK_COMMAND, JV_TYPE_CLOSEPORTS)) {
+		DD("Found batch ports command\n");
+		return (mp_cli_resp2buf(mp_cli_openport_l(root)));
 	}
 
 
 	if (EOK == j_test(root, JK_COMMAND, JV_COMMAND_PORTS)) {
 		DD("Found 'ports' command\n");
-		return (mp_cli_get_ports_l());
+		return (mp_cli_get_ports());
+	}
+
+	if (EOK == j_test(root, JK_COMMAND, JV_COMMAND_LOCKSTAT)) {
+		DD("Found 'lockstat' command\n");
+		return (mp_cli_resp2buf(ctl_lock_prof_dump()));
 	}
 
 	if (EOK == j_test(root, JK_TYPE, JV_TYPE_SSH)) {
 		DD("Found 'SSH' command\n");
-		return (mp_cli_ssh_forward(root));
+		return (mp_cli_resp2buf(mp_cli_ssh_forward(root)));
 	}
 
 	return (NULL);
@@ -280,11 +309,12 @@ void *mp_cli_thread(void *arg __attribute__((unused)))
 
 	do {
 		int fd2 = -1;
-		char *buf = NULL;
+		int lowat = 1;
+		char *tail = NULL;
+		buf_t *buf = NULL;
 		buf_t *buft = NULL;
 		//size_t len = CLI_BUF_LEN;
 		json_t *root = NULL;
-		json_t *root_resp = NULL;
 
 		/* Listen for incoming connection */
 		rc = (ssize_t)listen(fd, 2);
@@ -301,63 +331,54 @@ void *mp_cli_thread(void *arg __attribute__((unused)))
 		}
 
 		/* Allocate buffer for reading */
-		buf = zmalloc(CLI_BUF_LEN);
+		buf = buf_new(NULL, CLI_BUF_LEN);
 		TESTP_MES(buf, NULL, "Can't allocate buf");
 
-		rc = (ssize_t)setsockopt(fd2, SOL_SOCKET, SO_RCVLOWAT, buf, CLI_BUF_LEN);
+		rc = (ssize_t)setsockopt(fd2, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
 		if (rc < 0) {
 			DE("setsockopt(SO_RCVLOWAT) failed\n");
-			free(buf);
+			buf_free(buf);
 			break;
 		}
 
-		/* Receive buffer from cli */
-		rc = recv(fd2, buf, CLI_BUF_LEN, 0);
-		if (rc < 0) {
+		/* Receive buffer from cli directly into buf_t */
+		tail = buf_reserve(buf, CLI_BUF_LEN);
+		rc = recv(fd2, tail, CLI_BUF_LEN, 0);
+		if (rc < 0 || EOK != buf_commit(buf, (size_t)rc)) {
 			DE("recv failed\n");
-			free(buf);
+			buf_free(buf);
 			break;
 		}
 
-		/* Add 0 terminator, else json decoding will fail */
-		*(buf + rc) = '\0';
-		root = j_str2j(buf);
-		free(buf);
+		root = j_buf2j(buf);
+		buf_free(buf);
 		if (NULL == root) {
 			DE("Can't decode buf to JSON object\n");
 			break;
 		}
 
-		/* Now let's parse the command and receive from the parser an answer */
-		root_resp = mp_cli_parse_command(root);
+		/* Now let's parse the command and receive from the parser an encoded answer */
+		buft = mp_cli_parse_command(root);
 
 		/* That's it, we don't need request objext any more */
 		j_rm(root);
 
-		if (NULL == root_resp) {
-			DE("Can't create JSON object for respond (parse_cli_command failed)\n");
-			break;
-		}
-
-		/* Encode response object into text buffer */
-		buft = j_2buf(root_resp);
-		j_rm(root_resp);
-
 		if (NULL == buft) {
-			DE("Can't convert json to buf_t\n");
+			DE("Can't create respond (parse_cli_command failed)\n");
 			break;
 		}
 
-		/* Send the encoded JSON to cli */
-		rc = send(fd2, buft->data, buft->size, 0);
-		if (rc != (ssize_t)buft->size) {
+		/* Send the encoded JSON to cli; the cli reads until the connection closed */
+		rc = send(fd2, buft->data, buft->len, 0);
+		close(fd2);
+		if (rc != (ssize_t)buft->len) {
 			DE("send() failed");
-			buf_free_force(buft);
+			buf_free(buft);
 			break;
 		}
 
 		/* Free the buffer */
-		buf_free_force(buft);
+		buf_free(buft);
 	} while (1);
 
 	return (NULL);
@@ -12,29 +12,38 @@
 #include "mp-jansson.h"
 #include "mp-dict.h"
 
+/* Build forum topic of this machine. Uses published snapshot of 'me',
+   so it never waits for the writers of ctl->me */
+static int mp_communicate_forum_topic(char *forum_topic)
+{
+	ctl_snap_t *snap = ctl_snap_get_me(ctl_get());
+	TESTP_MES(snap, EBAD, "No snapshot of 'me'");
+
+	memset(forum_topic, 0, TOPIC_MAX_LEN);
+	snprintf(forum_topic, TOPIC_MAX_LEN, "users/%s/forum/%s",
+			 j_find_ref(snap->j, JK_USER),
+			 j_find_ref(snap->j, JK_UID));
+
+	ctl_snap_put(snap);
+	return (EOK);
+}
+
 int send_keepalive_l(struct mosquitto *mosq)
 {
-	control_t *ctl = NULL;
 	char forum_topic[TOPIC_MAX_LEN];
 	buf_t *buf = NULL;
 	int rc = EBAD;
 
-	memset(forum_topic, 0, TOPIC_MAX_LEN);
-
-	ctl = ctl_get();
-	ctl_lock(ctl);
-	snprintf(forum_topic, TOPIC_MAX_LEN, "users/%s/forum/%s",
-			 j_find_ref(ctl->me, JK_USER),
-			 j_find_ref(ctl->me, JK_UID));
+	rc = mp_communicate_forum_topic(forum_topic);
+	TESTI_MES(rc, EBAD, "Can't build forum topic");
 
 	buf = mp_requests_build_keepalive();
-	ctl_unlock(ctl);
 	if (NULL == buf) {
 		DE("can't build notification\n");
 		return (EBAD);
 	}
 
-	rc = mosquitto_publish(mosq, 0, forum_topic, (int)buf->size, buf->data, 0, false);
+	rc = mosquitto_publish(mosq, 0, forum_topic, (int)buf->len, buf->data, 0, false);
 	if (MOSQ_ERR_SUCCESS == rc) {
 		rc = EOK;
 		goto end;
@@ -50,45 +59,43 @@ int send_keepalive_l(struct mosquitto *mosq)
 
 	DD("Reconnected\n");
 
-	rc = mosquitto_publish(mosq, 0, forum_topic, (int)buf->size, buf->data, 0, false);
+	rc = mosquitto_publish(mosq, 0, forum_topic, (int)buf->len, buf->data, 0, false);
 	if (MOSQ_ERR_SUCCESS != rc) {
 		DE("Failed to send notification\n");
 		rc = EBAD;
 	}
 
 end:
-	buf_free_force(buf);
+	buf_free(buf);
 	return (rc);
 }
 
 
 int send_reveal_l(struct mosquitto *mosq)
 {
-	control_t *ctl = NULL;
+	ctl_snap_t *snap = NULL;
 	char forum_topic[TOPIC_MAX_LEN];
 	buf_t *buf = NULL;
 	int rc = EBAD;
 
-	memset(forum_topic, 0, TOPIC_MAX_LEN);
-
-	ctl = ctl_get_locked();
-	snprintf(forum_topic, TOPIC_MAX_LEN, "users/%s/forum/%s", 
-			 j_find_ref(ctl->me, JK_USER),
-			 j_find_ref(ctl->me, JK_UID));
+	rc = mp_communicate_forum_topic(forum_topic);
+	TESTI_MES(rc, EBAD, "Can't build forum topic");
 
-	buf = mp_requests_build_reveal(j_find_ref(ctl->me, JK_UID),
-									j_find_ref(ctl->me, JK_NAME));
-	ctl_unlock(ctl);
+	snap = ctl_snap_get_me(ctl_get());
+	TESTP_MES(snap, EBAD, "No snapshot of 'me'");
+	buf = mp_requests_build_reveal(j_find_ref(snap->j, JK_UID),
+									j_find_ref(snap->j, JK_NAME));
+	ctl_snap_put(snap);
 
 	TESTP_MES(buf, EBAD, "Can't build notification");
 
-	rc = mosquitto_publish(mosq, 0, forum_topic, (int)buf->size, buf->data, 0, false);
+	rc = mosquitto_publish(mosq, 0, forum_topic, (int)buf->len, buf->data, 0, false);
 	if (MOSQ_ERR_SUCCESS != rc) {
 		DE("Failed to send reveal request\n");
 		return (EBAD);
 	}
 
-	buf_free_force(buf);
+	buf_free(buf);
 	return (EOK);
 }
 
@@ -97,79 +104,67 @@ int send_request_to_open_port(struct mosquitto *mosq, json_t *root)
 	int rc = EBAD;
 	buf_t *buf = NULL;
 	char forum_topic[TOPIC_MAX_LEN];
-	control_t *ctl = NULL;
 
 	TESTP(mosq, EBAD);
 
-	ctl = ctl_get();
-
-	snprintf(forum_topic, TOPIC_MAX_LEN, "users/%s/forum/%s",
-			 j_find_ref(ctl->me, JK_USER),
-			 j_find_ref(ctl->me, JK_UID));
+	rc = mp_communicate_forum_topic(forum_topic);
+	TESTI_MES(rc, EBAD, "Can't build forum topic");
 
 	DDD("Going to build request\n");
 	buf = j_2buf(root);
 
 	TESTP_MES(buf, EBAD, "Can't build open port request");
 	DDD("Going to send request\n");
-	rc = mosquitto_publish(mosq, 0, forum_topic, (int)buf->size, buf->data, 0, false);
-	buf_free_force(buf);
+	rc = mosquitto_publish(mosq, 0, forum_topic, (int)buf->len, buf->data, 0, false);
+	buf_free(buf);
 	DDD("Sent request, status is %d\n", rc);
 	return (rc);
 }
 
-int send_request_to_open_port_old(struct mosquitto *mosq, char *target_uid, char *port, char *protocol)
+int send_request_to_open_port_old(struct mosquitto *mosq, char *target_uid, int port, char *protocol)
 {
 	int rc = EBAD;
 	buf_t *buf = NULL;
 	char forum_topic[TOPIC_MAX_LEN];
-	control_t *ctl = NULL;
 
 	TESTP(mosq, EBAD);
 	TESTP(target_uid, EBAD);
-	TESTP(port, EBAD);
 	TESTP(protocol, EBAD);
 
-	ctl = ctl_get();
-
-	snprintf(forum_topic, TOPIC_MAX_LEN, "users/%s/forum/%s",
-			 j_find_ref(ctl->me, JK_USER),
-			 j_find_ref(ctl->me, JK_UID));
+	rc = mp_communicate_forum_topic(forum_topic);
+	TESTI_MES(rc, EBAD, "Can't build forum topic");
 
 	DDD("Going to build request\n");
 	buf = mp_requests_open_port(target_uid, port, protocol);
 
 	TESTP_MES(buf, EBAD, "Can't build open port request");
 	DDD("Going to send request\n");
-	rc = mosquitto_publish(mosq, 0, forum_topic, (int)buf->size, buf->data, 0, false);
+	rc = mosquitto_publish(mosq, 0, forum_topic, (int)buf->len, buf->data, 0, false);
+	buf_free(buf);
 	DDD("Sent request, status is %d\n", rc);
 	return (rc);
 }
 
-int send_request_to_close_port(struct mosquitto *mosq, char *target_uid, char *port, char *protocol)
+int send_request_to_close_port(struct mosquitto *mosq, char *target_uid, int port, char *protocol)
 {
 	int rc = EBAD;
 	buf_t *buf = NULL;
 	char forum_topic[TOPIC_MAX_LEN];
-	control_t *ctl = NULL;
 
 	TESTP(mosq, EBAD);
 	TESTP(target_uid, EBAD);
-	TESTP(port, EBAD);
 	TESTP(protocol, EBAD);
 
-	ctl = ctl_get();
-
-	snprintf(forum_topic, TOPIC_MAX_LEN, "users/%s/forum/%s",
-			 j_find_ref(ctl->me, JK_USER),
-			 j_find_ref(ctl->me, JK_UID));
+	rc = mp_communicate_forum_topic(forum_topic);
+	TESTI_MES(rc, EBAD, "Can't build forum topic");
 
 	DDD("Going to build request\n");
 	buf = mp_requests_close_port(target_uid, port, protocol);
 
 	TESTP_MES(buf, EBAD, "Can't build open port request");
 	DDD("Going to send request\n");
-	rc = mosquitto_publish(mosq, 0, forum_topic, (int)buf->size, buf->data, 0, false);
+	rc = mosquitto_publish(mosq, 0, forum_topic, (int)buf->len, buf->data, 0, false);
+	buf_free(buf);
 	DDD("Sent request, status is %d\n", rc);
 	return (rc);
 }
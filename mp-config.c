@@ -125,7 +125,7 @@ static json_t *mp_config_read(void)
 	root = j_str2j(buf);
 
 err:
-	TFREE(filename);
+	TZFREE(filename);
 	TFREE(buf);
 	if (fd) fclose(fd);
 	return (root);
@@ -160,10 +160,10 @@ int mp_config_save(void *_ctl)
 	} else {
 		DE("Some error\n");
 		perror("Config directory testing error: ");
-		free(dirname);
+		zfree(dirname);
 		return (EBAD);
 	}
-	free(dirname);
+	zfree(dirname);
 
 	filename = mp_config_get_config_name();
 	TESTP_MES(filename, -1, "Can't create config file name");
@@ -175,24 +175,24 @@ int mp_config_save(void *_ctl)
 	}
 
 	buf = j_2buf(ctl->config);
-	if (NULL == buf || 0 == buf->size) {
+	if (NULL == buf || 0 == buf->len) {
 		DE("Can't encode config file\n");
 		rc = -1;
 		goto err;
 	}
 
-	fwrite(buf->data, 1, buf->size, fd);
+	written = fwrite(buf->data, 1, buf->len, fd);
 	fclose(fd);
 	fd = NULL;
 
-	if (written != buf->size) {
+	rc = EOK;
+	if (written != buf->len) {
 		rc = EBAD;
 	}
 
-	rc = EOK;
-
 err:
-	if (NULL != buf) buf_free_force(buf);
+	TZFREE(filename);
+	if (NULL != buf) buf_free(buf);
 	if (NULL != fd) fclose(fd);
 	return (rc);
 }
@@ -223,6 +223,9 @@ int mp_config_from_ctl(void *_ctl)
 	rc = j_add_str(ctl->config, JK_BRIDGE, JV_YES);
 	TESTI_MES(rc, EBAD, "Can't add JK_BRIDGE");
 
+	rc = j_cp(ctl->me, ctl->config, JK_SERVICE_PORTS);
+	TESTI_MES(rc, EBAD, "Can't copy JK_SERVICE_PORTS");
+
 	return (mp_config_save(ctl));
 }
 
@@ -1,3 +1,9 @@
+#define _GNU_SOURCE /* pthread_rwlockattr_setkind_np() */
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <stdlib.h>
+#include <netinet/in.h>
 #include "mp-ctl.h"
 #include "mp-common.h"
 #include "mp-debug.h"
@@ -5,10 +11,250 @@
 #include "mp-jansson.h"
 #include "mp-dict.h"
 
+/* Snapshots share host objects between generations, and the last reference
+   to a snapshot may be dropped by any thread. It is safe only if jansson
+   changes reference counters atomically, what it does since version 2.11.
+   Also several threads encode the same snapshot / the same object under
+   read lock at once; json_dumps() doesn't touch the object since 2.13 */
+#if JANSSON_VERSION_HEX < 0x020d00
+	#error "jansson >= 2.13 is required: atomic json_t reference counting, reentrant json_dumps()"
+#endif
+
+#ifdef DEBUG3
+/* Bitmasks of domains locked by the current thread, for lock assertions */
+static __thread unsigned int ctl_held_r = 0;
+static __thread unsigned int ctl_held_w = 0;
+
+int ctl_lock_held(ctl_lock_dom_e dom, int write)
+{
+	if (write) return (0 != (ctl_held_w & (1U << dom)));
+	return (0 != ((ctl_held_r | ctl_held_w) & (1U << dom)));
+}
+
+/* Called before a domain locked: it must not be held yet,
+   and no domain after it in the lock order must be held */
+static void ctl_lock_check(ctl_lock_dom_e dom)
+{
+	unsigned int held = ctl_held_r | ctl_held_w;
+	if (0 != (held >> dom)) {
+		DE("Lock order violation: locking domain %d while holding mask 0x%X\n", dom, held);
+		assert(1 == 0);
+	}
+}
+#endif /* DEBUG3 */
+
+#ifdef CTL_LOCK_PROF
+/* Lock profiler: wait and hold time of ctl locks per call site */
+
+/* Max number of call sites; must be power of 2 */
+#define CTL_PROF_SITES 256
+/* Histogram bucket 0 counts times < 1 usec, bucket N counts [2^(N-1), 2^N) usec;
+   the last bucket counts everything longer */
+#define CTL_PROF_BUCKETS 24
+
+typedef struct ctl_prof_site_struct {
+	const char *func;	/* Call site function, NULL if the slot is free */
+	int line;			/* Call site line */
+	int dom;			/* Lock domain, ctl_lock_dom_e */
+	int write;			/* 1 for ctl_lock(), 0 for ctl_rlock() */
+	uint64_t count;
+	uint64_t wait_total_ns;
+	uint64_t wait_max_ns;
+	uint64_t hold_total_ns;
+	uint64_t hold_max_ns;
+	uint64_t wait_hist[CTL_PROF_BUCKETS];
+	uint64_t hold_hist[CTL_PROF_BUCKETS];
+} ctl_prof_site_t;
+
+static ctl_prof_site_t ctl_prof_sites[CTL_PROF_SITES];
+/* Taken only to register a new call site */
+static pthread_mutex_t ctl_prof_sites_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* When the current thread got a domain lock, and from which call site */
+static __thread uint64_t ctl_prof_since[CTL_LOCK_MAX];
+static __thread ctl_prof_site_t *ctl_prof_holder[CTL_LOCK_MAX];
+
+static const char *ctl_lock_dom_names[CTL_LOCK_MAX] = {"me", "hosts", "tickets", "mosq"};
+
+static uint64_t ctl_prof_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+static int ctl_prof_bucket(uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int bucket = 0;
+
+	while (us > 0 && bucket < CTL_PROF_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+	return (bucket);
+}
+
+/* Find the call site, register it if it is new. Sites are never removed,
+   so a registered site found without lock */
+static ctl_prof_site_t *ctl_prof_site(const char *func, int line, int dom, int write)
+{
+	size_t i;
+	size_t slot = (((uintptr_t)func >> 3) ^ ((size_t)line * 2654435761U) ^ (size_t)dom) & (CTL_PROF_SITES - 1);
+	int locked = 0;
+
+	for (i = 0; i < CTL_PROF_SITES; i++) {
+		ctl_prof_site_t *site = &ctl_prof_sites[(slot + i) & (CTL_PROF_SITES - 1)];
+		const char *f = __atomic_load_n(&site->func, __ATOMIC_ACQUIRE);
+
+		if (NULL == f) {
+			/* Not registered: register under lock. Another thread could take the slot meanwhile */
+			if (!locked) {
+				pthread_mutex_lock(&ctl_prof_sites_lock);
+				locked = 1;
+				if (NULL != __atomic_load_n(&site->func, __ATOMIC_ACQUIRE)) {
+					i--;
+					continue;
+				}
+			}
+			site->line = line;
+			site->dom = dom;
+			site->write = write;
+			__atomic_store_n(&site->func, func, __ATOMIC_RELEASE);
+			pthread_mutex_unlock(&ctl_prof_sites_lock);
+			return (site);
+		}
+
+		if (f == func && site->line == line && site->dom == dom) {
+			if (locked) pthread_mutex_unlock(&ctl_prof_sites_lock);
+			return (site);
+		}
+	}
+
+	if (locked) pthread_mutex_unlock(&ctl_prof_sites_lock);
+	return (NULL);
+}
+
+static void ctl_prof_max(uint64_t *max, uint64_t val)
+{
+	uint64_t cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+	while (val > cur && !__atomic_compare_exchange_n(max, &cur, val, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void ctl_prof_lock(control_t *ctl, ctl_lock_dom_e dom, int write, const char *func, int line)
+{
+	ctl_prof_site_t *site = NULL;
+	uint64_t start = ctl_prof_now();
+	uint64_t wait;
+
+	if (write) pthread_rwlock_wrlock(&ctl->locks[dom]);
+	else pthread_rwlock_rdlock(&ctl->locks[dom]);
+
+	ctl_prof_since[dom] = ctl_prof_now();
+	wait = ctl_prof_since[dom] - start;
+
+	site = ctl_prof_site(func, line, dom, write);
+	ctl_prof_holder[dom] = site;
+	if (NULL == site) {
+		return;
+	}
+
+	__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&site->wait_total_ns, wait, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&site->wait_hist[ctl_prof_bucket(wait)], 1, __ATOMIC_RELAXED);
+	ctl_prof_max(&site->wait_max_ns, wait);
+}
+
+/* Account hold time to the site which took the lock. Called before unlock */
+static void ctl_prof_unlock(ctl_lock_dom_e dom)
+{
+	ctl_prof_site_t *site = ctl_prof_holder[dom];
+	uint64_t hold;
+
+	if (NULL == site) return;
+
+	hold = ctl_prof_now() - ctl_prof_since[dom];
+	ctl_prof_holder[dom] = NULL;
+
+	__atomic_add_fetch(&site->hold_total_ns, hold, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&site->hold_hist[ctl_prof_bucket(hold)], 1, __ATOMIC_RELAXED);
+	ctl_prof_max(&site->hold_max_ns, hold);
+}
+
+static json_t *ctl_prof_hist2j(uint64_t *hist)
+{
+	json_t *arr = j_arr();
+	int i;
+
+	TESTP(arr, NULL);
+	for (i = 0; i < CTL_PROF_BUCKETS; i++) {
+		json_array_append_new(arr, json_integer((json_int_t)__atomic_load_n(&hist[i], __ATOMIC_RELAXED)));
+	}
+	return (arr);
+}
+
+void *ctl_lock_prof_dump(void)
+{
+	json_t *root = j_new();
+	json_t *sites = j_arr();
+	size_t i;
+
+	TESTP(root, NULL);
+	TESTP(sites, NULL);
+
+	for (i = 0; i < CTL_PROF_SITES; i++) {
+		ctl_prof_site_t *site = &ctl_prof_sites[i];
+		const char *func = __atomic_load_n(&site->func, __ATOMIC_ACQUIRE);
+		json_t *j_site = NULL;
+		uint64_t count;
+
+		if (NULL == func) continue;
+
+		count = __atomic_load_n(&site->count, __ATOMIC_RELAXED);
+		j_site = j_new();
+		TESTP_GO(j_site, err);
+		j_add_str(j_site, JK_PROF_FUNC, func);
+		j_add_int(j_site, JK_PROF_LINE, site->line);
+		j_add_str(j_site, JK_PROF_LOCK, ctl_lock_dom_names[site->dom]);
+		j_add_str(j_site, JK_PROF_MODE, site->write ? "w" : "r");
+		j_add_int(j_site, JK_PROF_COUNT, (json_int_t)count);
+		j_add_int(j_site, JK_PROF_WAIT_TOTAL, (json_int_t)(__atomic_load_n(&site->wait_total_ns, __ATOMIC_RELAXED) / 1000));
+		j_add_int(j_site, JK_PROF_WAIT_MAX, (json_int_t)(__atomic_load_n(&site->wait_max_ns, __ATOMIC_RELAXED) / 1000));
+		j_add_int(j_site, JK_PROF_HOLD_TOTAL, (json_int_t)(__atomic_load_n(&site->hold_total_ns, __ATOMIC_RELAXED) / 1000));
+		j_add_int(j_site, JK_PROF_HOLD_MAX, (json_int_t)(__atomic_load_n(&site->hold_max_ns, __ATOMIC_RELAXED) / 1000));
+		j_add_j(j_site, JK_PROF_WAIT_HIST, ctl_prof_hist2j(site->wait_hist));
+		j_add_j(j_site, JK_PROF_HOLD_HIST, ctl_prof_hist2j(site->hold_hist));
+		j_arr_add(sites, j_site);
+	}
+
+	j_add_str(root, JK_STATUS, JV_OK);
+	j_add_j(root, JK_PROF_SITES, sites);
+	return (root);
+err:
+	j_rm(sites);
+	j_rm(root);
+	return (NULL);
+}
+#else
+void *ctl_lock_prof_dump(void)
+{
+	json_t *root = j_new();
+	TESTP(root, NULL);
+	j_add_str(root, JK_STATUS, JV_BAD);
+	j_add_str(root, JK_REASON, "Lock profiler is not compiled in, rebuild with -DCTL_LOCK_PROF");
+	return (root);
+}
+#endif /* CTL_LOCK_PROF */
+
+/* Indexes of hosts, see below */
+static int ctl_idx_reset(control_t *ctl);
+
 control_t *g_ctl = NULL;
 int ctl_allocate_init(void)
 {
 	json_t *ports = NULL;
+	pthread_rwlockattr_t attr;
+	int i;
 
 	if (NULL != g_ctl) return (-1);
 	g_ctl = zmalloc(sizeof(control_t));
@@ -29,21 +275,87 @@ int ctl_allocate_init(void)
 	TESTP(g_ctl->tickets, -1);
 
 	j_add_str(g_ctl->me, JK_TYPE, JV_TYPE_ME);
-	g_ctl->status = ST_START;
-	return (sem_init(&g_ctl->lock, 0, 1));
+	ctl_status_set(g_ctl, ST_START);
+
+	if (EOK != ctl_idx_reset(g_ctl)) return (EBAD);
+
+	g_ctl->htab_ports = ctl_ports_alloc(64);
+	TESTP(g_ctl->htab_ports, EBAD);
+
+	pthread_mutex_init(&g_ctl->snap_lock, NULL);
+
+	/* Readers come often (CLI, keepalive) and should not starve the writers */
+	if (0 != pthread_rwlockattr_init(&attr)) return (EBAD);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	for (i = 0; i < CTL_LOCK_MAX; i++) {
+		if (0 != pthread_rwlock_init(&g_ctl->locks[i], &attr)) {
+			DE("Can't init lock %d\n", i);
+			pthread_rwlockattr_destroy(&attr);
+			return (EBAD);
+		}
+	}
+	pthread_rwlockattr_destroy(&attr);
+
+	ctl_lock(g_ctl, CTL_LOCK_ME);
+	ctl_lock(g_ctl, CTL_LOCK_HOSTS);
+	if (EOK != ctl_snap_me_publish(g_ctl) || EOK != ctl_snap_hosts_publish(g_ctl)) {
+		DE("Can't publish initial snapshots\n");
+		ctl_unlock(g_ctl, CTL_LOCK_HOSTS);
+		ctl_unlock(g_ctl, CTL_LOCK_ME);
+		return (EBAD);
+	}
+	ctl_unlock(g_ctl, CTL_LOCK_HOSTS);
+	ctl_unlock(g_ctl, CTL_LOCK_ME);
+
+	return (EOK);
+}
+
+int ctl_lock_at(control_t *ctl, ctl_lock_dom_e dom, const char *func __attribute__((unused)), int line __attribute__((unused)))
+{
+	TESTP_ASSERT(ctl, "NULL!");
+#ifdef DEBUG3
+	ctl_lock_check(dom);
+#endif
+#ifdef CTL_LOCK_PROF
+	ctl_prof_lock(ctl, dom, 1, func, line);
+#else
+	pthread_rwlock_wrlock(&ctl->locks[dom]);
+#endif
+#ifdef DEBUG3
+	ctl_held_w |= (1U << dom);
+#endif
+	return (EOK);
 }
 
-int ctl_lock(control_t *ctl)
+int ctl_rlock_at(control_t *ctl, ctl_lock_dom_e dom, const char *func __attribute__((unused)), int line __attribute__((unused)))
 {
 	TESTP_ASSERT(ctl, "NULL!");
-	sem_wait(&ctl->lock);
-	return (0);
+#ifdef DEBUG3
+	ctl_lock_check(dom);
+#endif
+#ifdef CTL_LOCK_PROF
+	ctl_prof_lock(ctl, dom, 0, func, line);
+#else
+	pthread_rwlock_rdlock(&ctl->locks[dom]);
+#endif
+#ifdef DEBUG3
+	ctl_held_r |= (1U << dom);
+#endif
+	return (EOK);
 }
 
-int ctl_unlock(control_t *ctl)
+int ctl_unlock(control_t *ctl, ctl_lock_dom_e dom)
 {
 	TESTP_ASSERT(ctl, "NULL!");
-	sem_post(&ctl->lock);
+#ifdef DEBUG3
+	CTL_ASSERT_LOCKED(dom);
+	ctl_held_r &= ~(1U << dom);
+	ctl_held_w &= ~(1U << dom);
+#endif
+#ifdef CTL_LOCK_PROF
+	ctl_prof_unlock(dom);
+#endif
+	pthread_rwlock_unlock(&ctl->locks[dom]);
 	return (EOK);
 }
 
@@ -52,8 +364,430 @@ control_t *ctl_get(void)
 	return (g_ctl);
 }
 
-control_t *ctl_get_locked(void)
+
+static ctl_snap_t *ctl_snap_new(json_t *j)
 {
-	return (g_ctl);
+	ctl_snap_t *snap = NULL;
+
+	TESTP(j, NULL);
+	snap = zmalloc(sizeof(ctl_snap_t));
+	TESTP_MES(snap, NULL, "Can't allocate snapshot");
+
+	snap->j = j;
+	/* This is the reference of the publisher, dropped when the snapshot replaced */
+	snap->refs = 1;
+	return (snap);
+}
+
+void ctl_snap_put(ctl_snap_t *snap)
+{
+	if (NULL == snap) return;
+
+	if (0 == __atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL)) {
+		json_decref(snap->j);
+		zfree(snap);
+	}
+}
+
+/* Readers never block: they announce themselves in 'snap_readers' of the current
+   epoch only for the time of loading the pointer and taking a reference */
+static ctl_snap_t *ctl_snap_get(control_t *ctl, ctl_snap_t **slot)
+{
+	ctl_snap_t *snap = NULL;
+	unsigned int epoch;
+
+	do {
+		epoch = __atomic_load_n(&ctl->snap_epoch, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&ctl->snap_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+		/* The epoch moved before we registered: the writer may not count us */
+		if (epoch == __atomic_load_n(&ctl->snap_epoch, __ATOMIC_SEQ_CST)) break;
+		__atomic_sub_fetch(&ctl->snap_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+	} while (1);
+
+	snap = __atomic_load_n(slot, __ATOMIC_SEQ_CST);
+	if (NULL != snap) {
+		__atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_sub_fetch(&ctl->snap_readers[epoch & 1], 1, __ATOMIC_RELEASE);
+	return (snap);
+}
+
+/* Drop the publisher reference of the replaced snapshots no reader can still load.
+   A snapshot retired in epoch E is safe when the epoch is E + 2: the readers of E are gone.
+   The epoch moves on only if the readers of the previous one are gone; nobody waits.
+   Called with snap_lock held */
+static void ctl_snap_reclaim_l(control_t *ctl)
+{
+	ctl_snap_t **prev = &ctl->snap_retired;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		unsigned int epoch = __atomic_load_n(&ctl->snap_epoch, __ATOMIC_SEQ_CST);
+		if (0 != __atomic_load_n(&ctl->snap_readers[(epoch + 1) & 1], __ATOMIC_SEQ_CST)) break;
+		__atomic_store_n(&ctl->snap_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+	}
+
+	while (NULL != *prev) {
+		ctl_snap_t *snap = *prev;
+
+		if (ctl->snap_epoch - snap->retired_epoch >= 2) {
+			*prev = snap->retired_next;
+			ctl_snap_put(snap);
+		} else {
+			prev = &snap->retired_next;
+		}
+	}
+}
+
+/* Replace the published snapshot in 'slot' with 'snap'.
+   A reader could load the old pointer and not take the reference yet:
+   the old snapshot is released later, when such readers are gone */
+static void ctl_snap_swap(control_t *ctl, ctl_snap_t **slot, ctl_snap_t *snap)
+{
+	ctl_snap_t *old = __atomic_exchange_n(slot, snap, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&ctl->snap_lock);
+	if (NULL != old) {
+		old->retired_epoch = ctl->snap_epoch;
+		old->retired_next = ctl->snap_retired;
+		ctl->snap_retired = old;
+	}
+	ctl_snap_reclaim_l(ctl);
+	pthread_mutex_unlock(&ctl->snap_lock);
+}
+
+int ctl_snap_me_publish(control_t *ctl)
+{
+	ctl_snap_t *snap = NULL;
+
+	TESTP(ctl, EBAD);
+	CTL_ASSERT_WLOCKED(CTL_LOCK_ME);
+	snap = ctl_snap_new(j_dup(ctl->me));
+	TESTP_MES(snap, EBAD, "Can't create snapshot of 'me'");
+	ctl_snap_swap(ctl, &ctl->snap_me, snap);
+	return (EOK);
+}
+
+/*** Indexes of hosts ***/
+
+#define CTL_SVC_KEY_LEN 256
+
+static void ctl_svc_key(char *key, const char *uid, int port, const char *protocol)
+{
+	snprintf(key, CTL_SVC_KEY_LEN, "%s %d %s", uid, port, protocol);
+}
+
+/* Key of the ordered index: hosts with the same name are kept, sorted by uid */
+static void ctl_sorted_key(char *key, const char *uid, json_t *host)
+{
+	const char *name = j_find_ref(host, JK_NAME);
+	snprintf(key, CTL_SVC_KEY_LEN, "%s %s", NULL != name ? name : "", uid);
+}
+
+
+/* Release the data of index 'ht' and the index itself */
+static void ctl_idx_free(htable_t *ht)
+{
+	hnode_t *node;
+	size_t index;
+
+	if (NULL == ht) return;
+	htable_each(ht, index, node) {
+		json_decref(node->data);
+	}
+	htable_free(ht);
+}
+
+/* Drop all indexes of hosts and start empty ones */
+static int ctl_idx_reset(control_t *ctl)
+{
+	ctl_idx_free(ctl->hosts_uid);
+	ctl_idx_free(ctl->hosts_svc);
+	ctl_idx_free(ctl->hosts_sorted);
+
+	ctl->hosts_uid = htable_alloc(64);
+	ctl->hosts_svc = htable_alloc(64);
+	ctl->hosts_sorted = htable_alloc(64);
+	TESTP(ctl->hosts_uid, EBAD);
+	TESTP(ctl->hosts_svc, EBAD);
+	TESTP(ctl->hosts_sorted, EBAD);
+	if (0 != htable_set_ordered(ctl->hosts_sorted)) return (EBAD);
+	return (EOK);
+}
+
+/* Add keys of 'host' to the indexes; the host is shared, not copied */
+static void ctl_idx_host_add(control_t *ctl, const char *uid, json_t *host)
+{
+	json_t *ports;
+	json_t *port;
+	size_t index;
+	char key[CTL_SVC_KEY_LEN];
+
+	if (0 != htable_insert(ctl->hosts_uid, (char *)uid, json_incref(host))) {
+		DE("Can't index host %s\n", uid);
+		json_decref(host);
+		return;
+	}
+
+	ctl_sorted_key(key, uid, host);
+	if (0 != htable_insert(ctl->hosts_sorted, key, json_incref(host))) json_decref(host);
+
+	/* Service ports: the endpoint is external IP of the host and external port of the mapping */
+	ports = j_find_j(host, "ports");
+	json_array_foreach(ports, index, port) {
+		json_t *endpoint = j_new();
+		TESTP(endpoint, );
+		j_cp(host, endpoint, JK_IP_EXT);
+		j_cp(port, endpoint, JK_PORT_EXT);
+		ctl_svc_key(key, uid, ctl_port_get(port, JK_PORT_INT), j_find_ref(port, JK_PROTOCOL));
+		/* A duplicate mapping in the array: the first one wins */
+		if (0 != htable_insert(ctl->hosts_svc, key, endpoint)) json_decref(endpoint);
+	}
+}
+
+/* Remove keys of host 'uid', as the host was when indexed */
+static void ctl_idx_host_del(control_t *ctl, const char *uid)
+{
+	json_t *old = htable_find(ctl->hosts_uid, (char *)uid);
+	json_t *ports;
+	json_t *port;
+	size_t index;
+	char key[CTL_SVC_KEY_LEN];
+
+	if (NULL == old) return;
+
+	ctl_sorted_key(key, uid, old);
+	json_decref(htable_delete(ctl->hosts_sorted, key));
+
+	ports = j_find_j(old, "ports");
+	json_array_foreach(ports, index, port) {
+		ctl_svc_key(key, uid, ctl_port_get(port, JK_PORT_INT), j_find_ref(port, JK_PROTOCOL));
+		if (NULL != htable_find(ctl->hosts_svc, key)) json_decref(htable_delete(ctl->hosts_svc, key));
+	}
+
+	json_decref(htable_delete(ctl->hosts_uid, (char *)uid));
+}
+
+/* Build all indexes from ctl->hosts */
+static int ctl_hosts_index_rebuild(control_t *ctl)
+{
+	const char *uid;
+	json_t *host;
+
+	if (EOK != ctl_idx_reset(ctl)) return (EBAD);
+	json_object_foreach(ctl->hosts, uid, host) {
+		ctl_idx_host_add(ctl, uid, host);
+	}
+	return (EOK);
+}
+
+/* Update indexes for one host, key by key; host == NULL removes it.
+   Returns 1 if the indexes changed */
+static int ctl_hosts_index_update(control_t *ctl, const char *uid, json_t *host)
+{
+	json_t *old = htable_find(ctl->hosts_uid, (char *)uid);
+
+	/* Most of keepalives repeat the host as it was */
+	if (NULL != old && NULL != host && json_equal(old, host)) return (0);
+	if (NULL == old && NULL == host) return (0);
+
+	ctl_idx_host_del(ctl, uid);
+	if (NULL != host) ctl_idx_host_add(ctl, uid, host);
+	return (1);
+}
+
+/* Publish the hosts ordered by name, as 'mcl -l' shows them. No deep copy:
+   the snapshot shares the hosts with ctl->hosts, where they are never changed */
+static int ctl_snap_hosts_swap(control_t *ctl)
+{
+	json_t *arr = j_arr();
+	ctl_snap_t *snap = NULL;
+	hsnode_t *snode;
+
+	TESTP(arr, EBAD);
+	htable_each_sorted(ctl->hosts_sorted, snode) {
+		if (0 != json_array_append(arr, snode->data)) {
+			DE("Can't add host to the list\n");
+			json_decref(arr);
+			return (EBAD);
+		}
+	}
+
+	snap = ctl_snap_new(arr);
+	if (NULL == snap) {
+		DE("Can't create snapshot of 'hosts'\n");
+		json_decref(arr);
+		return (EBAD);
+	}
+	ctl_snap_swap(ctl, &ctl->snap_hosts, snap);
+	return (EOK);
+}
+
+int ctl_snap_hosts_publish(control_t *ctl)
+{
+	TESTP(ctl, EBAD);
+	CTL_ASSERT_WLOCKED(CTL_LOCK_HOSTS);
+	if (EOK != ctl_hosts_index_rebuild(ctl)) {
+		DE("Can't rebuild indexes of hosts\n");
+	}
+	return (ctl_snap_hosts_swap(ctl));
 }
 
+int ctl_snap_hosts_update(control_t *ctl, const char *uid, void *host)
+{
+	TESTP(ctl, EBAD);
+	TESTP(uid, EBAD);
+	CTL_ASSERT_WLOCKED(CTL_LOCK_HOSTS);
+
+	if (NULL == ctl->snap_hosts) {
+		return (ctl_snap_hosts_publish(ctl));
+	}
+
+	/* A host in ctl->hosts is never changed, only replaced: the indexes share it.
+	   Every keepalive lands here, but a new list is published only if the host changed */
+	if (!ctl_hosts_index_update(ctl, uid, host)) return (EOK);
+	return (ctl_snap_hosts_swap(ctl));
+}
+
+int ctl_port_get(void *obj, const char *key)
+{
+	json_int_t port = 0;
+	const char *str;
+	char *end = NULL;
+
+	/* Clients of the old wire format send the port as a string: "22" */
+	if (EOK != j_find_int(obj, key, &port)) {
+		str = j_find_ref(obj, key);
+		if (NULL == str) return (0);
+		port = strtol(str, &end, 10);
+		if (end == str || '\0' != *end) return (0);
+	}
+
+	if (port < 0 || port > 65535) return (0);
+	return ((int)port);
+}
+
+int ctl_port_key(int port, const char *protocol, htype_port_t *key)
+{
+	TESTP(protocol, EBAD);
+	TESTP(key, EBAD);
+
+	if (port < 1 || port > 65535) {
+		DE("Bad port: %d\n", port);
+		return (EBAD);
+	}
+
+	if (0 == strcmp(protocol, JV_TCP)) {
+		key->protocol = IPPROTO_TCP;
+	} else if (0 == strcmp(protocol, JV_UDP)) {
+		key->protocol = IPPROTO_UDP;
+	} else {
+		DE("Bad protocol: %s\n", protocol);
+		return (EBAD);
+	}
+
+	key->port = (uint16_t)port;
+	return (EOK);
+}
+
+int ctl_ports_find_l(control_t *ctl, int port, const char *protocol)
+{
+	htype_port_t key;
+	ctl_port_t *mapped;
+
+	TESTP(ctl, 0);
+	CTL_ASSERT_LOCKED(CTL_LOCK_ME);
+
+	if (EOK != ctl_port_key(port, protocol, &key)) return (0);
+	mapped = ctl_ports_find(ctl->htab_ports, &key);
+	return (mapped ? mapped->port_ext : 0);
+}
+
+int ctl_ports_add_l(control_t *ctl, void *mapping)
+{
+	htype_port_t key;
+	htype_port_t ext;
+	ctl_port_t *mapped;
+
+	TESTP(ctl, EBAD);
+	TESTP(mapping, EBAD);
+	CTL_ASSERT_WLOCKED(CTL_LOCK_ME);
+
+	if (EOK != ctl_port_key(ctl_port_get(mapping, JK_PORT_INT), j_find_ref(mapping, JK_PROTOCOL), &key) ||
+		EOK != ctl_port_key(ctl_port_get(mapping, JK_PORT_EXT), j_find_ref(mapping, JK_PROTOCOL), &ext)) {
+		DE("Bad mapping\n");
+		return (EBAD);
+	}
+
+	mapped = ctl_ports_put(ctl->htab_ports, &key, NULL);
+	TESTP_MES(mapped, EBAD, "Can't add mapping to index");
+	mapped->port_ext = ext.port;
+	return (EOK);
+}
+
+int ctl_ports_del_l(control_t *ctl, int port, const char *protocol)
+{
+	htype_port_t key;
+
+	TESTP(ctl, EBAD);
+	CTL_ASSERT_WLOCKED(CTL_LOCK_ME);
+
+	if (EOK != ctl_port_key(port, protocol, &key)) return (EBAD);
+	return (0 == ctl_ports_del(ctl->htab_ports, &key, NULL) ? EOK : EBAD);
+}
+
+int ctl_ports_rebuild_l(control_t *ctl)
+{
+	json_t *ports;
+	json_t *val;
+	size_t index;
+	ctl_ports_t *fresh;
+	ctl_ports_t *old;
+	int rc = EOK;
+
+	TESTP(ctl, EBAD);
+	CTL_ASSERT_WLOCKED(CTL_LOCK_ME);
+
+	fresh = ctl_ports_alloc(64);
+	TESTP(fresh, EBAD);
+	old = ctl->htab_ports;
+	ctl->htab_ports = fresh;
+
+	ports = j_find_j(ctl->me, "ports");
+	json_array_foreach(ports, index, val) {
+		if (EOK != ctl_ports_add_l(ctl, val)) {
+			rc = EBAD;
+		}
+	}
+
+	ctl_ports_free(old);
+	return (rc);
+}
+
+void *ctl_host_service(control_t *ctl, const char *uid, int port, const char *protocol)
+{
+	char key[CTL_SVC_KEY_LEN];
+	json_t *endpoint;
+
+	TESTP(ctl, NULL);
+	TESTP(uid, NULL);
+	TESTP(protocol, NULL);
+
+	ctl_svc_key(key, uid, port, protocol);
+	ctl_rlock(ctl, CTL_LOCK_HOSTS);
+	endpoint = json_incref(htable_find(ctl->hosts_svc, key));
+	ctl_unlock(ctl, CTL_LOCK_HOSTS);
+	return (endpoint);
+}
+
+ctl_snap_t *ctl_snap_get_me(control_t *ctl)
+{
+	TESTP(ctl, NULL);
+	return (ctl_snap_get(ctl, &ctl->snap_me));
+}
+
+ctl_snap_t *ctl_snap_get_hosts(control_t *ctl)
+{
+	TESTP(ctl, NULL);
+	return (ctl_snap_get(ctl, &ctl->snap_hosts));
+}
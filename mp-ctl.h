@@ -1,8 +1,10 @@
 #ifndef _SEC_CTL_H_
 #define _SEC_CTL_H_
 
-#include <semaphore.h>
+#include <pthread.h>
+#include <assert.h>
 #include "mp-htable.h"
+#include "mp-htype.h"
 
 /* What is the current client status now? */
 enum e_status{
@@ -13,13 +15,44 @@ enum e_status{
 	ST_STOPPED				/* Received "stop" signal from cli */
 };
 
+/* Index of local port mappings ('ports' array of 'me'):
+   (internal port, protocol) -> external port */
+typedef struct ctl_port_struct {
+	uint16_t port_ext;
+} ctl_port_t;
+
+HTYPE_INIT(ctl_ports, htype_port_t, ctl_port_t, htype_port_hash, htype_port_eq)
+
+/* Immutable, reference counted copy of a JSON object kept in control_t.
+   The state owner publishes a new snapshot every time the object changes.
+   Readers take a reference with ctl_snap_get_*() and use it without
+   ctl lock; the reference released with ctl_snap_put().
+   The JSON object inside of a snapshot must never be modified. */
+typedef struct ctl_snap_struct {
+	int refs;	/* Reference counter, changed atomically */
+	void *j;	/* JSON object, read only */
+	struct ctl_snap_struct *retired_next;	/* Replaced, the publisher reference not dropped yet */
+	unsigned int retired_epoch;
+} ctl_snap_t;
+
+/* Lock domains of control_t. Every domain has its own rwlock.
+   If several domains needed at once, they must be locked in the order
+   of this enum; in debug mode (DEBUG3) the order is asserted */
+typedef enum ctl_lock_dom_enum {
+	CTL_LOCK_ME = 0,	/* ctl->me and its snapshot */
+	CTL_LOCK_HOSTS,		/* ctl->hosts and its snapshot */
+	CTL_LOCK_TICKETS,	/* ctl->tickets */
+	CTL_LOCK_MOSQ,		/* ctl->mosq and ctl->config */
+	CTL_LOCK_MAX
+} ctl_lock_dom_e;
+
 /* This is a global structure.
    Pointer to the structure shouldbe get with ctl_get()
-   The structure should bw lock with ctl_lock()
-   and unlocked with ctl_unlock()
+   A domain of the structure should be locked with ctl_lock() (writer)
+   or ctl_rlock() (reader) and unlocked with ctl_unlock()
    Allocated and inited in main() */
 typedef struct control_struct {
-	sem_t lock; /* get semaphore before manipulate this struct */
+	pthread_rwlock_t locks[CTL_LOCK_MAX]; /* One rwlock per domain, see ctl_lock_dom_e */
 	struct mosquitto *mosq; /* Instance of mosquitto connection */
 	void *me; /* JSON object describing this machine */
 	/* We send this JSON to remote hosts. It contains full descruption
@@ -41,7 +74,7 @@ typedef struct control_struct {
 	    external port, internal port
 	 
 	 */
-	enum e_status status;	/* Connection status */
+	enum e_status status;	/* Connection status, use ctl_status_get() / ctl_status_set() */
 	/* These must be protected with lock */
 
 	/* hosts is a JSON object holding remote machines.
@@ -53,21 +86,95 @@ typedef struct control_struct {
 
 	//htable_t *holder_sources; /* Here we keep remote computers */
 	//void *ports; /* JSON array - open ports */
-	htable_t *htab_ports; /* Here we keep mapped ports (port_t, see above), sorted by internal port */
+	ctl_ports_t *htab_ports; /* Index of 'ports' of 'me', see ctl_ports_*(); protected by CTL_LOCK_ME */
 	void *config; /* The config file in form of JSON object */
 	void *tickets;
+
+	/* Published read-only snapshots of 'me' and 'hosts'.
+	   Replaced by the writer holding the domain lock, read without the lock */
+	ctl_snap_t *snap_me;
+	ctl_snap_t *snap_hosts;
+	/* Indexes of ctl->hosts, updated key by key with the hosts; protected by CTL_LOCK_HOSTS.
+	   The hosts are shared with ctl->hosts: a host is replaced by a new object, never changed */
+	htable_t *hosts_uid;		/* uid -> host as it was indexed, to remove its keys */
+	htable_t *hosts_svc;		/* "uid port protocol" -> {JK_IP_EXT, JK_PORT_EXT} */
+	htable_t *hosts_sorted;		/* "name uid" -> host, ordered */
+	/* Readers between snapshot pointer load and reference grab, per epoch parity */
+	int snap_readers[2];
+	unsigned int snap_epoch;
+	/* Replaced snapshots waiting for the readers of their epoch, see ctl_snap_swap() */
+	ctl_snap_t *snap_retired;
+	pthread_mutex_t snap_lock;
 } control_t;
 
 
+/* The status is read and changed atomically, no lock needed */
+#define ctl_status_get(ctl) __atomic_load_n(&(ctl)->status, __ATOMIC_ACQUIRE)
+#define ctl_status_set(ctl, st) __atomic_store_n(&(ctl)->status, (st), __ATOMIC_RELEASE)
+
+/* Lock assertions, active in debug mode only */
+#ifdef DEBUG3
+extern int ctl_lock_held(ctl_lock_dom_e dom, int write);
+	#define CTL_ASSERT_LOCKED(dom) assert(ctl_lock_held(dom, 0))
+	#define CTL_ASSERT_WLOCKED(dom) assert(ctl_lock_held(dom, 1))
+#else
+	#define CTL_ASSERT_LOCKED(dom) do{}while(0)
+	#define CTL_ASSERT_WLOCKED(dom) do{}while(0)
+#endif /* DEBUG3 */
+
 /* Allocate and init sct scruct, must be called once */
 extern int ctl_allocate_init(void);
 /* Get pointer to global  control_structure */
 extern control_t *ctl_get(void);
-/* Lock ctl and get pointer to global  control_structure */
-extern control_t *ctl_get_locked(void);
-/* Lock global control_structure */
-extern int ctl_lock(control_t *ctl);
-/* Unock global control_structure */
-extern int ctl_unlock(control_t *ctl);
+/* Lock domain 'dom' of global control_structure for writing */
+#define ctl_lock(ctl, dom) ctl_lock_at(ctl, dom, __func__, __LINE__)
+/* Lock domain 'dom' of global control_structure for reading */
+#define ctl_rlock(ctl, dom) ctl_rlock_at(ctl, dom, __func__, __LINE__)
+/* Unock domain 'dom' of global control_structure */
+extern int ctl_unlock(control_t *ctl, ctl_lock_dom_e dom);
+
+/* Lock functions behind ctl_lock() / ctl_rlock(). The call site 'func' / 'line'
+   is used by the lock profiler (compiled in with -DCTL_LOCK_PROF) only */
+extern int ctl_lock_at(control_t *ctl, ctl_lock_dom_e dom, const char *func, int line);
+extern int ctl_rlock_at(control_t *ctl, ctl_lock_dom_e dom, const char *func, int line);
+
+/* Index of local mappings; the caller holds CTL_LOCK_ME (for write if it changes the index).
+   Ports are numbers, protocol is given as in JSON: 22, "TCP" */
+extern int ctl_port_key(int port, const char *protocol, htype_port_t *key);
+/* Port number kept in JSON object 'obj' under 'key', as a number or as a numeric string;
+   returns 0 if absent or invalid */
+extern int ctl_port_get(void *obj, const char *key);
+/* Find external port mapped to internal 'port' / 'protocol'; returns 0 if not mapped */
+extern int ctl_ports_find_l(control_t *ctl, int port, const char *protocol);
+/* Add / remove mapping (JSON object with JK_PORT_EXT, JK_PORT_INT, JK_PROTOCOL) */
+extern int ctl_ports_add_l(control_t *ctl, void *mapping);
+extern int ctl_ports_del_l(control_t *ctl, int port, const char *protocol);
+/* Rebuild the index from 'ports' array of 'me' */
+extern int ctl_ports_rebuild_l(control_t *ctl);
+
+/* Where to connect to service 'port' / 'protocol' (22, "TCP") of the host 'uid':
+   referenced read-only JSON object {JK_IP_EXT, JK_PORT_EXT}, NULL if the service port is not mapped.
+   Takes CTL_LOCK_HOSTS for read */
+extern void *ctl_host_service(control_t *ctl, const char *uid, int port, const char *protocol);
+
+/* Dump lock profiler statistics: returns JSON object with
+   per call site wait / hold times and histograms */
+extern void *ctl_lock_prof_dump(void);
+
+/* Publish new snapshot of ctl->me. Call it with CTL_LOCK_ME locked after 'me' changed */
+extern int ctl_snap_me_publish(control_t *ctl);
+/* Publish new full snapshot of ctl->hosts. Call it with CTL_LOCK_HOSTS locked */
+extern int ctl_snap_hosts_publish(control_t *ctl);
+/* Host 'uid' changed in ctl->hosts: update the indexes and publish a new snapshot
+   if the host differs from the indexed one. If 'host' is NULL the host removed.
+   Call it with CTL_LOCK_HOSTS locked */
+extern int ctl_snap_hosts_update(control_t *ctl, const char *uid, void *host);
+/* Get reference to the current snapshot of ctl->me; no lock needed */
+extern ctl_snap_t *ctl_snap_get_me(control_t *ctl);
+/* Get reference to the current snapshot of ctl->hosts: JSON array of the hosts
+   ordered by name, then uid; no lock needed */
+extern ctl_snap_t *ctl_snap_get_hosts(control_t *ctl);
+/* Release reference to a snapshot */
+extern void ctl_snap_put(ctl_snap_t *snap);
 
 #endif /* _SEC_CTL_H_ */
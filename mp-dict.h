@@ -51,6 +51,9 @@
 #define JK_SHOW_RPORTS "show-ports-remote"
 #define JK_SHOW_INFO "show-info"
 #define JK_SHOW_HOSTS "show-hosts"
+#define JK_SHOW_LOCKS "show-locks"
+/* Ports for -o / -c as given: "22,80/UDP,8000-8010" */
+#define JK_PORTS_SPEC "ports-spec"
 
 /** Config file fields **/
 
@@ -60,6 +63,8 @@
 #define JK_TARGET "target"
 /* Is this machine a bridge? */
 #define JK_BRIDGE "bridge"
+/* Ports a target maps at start: array of {JK_PORT_INT, JK_PROTOCOL} */
+#define JK_SERVICE_PORTS "service_ports"
 
 /* If the JSON object includes a list, its name should be defined as well */
 /** Array type **/
@@ -69,6 +74,20 @@
 /* list of remote hosts */
 #define JK_ARR_HOSTS "list_remote_hosts"
 
+/** Lock profiler dump (mp-shell -L) **/
+#define JK_PROF_SITES "lock_sites"
+#define JK_PROF_FUNC "func"
+#define JK_PROF_LINE "line"
+#define JK_PROF_LOCK "lock"
+#define JK_PROF_MODE "mode"
+#define JK_PROF_COUNT "count"
+#define JK_PROF_WAIT_TOTAL "wait_total_us"
+#define JK_PROF_WAIT_MAX "wait_max_us"
+#define JK_PROF_HOLD_TOTAL "hold_total_us"
+#define JK_PROF_HOLD_MAX "hold_max_us"
+#define JK_PROF_WAIT_HIST "wait_hist"
+#define JK_PROF_HOLD_HIST "hold_hist"
+
 /* Ticket: how we define session between mp-shell and remote machine */
 #define JK_TICKET "ticket"
 
@@ -79,7 +98,7 @@
 #define JV_NA "NA" /* For undefined state */
 #define JV_OK "1"
 #define JV_BAD "0"
-#define JV_NO_PORT "0"
+#define JV_NO_PORT 0 /* Ports are JSON integers */
 #define JV_NO_IP "0.0.0.0"
 #define JV_TCP "TCP"
 #define JV_UDP "UDP"
@@ -111,6 +130,9 @@
 #define JV_TYPE_SSHR_DONE "sshr-done"
 #define JV_TYPE_OPENPORT "openport"
 #define JV_TYPE_CLOSEPORT "closeport"
+/* Batch of ports in JK_ARR_PORTS; per-port results returned in the ticket */
+#define JV_TYPE_OPENPORTS "openports"
+#define JV_TYPE_CLOSEPORTS "closeports"
 #define JV_TYPE_KEEPALIVE "keepelive"
 #define JV_TYPE_TICKET "ticket-type"
 
@@ -118,5 +140,6 @@
 #define JV_COMMAND_LIST "list"	/* list remote hosts */
 #define JV_COMMAND_PORTS "ports"	/* show opened ports */
 #define JV_COMMAND_RPORTS "rports" /* Shell asks for remote ports */
+#define JV_COMMAND_LOCKSTAT "lockstat" /* Shell asks for lock profiler statistics */
 
 #endif /* MP_DICT_H_ */
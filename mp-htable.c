@@ -1,5 +1,14 @@
 /*@-skipposixheaders@*/
 #include <string.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/random.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 /*@=skipposixheaders@*/
 
 #include "mp-common.h"
@@ -18,10 +27,9 @@ static inline uint32_t murmur_32_scramble(uint32_t k)
 }
 #endif
 
-uint32_t murmur3_32(const uint8_t *key, size_t len)
+static uint32_t murmur3_32_seed(const uint8_t *key, size_t len, uint32_t h)
 {
 #ifndef S_SPLINT_S
-	uint32_t h = MURMUR_SEED;
 	uint32_t k;
 	/* Read in groups of 4. */
 
@@ -56,15 +64,529 @@ uint32_t murmur3_32(const uint8_t *key, size_t len)
 #endif /* S_SPLINT_S */
 }
 
-/* Allocate new hash table node */
-static hnode_t *hnode_alloc()
+uint32_t murmur3_32(const uint8_t *key, size_t len)
+{
+	return (murmur3_32_seed(key, len, MURMUR_SEED));
+}
+
+uint64_t htable_hash_murmur3(const void *key, size_t len, uint64_t seed)
+{
+	return (murmur3_32_seed(key, len, (uint32_t)(seed ^ (seed >> 32))));
+}
+
+/*** wyhash ***/
+
+static const uint64_t wyp[4] = {0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL, 0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL};
+
+/* 64x64 -> 128 multiplication; low and high halves returned in 'a' and 'b' */
+static inline void wymum(uint64_t *a, uint64_t *b)
+{
+	__uint128_t r = *a;
+	r *= *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t wymix(uint64_t a, uint64_t b)
+{
+	wymum(&a, &b);
+	return (a ^ b);
+}
+
+static inline uint64_t wyr8(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return (v);
+}
+
+static inline uint64_t wyr4(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return (v);
+}
+
+static inline uint64_t wyr3(const uint8_t *p, size_t k)
+{
+	return (((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1]);
+}
+
+static uint64_t wyhash(const uint8_t *p, size_t len, uint64_t seed)
+{
+	uint64_t a;
+	uint64_t b;
+	size_t i = len;
+
+	seed ^= wymix(seed ^ wyp[0], wyp[1]);
+	if (len <= 16) {
+		if (len >= 4) {
+			a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+			b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - ((len >> 3) << 2));
+		} else if (len > 0) {
+			a = wyr3(p, len);
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		if (i > 48) {
+			uint64_t see1 = seed;
+			uint64_t see2 = seed;
+			do {
+				seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+				see1 = wymix(wyr8(p + 16) ^ wyp[2], wyr8(p + 24) ^ see1);
+				see2 = wymix(wyr8(p + 32) ^ wyp[3], wyr8(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16) {
+			seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = wyr8(p + i - 16);
+		b = wyr8(p + i - 8);
+	}
+
+	a ^= wyp[1];
+	b ^= seed;
+	wymum(&a, &b);
+	return (wymix(a ^ wyp[0] ^ len, b ^ wyp[1]));
+}
+
+/* Long keys: xxh3-style accumulation of 64 byte stripes in 8 lanes.
+   Every lane: acc[i ^ 1] += data[i]; acc[i] += lo32(data[i] ^ secret[i]) * hi32(data[i] ^ secret[i]) */
+#define HTABLE_STRIPE 64
+#define HTABLE_LANES 8
+
+/* The scalar version is used without SSE2, and by the benchmark to check the SSE2 one */
+#if !defined(__SSE2__) || defined(STANDALONE)
+static void htable_stripes_scalar(uint64_t *acc, const uint8_t *p, size_t stripes, const uint64_t *secret)
+{
+	size_t s;
+	int i;
+
+	for (s = 0; s < stripes; s++, p += HTABLE_STRIPE) {
+		for (i = 0; i < HTABLE_LANES; i++) {
+			uint64_t data = wyr8(p + i * 8);
+			uint64_t key = data ^ secret[i];
+			acc[i ^ 1] += data;
+			acc[i] += (key & 0xFFFFFFFFULL) * (key >> 32);
+		}
+	}
+}
+#endif
+
+#ifdef __SSE2__
+static void htable_stripes_sse2(uint64_t *acc, const uint8_t *p, size_t stripes, const uint64_t *secret)
+{
+	__m128i vacc[HTABLE_LANES / 2];
+	__m128i vsecret[HTABLE_LANES / 2];
+	size_t s;
+	int i;
+
+	for (i = 0; i < HTABLE_LANES / 2; i++) {
+		vacc[i] = _mm_loadu_si128((const __m128i *)(acc + i * 2));
+		vsecret[i] = _mm_loadu_si128((const __m128i *)(secret + i * 2));
+	}
+
+	for (s = 0; s < stripes; s++, p += HTABLE_STRIPE) {
+		for (i = 0; i < HTABLE_LANES / 2; i++) {
+			__m128i data = _mm_loadu_si128((const __m128i *)(p + i * 16));
+			__m128i key = _mm_xor_si128(data, vsecret[i]);
+			/* hi32 of every lane moved to lo32 for _mm_mul_epu32 */
+			__m128i key_hi = _mm_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1));
+			__m128i product = _mm_mul_epu32(key, key_hi);
+			/* Swap the two lanes: data[i] goes to acc[i ^ 1] */
+			__m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+			vacc[i] = _mm_add_epi64(vacc[i], _mm_add_epi64(product, swapped));
+		}
+	}
+
+	for (i = 0; i < HTABLE_LANES / 2; i++) {
+		_mm_storeu_si128((__m128i *)(acc + i * 2), vacc[i]);
+	}
+}
+#define htable_stripes htable_stripes_sse2
+#else
+#define htable_stripes htable_stripes_scalar
+#endif /* __SSE2__ */
+
+uint64_t htable_hash_wy(const void *key, size_t len, uint64_t seed)
+{
+	const uint8_t *p = key;
+	uint64_t acc[HTABLE_LANES];
+	uint64_t secret[HTABLE_LANES];
+	size_t stripes;
+	int i;
+
+	if (len <= HTABLE_HASH_LONG) {
+		return (wyhash(p, len, seed));
+	}
+
+	for (i = 0; i < HTABLE_LANES; i++) {
+		secret[i] = wyp[i & 3] ^ (seed + (uint64_t)i);
+		acc[i] = wyp[(i + 1) & 3];
+	}
+
+	stripes = len / HTABLE_STRIPE;
+	htable_stripes(acc, p, stripes, secret);
+
+	/* Fold the lanes into seed of the tail */
+	for (i = 0; i < HTABLE_LANES; i += 2) {
+		seed ^= wymix(acc[i] ^ wyp[0], acc[i + 1] ^ wyp[1]);
+	}
+
+	return (wyhash(p + stripes * HTABLE_STRIPE, len - stripes * HTABLE_STRIPE, seed ^ len));
+}
+
+static uint64_t htable_seed_val;
+static pthread_once_t htable_seed_once = PTHREAD_ONCE_INIT;
+
+static void htable_seed_init(void)
+{
+	struct timespec ts;
+
+	if (sizeof(htable_seed_val) == getrandom(&htable_seed_val, sizeof(htable_seed_val), GRND_NONBLOCK)) {
+		return;
+	}
+
+	/* No entropy yet (early boot): still different for every process */
+	DD("getrandom() failed, seed from time and pid\n");
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	htable_seed_val = wymix((uint64_t)ts.tv_nsec ^ ((uint64_t)ts.tv_sec << 32), (uint64_t)getpid() ^ (uint64_t)(uintptr_t)&ts);
+}
+
+uint64_t htable_seed(void)
+{
+	pthread_once(&htable_seed_once, htable_seed_init);
+	return (htable_seed_val);
+}
+
+/* Hash of the key with the hash function of the table */
+static inline uint64_t htable_hash_key(htable_t *ht, const char *key)
+{
+	return (ht->hash(key, strlen(key), ht->seed));
+}
+
+/* Round up to power of 2, not less than HTABLE_SIZE_MIN */
+static size_t htable_size_round(size_t size)
 {
-	hnode_t *node = zmalloc(sizeof(hnode_t));
-	TESTP_MES(node, NULL, "Can't alloc");
-	return (node);
+	size_t r = HTABLE_SIZE_MIN;
+	while (r < size) {
+		r <<= 1;
+	}
+	return (r);
+}
+
+/*** Slab ***/
+
+#define HSLAB_MIN 16
+/* Page header: keeps the objects 16 bytes aligned */
+#define HSLAB_PAGE_HDR 16
+
+/* Big object header; doubly linked for O(1) free */
+typedef struct hslab_big_struct {
+	struct hslab_big_struct *next;
+	struct hslab_big_struct *prev;
+	char mem[] __attribute__((aligned(16)));
+} hslab_big_t;
+
+static hslab_t *hslab_new(void)
+{
+	hslab_t *slab = zmalloc(sizeof(hslab_t));
+	TESTP_MES(slab, NULL, "Can't alloc");
+	return (slab);
 }
 
-/* Allocate new hash table */
+/* Size class of the object, -1 for big objects */
+static int hslab_class(size_t size)
+{
+	size_t csize = HSLAB_MIN;
+	int class = 0;
+
+	while (csize < size) {
+		csize <<= 1;
+		class++;
+	}
+	return (class < HSLAB_CLASSES ? class : -1);
+}
+
+/* Allocate new page and cut it into free objects of the class */
+static int hslab_grow(hslab_t *slab, int class)
+{
+	size_t csize = (size_t)HSLAB_MIN << class;
+	/* Not zeroed: every object is fully initialized by its user */
+	char *page = malloc(HSLAB_PAGE);
+	char *obj;
+
+	TESTP_MES(page, -1, "Can't allocate slab page");
+	*(void **)page = slab->pages;
+	slab->pages = page;
+	slab->pages_num++;
+
+	for (obj = page + HSLAB_PAGE_HDR; obj + csize <= page + HSLAB_PAGE; obj += csize) {
+		*(void **)obj = slab->free[class];
+		slab->free[class] = obj;
+	}
+	return (0);
+}
+
+static void *hslab_alloc(hslab_t *slab, size_t size)
+{
+	int class = hslab_class(size);
+	void *obj;
+
+	if (class < 0) {
+		hslab_big_t *big = malloc(sizeof(hslab_big_t) + size);
+		TESTP_MES(big, NULL, "Can't alloc");
+		big->prev = NULL;
+		big->next = slab->big;
+		if (NULL != big->next) big->next->prev = big;
+		slab->big = big;
+		return (big->mem);
+	}
+
+	if (NULL == slab->free[class] && 0 != hslab_grow(slab, class)) {
+		return (NULL);
+	}
+
+	obj = slab->free[class];
+	slab->free[class] = *(void **)obj;
+	return (obj);
+}
+
+/* Return the object to the slab; 'size' is the size it was allocated with */
+static void hslab_free(hslab_t *slab, void *obj, size_t size)
+{
+	int class = hslab_class(size);
+
+	if (class < 0) {
+		hslab_big_t *big = (hslab_big_t *)((char *)obj - offsetof(hslab_big_t, mem));
+		if (NULL != big->prev) big->prev->next = big->next;
+		else slab->big = big->next;
+		if (NULL != big->next) big->next->prev = big->prev;
+		free(big);
+		return;
+	}
+
+	*(void **)obj = slab->free[class];
+	slab->free[class] = obj;
+}
+
+/* Free all pages and big objects at once */
+static void hslab_destroy(hslab_t *slab)
+{
+	void *page;
+	hslab_big_t *big;
+
+	if (NULL == slab) return;
+
+	while (NULL != (page = slab->pages)) {
+		slab->pages = *(void **)page;
+		free(page);
+	}
+
+	while (NULL != (big = slab->big)) {
+		slab->big = big->next;
+		free(big);
+	}
+
+	zfree(slab);
+}
+
+/* Copy of the key in the slab */
+static char *hslab_strdup(hslab_t *slab, const char *key)
+{
+	size_t len = strlen(key) + 1;
+	char *copy = hslab_alloc(slab, len);
+	TESTP(copy, NULL);
+	memcpy(copy, key, len);
+	return (copy);
+}
+
+/*** Ordered index ***/
+
+#define HSKIP_NODE_SIZE(level) (sizeof(hsnode_t) + sizeof(hsnode_t *) * (level))
+
+static hskip_t *hskip_alloc(hslab_t *slab)
+{
+	hskip_t *sl = zmalloc(sizeof(hskip_t));
+	TESTP_MES(sl, NULL, "Can't alloc");
+
+	sl->slab = slab;
+	sl->head = hslab_alloc(slab, HSKIP_NODE_SIZE(HSKIP_LEVEL_MAX));
+	if (NULL == sl->head) {
+		zfree(sl);
+		return (NULL);
+	}
+
+	memset(sl->head, 0, HSKIP_NODE_SIZE(HSKIP_LEVEL_MAX));
+	sl->level = 1;
+	sl->rnd = htable_seed() | 1;
+	return (sl);
+}
+
+/* Level of a new node: every next level with probability 1/4 */
+static int hskip_level(hskip_t *sl)
+{
+	int level = 1;
+
+	/* xorshift64 */
+	sl->rnd ^= sl->rnd << 13;
+	sl->rnd ^= sl->rnd >> 7;
+	sl->rnd ^= sl->rnd << 17;
+
+	while (level < HSKIP_LEVEL_MAX && 0 == ((sl->rnd >> (level * 2)) & 3)) {
+		level++;
+	}
+	return (level);
+}
+
+/* Find the last node before 'key' on every level */
+static void hskip_path(hskip_t *sl, const char *key, hsnode_t **path)
+{
+	hsnode_t *node = sl->head;
+	int i;
+
+	for (i = sl->level - 1; i >= 0; i--) {
+		while (NULL != node->next[i] && strcmp(node->next[i]->key, key) < 0) {
+			node = node->next[i];
+		}
+		path[i] = node;
+	}
+}
+
+/* Link the key into the index; the key must not be in the index */
+static int hskip_insert(hskip_t *sl, char *key, void *data)
+{
+	hsnode_t *path[HSKIP_LEVEL_MAX];
+	hsnode_t *node;
+	int level = hskip_level(sl);
+	int i;
+
+	hskip_path(sl, key, path);
+	for (i = sl->level; i < level; i++) {
+		path[i] = sl->head;
+	}
+
+	node = hslab_alloc(sl->slab, HSKIP_NODE_SIZE(level));
+	TESTP(node, -1);
+	node->key = key;
+	node->data = data;
+
+	for (i = 0; i < level; i++) {
+		node->next[i] = path[i]->next[i];
+		path[i]->next[i] = node;
+	}
+
+	if (level > sl->level) sl->level = level;
+	return (0);
+}
+
+static void hskip_delete(hskip_t *sl, const char *key)
+{
+	hsnode_t *path[HSKIP_LEVEL_MAX];
+	hsnode_t *node;
+	int i;
+
+	hskip_path(sl, key, path);
+	node = path[0]->next[0];
+	if (NULL == node || 0 != strcmp(node->key, key)) {
+		DE("Key %s is not in the ordered index\n", key);
+		return;
+	}
+
+	/* The node is linked on all its levels, so 'i' ends up equal to the node level */
+	for (i = 0; i < sl->level && path[i]->next[i] == node; i++) {
+		path[i]->next[i] = node->next[i];
+	}
+
+	while (sl->level > 1 && NULL == sl->head->next[sl->level - 1]) {
+		sl->level--;
+	}
+	hslab_free(sl->slab, node, HSKIP_NODE_SIZE(i));
+}
+
+/* Find the slot index of the key; returns -1 if not found */
+static ssize_t htable_lookup(htable_t *ht, const char *key, uint64_t hash)
+{
+	size_t mask = ht->size - 1;
+	size_t slot = HTABLE_SLOT(ht, hash);
+	uint32_t psl = 1;
+
+	/* Robin Hood invariant: once we see a node closer to its home than we are
+	   to ours, the key is not in the table. An empty slot has psl 0 and stops the search too */
+	while (ht->nodes[slot].psl >= psl) {
+		if (ht->nodes[slot].hash == hash && 0 == strcmp(ht->nodes[slot].key, key)) {
+			return ((ssize_t)slot);
+		}
+		slot = (slot + 1) & mask;
+		psl++;
+	}
+
+	return (-1);
+}
+
+/* Put the node into the slot array, no resize, no duplicate check.
+   Keeps ht->collisions up to date */
+static void htable_place(htable_t *ht, hnode_t node)
+{
+	size_t mask = ht->size - 1;
+	size_t slot = HTABLE_SLOT(ht, node.hash);
+	/* Was the carried node already counted as collision */
+	int counted = 0;
+
+	node.psl = 1;
+	while (0 != ht->nodes[slot].psl) {
+		/* Take the slot from a node which is closer to its home ("rich") */
+		if (ht->nodes[slot].psl < node.psl) {
+			hnode_t tmp = ht->nodes[slot];
+			ht->nodes[slot] = node;
+			if (!counted) ht->collisions++;
+			node = tmp;
+			counted = (node.psl > 1);
+		}
+		slot = (slot + 1) & mask;
+		node.psl++;
+	}
+
+	if (node.psl > 1 && !counted) ht->collisions++;
+	ht->nodes[slot] = node;
+}
+
+/* Reallocate the slot array to 'size' slots and rehash all nodes */
+static int htable_resize(htable_t *ht, size_t size)
+{
+	hnode_t *old = ht->nodes;
+	size_t old_size = ht->size;
+	size_t i;
+
+	DDD("Resize htable: %zu -> %zu slots, %zu members\n", old_size, size, ht->members);
+
+	ht->nodes = zmalloc(sizeof(hnode_t) * size);
+	if (NULL == ht->nodes) {
+		DE("Can't allocate %zu slots\n", size);
+		ht->nodes = old;
+		return (-1);
+	}
+
+	ht->size = size;
+	ht->collisions = 0;
+	for (i = 0; i < old_size; i++) {
+		if (0 != old[i].psl) {
+			htable_place(ht, old[i]);
+		}
+	}
+
+	zfree(old);
+	return (0);
+}
+
+/* Allocate new hash table; 'size' is the initial number of slots, the table grows when needed */
 htable_t *htable_alloc(size_t size)
 {
 	htable_t *ht;
@@ -80,135 +602,160 @@ htable_t *htable_alloc(size_t size)
 		return (NULL);
 	}
 
-	ht->nodes = zmalloc(sizeof(hnode_t *) * size);
-	if (NULL == ht->nodes) {
-		DE("Can't allocate array of pointers\n");
-		free(ht);
+	ht->size = htable_size_round(size);
+	ht->hash = htable_hash_wy;
+	ht->seed = htable_seed();
+	ht->nodes = zmalloc(sizeof(hnode_t) * ht->size);
+	ht->slab = hslab_new();
+	if (NULL == ht->nodes || NULL == ht->slab) {
+		DE("Can't allocate array of slots\n");
+		TZFREE(ht->nodes);
+		TZFREE(ht->slab);
+		zfree(ht);
 		return (NULL);
 	}
 
-	ht->size = size;
 	return (ht);
 }
 
-/* Free hash table */
+/* Free hash table, its keys and ordered index: they all live in the slab.
+   The data is owned by caller and not freed */
 int htable_free(htable_t *ht)
 {
 	TESTP_MES(ht, -1, "Got NULL");
-	/* TODO */
-	free(ht->nodes);
-	free(ht);
+
+	hslab_destroy(ht->slab);
+	TZFREE(ht->order);
+	zfree(ht->nodes);
+	zfree(ht);
+	return (0);
+}
+
+int htable_set_hash(htable_t *ht, htable_hash_f hash)
+{
+	TESTP_MES(ht, -1, "Got NULL");
+	TESTP_MES(hash, -1, "Got NULL");
+	if (ht->members > 0) {
+		DE("Can't change hash function of not empty table\n");
+		return (-1);
+	}
+	ht->hash = hash;
 	return (0);
 }
 
-/* insert new key / value pair */
+int htable_set_ordered(htable_t *ht)
+{
+	TESTP_MES(ht, -1, "Got NULL");
+	if (ht->members > 0) {
+		DE("Can't make not empty table ordered\n");
+		return (-1);
+	}
+	if (NULL != ht->order) return (0);
+
+	ht->order = hskip_alloc(ht->slab);
+	TESTP_MES(ht->order, -1, "Can't allocate ordered index\n");
+	return (0);
+}
+
+/* insert new key / value pair; returns -1 if the key already in the table */
 int htable_insert(htable_t *ht, char *key, void *data)
 {
-	hnode_t *node;
-	hnode_t *node_p;
-	uint32_t hash;
-	size_t slot;
+	hnode_t node;
+	uint64_t hash;
 
 	TESTP_MES(ht, -1, "Got ht NULL");
 	TESTP_MES(key, -1, "Got key NULL");
 	TESTP_MES(data, -1, "Got data NULL");
 
 	/* Calculate hash for the jey */
-	hash = murmur3_32((uint8_t *)key, strlen(key));
-
-	DDD("Counted hash for key %s : %X\n", key, hash);
+	hash = htable_hash_key(ht, key);
 
-	/* Find slot in the hash table for this data */
-	slot = HTABLE_SLOT(ht, hash);
+	DDD("Counted hash for key %s : %llX\n", key, (unsigned long long)hash);
 
-	DDD("Slot for key %s : %zu, size of htable: %zu\n", key, slot, ht->size);
-
-	/* Allocate new hash node */
-	node = hnode_alloc();
-	TESTP_MES(node, -1, "Can't allocate node\n");
-	node->data = data;
-	node->key = strdup(key);
-	node->hash = hash;
+	if (htable_lookup(ht, key, hash) >= 0) {
+		DE("Key %s already in the table\n", key);
+		return (-1);
+	}
 
-	DDD("Starting insert point search\n");
-	/* If this slot in hash table is vacant - insert the hash node  */
-	if (NULL == ht->nodes[slot]) {
-		DDD("Slot is empty - insert and finish\n");
-		ht->nodes[slot] = node;
-		ht->members++;
-		return (0);
+	/* Keep load factor under HTABLE_LOAD_MAX */
+	if ((ht->members + 1) * 100 > ht->size * HTABLE_LOAD_MAX) {
+		if (0 != htable_resize(ht, ht->size << 1)) {
+			DE("Can't grow the table\n");
+			return (-1);
+		}
 	}
 
-	DDD("Slot is not empty, starting linked list search\n");
+	node.hash = hash;
+	node.psl = 0;
+	node.data = data;
+	node.key = hslab_strdup(ht->slab, key);
+	TESTP_MES(node.key, -1, "Can't allocate key\n");
 
-	/* If in this slot already a node - insert into tail of this node */
-	node_p = ht->nodes[slot];
-	while (NULL != node_p->next) {
-		DDD("Searchin tail: current node is key %s\n", node_p->key);
-		node_p = node_p->next;
+	if (NULL != ht->order && 0 != hskip_insert(ht->order, node.key, data)) {
+		DE("Can't add key %s to ordered index\n", key);
+		hslab_free(ht->slab, node.key, strlen(node.key) + 1);
+		return (-1);
 	}
 
-	DDD("Found end of linked list\n");
-
+	htable_place(ht, node);
 	ht->members++;
-	node_p->next = node;
-	/* If we are here, it means a collition has place, the slot is occupied */
-	ht->collisions++;
 	return (0);
 }
 
-/* remove data for the given key; the data returned */
-void *htable_delete(htable_t *ht, char *key)
+/* Remove the node of the key from the table; its key returned in 'node_key' and not freed */
+static void *htable_unlink(htable_t *ht, char *key, char **node_key)
 {
-	hnode_t *node;
-	hnode_t *node_p;
-//	hnode_t *node_r;
-	uint32_t hash;
+	size_t mask;
 	size_t slot;
+	size_t next;
+	ssize_t found;
 	void *data;
 
-	TESTP_MES(ht, NULL, "Got NULL");
-	TESTP_MES(key, NULL, "Got NULL");
-
-	hash = murmur3_32((uint8_t *)key, strlen(key));
-	slot = HTABLE_SLOT(ht, hash);
-
-	node_p = node = ht->nodes[slot];
-
-	/* Iterate over the linked list (if any) until NULL or until hash found */
-	while ((NULL != node) && (node->hash != hash)) {
-		node_p = node;
-		node = node->next;
-	}
+	found = htable_lookup(ht, key, htable_hash_key(ht, key));
 
 	/* We can't find node with this key */
-	if (NULL == node) {
+	if (found < 0) {
 		DE("Not found key %s\n", key);
 		return (NULL);
 	}
 
-	/* We found the node. What now?*/
+	slot = (size_t)found;
+	mask = ht->size - 1;
+	data = ht->nodes[slot].data;
+	*node_key = ht->nodes[slot].key;
+	if (ht->nodes[slot].psl > 1) ht->collisions--;
+
+	/* Backward shift: pull following nodes one slot back until an empty slot
+	   or a node in its home slot. No tombstones left behind */
+	next = (slot + 1) & mask;
+	while (ht->nodes[next].psl > 1) {
+		ht->nodes[slot] = ht->nodes[next];
+		ht->nodes[slot].psl--;
+		if (1 == ht->nodes[slot].psl) ht->collisions--;
+		slot = next;
+		next = (next + 1) & mask;
+	}
 
-	/* If the found node and pointer to previous node are the same,
-	   it means the found node is in the head of the list (if any) */
+	memset(&ht->nodes[slot], 0, sizeof(hnode_t));
+	if (NULL != ht->order) hskip_delete(ht->order, *node_key);
+	ht->members--;
 
-	/* The node is the only node in the slot:
-	   the "next" if the first node in the slot is NULL */
-	data = node->data;
+	return (data);
+}
 
-	if (NULL == ht->nodes[slot]->next) {
-		free(node->key);
-		free(node);
-		ht->nodes[slot] = NULL;
-	} else {
-		/* SEB: TODO: Fix here */
-		node_p->next = node->next;
-		free(node->key);
-		free(node);
-	}
+/* remove data for the given key; the data returned */
+void *htable_delete(htable_t *ht, char *key)
+{
+	char *node_key = NULL;
+	void *data;
 
-	ht->members--;
+	TESTP_MES(ht, NULL, "Got NULL");
+	TESTP_MES(key, NULL, "Got NULL");
 
+	data = htable_unlink(ht, key, &node_key);
+	if (NULL != node_key) {
+		hslab_free(ht->slab, node_key, strlen(node_key) + 1);
+	}
 	return (data);
 }
 
@@ -223,108 +770,292 @@ void *htable_replace(htable_t *ht, char *key, void *data){
 /* find data for the given key */
 void *htable_find(htable_t *ht, char *key)
 {
-	hnode_t *node;
-	uint32_t hash;
-	size_t slot;
+	uint64_t hash;
+	ssize_t slot;
 
 	TESTP_MES(ht, NULL, "Got NULL");
 	TESTP_MES(key, NULL, "Got NULL");
 
-	hash = murmur3_32((uint8_t *)key, strlen(key));
-	slot = HTABLE_SLOT(ht, hash);
+	hash = htable_hash_key(ht, key);
+
+	DDD("Search for key %s, hash %llX\n", key, (unsigned long long)hash);
 
-	DDD("Search for key %s, hash %X, slot %zu\n", key, hash, slot);
+	slot = htable_lookup(ht, key, hash);
+	if (slot >= 0) {
+		return (ht->nodes[slot].data);
+	}
+
+	return (NULL);
+}
 
-	node = ht->nodes[slot];
 
-	/* Iterate over the linked list (if any) until NULL or until hash found */
-	while ((NULL != node) && (node->hash != hash)) {
-		node = node->next;
+/*** Concurrent (RCU) variant ***/
+
+/* Copy of the table sharing the keys with the original */
+static htable_t *htable_clone(htable_t *ht)
+{
+	htable_t *copy = zmalloc(sizeof(htable_t));
+	TESTP_MES(copy, NULL, "Can't allocate hash table\n");
+
+	copy->nodes = zmalloc(sizeof(hnode_t) * ht->size);
+	if (NULL == copy->nodes) {
+		DE("Can't allocate array of slots\n");
+		zfree(copy);
+		return (NULL);
 	}
 
-	if (node) {
-		return (node->data);
+	memcpy(copy->nodes, ht->nodes, sizeof(hnode_t) * ht->size);
+	copy->size = ht->size;
+	copy->members = ht->members;
+	copy->collisions = ht->collisions;
+	copy->hash = ht->hash;
+	copy->seed = ht->seed;
+	copy->slab = ht->slab;
+	return (copy);
+}
+
+/* Free the table structure, but not the slab: it is shared with a clone.
+   Clones are never ordered */
+static void htable_free_shallow(htable_t *ht)
+{
+	zfree(ht->nodes);
+	zfree(ht);
+}
+
+/* Wait until all readers which could see the previous table leave.
+   A reader registers in counter of the current epoch parity; we move the epoch
+   and wait the old counter drains. Called by writer under hr->wlock */
+static void htable_rcu_synchronize(htable_rcu_t *hr)
+{
+	unsigned int epoch = __atomic_load_n(&hr->epoch, __ATOMIC_SEQ_CST);
+
+	__atomic_store_n(&hr->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+	while (0 != __atomic_load_n(&hr->readers[epoch & 1], __ATOMIC_SEQ_CST)) {
+		sched_yield();
 	}
+}
 
-	return (NULL);
+/* Publish new table, wait for grace period; returns the previous table */
+static htable_t *htable_rcu_publish(htable_rcu_t *hr, htable_t *ht)
+{
+	htable_t *old = __atomic_exchange_n(&hr->ht, ht, __ATOMIC_SEQ_CST);
+	htable_rcu_synchronize(hr);
+	return (old);
 }
 
+htable_rcu_t *htable_rcu_alloc(size_t size)
+{
+	htable_rcu_t *hr = zmalloc(sizeof(htable_rcu_t));
+	TESTP_MES(hr, NULL, "Can't allocate hash table\n");
 
-/* Test if this key already in the hash table. 0 for "yes", 1 for "no", -1 for error */
-#if 0
-int htable_test_key(htable_t *ht, char *key){
-	void *data;
-	TESTP(ht, -1, "Got NULL");
-	TESTP(key, -1, "Got NULL");
-	data = htable_find(ht, key);
-	if (NULL == data) return (1);
+	hr->ht = htable_alloc(size);
+	if (NULL == hr->ht) {
+		zfree(hr);
+		return (NULL);
+	}
+
+	pthread_mutex_init(&hr->wlock, NULL);
+	return (hr);
+}
+
+int htable_rcu_free(htable_rcu_t *hr)
+{
+	TESTP_MES(hr, -1, "Got NULL");
+	htable_free(hr->ht);
+	pthread_mutex_destroy(&hr->wlock);
+	free(hr->retired);
+	zfree(hr);
 	return (0);
 }
-#endif
 
-/* remove first found key from hash table */
-void *htable_first_key(htable_t *ht)
+unsigned int htable_rcu_read_lock(htable_rcu_t *hr)
+{
+	unsigned int epoch;
+
+	do {
+		epoch = __atomic_load_n(&hr->epoch, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&hr->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+		/* The epoch moved before we registered: the writer may not wait for us */
+		if (epoch == __atomic_load_n(&hr->epoch, __ATOMIC_SEQ_CST)) {
+			return (epoch);
+		}
+		__atomic_sub_fetch(&hr->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+	} while (1);
+}
+
+void htable_rcu_read_unlock(htable_rcu_t *hr, unsigned int epoch)
+{
+	__atomic_sub_fetch(&hr->readers[epoch & 1], 1, __ATOMIC_RELEASE);
+}
+
+void *htable_rcu_find(htable_rcu_t *hr, char *key)
+{
+	TESTP_MES(hr, NULL, "Got NULL");
+	return (htable_find(__atomic_load_n(&hr->ht, __ATOMIC_ACQUIRE), key));
+}
+
+htable_t *htable_rcu_begin(htable_rcu_t *hr)
+{
+	TESTP_MES(hr, NULL, "Got NULL");
+
+	pthread_mutex_lock(&hr->wlock);
+	hr->w = htable_clone(hr->ht);
+	if (NULL == hr->w) {
+		pthread_mutex_unlock(&hr->wlock);
+		return (NULL);
+	}
+	hr->retired_num = 0;
+	return (hr->w);
+}
+
+void *htable_rcu_remove(htable_rcu_t *hr, char *key)
+{
+	char *node_key = NULL;
+	void *data;
+
+	TESTP_MES(hr, NULL, "Got NULL");
+	TESTP_MES(hr->w, NULL, "Not in a batch");
+	TESTP_MES(key, NULL, "Got NULL");
+
+	/* Make room before unlinking: then the key is never lost */
+	if (hr->retired_num == hr->retired_size) {
+		size_t size = hr->retired_size ? hr->retired_size * 2 : 16;
+		char **retired = realloc(hr->retired, sizeof(char *) * size);
+		TESTP_MES(retired, NULL, "Can't allocate");
+		hr->retired = retired;
+		hr->retired_size = size;
+	}
+
+	data = htable_unlink(hr->w, key, &node_key);
+	if (NULL != node_key) {
+		/* Readers of the published table may still use the key */
+		hr->retired[hr->retired_num++] = node_key;
+	}
+	return (data);
+}
+
+int htable_rcu_commit(htable_rcu_t *hr)
 {
-	hnode_t *node;
 	size_t i;
 
-	TESTP_MES(ht, NULL, "Got NULL");
+	TESTP_MES(hr, -1, "Got NULL");
+	TESTP_MES(hr->w, -1, "Not in a batch");
 
-	htable_each(ht, i, node) {
-		return (node->key);
+	/* After the grace period no reader sees the removed keys and data.
+	   The slab is not thread safe: the keys are freed under the writer lock */
+	htable_free_shallow(htable_rcu_publish(hr, hr->w));
+	for (i = 0; i < hr->retired_num; i++) {
+		hslab_free(hr->w->slab, hr->retired[i], strlen(hr->retired[i]) + 1);
 	}
+	hr->retired_num = 0;
+	hr->w = NULL;
+	pthread_mutex_unlock(&hr->wlock);
+	return (0);
+}
 
-	return (NULL);
+/* The key string is used by the published table: it was there before the batch */
+static int htable_rcu_published(htable_rcu_t *hr, const char *key)
+{
+	ssize_t slot = htable_lookup(hr->ht, key, htable_hash_key(hr->ht, key));
+	return (slot >= 0 && hr->ht->nodes[slot].key == key);
 }
 
-/* Comparation function, used in htable_sort() */
-static int htable_comp(const void *p1, const void *p2)
+void htable_rcu_abort(htable_rcu_t *hr)
 {
-	hnode_t *h1 = *(hnode_t **)p1;
-	hnode_t *h2 = *(hnode_t **)p2;
-	DDD("Compare: |%s| |%s|\n", h1->key, h2->key);
-	return (strcmp(h1->key, h2->key));
+	hnode_t *node;
+	size_t index;
+	size_t i;
+
+	if (NULL == hr || NULL == hr->w) return;
+
+	/* The keys of the published table are shared with the copy and stay.
+	   The keys inserted in the batch, kept or removed again, are returned to the slab */
+	htable_each(hr->w, index, node) {
+		if (!htable_rcu_published(hr, node->key)) {
+			hslab_free(hr->w->slab, node->key, strlen(node->key) + 1);
+		}
+	}
+	for (i = 0; i < hr->retired_num; i++) {
+		if (!htable_rcu_published(hr, hr->retired[i])) {
+			hslab_free(hr->w->slab, hr->retired[i], strlen(hr->retired[i]) + 1);
+		}
+	}
+
+	htable_free_shallow(hr->w);
+	hr->retired_num = 0;
+	hr->w = NULL;
+	pthread_mutex_unlock(&hr->wlock);
 }
 
-/* Prepare sorted array */
-int htable_sort(htable_t *ht)
+int htable_rcu_insert(htable_rcu_t *hr, char *key, void *data)
 {
-	size_t i = 0;
-	int j = 0;
-	hnode_t *node = NULL;
-	hnode_t **sarr = NULL;
-	TESTP_MES(ht, -1, "Got NULL");
-	if (ht->members < 1) {
-		DE("Not enough elements\n");
+	htable_t *w = htable_rcu_begin(hr);
+
+	TESTP(w, -1);
+	if (0 != htable_insert(w, key, data)) {
+		htable_rcu_abort(hr);
 		return (-1);
 	}
+	return (htable_rcu_commit(hr));
+}
 
-	sarr = zmalloc((sizeof(hnode_t *) * ht->members) + 1);
-	TESTP_MES(sarr, -1, "Can't allocate array for sorted");
+void *htable_rcu_delete(htable_rcu_t *hr, char *key)
+{
+	htable_t *w;
+	void *data;
 
-	DD("Starting copying\n");
-	htable_each(ht, i, node) {
-		DDD("Copying  node |%s|\n", node->key);
-		sarr[j] = node;
-		j++;
+	TESTP_MES(key, NULL, "Got NULL");
+	w = htable_rcu_begin(hr);
+	TESTP(w, NULL);
+
+	data = htable_rcu_remove(hr, key);
+	if (NULL == data) {
+		htable_rcu_abort(hr);
+		return (NULL);
 	}
 
-	DDD("Finished copying\n");
-	sarr[j] = NULL;
+	htable_rcu_commit(hr);
+	return (data);
+}
+
+htable_t *htable_rcu_swap(htable_rcu_t *hr, htable_t *ht)
+{
+	htable_t *old;
+
+	TESTP_MES(hr, NULL, "Got NULL");
+	TESTP_MES(ht, NULL, "Got NULL");
 
-	DDD("Starting qsort\n");
-	qsort(sarr, ht->members - 1, sizeof(hnode_t *), htable_comp);
-	DDD("Finished qsort\n");
-	ht->misc = sarr;
+	pthread_mutex_lock(&hr->wlock);
+	old = htable_rcu_publish(hr, ht);
+	pthread_mutex_unlock(&hr->wlock);
+	return (old);
+}
+
+/* Test if this key already in the hash table. 0 for "yes", 1 for "no", -1 for error */
+#if 0
+int htable_test_key(htable_t *ht, char *key){
+	void *data;
+	TESTP(ht, -1, "Got NULL");
+	TESTP(key, -1, "Got NULL");
+	data = htable_find(ht, key);
+	if (NULL == data) return (1);
 	return (0);
 }
+#endif
 
-int htable_unsort(htable_t *ht)
+/* remove first found key from hash table */
+void *htable_first_key(htable_t *ht)
 {
-	TESTP_MES(ht, -1, "Got NULL");
-	TESTP_MES(ht->misc, -1, "misc is NULL");
-	free(ht->misc);
-	return (0);
+	hnode_t *node;
+	size_t i;
+
+	TESTP_MES(ht, NULL, "Got NULL");
+
+	htable_each(ht, i, node) {
+		return (node->key);
+	}
+
+	return (NULL);
 }
 
 /*** Testing here ***/
@@ -343,6 +1074,7 @@ static int hrable_test_number(int table_size){
 	}
 
 	D("Created htable - OK\n");
+	htable_set_ordered(ht);
 
 	/* Test insert */
 	for (i = 0; keys[i] != NULL; i++) {
@@ -365,22 +1097,16 @@ static int hrable_test_number(int table_size){
 		int i;
 		hnode_t *hn;
 
-		htab_each(ht, i, hn) {
+		htable_each(ht, i, hn) {
 
 			printf("Key: %s val: %s\n", hn->key, (char *)hn->data);
 		}
 
 	}
 	{
-		hnode_t *hn;
-		int i = 12;
-		if (0 == htable_sort(ht)) {
-			htab_each_sorted(ht, i, hn) {
-				if (hn) {
-					DDD("Sorted: key: %s, val: %s\n", hn->key, (char *)hn->data);
-				} else DDD("Got NULL\n");
-			}
-			htable_unsort(ht);
+		hsnode_t *sn;
+		htable_each_sorted(ht, sn) {
+			DDD("Sorted: key: %s, val: %s\n", sn->key, (char *)sn->data);
 		}
 	}
 
@@ -452,3 +1178,180 @@ int hrable_test(void){
 #endif
 
 
+
+#ifdef STANDALONE
+/*** Hash microbenchmark: make hbench && ./htable-bench [number of keys] ***/
+#include <stdio.h>
+#include <stdlib.h>
+#include "mp-htype.h"
+
+/* Typed table with the uid embedded in the slot, to compare with htable_t */
+HTYPE_FSTR_DECLARE(bench_uid, 32)
+HTYPE_INIT(bench_tab, bench_uid_t, void *, bench_uid_hash, bench_uid_eq)
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+/* Keys of the same shape as mp_os_generate_uid() makes: "seb-1234-5678-9012" */
+static char **bench_uids(size_t num)
+{
+	char **keys = zmalloc(sizeof(char *) * num);
+	size_t i;
+
+	TESTP(keys, NULL);
+	for (i = 0; i < num; i++) {
+		keys[i] = zmalloc(32);
+		TESTP(keys[i], NULL);
+		snprintf(keys[i], 32, "seb-%04d-%04d-%04d", rand() % 10000, rand() % 10000, rand() % 10000);
+	}
+	return (keys);
+}
+
+static void bench_hash(const char *name, htable_hash_f hash, char **keys, size_t num)
+{
+	const int rounds = 20;
+	volatile uint64_t sink = 0;
+	uint64_t start;
+	uint64_t t_hash;
+	uint64_t t_insert;
+	uint64_t t_find;
+	htable_t *ht;
+	size_t i;
+	int r;
+
+	start = bench_now();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < num; i++) {
+			sink += hash(keys[i], strlen(keys[i]), htable_seed());
+		}
+	}
+	t_hash = bench_now() - start;
+
+	ht = htable_alloc(1);
+	htable_set_hash(ht, hash);
+	start = bench_now();
+	for (i = 0; i < num; i++) {
+		/* Random uids may repeat: then insert fails, that's ok */
+		htable_insert(ht, keys[i], keys[i]);
+	}
+	t_insert = bench_now() - start;
+
+	start = bench_now();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < num; i++) {
+			sink += (uintptr_t)htable_find(ht, keys[i]);
+		}
+	}
+	t_find = bench_now() - start;
+
+	printf("%-10s hash %6.1f ns/key, insert %6.1f ns/key, find %6.1f ns/key, displaced %5.1f%% (%zu members, %zu slots)\n",
+		   name, (double)t_hash / (rounds * num), (double)t_insert / num, (double)t_find / (rounds * num),
+		   100.0 * ht->collisions / ht->members, ht->members, ht->size);
+	htable_free(ht);
+}
+
+static void bench_typed(char **keys, size_t num)
+{
+	const int rounds = 20;
+	volatile uint64_t sink = 0;
+	bench_tab_t *t = bench_tab_alloc(1);
+	bench_uid_t *ukeys = zmalloc(sizeof(bench_uid_t) * num);
+	uint64_t start;
+	uint64_t t_insert;
+	uint64_t t_find;
+	size_t i;
+	int r;
+
+	for (i = 0; i < num; i++) {
+		bench_uid_set(&ukeys[i], keys[i]);
+	}
+
+	start = bench_now();
+	for (i = 0; i < num; i++) {
+		*bench_tab_put(t, &ukeys[i], NULL) = keys[i];
+	}
+	t_insert = bench_now() - start;
+
+	start = bench_now();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < num; i++) {
+			sink += (uintptr_t)*bench_tab_find(t, &ukeys[i]);
+		}
+	}
+	t_find = bench_now() - start;
+
+	printf("%-10s                 insert %6.1f ns/key, find %6.1f ns/key (%zu members, %zu slots)\n",
+		   "typed", (double)t_insert / num, (double)t_find / (rounds * num), t->members, t->size);
+	bench_tab_free(t);
+	zfree(ukeys);
+}
+
+static void bench_long(size_t len)
+{
+	const int rounds = 2000;
+	uint8_t *buf = zmalloc(len);
+	uint64_t acc_s[HTABLE_LANES] = {0};
+	uint64_t secret[HTABLE_LANES];
+	uint64_t start;
+	uint64_t t_scalar;
+	size_t i;
+	int r;
+
+	for (i = 0; i < len; i++) buf[i] = (uint8_t)rand();
+	for (i = 0; i < HTABLE_LANES; i++) secret[i] = wyp[i & 3] + i;
+
+	start = bench_now();
+	for (r = 0; r < rounds; r++) {
+		htable_stripes_scalar(acc_s, buf, len / HTABLE_STRIPE, secret);
+	}
+	t_scalar = bench_now() - start;
+	printf("stripes %5zu bytes: scalar %5.2f GB/s", len, (double)len * rounds / t_scalar);
+
+#ifdef __SSE2__
+	{
+		uint64_t acc_v[HTABLE_LANES] = {0};
+		uint64_t t_sse2;
+
+		start = bench_now();
+		for (r = 0; r < rounds; r++) {
+			htable_stripes_sse2(acc_v, buf, len / HTABLE_STRIPE, secret);
+		}
+		t_sse2 = bench_now() - start;
+		printf(", sse2 %5.2f GB/s, results %s", (double)len * rounds / t_sse2,
+			   memcmp(acc_s, acc_v, sizeof(acc_s)) ? "DIFFER - ERROR" : "equal");
+	}
+#endif
+	printf("\n");
+	zfree(buf);
+}
+
+int main(int argi, char **argc)
+{
+	size_t num = 100000;
+	char **keys;
+	size_t i;
+
+	if (argi > 1) num = strtoul(argc[1], NULL, 10);
+	if (num < 1) num = 1;
+
+	srand((unsigned int)htable_seed());
+	keys = bench_uids(num);
+	TESTP(keys, -1);
+
+	printf("%zu uid keys like %s, seed %llX\n", num, keys[0], (unsigned long long)htable_seed());
+	bench_hash("wyhash", htable_hash_wy, keys, num);
+	bench_hash("murmur3", htable_hash_murmur3, keys, num);
+	bench_typed(keys, num);
+
+	bench_long(1024);
+	bench_long(65536);
+
+	for (i = 0; i < num; i++) zfree(keys[i]);
+	zfree(keys);
+	return (0);
+}
+#endif /* STANDALONE */
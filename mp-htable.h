@@ -1,47 +1,146 @@
 #ifndef _SEC_HTABLE_H_
 #define _SEC_HTABLE_H_
 #include <stdint.h>
+#include <pthread.h>
 
 #define MURMUR_SEED 17
 uint32_t murmur3_32(const uint8_t *key, size_t len);
 
+/* Hash function of htable: any function of this type can be set by htable_set_hash() */
+typedef uint64_t (*htable_hash_f)(const void *key, size_t len, uint64_t seed);
+
+/* wyhash-style 64 bit hash; default for all tables.
+   Keys longer than HTABLE_HASH_LONG are processed in 64 byte stripes,
+   vectorized when built with SSE2; the result doesn't depend on the path */
+#define HTABLE_HASH_LONG 256
+extern uint64_t htable_hash_wy(const void *key, size_t len, uint64_t seed);
+/* murmur3_32 with seed, for comparison */
+extern uint64_t htable_hash_murmur3(const void *key, size_t len, uint64_t seed);
+/* Random seed, generated once per process; all tables use it by default */
+extern uint64_t htable_seed(void);
+
+/* Hash table: open addressing with Robin Hood probing.
+   Nodes are stored in the slot array itself; a node moves when the table grows
+   or when a neighbour is deleted (backward shift), so never keep a pointer to hnode_t
+   over htable_insert() / htable_delete() */
 typedef struct hnode_struct {
-	uint32_t hash;
+	uint64_t hash;
+	uint32_t psl; /* Probe sequence length + 1; 0 means the slot is empty */
 	char *key;
-	char *data;
-	struct hnode_struct *next;
+	void *data;
 } hnode_t;
 
+/* Per-table slab: keys and ordered index nodes are allocated here.
+   Objects are grouped by size classes (16, 32 ... 2048 bytes) in HSLAB_PAGE pages;
+   bigger objects are allocated one by one. Freed all at once by htable_free() */
+#define HSLAB_PAGE (16 * 1024)
+#define HSLAB_CLASSES 8
+typedef struct hslab_struct {
+	void *free[HSLAB_CLASSES]; /* Free objects of every size class */
+	void *pages; /* All pages, linked through their first pointer */
+	void *big; /* Objects bigger than the biggest class */
+	size_t pages_num;
+} hslab_t;
+
+/* Ordered index: skip list over the keys, kept up to date by insert / delete */
+#define HSKIP_LEVEL_MAX 16
+typedef struct hsnode_struct {
+	char *key; /* The same string as in hnode_t */
+	void *data;
+	struct hsnode_struct *next[]; /* One pointer per level of the node */
+} hsnode_t;
+
+typedef struct hskip_struct {
+	hslab_t *slab; /* Nodes are allocated in the slab of the table */
+	hsnode_t *head; /* Sentinel with HSKIP_LEVEL_MAX levels */
+	int level; /* Highest level in use */
+	uint64_t rnd; /* Level generator state */
+} hskip_t;
+
 typedef struct htable_struct {
-	hnode_t **nodes;
-	size_t size;
+	hnode_t *nodes;
+	size_t size; /* Number of slots, always power of 2 */
 	size_t members;
-	size_t collisions;
-	void *misc;
+	size_t collisions; /* Members not in their home slot */
+	htable_hash_f hash;
+	uint64_t seed;
+	hslab_t *slab; /* Keys; the table and its RCU clones share it */
+	hskip_t *order; /* Ordered index, NULL if the table is not ordered */
 } htable_t;
 
+/* Minimal number of slots */
+#define HTABLE_SIZE_MIN 8
+/* The table grows x2 when it is filled more than HTABLE_LOAD_MAX percent */
+#define HTABLE_LOAD_MAX 80
+
 /* accepts: trable_t, hash */
-#define HTABLE_SLOT(htbl, hsh) (hsh % (htbl->size))
+#define HTABLE_SLOT(htbl, hsh) ((hsh) & ((htbl)->size - 1))
 
-// #define htab_each(htable_t *htab, int index, hnode_t *node)
+/* Iterate all nodes. Don't insert or delete inside of this loop.
+   The empty slots are skipped by "if () {} else": an 'else' after the loop body
+   can't bind to the macro */
 #define htable_each(htab, index, hnode) \
-	for (i = 0, hnode = htab->nodes[i] ; i < htab->size; i++) \
-		for (hnode = htab->nodes[i]; hnode != NULL ; hnode = hnode->next)
+	for (index = 0; index < (htab)->size; index++) \
+		if (0 == (hnode = &(htab)->nodes[index])->psl) {} else
 
-#define htable_each_sorted(htab, index, hnode) \
-	for(index = 0, hnode = ((hnode_t **)htab->misc)[index] ; index < htab->members - 1; hnode = ((hnode_t **)htab->misc)[++index]) 
+/* Iterate all members in strcmp() order of keys; the table must be ordered, see htable_set_ordered().
+   Don't insert or delete inside of this loop */
+#define htable_each_sorted(htab, snode) \
+	for (snode = (htab)->order ? (htab)->order->head->next[0] : NULL; NULL != snode; snode = snode->next[0])
 
 
 extern htable_t *htable_alloc(size_t size);
 extern int htable_free(htable_t *ht);
+/* Change hash function; allowed for empty table only */
+extern int htable_set_hash(htable_t *ht, htable_hash_f hash);
+/* Keep ordered index of the keys for htable_each_sorted(); allowed for empty table only */
+extern int htable_set_ordered(htable_t *ht);
 extern int htable_insert(htable_t *ht, char *key, void *data);
 extern void *htable_delete(htable_t *ht, char *key);
 //extern void *htable_replace(htable_t *ht, char *key, void *data);
 extern void *htable_find(htable_t *ht, char *key);
 //extern int htable_test_key(htable_t *ht, char *key);
 extern void *htable_first_key(htable_t *ht);
-extern int htable_sort(htable_t *ht);
-extern int htable_unsort(htable_t *ht);
+
+/* Concurrent variant: readers never block, writers are serialized.
+   A writer builds a modified copy of the table, publishes it, then waits
+   until all readers which could see the previous table are gone (grace period).
+   Writes cost O(n), reads are as fast as htable_find(): use it for read-mostly tables.
+   The RCU table is never ordered */
+typedef struct htable_rcu_struct {
+	htable_t *ht;			/* Published table, never modified in place */
+	pthread_mutex_t wlock;	/* Serializes writers */
+	unsigned int epoch;		/* Grace period counter */
+	int readers[2];			/* Active readers per epoch parity */
+	htable_t *w;			/* Writable copy between htable_rcu_begin() and htable_rcu_commit() */
+	char **retired;			/* Keys removed in the current batch, freed after grace period */
+	size_t retired_num;
+	size_t retired_size;
+} htable_rcu_t;
+
+extern htable_rcu_t *htable_rcu_alloc(size_t size);
+/* Free the table and the keys; no readers must be active */
+extern int htable_rcu_free(htable_rcu_t *hr);
+/* Enter / leave read section; the returned epoch must be passed to htable_rcu_read_unlock() */
+extern unsigned int htable_rcu_read_lock(htable_rcu_t *hr);
+extern void htable_rcu_read_unlock(htable_rcu_t *hr, unsigned int epoch);
+/* Find data for the key; call it inside of read section, the data is valid until the section end */
+extern void *htable_rcu_find(htable_rcu_t *hr, char *key);
+extern int htable_rcu_insert(htable_rcu_t *hr, char *key, void *data);
+/* Remove the key; when it returns no reader sees the data anymore, so the caller may free it */
+extern void *htable_rcu_delete(htable_rcu_t *hr, char *key);
+/* Batch of changes: one copy and one grace period for many operations.
+   htable_rcu_begin() locks the writers and returns writable copy: use htable_find() /
+   htable_insert() on it and htable_rcu_remove() (not htable_delete()) to remove.
+   htable_rcu_commit() publishes it; data removed in the batch may be freed after it returns.
+   htable_rcu_abort() drops the copy and the keys added in the batch */
+extern htable_t *htable_rcu_begin(htable_rcu_t *hr);
+extern void *htable_rcu_remove(htable_rcu_t *hr, char *key);
+extern int htable_rcu_commit(htable_rcu_t *hr);
+extern void htable_rcu_abort(htable_rcu_t *hr);
+/* Replace the whole table by 'ht'; the previous table returned after grace period,
+   the caller frees its data and calls htable_free() */
+extern htable_t *htable_rcu_swap(htable_rcu_t *hr, htable_t *ht);
 
 extern int hrable_test(void);
 #endif /* _SEC_HTABLE_H_ */
@@ -0,0 +1,238 @@
+#ifndef _SEC_HTYPE_H_
+#define _SEC_HTYPE_H_
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "mp-htable.h"
+#include "mp-memory.h"
+
+/*
+ * Type specialized hash table, generated by macro (in the spirit of klib/khash).
+ * The key and the value are stored in the slot: no allocation per entry,
+ * no void pointers, hash and compare are inlined for every instance.
+ * Open addressing with Robin Hood probing and backward shift delete, like htable_t.
+ *
+ * Declare an instance:
+ *     HTYPE_INIT(ports, htype_port_t, port_map_t, htype_port_hash, htype_port_eq)
+ * This generates type ports_t and functions:
+ *     ports_t *ports_alloc(size_t size);
+ *     void ports_free(ports_t *t);
+ *     port_map_t *ports_find(ports_t *t, const htype_port_t *key);
+ *     port_map_t *ports_put(ports_t *t, const htype_port_t *key, int *added);
+ *     int ports_del(ports_t *t, const htype_port_t *key, port_map_t *val);
+ * The keys are passed by pointer, the hash and compare functions are:
+ *     uint32_t hash_f(const key_t *key, uint64_t seed);
+ *     int eq_f(const key_t *a, const key_t *b);
+ * The seed is taken once, when the table is allocated.
+ * The pointer returned by _find() / _put() is valid until the next _put() / _del().
+ */
+
+/* The table grows x2 when it is filled more than HTYPE_LOAD_MAX percent */
+#define HTYPE_LOAD_MAX 80
+#define HTYPE_SIZE_MIN 8
+
+/* Iterate all used slots; 'slot' is pointer to the slot, use slot->key and slot->val.
+   Same "if () {} else" skip as htable_each() */
+#define htype_each(t, index, slot) \
+	for (index = 0; index < (t)->size; index++) \
+		if (0 == (slot = &(t)->slots[index])->psl) {} else
+
+/*** Hash and compare for the common key types ***/
+
+/* Integer keys */
+static inline uint32_t htype_int_hash(const uint64_t *pkey, uint64_t seed)
+{
+	uint64_t key = *pkey ^ seed;
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return ((uint32_t)key);
+}
+
+static inline int htype_int_eq(const uint64_t *a, const uint64_t *b)
+{
+	return (*a == *b);
+}
+
+/* Port mapping keys: (port, protocol); protocol is IPPROTO_TCP / IPPROTO_UDP */
+typedef struct htype_port_struct {
+	uint16_t port;
+	uint8_t protocol;
+} htype_port_t;
+
+static inline uint32_t htype_port_hash(const htype_port_t *key, uint64_t seed)
+{
+	uint64_t k = ((uint64_t)key->port << 8) | key->protocol;
+	return (htype_int_hash(&k, seed));
+}
+
+static inline int htype_port_eq(const htype_port_t *a, const htype_port_t *b)
+{
+	return (a->port == b->port && a->protocol == b->protocol);
+}
+
+/* Fixed size string keys: HTYPE_FSTR_DECLARE(uid_key, 64) declares type uid_key_t
+   with member 's' and functions uid_key_set() / uid_key_hash() / uid_key_eq().
+   The key is zero padded (set it with uid_key_set()): hash and compare work on
+   the whole fixed size buffer, no strlen() */
+#define HTYPE_FSTR_DECLARE(name, len) \
+	typedef struct name##_struct { \
+		char s[len]; \
+	} name##_t; \
+	static inline void name##_set(name##_t *key, const char *s) \
+	{ \
+		memset(key->s, 0, len); \
+		strncpy(key->s, s, len - 1); \
+	} \
+	static inline uint32_t name##_hash(const name##_t *key, uint64_t seed) \
+	{ \
+		return ((uint32_t)htable_hash_wy(key->s, len, seed)); \
+	} \
+	static inline int name##_eq(const name##_t *a, const name##_t *b) \
+	{ \
+		return (0 == memcmp(a->s, b->s, len)); \
+	}
+
+/*** The table ***/
+
+#define HTYPE_INIT(name, key_t, val_t, hash_f, eq_f) \
+	typedef struct name##_slot_struct { \
+		uint32_t hash; \
+		uint32_t psl; /* Probe sequence length + 1; 0 means the slot is empty */ \
+		key_t key; \
+		val_t val; \
+	} name##_slot_t; \
+	\
+	typedef struct name##_struct { \
+		name##_slot_t *slots; \
+		size_t size; /* Power of 2 */ \
+		size_t members; \
+		uint64_t seed; \
+	} name##_t; \
+	\
+	static inline name##_t *name##_alloc(size_t size) \
+	{ \
+		name##_t *t = zmalloc(sizeof(name##_t)); \
+		if (NULL == t) return (NULL); \
+		t->size = HTYPE_SIZE_MIN; \
+		t->seed = htable_seed(); \
+		while (t->size < size) t->size <<= 1; \
+		t->slots = zmalloc(t->size * sizeof(name##_slot_t)); \
+		if (NULL == t->slots) { \
+			zfree(t); \
+			return (NULL); \
+		} \
+		return (t); \
+	} \
+	\
+	static inline void name##_free(name##_t *t) \
+	{ \
+		if (NULL == t) return; \
+		zfree(t->slots); \
+		zfree(t); \
+	} \
+	\
+	/* Place the slot content, returns index where 'first' ended up */ \
+	static inline size_t name##_place(name##_t *t, name##_slot_t slot) \
+	{ \
+		size_t mask = t->size - 1; \
+		size_t i = slot.hash & mask; \
+		size_t first = (size_t)-1; \
+		slot.psl = 1; \
+		while (0 != t->slots[i].psl) { \
+			if (t->slots[i].psl < slot.psl) { \
+				name##_slot_t tmp = t->slots[i]; \
+				t->slots[i] = slot; \
+				if ((size_t)-1 == first) first = i; \
+				slot = tmp; \
+			} \
+			i = (i + 1) & mask; \
+			slot.psl++; \
+		} \
+		t->slots[i] = slot; \
+		return ((size_t)-1 == first ? i : first); \
+	} \
+	\
+	static inline int name##_resize(name##_t *t, size_t size) \
+	{ \
+		name##_slot_t *old = t->slots; \
+		size_t old_size = t->size; \
+		size_t i; \
+		t->slots = zmalloc(size * sizeof(name##_slot_t)); \
+		if (NULL == t->slots) { \
+			t->slots = old; \
+			return (-1); \
+		} \
+		t->size = size; \
+		for (i = 0; i < old_size; i++) { \
+			if (0 != old[i].psl) name##_place(t, old[i]); \
+		} \
+		zfree(old); \
+		return (0); \
+	} \
+	\
+	static inline ssize_t name##_lookup(name##_t *t, const key_t *key, uint32_t hash) \
+	{ \
+		size_t mask = t->size - 1; \
+		size_t i = hash & mask; \
+		uint32_t psl = 1; \
+		while (t->slots[i].psl >= psl) { \
+			if (t->slots[i].hash == hash && eq_f(&t->slots[i].key, key)) return ((ssize_t)i); \
+			i = (i + 1) & mask; \
+			psl++; \
+		} \
+		return (-1); \
+	} \
+	\
+	static inline val_t *name##_find(name##_t *t, const key_t *key) \
+	{ \
+		ssize_t i = name##_lookup(t, key, hash_f(key, t->seed)); \
+		return (i < 0 ? NULL : &t->slots[i].val); \
+	} \
+	\
+	/* Find or add the key; new value is zeroed. 'added' (if not NULL) set to 1 for new key */ \
+	static inline val_t *name##_put(name##_t *t, const key_t *key, int *added) \
+	{ \
+		name##_slot_t slot; \
+		uint32_t hash = hash_f(key, t->seed); \
+		ssize_t i = name##_lookup(t, key, hash); \
+		if (NULL != added) *added = 0; \
+		if (i >= 0) return (&t->slots[i].val); \
+		if ((t->members + 1) * 100 > t->size * HTYPE_LOAD_MAX && 0 != name##_resize(t, t->size << 1)) { \
+			return (NULL); \
+		} \
+		memset(&slot, 0, sizeof(slot)); \
+		slot.hash = hash; \
+		slot.key = *key; \
+		i = (ssize_t)name##_place(t, slot); \
+		t->members++; \
+		if (NULL != added) *added = 1; \
+		return (&t->slots[i].val); \
+	} \
+	\
+	/* Remove the key; its value copied to 'val' if not NULL. Returns -1 if not found */ \
+	static inline int name##_del(name##_t *t, const key_t *key, val_t *val) \
+	{ \
+		size_t mask = t->size - 1; \
+		ssize_t found = name##_lookup(t, key, hash_f(key, t->seed)); \
+		size_t i; \
+		size_t next; \
+		if (found < 0) return (-1); \
+		i = (size_t)found; \
+		if (NULL != val) *val = t->slots[i].val; \
+		next = (i + 1) & mask; \
+		while (t->slots[next].psl > 1) { \
+			t->slots[i] = t->slots[next]; \
+			t->slots[i].psl--; \
+			i = next; \
+			next = (next + 1) & mask; \
+		} \
+		memset(&t->slots[i], 0, sizeof(name##_slot_t)); \
+		t->members--; \
+		return (0); \
+	}
+
+#endif /* _SEC_HTYPE_H_ */
@@ -0,0 +1,917 @@
+#define _GNU_SOURCE /* memmem() */
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mp-common.h"
+#include "mp-debug.h"
+#include "mp-memory.h"
+#include "buf_t.h"
+#include "mp-soap.h"
+#include "mp-igd-mock.h"
+
+#define MOCK_SSDP_ADDR "239.255.255.250"
+#define MOCK_SSDP_PORT 1900
+#define MOCK_DESC_PATH "/rootDesc.xml"
+/* Every POST to "/ctl/..." is a control request, for any service */
+#define MOCK_CTL_PREFIX "/ctl/"
+#define MOCK_UUID "4d696e69-5550-6e50-4d6f-636b49474400"
+#define MOCK_EXTERNAL_IP "1.2.3.4"
+#define MOCK_DESC "Mock foreign mapping"
+/* The threads look at the stop flag this often */
+#define MOCK_POLL_MS 200
+/* A request bigger than this is not UPnP */
+#define MOCK_REQ_MAX 16384
+#define MOCK_IO_LEN 4096
+#define MOCK_URL_LEN 64
+#define MOCK_ARG_LEN 128
+#define MOCK_ANSWER_LEN 2048
+
+/* The foreign mappings are spread over the ports above the well known ones */
+#define MOCK_PORT_MIN 1025
+#define MOCK_PORT_RANGE (65536 - MOCK_PORT_MIN)
+
+typedef struct mock_map_struct {
+	uint16_t port_ext;
+	uint16_t port_int;
+	uint8_t protocol;	/* IPPROTO_TCP / IPPROTO_UDP */
+	uint32_t lease;
+	char client[INET6_ADDRSTRLEN];
+	char desc[64];
+} mock_map_t;
+
+struct mp_igd_mock_struct {
+	mp_igd_mock_conf_t conf;
+	char external_ip[INET6_ADDRSTRLEN];
+	char url[MOCK_URL_LEN];
+	int http_fd;
+	int ssdp_fd;	/* -1 if SSDP is off */
+	pthread_t http_thread;
+	pthread_t ssdp_thread;
+	pthread_mutex_t lock;	/* Everything below */
+	pthread_cond_t cond;
+	int stop;
+	int conns;				/* Connection threads running */
+	mock_map_t *maps;		/* The table in the order GetGenericPortMappingEntry returns it */
+	size_t num;
+	size_t size;
+	size_t requests;
+	unsigned int seed;		/* Failure injection */
+};
+
+typedef struct mock_conn_struct {
+	mp_igd_mock_t *mock;
+	int fd;
+} mock_conn_t;
+
+/* One parsed HTTP request */
+typedef struct mock_req_struct {
+	char method[8];
+	char path[128];
+	char action[64];	/* From SOAPAction header, after '#' */
+	const char *body;
+	size_t body_len;
+	int close;			/* "Connection: close" */
+} mock_req_t;
+
+static int mock_stopping(mp_igd_mock_t *mock)
+{
+	int stop;
+
+	pthread_mutex_lock(&mock->lock);
+	stop = mock->stop;
+	pthread_mutex_unlock(&mock->lock);
+	return (stop);
+}
+
+/*** The table; all the functions are called with mock->lock held ***/
+
+static const char *mock_proto_str(uint8_t protocol)
+{
+	return (IPPROTO_UDP == protocol ? "UDP" : "TCP");
+}
+
+static ssize_t mock_find_l(const mp_igd_mock_t *mock, uint16_t port, uint8_t protocol)
+{
+	size_t i;
+
+	/* Linear, like in the routers */
+	for (i = 0; i < mock->num; i++) {
+		if (mock->maps[i].port_ext == port && mock->maps[i].protocol == protocol) return ((ssize_t)i);
+	}
+	return (-1);
+}
+
+/* Add or update the mapping; returns UPnP error code */
+static int mock_add_l(mp_igd_mock_t *mock, const mock_map_t *map)
+{
+	ssize_t i = mock_find_l(mock, map->port_ext, map->protocol);
+
+	if (mock->conf.permanent && 0 != map->lease) return (725);
+
+	if (i >= 0) {
+		/* The same client may update its mapping */
+		if (0 != strcmp(mock->maps[i].client, map->client)) return (718);
+		mock->maps[i] = *map;
+		return (0);
+	}
+
+	if (mock->num == mock->size) {
+		size_t size = (0 == mock->size) ? 64 : mock->size * 2;
+		mock_map_t *maps = realloc(mock->maps, size * sizeof(mock_map_t));
+
+		if (NULL == maps) return (501);
+		mock->maps = maps;
+		mock->size = size;
+	}
+
+	mock->maps[mock->num++] = *map;
+	return (0);
+}
+
+static void mock_del_l(mp_igd_mock_t *mock, size_t i)
+{
+	/* Keep the order: the indexes of GetGenericPortMappingEntry shift like in the routers */
+	memmove(&mock->maps[i], &mock->maps[i + 1], (mock->num - i - 1) * sizeof(mock_map_t));
+	mock->num--;
+}
+
+static int mock_fill_l(mp_igd_mock_t *mock, size_t entries)
+{
+	size_t i;
+
+	for (i = 0; i < entries; i++) {
+		mock_map_t map;
+
+		memset(&map, 0, sizeof(map));
+		map.port_ext = (uint16_t)(MOCK_PORT_MIN + i % MOCK_PORT_RANGE);
+		map.port_int = map.port_ext;
+		map.protocol = (i / MOCK_PORT_RANGE) ? IPPROTO_UDP : IPPROTO_TCP;
+		snprintf(map.client, sizeof(map.client), "192.168.1.%zu", 100 + i % 100);
+		snprintf(map.desc, sizeof(map.desc), "%s", MOCK_DESC);
+		if (0 != mock_add_l(mock, &map)) return (EBAD);
+	}
+	return (EOK);
+}
+
+/*** SOAP ***/
+
+static const char *mock_error_str(int error)
+{
+	switch (error) {
+	case 401:
+		return ("Invalid Action");
+	case 402:
+		return ("Invalid Args");
+	case 713:
+		return ("SpecifiedArrayIndexInvalid");
+	case 714:
+		return ("NoSuchEntryInArray");
+	case 718:
+		return ("ConflictInMappingEntry");
+	case 725:
+		return ("OnlyPermanentLeasesSupported");
+	default:
+		return ("Action Failed");
+	}
+}
+
+static int mock_arg_port(const buf_t *body, const char *name)
+{
+	char val[MOCK_ARG_LEN];
+	int port;
+
+	if (EOK != mp_soap_arg(body, name, val, sizeof(val))) return (-1);
+	port = atoi(val);
+	return ((port < 0 || port > 65535) ? -1 : port);
+}
+
+static int mock_arg_proto(const buf_t *body, uint8_t *protocol)
+{
+	char val[MOCK_ARG_LEN];
+
+	if (EOK != mp_soap_arg(body, "NewProtocol", val, sizeof(val))) return (EBAD);
+	if (0 == strcmp(val, "TCP")) *protocol = IPPROTO_TCP;
+	else if (0 == strcmp(val, "UDP")) *protocol = IPPROTO_UDP;
+	else return (EBAD);
+	return (EOK);
+}
+
+/* Read the mapping of AddPortMapping / AddAnyPortMapping; EBAD if the arguments are bad */
+static int mock_arg_map(const buf_t *body, mock_map_t *map)
+{
+	char val[MOCK_ARG_LEN];
+	int port_ext = mock_arg_port(body, "NewExternalPort");
+	int port_int = mock_arg_port(body, "NewInternalPort");
+
+	memset(map, 0, sizeof(mock_map_t));
+	if (port_ext < 0 || port_int < 1 || EOK != mock_arg_proto(body, &map->protocol)) return (EBAD);
+	if (EOK != mp_soap_arg(body, "NewInternalClient", map->client, sizeof(map->client)) || '\0' == map->client[0]) return (EBAD);
+
+	map->port_ext = (uint16_t)port_ext;
+	map->port_int = (uint16_t)port_int;
+	mp_soap_arg(body, "NewPortMappingDescription", map->desc, sizeof(map->desc));
+	if (EOK == mp_soap_arg(body, "NewLeaseDuration", val, sizeof(val))) map->lease = (uint32_t)strtoul(val, NULL, 10);
+	return (EOK);
+}
+
+static void mock_entry_args(const mock_map_t *map, int generic, char *out, size_t size)
+{
+	char head[MOCK_ARG_LEN] = "";
+
+	if (generic) {
+		snprintf(head, sizeof(head),
+				 "<NewRemoteHost></NewRemoteHost>"
+				 "<NewExternalPort>%u</NewExternalPort>"
+				 "<NewProtocol>%s</NewProtocol>",
+				 map->port_ext, mock_proto_str(map->protocol));
+	}
+
+	snprintf(out, size,
+			 "%s"
+			 "<NewInternalPort>%u</NewInternalPort>"
+			 "<NewInternalClient>%s</NewInternalClient>"
+			 "<NewEnabled>1</NewEnabled>"
+			 "<NewPortMappingDescription>%s</NewPortMappingDescription>"
+			 "<NewLeaseDuration>%u</NewLeaseDuration>",
+			 head, map->port_int, map->client, map->desc, map->lease);
+}
+
+/* Run SOAP 'action'; the answer arguments are written into 'out'. Returns UPnP error code */
+static int mock_soap(mp_igd_mock_t *mock, const char *action, const buf_t *body, char *out, size_t size)
+{
+	char val[MOCK_ARG_LEN];
+	mock_map_t map;
+	uint8_t protocol;
+	ssize_t i;
+	int port;
+	int error = 0;
+
+	out[0] = '\0';
+
+	if (0 == strcmp(action, "GetStatusInfo")) {
+		snprintf(out, size, "<NewConnectionStatus>Connected</NewConnectionStatus>"
+				 "<NewLastConnectionError>ERROR_NONE</NewLastConnectionError>"
+				 "<NewUptime>1000</NewUptime>");
+		return (0);
+	}
+
+	if (0 == strcmp(action, "GetExternalIPAddress")) {
+		snprintf(out, size, "<NewExternalIPAddress>%s</NewExternalIPAddress>", mock->external_ip);
+		return (0);
+	}
+
+	if (0 == strcmp(action, "GetCommonLinkProperties")) {
+		snprintf(out, size, "<NewWANAccessType>Ethernet</NewWANAccessType>"
+				 "<NewLayer1UpstreamMaxBitRate>1000000000</NewLayer1UpstreamMaxBitRate>"
+				 "<NewLayer1DownstreamMaxBitRate>1000000000</NewLayer1DownstreamMaxBitRate>"
+				 "<NewPhysicalLinkStatus>Up</NewPhysicalLinkStatus>");
+		return (0);
+	}
+
+	if (0 == strcmp(action, "GetGenericPortMappingEntry")) {
+		size_t index;
+
+		if (EOK != mp_soap_arg(body, "NewPortMappingIndex", val, sizeof(val))) return (402);
+		index = strtoul(val, NULL, 10);
+
+		pthread_mutex_lock(&mock->lock);
+		if (index < mock->num) mock_entry_args(&mock->maps[index], 1, out, size);
+		else error = 713;
+		pthread_mutex_unlock(&mock->lock);
+		return (error);
+	}
+
+	if (0 == strcmp(action, "GetSpecificPortMappingEntry")) {
+		port = mock_arg_port(body, "NewExternalPort");
+		if (port < 1 || EOK != mock_arg_proto(body, &protocol)) return (402);
+
+		pthread_mutex_lock(&mock->lock);
+		i = mock_find_l(mock, (uint16_t)port, protocol);
+		if (i >= 0) mock_entry_args(&mock->maps[i], 0, out, size);
+		else error = 714;
+		pthread_mutex_unlock(&mock->lock);
+		return (error);
+	}
+
+	if (0 == strcmp(action, "AddPortMapping")) {
+		if (EOK != mock_arg_map(body, &map) || 0 == map.port_ext) return (402);
+
+		pthread_mutex_lock(&mock->lock);
+		error = mock_add_l(mock, &map);
+		pthread_mutex_unlock(&mock->lock);
+		return (error);
+	}
+
+	if (0 == strcmp(action, "AddAnyPortMapping")) {
+		int tries;
+
+		if (!mock->conf.v2) return (401);
+		if (EOK != mock_arg_map(body, &map)) return (402);
+		if (map.port_ext < MOCK_PORT_MIN) map.port_ext = MOCK_PORT_MIN;
+
+		/* The requested port if it is free, else the next free one */
+		pthread_mutex_lock(&mock->lock);
+		error = 718;
+		for (tries = 0; 718 == error && tries < MOCK_PORT_RANGE; tries++) {
+			error = mock_add_l(mock, &map);
+			if (718 == error) {
+				map.port_ext = (uint16_t)(MOCK_PORT_MIN + (map.port_ext - MOCK_PORT_MIN + 1) % MOCK_PORT_RANGE);
+			}
+		}
+		pthread_mutex_unlock(&mock->lock);
+
+		if (0 == error) snprintf(out, size, "<NewReservedPort>%u</NewReservedPort>", map.port_ext);
+		return (error);
+	}
+
+	if (0 == strcmp(action, "DeletePortMapping")) {
+		port = mock_arg_port(body, "NewExternalPort");
+		if (port < 1 || EOK != mock_arg_proto(body, &protocol)) return (402);
+
+		pthread_mutex_lock(&mock->lock);
+		i = mock_find_l(mock, (uint16_t)port, protocol);
+		if (i >= 0) mock_del_l(mock, (size_t)i);
+		else error = 714;
+		pthread_mutex_unlock(&mock->lock);
+		return (error);
+	}
+
+	DD("Not supported action: %s\n", action);
+	return (401);
+}
+
+/*** HTTP ***/
+
+static int mock_send(int fd, int status, const char *type, const char *body, int closing)
+{
+	char head[256];
+	size_t len = strlen(body);
+	int head_len;
+	const char *text = (200 == status) ? "OK" : (500 == status) ? "Internal Server Error" : "Not Found";
+
+	head_len = snprintf(head, sizeof(head),
+						"HTTP/1.1 %d %s\r\n"
+						"Content-Type: %s\r\n"
+						"Content-Length: %zu\r\n"
+						"Server: Linux UPnP/1.1 mp-igd-mock/1.0\r\n"
+						"Connection: %s\r\n\r\n",
+						status, text, type, len, closing ? "close" : "keep-alive");
+
+	if (send(fd, head, (size_t)head_len, MSG_NOSIGNAL | MSG_MORE) != head_len ||
+		send(fd, body, len, MSG_NOSIGNAL) != (ssize_t)len) {
+		DE("Can't send answer\n");
+		return (EBAD);
+	}
+	return (EOK);
+}
+
+static int mock_send_desc(mp_igd_mock_t *mock, int fd, int closing)
+{
+	char desc[MOCK_ANSWER_LEN];
+	int v = mock->conf.v2 ? 2 : 1;
+
+	snprintf(desc, sizeof(desc),
+			 "<?xml version=\"1.0\"?>\r\n"
+			 "<root xmlns=\"urn:schemas-upnp-org:device-1-0\">"
+			 "<specVersion><major>1</major><minor>0</minor></specVersion>"
+			 "<device><deviceType>urn:schemas-upnp-org:device:InternetGatewayDevice:%d</deviceType>"
+			 "<friendlyName>MP mock IGD</friendlyName><manufacturer>mp</manufacturer>"
+			 "<modelName>mp-igd-mock</modelName><UDN>uuid:" MOCK_UUID "</UDN>"
+			 "<deviceList><device><deviceType>urn:schemas-upnp-org:device:WANDevice:%d</deviceType>"
+			 "<friendlyName>WAN device</friendlyName><UDN>uuid:" MOCK_UUID "01</UDN>"
+			 "<serviceList><service>"
+			 "<serviceType>urn:schemas-upnp-org:service:WANCommonInterfaceConfig:1</serviceType>"
+			 "<serviceId>urn:upnp-org:serviceId:WANCommonIFC1</serviceId>"
+			 "<controlURL>" MOCK_CTL_PREFIX "CmnIfCfg</controlURL><eventSubURL>/evt/CmnIfCfg</eventSubURL>"
+			 "<SCPDURL>/WANCfg.xml</SCPDURL>"
+			 "</service></serviceList>"
+			 "<deviceList><device><deviceType>urn:schemas-upnp-org:device:WANConnectionDevice:%d</deviceType>"
+			 "<friendlyName>WAN connection</friendlyName><UDN>uuid:" MOCK_UUID "02</UDN>"
+			 "<serviceList><service>"
+			 "<serviceType>urn:schemas-upnp-org:service:WANIPConnection:%d</serviceType>"
+			 "<serviceId>urn:upnp-org:serviceId:WANIPConn1</serviceId>"
+			 "<controlURL>" MOCK_CTL_PREFIX "IPConn</controlURL><eventSubURL>/evt/IPConn</eventSubURL>"
+			 "<SCPDURL>/WANIPCn.xml</SCPDURL>"
+			 "</service></serviceList>"
+			 "</device></deviceList></device></deviceList></device></root>\r\n",
+			 v, v, v, v);
+
+	return (mock_send(fd, 200, "text/xml", desc, closing));
+}
+
+/* Answer SOAP request; EBAD if the connection should be dropped */
+static int mock_send_soap(mp_igd_mock_t *mock, int fd, const mock_req_t *r)
+{
+	char args[MOCK_ANSWER_LEN];
+	char answer[MOCK_ANSWER_LEN + 512];
+	char service[MOCK_ARG_LEN];
+	buf_t *body;
+	int dice;
+	int error;
+
+	pthread_mutex_lock(&mock->lock);
+	mock->requests++;
+	dice = rand_r(&mock->seed) % 100;
+	pthread_mutex_unlock(&mock->lock);
+
+	if (dice < mock->conf.drop_pct) {
+		DD("Drop %s\n", r->action);
+		return (EBAD);
+	}
+
+	if (mock->conf.delay_ms > 0) usleep((useconds_t)mock->conf.delay_ms * 1000);
+
+	if (dice < mock->conf.drop_pct + mock->conf.fail_pct) {
+		error = 501;
+	} else {
+		/* A copy: mp_soap_arg() needs '\0' at the end, a view would run into the next request */
+		body = buf_new(NULL, r->body_len);
+		TESTP_MES(body, EBAD, "Can't allocate buf_t");
+		if (r->body_len > 0) buf_add(body, r->body, r->body_len);
+		error = mock_soap(mock, r->action, body, args, sizeof(args));
+		buf_free(body);
+	}
+
+	if (0 != error) {
+		snprintf(answer, sizeof(answer),
+				 "<?xml version=\"1.0\"?>\r\n"
+				 "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+				 "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\"><s:Body><s:Fault>"
+				 "<faultcode>s:Client</faultcode><faultstring>UPnPError</faultstring><detail>"
+				 "<UPnPError xmlns=\"urn:schemas-upnp-org:control-1-0\">"
+				 "<errorCode>%d</errorCode><errorDescription>%s</errorDescription>"
+				 "</UPnPError></detail></s:Fault></s:Body></s:Envelope>\r\n",
+				 error, mock_error_str(error));
+		return (mock_send(fd, 500, "text/xml; charset=\"utf-8\"", answer, r->close));
+	}
+
+	snprintf(service, sizeof(service), "urn:schemas-upnp-org:service:WANIPConnection:%d", mock->conf.v2 ? 2 : 1);
+	snprintf(answer, sizeof(answer),
+			 "<?xml version=\"1.0\"?>\r\n"
+			 "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+			 "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\"><s:Body>"
+			 "<u:%sResponse xmlns:u=\"%s\">%s</u:%sResponse></s:Body></s:Envelope>\r\n",
+			 r->action, service, args, r->action);
+	return (mock_send(fd, 200, "text/xml; charset=\"utf-8\"", answer, r->close));
+}
+
+/* Value of header 'name' in 'head' (without the final empty line); EBAD if there is no such header */
+static int mock_header(const char *head, size_t len, const char *name, char *val, size_t size)
+{
+	size_t name_len = strlen(name);
+	const char *end = head + len;
+	const char *line = head;
+
+	while (line < end) {
+		const char *eol = memmem(line, (size_t)(end - line), "\r\n", 2);
+		if (NULL == eol) eol = end;
+
+		if ((size_t)(eol - line) > name_len && 0 == strncasecmp(line, name, name_len) && ':' == line[name_len]) {
+			const char *v = line + name_len + 1;
+			while (v < eol && ' ' == *v) v++;
+			snprintf(val, size, "%.*s", (int)(eol - v), v);
+			return (EOK);
+		}
+		line = eol + 2;
+	}
+	return (EBAD);
+}
+
+/* Parse one request; returns its length, 0 if it is not complete yet, -1 if it is broken */
+static ssize_t mock_parse(const char *data, size_t len, mock_req_t *r)
+{
+	char val[MOCK_ARG_LEN];
+	const char *end = memmem(data, len, "\r\n\r\n", 4);
+	const char *hash;
+	size_t head_len;
+	size_t body_len = 0;
+
+	if (NULL == end) return (len > MOCK_REQ_MAX ? -1 : 0);
+	head_len = (size_t)(end - data);
+
+	memset(r, 0, sizeof(mock_req_t));
+	if (2 != sscanf(data, "%7s %127s", r->method, r->path)) return (-1);
+
+	if (EOK == mock_header(data, head_len, "Content-Length", val, sizeof(val))) {
+		body_len = strtoul(val, NULL, 10);
+		if (body_len > MOCK_REQ_MAX) return (-1);
+	}
+	if (len < head_len + 4 + body_len) return (0);
+
+	/* "\"urn:schemas-upnp-org:service:WANIPConnection:1#AddPortMapping\"" */
+	if (EOK == mock_header(data, head_len, "SOAPAction", val, sizeof(val)) && NULL != (hash = strchr(val, '#'))) {
+		snprintf(r->action, sizeof(r->action), "%.*s", (int)strcspn(hash + 1, "\""), hash + 1);
+	}
+
+	r->close = (EOK == mock_header(data, head_len, "Connection", val, sizeof(val)) && 0 == strcasecmp(val, "close"));
+	r->body = end + 4;
+	r->body_len = body_len;
+	return ((ssize_t)(head_len + 4 + body_len));
+}
+
+static void *mock_conn_thread(void *arg)
+{
+	mock_conn_t *conn = arg;
+	mp_igd_mock_t *mock = conn->mock;
+	buf_t *in = buf_new(NULL, MOCK_IO_LEN);
+	struct pollfd pfd;
+
+	pfd.fd = conn->fd;
+	pfd.events = POLLIN;
+
+	while (NULL != in && !mock_stopping(mock)) {
+		char *room;
+		ssize_t got;
+		size_t off = 0;
+		int rc = poll(&pfd, 1, MOCK_POLL_MS);
+
+		if (0 == rc) continue;
+		if (rc < 0 && EINTR == errno) continue;
+		if (rc < 0) break;
+
+		room = buf_reserve(in, MOCK_IO_LEN);
+		if (NULL == room) break;
+		got = recv(conn->fd, room, MOCK_IO_LEN, 0);
+		if (got <= 0) break;
+		buf_commit(in, (size_t)got);
+
+		/* Pipelined requests come in one read: answer all of them, in order */
+		while (off < in->len) {
+			mock_req_t r;
+			ssize_t len = mock_parse(in->data + off, in->len - off, &r);
+			int close_it;
+
+			if (len < 0) goto end;
+			if (0 == len) break;
+			off += (size_t)len;
+
+			close_it = r.close || mock->conf.no_keepalive;
+			r.close = close_it;
+			if (0 == strcmp(r.method, "GET") && 0 == strcmp(r.path, MOCK_DESC_PATH)) {
+				if (EOK != mock_send_desc(mock, conn->fd, close_it)) goto end;
+			} else if (0 == strcmp(r.method, "POST") && 0 == strncmp(r.path, MOCK_CTL_PREFIX, strlen(MOCK_CTL_PREFIX))) {
+				if (EOK != mock_send_soap(mock, conn->fd, &r)) goto end;
+			} else {
+				mock_send(conn->fd, 404, "text/plain", "Not Found\r\n", 1);
+				goto end;
+			}
+			if (close_it) goto end;
+		}
+
+		/* Keep the incomplete request */
+		memmove(in->data, in->data + off, in->len - off);
+		in->len -= off;
+		in->data[in->len] = '\0';
+	}
+end:
+	close(conn->fd);
+	if (NULL != in) buf_free(in);
+	zfree(conn);
+
+	pthread_mutex_lock(&mock->lock);
+	mock->conns--;
+	pthread_cond_signal(&mock->cond);
+	pthread_mutex_unlock(&mock->lock);
+	return (NULL);
+}
+
+static void *mock_http_thread(void *arg)
+{
+	mp_igd_mock_t *mock = arg;
+	struct pollfd pfd;
+
+	pfd.fd = mock->http_fd;
+	pfd.events = POLLIN;
+
+	while (!mock_stopping(mock)) {
+		mock_conn_t *conn;
+		pthread_t thread;
+		int fd;
+
+		if (poll(&pfd, 1, MOCK_POLL_MS) <= 0) continue;
+
+		fd = accept(mock->http_fd, NULL, NULL);
+		if (fd < 0) continue;
+
+		conn = zmalloc(sizeof(mock_conn_t));
+		if (NULL == conn) {
+			DE("Can't allocate connection\n");
+			close(fd);
+			continue;
+		}
+		conn->mock = mock;
+		conn->fd = fd;
+
+		/* One thread per connection: the clients keep their connections */
+		pthread_mutex_lock(&mock->lock);
+		mock->conns++;
+		pthread_mutex_unlock(&mock->lock);
+		if (0 != pthread_create(&thread, NULL, mock_conn_thread, conn)) {
+			DE("Can't start connection thread\n");
+			close(fd);
+			zfree(conn);
+			pthread_mutex_lock(&mock->lock);
+			mock->conns--;
+			pthread_mutex_unlock(&mock->lock);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return (NULL);
+}
+
+/*** SSDP ***/
+
+static int mock_ssdp_open(void)
+{
+	struct sockaddr_in addr;
+	struct ip_mreq mreq;
+	int on = 1;
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (fd < 0) {
+		DE("Can't create SSDP socket\n");
+		return (-1);
+	}
+
+	/* minissdpd or another responder may have the port already */
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(MOCK_SSDP_PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (0 != bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		DE("Can't bind SSDP port %d\n", MOCK_SSDP_PORT);
+		close(fd);
+		return (-1);
+	}
+
+	/* M-SEARCH goes out of the default interface and loops back; join there and on loopback */
+	mreq.imr_multiaddr.s_addr = inet_addr(MOCK_SSDP_ADDR);
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	if (0 != setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq))) {
+		DD("Can't join SSDP group on the default interface\n");
+	}
+	mreq.imr_interface.s_addr = htonl(INADDR_LOOPBACK);
+	setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+	return (fd);
+}
+
+static void *mock_ssdp_thread(void *arg)
+{
+	mp_igd_mock_t *mock = arg;
+	struct pollfd pfd;
+
+	pfd.fd = mock->ssdp_fd;
+	pfd.events = POLLIN;
+
+	while (!mock_stopping(mock)) {
+		char msg[MOCK_IO_LEN];
+		char answer[MOCK_ANSWER_LEN];
+		char st[MOCK_ARG_LEN];
+		struct sockaddr_in from;
+		socklen_t from_len = sizeof(from);
+		ssize_t len;
+		int answer_len;
+
+		if (poll(&pfd, 1, MOCK_POLL_MS) <= 0) continue;
+
+		len = recvfrom(mock->ssdp_fd, msg, sizeof(msg) - 1, 0, (struct sockaddr *)&from, &from_len);
+		if (len <= 0) continue;
+		msg[len] = '\0';
+
+		if (0 != strncmp(msg, "M-SEARCH", 8) || EOK != mock_header(msg, (size_t)len, "ST", st, sizeof(st))) continue;
+		if (NULL == strstr(st, "ssdp:all") && NULL == strstr(st, "rootdevice") &&
+			NULL == strstr(st, "InternetGatewayDevice") && NULL == strstr(st, "WANIPConnection") &&
+			NULL == strstr(st, "WANConnectionDevice")) {
+			continue;
+		}
+
+		answer_len = snprintf(answer, sizeof(answer),
+							  "HTTP/1.1 200 OK\r\n"
+							  "CACHE-CONTROL: max-age=120\r\n"
+							  "ST: %s\r\n"
+							  "USN: uuid:" MOCK_UUID "::%s\r\n"
+							  "EXT:\r\n"
+							  "SERVER: Linux UPnP/1.1 mp-igd-mock/1.0\r\n"
+							  "LOCATION: %s\r\n\r\n",
+							  st, st, mock->url);
+		sendto(mock->ssdp_fd, answer, (size_t)answer_len, 0, (struct sockaddr *)&from, from_len);
+	}
+	return (NULL);
+}
+
+/*** API ***/
+
+/*@null@*/ mp_igd_mock_t *mp_igd_mock_start(const mp_igd_mock_conf_t *conf)
+{
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	mp_igd_mock_t *mock;
+	int on = 1;
+
+	TESTP(conf, NULL);
+
+	mock = zmalloc(sizeof(mp_igd_mock_t));
+	TESTP_MES(mock, NULL, "Can't allocate mock IGD");
+	mock->conf = *conf;
+	mock->ssdp_fd = -1;
+	mock->seed = (unsigned int)getpid();
+	snprintf(mock->external_ip, sizeof(mock->external_ip), "%s", NULL == conf->external_ip ? MOCK_EXTERNAL_IP : conf->external_ip);
+	/* The caller's string may go away */
+	mock->conf.external_ip = NULL;
+	pthread_mutex_init(&mock->lock, NULL);
+	pthread_cond_init(&mock->cond, NULL);
+
+	if (EOK != mock_fill_l(mock, conf->entries)) {
+		DE("Can't fill the table\n");
+		goto err;
+	}
+
+	mock->http_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (mock->http_fd < 0) {
+		DE("Can't create HTTP socket\n");
+		goto err;
+	}
+	setsockopt(mock->http_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)conf->http_port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (0 != bind(mock->http_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+		0 != listen(mock->http_fd, 16) ||
+		0 != getsockname(mock->http_fd, (struct sockaddr *)&addr, &addr_len)) {
+		DE("Can't listen on port %d\n", conf->http_port);
+		close(mock->http_fd);
+		goto err;
+	}
+	snprintf(mock->url, sizeof(mock->url), "http://127.0.0.1:%u" MOCK_DESC_PATH, ntohs(addr.sin_port));
+
+	if (0 != pthread_create(&mock->http_thread, NULL, mock_http_thread, mock)) {
+		DE("Can't start HTTP thread\n");
+		close(mock->http_fd);
+		goto err;
+	}
+
+	if (conf->ssdp) {
+		mock->ssdp_fd = mock_ssdp_open();
+		if (mock->ssdp_fd >= 0 && 0 != pthread_create(&mock->ssdp_thread, NULL, mock_ssdp_thread, mock)) {
+			DE("Can't start SSDP thread\n");
+			close(mock->ssdp_fd);
+			mock->ssdp_fd = -1;
+		}
+	}
+
+	DD("Mock IGD: %s, %zu mappings\n", mock->url, mock->num);
+	return (mock);
+err:
+	free(mock->maps);
+	pthread_mutex_destroy(&mock->lock);
+	pthread_cond_destroy(&mock->cond);
+	zfree(mock);
+	return (NULL);
+}
+
+void mp_igd_mock_stop(/*@null@*/ mp_igd_mock_t *mock)
+{
+	if (NULL == mock) return;
+
+	pthread_mutex_lock(&mock->lock);
+	mock->stop = 1;
+	pthread_mutex_unlock(&mock->lock);
+
+	pthread_join(mock->http_thread, NULL);
+	if (mock->ssdp_fd >= 0) pthread_join(mock->ssdp_thread, NULL);
+
+	/* The connection threads see the flag within MOCK_POLL_MS */
+	pthread_mutex_lock(&mock->lock);
+	while (mock->conns > 0) pthread_cond_wait(&mock->cond, &mock->lock);
+	pthread_mutex_unlock(&mock->lock);
+
+	close(mock->http_fd);
+	if (mock->ssdp_fd >= 0) close(mock->ssdp_fd);
+	free(mock->maps);
+	pthread_mutex_destroy(&mock->lock);
+	pthread_cond_destroy(&mock->cond);
+	zfree(mock);
+}
+
+const char *mp_igd_mock_url(const mp_igd_mock_t *mock)
+{
+	TESTP(mock, NULL);
+	return (mock->url);
+}
+
+size_t mp_igd_mock_entries(mp_igd_mock_t *mock)
+{
+	size_t num;
+
+	TESTP(mock, 0);
+	pthread_mutex_lock(&mock->lock);
+	num = mock->num;
+	pthread_mutex_unlock(&mock->lock);
+	return (num);
+}
+
+size_t mp_igd_mock_requests(mp_igd_mock_t *mock)
+{
+	size_t requests;
+
+	TESTP(mock, 0);
+	pthread_mutex_lock(&mock->lock);
+	requests = mock->requests;
+	pthread_mutex_unlock(&mock->lock);
+	return (requests);
+}
+
+#ifdef STANDALONE
+/*** Mock IGD alone: make igdmock && ./igd-mock -h ***/
+#include <signal.h>
+
+static volatile sig_atomic_t g_mock_stop;
+
+static void mock_signal(int sig __attribute__((unused)))
+{
+	g_mock_stop = 1;
+}
+
+static void mock_usage(const char *name)
+{
+	printf("Usage: %s [-p http port] [-n mappings] [-d delay ms] [-f fail %%] [-x drop %%]\n"
+		   "          [-e external ip] [-2 (IGD v2)] [-k (no keep-alive)] [-P (permanent leases only)] [-S (no SSDP)]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	mp_igd_mock_conf_t conf;
+	mp_igd_mock_t *mock;
+	int opt;
+
+	memset(&conf, 0, sizeof(conf));
+	conf.ssdp = 1;
+
+	while ((opt = getopt(argc, argv, "p:n:d:f:x:e:2kPSh")) != -1) {
+		switch (opt) {
+		case 'p':
+			conf.http_port = atoi(optarg);
+			break;
+		case 'n':
+			conf.entries = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			conf.delay_ms = atoi(optarg);
+			break;
+		case 'f':
+			conf.fail_pct = atoi(optarg);
+			break;
+		case 'x':
+			conf.drop_pct = atoi(optarg);
+			break;
+		case 'e':
+			conf.external_ip = optarg;
+			break;
+		case '2':
+			conf.v2 = 1;
+			break;
+		case 'k':
+			conf.no_keepalive = 1;
+			break;
+		case 'P':
+			conf.permanent = 1;
+			break;
+		case 'S':
+			conf.ssdp = 0;
+			break;
+		default:
+			mock_usage(argv[0]);
+			return (0);
+		}
+	}
+
+	mock = mp_igd_mock_start(&conf);
+	TESTP_MES(mock, -1, "Can't start mock IGD");
+
+	signal(SIGINT, mock_signal);
+	signal(SIGTERM, mock_signal);
+	printf("Mock IGD: %s, %zu mappings; Ctrl-C to stop\n", mp_igd_mock_url(mock), mp_igd_mock_entries(mock));
+
+	while (!g_mock_stop) {
+		sleep(1);
+	}
+
+	printf("Served %zu requests, %zu mappings left\n", mp_igd_mock_requests(mock), mp_igd_mock_entries(mock));
+	mp_igd_mock_stop(mock);
+	return (0);
+}
+#endif /* STANDALONE */
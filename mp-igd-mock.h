@@ -0,0 +1,36 @@
+#ifndef _SEC_IGD_MOCK_H_
+#define _SEC_IGD_MOCK_H_
+
+#include <stddef.h>
+
+/* Mock UPnP Internet Gateway Device on loopback, to run mp-ports.c without a router:
+   SSDP responder, device description and WANIPConnection SOAP control over HTTP/1.1
+   (keep-alive and pipelined requests are served like mp-soap.c sends them).
+   The table size, the answer delay and the failures are configurable */
+
+typedef struct mp_igd_mock_struct mp_igd_mock_t;
+
+typedef struct mp_igd_mock_conf_struct {
+	int http_port;		/* 0: any free port */
+	int ssdp;			/* Answer SSDP M-SEARCH on 239.255.255.250:1900 */
+	size_t entries;		/* The table is filled with this many foreign mappings */
+	int delay_ms;		/* Every answer is delayed */
+	int fail_pct;		/* Percent of the SOAP requests answered with UPnP error 501 */
+	int drop_pct;		/* Percent of the SOAP requests: the connection closed without answer */
+	int v2;				/* WANIPConnection:2, with AddAnyPortMapping */
+	int no_keepalive;	/* Close the connection after every answer, like old routers */
+	int permanent;		/* Accept only permanent leases (error 725) */
+	const char *external_ip;	/* NULL: "1.2.3.4" */
+} mp_igd_mock_conf_t;
+
+extern /*@null@*/ mp_igd_mock_t *mp_igd_mock_start(const mp_igd_mock_conf_t *conf);
+/* Stop serving and wait for the threads; the table is lost */
+extern void mp_igd_mock_stop(/*@null@*/ mp_igd_mock_t *mock);
+
+/* Description URL, for mp_ports_igd_url() */
+extern const char *mp_igd_mock_url(const mp_igd_mock_t *mock);
+/* Number of mappings in the table and of SOAP requests served */
+extern size_t mp_igd_mock_entries(mp_igd_mock_t *mock);
+extern size_t mp_igd_mock_requests(mp_igd_mock_t *mock);
+
+#endif /* _SEC_IGD_MOCK_H_ */
@@ -43,11 +43,17 @@
 {
 	json_t *root = NULL;
 
+	json_error_t error;
+
 	TESTP(buf, NULL);
 	TESTP(buf->data, NULL);
 	//D("Got buffer: %s\n", buf->data);
-	root = json_loads(buf->data, 0, NULL);
-	TESTP(root, NULL);
+	/* Length is given: slices and views are not '\0' terminated */
+	root = json_loadb(buf->data, buf->len, 0, &error);
+	if (NULL == root) {
+		DE("Can't decode JSON buffer: %s, line %i, col %i\n", error.text, error.line, error.column);
+		return (NULL);
+	}
 	return (root);
 }
 
@@ -55,22 +61,24 @@
 {
 	buf_t *buf = NULL;
 	char *jd = NULL;
+	size_t len;
 
 	TESTP(j_obj, NULL);
 
 	//jd = json_dumps(j_obj, JSON_COMPACT);
 	jd = json_dumps(j_obj, (size_t)JSON_INDENT(4));
-	TESTP_MES(j_obj, NULL, "Can't transform JSON to string");
+	TESTP_MES(jd, NULL, "Can't transform JSON to string");
 
-	buf = buf_new(jd, strlen(jd));
-	TESTP_MES_GO(jd, err, "Can't allocate buf_t");
+	/* No copy: buf_t takes the string, '\0' included */
+	len = strlen(jd);
+	buf = buf_new(jd, len + 1);
+	TESTP_MES_GO(buf, err, "Can't allocate buf_t");
 
-	buf->len = buf->size;
+	buf->len = len;
 
 	return (buf);
 err:
 	TFREE(jd);
-	if (buf) buf_free_force(buf);
 	return (NULL);
 }
 
@@ -166,36 +174,40 @@ int j_cp_val(json_t *from, json_t *to, char *key_from, char *key_to)
 }
 
 
-#if 0
-int json_add_string_int(json_t *root, char *key, int val){
+int j_add_int(json_t *root, const char *key, json_int_t val)
+{
 	json_t *j_int = NULL;
 
-	if (NULL == root) {
-		DE("Got root == NULL\n");
-		return (-1);
-	}
-
-	if (NULL == key) {
-		DE("Got key == NULL\n");
-		return (-1);
-	}
+	TESTP(root, EBAD);
+	TESTP(key, EBAD);
 
 	j_int = json_integer(val);
+	TESTP(j_int, EBAD);
 
-	if (NULL == j_int) {
-		DE("Can't allocate json object\n");
-		return (-1);
+	if (0 != json_object_set_new(root, key, j_int)) {
+		DE("Can't set new pair into json object\n");
+		return (EBAD);
 	}
 
-	if (0 != json_object_set_new(root, key, j_int)) {
-		DE("Can't set new pait into json object\n");
-		//json_decref(j_int);
-		return (-1);
+	return (EOK);
+}
+
+int j_find_int(json_t *root, const char *key, json_int_t *val)
+{
+	json_t *j_int = NULL;
+
+	TESTP(root, EBAD);
+	TESTP(key, EBAD);
+	TESTP(val, EBAD);
+
+	j_int = json_object_get(root, key);
+	if (NULL == j_int || !json_is_integer(j_int)) {
+		return (EBAD);
 	}
 
-	return (0);
+	*val = json_integer_value(j_int);
+	return (EOK);
 }
-#endif
 
 /* Get JSON object, get  field name and expected value of this field.
    Return EOK if this is true, return EBAD is no match */
@@ -352,7 +364,7 @@ int j_print(json_t *root, const char *prefix)
 	TESTP(buf, EBAD);
 	if (prefix) D("%s :\n", prefix);
 	printf("%s\n", buf->data);
-	buf_free_force(buf);
+	buf_free(buf);
 	return EOK;
 	
 #if 0
@@ -114,20 +114,30 @@ int j_add_j(json_t *root, const char *key, json_t *obj);
  */
 int j_add_str(json_t *root, const char *key, const char *val);
 
-#if 0
 /**
- * @func int json_add_string_int(json_t *root, char *key, int val)
+ * @func int j_add_int(json_t *root, const char *key, json_int_t val)
  * @brief Add into JSON object integer "val" for key "key"
- * @author se (07/04/2020)
  * 
  * @param root 
  * @param key 
  * @param val 
  * 
- * @return int 
+ * @return int EOK on success, EBAD on failure
+ */
+int j_add_int(json_t *root, const char *key, json_int_t val);
+
+/**
+ * @func int j_find_int(json_t *root, const char *key, json_int_t *val)
+ * @brief Extract from JSON object integer value for key "key" 
+ *  	  into "val"
+ * 
+ * @param root 
+ * @param key 
+ * @param val 
+ * 
+ * @return int EOK on success, EBAD if not found or not integer
  */
-int json_add_string_int(json_t *root, char *key, int val);
-#endif
+int j_find_int(json_t *root, const char *key, json_int_t *val);
 
 
 /**
@@ -33,8 +33,9 @@
 /* Parameters:
    req - request which must contain JK_TICKET with ticket id
    status - operation status: must be JV_STATUS_STARTED, JV_STATUS_UPDATE, JV_STATUS_DONE
-   comment (optional) - free form test explaining what happens. THis text will be displeyed to user */
-int mp_main_ticket_responce(json_t *req, const char *status, const char *comment)
+   comment (optional) - free form test explaining what happens. THis text will be displeyed to user
+   ports (optional) - per-port results of a batch request, added as JK_ARR_PORTS; the reference is stolen */
+int mp_main_ticket_responce_ports(json_t *req, const char *status, const char *comment, json_t *ports)
 {
 	json_t *root = NULL;
 	const char *ticket = NULL;
@@ -48,12 +49,17 @@ int mp_main_ticket_responce(json_t *req, const char *status, const char *comment
 	ticket = j_find_ref(req, JK_TICKET);
 	if (NULL == ticket) {
 		DD("No ticket\n");
+		if (NULL != ports) j_rm(ports);
 		return (EOK);
 	}
 
 	DD("Found ticket :%s\n", ticket);
 	root = j_new();
-	TESTP(root, EBAD);
+	if (NULL == root) {
+		DE("Can't allocate JSON object\n");
+		if (NULL != ports) j_rm(ports);
+		return (EBAD);
+	}
 
 	j_add_str(root, JK_TYPE, JV_TYPE_TICKET);
 	j_add_str(root, JK_TICKET, ticket);
@@ -61,6 +67,9 @@ int mp_main_ticket_responce(json_t *req, const char *status, const char *comment
 	if (NULL != comment) {
 		j_add_str(root, JK_REASON, comment);
 	}
+	if (NULL != ports) {
+		j_add_j(root, JK_ARR_PORTS, ports);
+	}
 
 	/*TODO:  Add time of the ticket creation */
 
@@ -68,17 +77,22 @@ int mp_main_ticket_responce(json_t *req, const char *status, const char *comment
 	DD("Created ticket json resp:\n");
 	j_print(root, "root");
 
-	ctl = ctl_get_locked();
+	ctl = ctl_get();
+	ctl_lock(ctl, CTL_LOCK_TICKETS);
 	DD("Going to add ticket to tickets\n");
 	rc = j_add_j(ctl->tickets, ticket, root);
 
 	DD("Added ticket to tickets\n");
-	ctl_unlock(ctl);
-
 	j_print(ctl->tickets, "ctl->tickets");
+	ctl_unlock(ctl, CTL_LOCK_TICKETS);
 	return (rc);
 }
 
+int mp_main_ticket_responce(json_t *req, const char *status, const char *comment)
+{
+	return (mp_main_ticket_responce_ports(req, status, comment, NULL));
+}
+
 static int mp_main_remove_host_l(json_t *root)
 {
 	control_t *ctl = NULL;
@@ -88,58 +102,117 @@ static int mp_main_remove_host_l(json_t *root)
 	uid = j_find_dup(root, JK_UID);
 	TESTP_MES(uid, EBAD, "Can't extract uid from json\n");
 
-	ctl = ctl_get_locked();
-	j_rm_key(ctl->hosts, j_find_ref(root, JK_UID));
-	ctl_unlock(ctl);
+	ctl = ctl_get();
+	ctl_lock(ctl, CTL_LOCK_HOSTS);
+	j_rm_key(ctl->hosts, uid);
+	ctl_snap_hosts_update(ctl, uid, NULL);
+	ctl_unlock(ctl, CTL_LOCK_HOSTS);
+	TFREE(uid);
 	return (EOK);
 }
 
-/* This function is called when remote machine asks to open port for imcoming connection */
-static int mp_main_do_open_port_l(json_t *root)
+/* Find mapping of internal port 'port' / 'protocol' in 'ports' array.
+   Return index of the mapping, -1 if not found.
+   Linear: to test if the port is mapped use ctl_ports_find_l().
+   The caller must hold CTL_LOCK_ME */
+static int mp_main_find_port(json_t *ports, int port, const char *protocol)
 {
-	control_t *ctl = ctl_get();
-	json_t *mapping = NULL;
-	const char *asked_port = NULL;
-	const char *protocol = NULL;
-	//port_t *port = NULL;
 	json_t *val = NULL;
-	json_t *ports = NULL;
 	int index = 0;
 
-	TESTP(root, EBAD);
+	CTL_ASSERT_LOCKED(CTL_LOCK_ME);
 
-	asked_port = j_find_ref(root, JK_PORT_INT);
-	TESTP_MES(asked_port, EBAD, "Can't find 'port' field");
+	json_array_foreach(ports, index, val) {
+		if (port == ctl_port_get(val, JK_PORT_INT) &&
+			EOK == j_test(val, JK_PROTOCOL, protocol)) {
+			return (index);
+		}
+	}
 
-	protocol = j_find_ref(root, JK_PROTOCOL);
-	TESTP_MES(protocol, EBAD, "Can't find 'protocol' field");
+	return (-1);
+}
+
+/* Add new mapping into 'ports' array of 'me' and its index, publish the new 'me' */
+static int mp_main_add_mapping_l(json_t *mapping)
+{
+	control_t *ctl = ctl_get();
+	json_t *ports = NULL;
+	int rc = EBAD;
+
+	TESTP(mapping, EBAD);
+
+	ctl_lock(ctl, CTL_LOCK_ME);
+	/* Another request could map the same port while we were talking to the router */
+	if (0 != ctl_ports_find_l(ctl, ctl_port_get(mapping, JK_PORT_INT), j_find_ref(mapping, JK_PROTOCOL))) {
+		DD("Mapping already known\n");
+		ctl_unlock(ctl, CTL_LOCK_ME);
+		j_rm(mapping);
+		return (EOK);
+	}
 
 	ports = j_find_j(ctl->me, "ports");
-	TESTP(ports, EBAD);
+	if (NULL == ports) {
+		DE("Can't find 'ports' array\n");
+		ctl_unlock(ctl, CTL_LOCK_ME);
+		j_rm(mapping);
+		return (EBAD);
+	}
 
-	ctl_lock(ctl);
-	json_array_foreach(ports, index, val) {
-		if (EOK == j_test(val, JK_IP_INT, asked_port) &&
-			EOK == j_test(val, JK_PROTOCOL, protocol)) {
-			ctl_unlock(ctl);
-			DD("Already mapped port\n");
-			return (EOK);
-		}
+	if (EOK != ctl_ports_add_l(ctl, mapping)) {
+		DE("Can't index the mapping\n");
+	}
+
+	rc = j_arr_add(ports, mapping);
+	if (EOK == rc) {
+		rc = ctl_snap_me_publish(ctl);
 	}
-	ctl_unlock(ctl);
+	ctl_unlock(ctl, CTL_LOCK_ME);
+	return (rc);
+}
+
+/* Open port requests in flight, by (internal port, protocol). A request for a port
+   being opened waits for it and gets the same result instead of mapping it again */
+typedef struct mp_main_inflight_struct {
+	struct mp_main_inflight_struct *next;
+	int port;
+	const char *protocol;	/* Of the first request; valid while it is in the list */
+	int waiters;
+	int done;
+	int rc;
+} mp_main_inflight_t;
+
+static pthread_mutex_t g_inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_inflight_cond = PTHREAD_COND_INITIALIZER;
+static mp_main_inflight_t *g_inflight;
+
+/* Map 'asked_port' unless it is mapped already and add it to 'me' */
+static int mp_main_open_port_l(int asked_port, const char *protocol)
+{
+	control_t *ctl = ctl_get();
+	json_t *mapping = NULL;
+	char *local_ip = NULL;
+
+	ctl_rlock(ctl, CTL_LOCK_ME);
+	if (0 != ctl_ports_find_l(ctl, asked_port, protocol)) {
+		ctl_unlock(ctl, CTL_LOCK_ME);
+		DD("Already mapped port\n");
+		return (EOK);
+	}
+	local_ip = j_find_dup(ctl->me, JK_IP_INT);
+	ctl_unlock(ctl, CTL_LOCK_ME);
+
+	TESTP_MES(local_ip, EBAD, "Can't find my internal IP");
 
 	/* this function probes the internal port. Is it alreasy mapped, it returns the mapping */
-	mapping = mp_ports_if_mapped_json(asked_port, j_find_ref(ctl->me, JK_IP_INT), protocol);
+	mapping = mp_ports_if_mapped_json(asked_port, local_ip, protocol);
+	TFREE(local_ip);
 
 	/* Found existing mapping */
 	if (NULL != mapping) {
-		DD("Found existing mapping: %s -> %s | %s\n",
-		   j_find_ref(mapping, JK_PORT_EXT), j_find_ref(mapping, JK_PORT_INT), j_find_ref(mapping, JK_PROTOCOL));
+		DD("Found existing mapping: %d -> %d | %s\n",
+		   ctl_port_get(mapping, JK_PORT_EXT), ctl_port_get(mapping, JK_PORT_INT), j_find_ref(mapping, JK_PROTOCOL));
 		/* Add this mapping to table */
-		ctl_lock(ctl);
-		j_arr_add(ports, mapping);
-		ctl_unlock(ctl);
-		return (EOK);
+		return (mp_main_add_mapping_l(mapping));
 	}
 
 	/* If we here it means no such mapping exists. Let's map it */
@@ -147,65 +220,600 @@ static int mp_main_do_open_port_l(json_t *root)
 	TESTP_MES(mapping, EBAD, "Can't map port");
 
 	/* Ok, port mapped. Now we should update ctl->ports hash table */
+	return (mp_main_add_mapping_l(mapping));
+}
 
-	ctl_lock(ctl);
-	j_arr_add(ports, mapping);
-	ctl_unlock(ctl);
-	return (EOK);
+/* Request for the port in flight; called with g_inflight_lock held */
+static mp_main_inflight_t *mp_main_inflight_find(int port, const char *protocol)
+{
+	mp_main_inflight_t *op;
+
+	for (op = g_inflight; NULL != op; op = op->next) {
+		if (op->port == port && 0 == strcmp(op->protocol, protocol)) break;
+	}
+	return (op);
+}
+
+/* Register the caller as opening the port; called with g_inflight_lock held */
+static mp_main_inflight_t *mp_main_inflight_add(int port, const char *protocol)
+{
+	mp_main_inflight_t *op = zmalloc(sizeof(mp_main_inflight_t));
+
+	TESTP_MES(op, NULL, "Can't allocate request");
+	op->port = port;
+	op->protocol = protocol;
+	op->next = g_inflight;
+	g_inflight = op;
+	return (op);
+}
+
+/* The port is opened (or failed): wake up the waiters */
+static void mp_main_inflight_done(mp_main_inflight_t *op, int rc)
+{
+	mp_main_inflight_t **prev;
+
+	pthread_mutex_lock(&g_inflight_lock);
+	for (prev = &g_inflight; *prev != op; prev = &(*prev)->next) ;
+	*prev = op->next;
+	op->rc = rc;
+	op->done = 1;
+	pthread_cond_broadcast(&g_inflight_cond);
+	if (0 == op->waiters) zfree(op);
+	pthread_mutex_unlock(&g_inflight_lock);
+}
+
+/* Wait for the request joined by 'waiters++'; the last one out frees it */
+static int mp_main_inflight_wait(mp_main_inflight_t *op)
+{
+	int rc;
+
+	pthread_mutex_lock(&g_inflight_lock);
+	while (!op->done) pthread_cond_wait(&g_inflight_cond, &g_inflight_lock);
+	rc = op->rc;
+	if (0 == --op->waiters) zfree(op);
+	pthread_mutex_unlock(&g_inflight_lock);
+	return (rc);
+}
+
+/* Open 'asked_port' unless the same port is being opened: then wait for its result */
+static int mp_main_open_port_once_l(int asked_port, const char *protocol)
+{
+	mp_main_inflight_t *op = NULL;
+	int rc;
+
+	pthread_mutex_lock(&g_inflight_lock);
+	op = mp_main_inflight_find(asked_port, protocol);
+
+	if (NULL != op) {
+		DD("Port %d %s is being opened, wait for it\n", asked_port, protocol);
+		op->waiters++;
+		pthread_mutex_unlock(&g_inflight_lock);
+		return (mp_main_inflight_wait(op));
+	}
+
+	op = mp_main_inflight_add(asked_port, protocol);
+	pthread_mutex_unlock(&g_inflight_lock);
+	TESTP(op, EBAD);
+
+	rc = mp_main_open_port_l(asked_port, protocol);
+	mp_main_inflight_done(op, rc);
+	return (rc);
+}
+
+/* This function is called when remote machine asks to open port for imcoming connection */
+static int mp_main_do_open_port_l(json_t *root)
+{
+	int asked_port = 0;
+	const char *protocol = NULL;
+
+	TESTP(root, EBAD);
+
+	asked_port = ctl_port_get(root, JK_PORT_INT);
+	if (0 == asked_port) {
+		DE("Can't find 'port' field\n");
+		return (EBAD);
+	}
+
+	protocol = j_find_ref(root, JK_PROTOCOL);
+	TESTP_MES(protocol, EBAD, "Can't find 'protocol' field");
+
+	return (mp_main_open_port_once_l(asked_port, protocol));
+}
+
+/* Send keepalive from a thread other than the message loop: the loop
+   may be reconnecting or being destroyed meanwhile */
+void mp_main_send_keepalive(void)
+{
+	control_t *ctl = ctl_get();
+
+	ctl_rlock(ctl, CTL_LOCK_MOSQ);
+	if (NULL != ctl->mosq && ST_CONNECTED == ctl_status_get(ctl)) send_keepalive_l(ctl->mosq);
+	ctl_unlock(ctl, CTL_LOCK_MOSQ);
+}
+
+/* A target maps its service ports (JK_SERVICE_PORTS, SSH by default) in advance:
+   the first connection of a peer finds the port in 'me' and doesn't ask to open it */
+static void *mp_main_premap_thread(void *arg __attribute__((unused)))
+{
+	control_t *ctl = ctl_get();
+	json_t *ports = NULL;
+	json_t *val = NULL;
+	size_t index = 0;
+	size_t opened = 0;
+
+	ctl_rlock(ctl, CTL_LOCK_ME);
+	ports = j_find_j(ctl->me, JK_SERVICE_PORTS);
+	if (NULL != ports) ports = j_dup(ports);
+	ctl_unlock(ctl, CTL_LOCK_ME);
+	TESTP(ports, NULL);
+
+	json_array_foreach(ports, index, val) {
+		int port = ctl_port_get(val, JK_PORT_INT);
+		const char *protocol = j_find_ref(val, JK_PROTOCOL);
+
+		if (0 == port || NULL == protocol) {
+			DE("Bad service port in config\n");
+			continue;
+		}
+
+		/* A peer asking for the same port meanwhile joins this request */
+		if (EOK == mp_main_open_port_once_l(port, protocol)) {
+			D("Service port %d %s mapped\n", port, protocol);
+			opened++;
+		} else {
+			DE("Can't map service port %d %s\n", port, protocol);
+		}
+	}
+	j_rm(ports);
+
+	/* If not connected yet, the peers get 'me' on connect */
+	if (opened > 0) mp_main_send_keepalive();
+	return (NULL);
 }
 
 /* This function is called when remote machine asks to open port for imcoming connection */
 static int mp_main_do_close_port_l(json_t *root)
 {
 	control_t *ctl = ctl_get();
-	const char *asked_port = NULL;
+	int asked_port = 0;
 	const char *protocol = NULL;
-	json_t *val = NULL;
 	json_t *ports = NULL;
 	int index = 0;
-	int index_save = 0;
-	const char *external_port = NULL;
+	int port_ext = 0;
 	int rc = EBAD;
 
 	TESTP(root, EBAD);
 
-	asked_port = j_find_ref(root, JK_PORT_INT);
-	TESTP_MES(asked_port, EBAD, "Can't find 'port' field");
+	asked_port = ctl_port_get(root, JK_PORT_INT);
+	if (0 == asked_port) {
+		DE("Can't find 'port' field\n");
+		return (EBAD);
+	}
 
 	protocol = j_find_ref(root, JK_PROTOCOL);
 	TESTP_MES(protocol, EBAD, "Can't find 'protocol' field");
 
-	ports = j_find_j(ctl->me, "ports");
-	TESTP(ports, EBAD);
-
-	ctl_lock(ctl);
-	json_array_foreach(ports, index, val) {
-		if (EOK == j_test(val, JK_PORT_INT, asked_port) &&
-			EOK == j_test(val, JK_PROTOCOL, protocol)) {
-			external_port = j_find_ref(val, JK_PORT_EXT);
-			index_save = index;
-			D("Found opened port: %s -> %sd %s\n", asked_port, external_port, protocol);
-			ctl_unlock(ctl);
-		}
-	}
-	ctl_unlock(ctl);
+	ctl_rlock(ctl, CTL_LOCK_ME);
+	port_ext = ctl_ports_find_l(ctl, asked_port, protocol);
+	ctl_unlock(ctl, CTL_LOCK_ME);
 
-	if (NULL == external_port) {
+	if (0 == port_ext) {
 		DE("No such a open port\n");
 		return (EBAD);
 	}
 
+	D("Found opened port: %d -> %d %s\n", asked_port, port_ext, protocol);
+
 	/* this function probes the internal port. If it alreasy mapped, it returns the mapping */
-	rc = mp_ports_unmap_port(asked_port, external_port, protocol);
+	rc = mp_ports_unmap_port(asked_port, port_ext, protocol);
 
 	if (0 != rc) {
 		DE("Can'r remove port \n");
 		return (EBAD);
 	}
 
-	ctl_lock(ctl);
-	json_array_remove(ports, index_save);
-	ctl_unlock(ctl);
+	/* The lock was released during unmapping and the array could change: find the port again */
+	ctl_lock(ctl, CTL_LOCK_ME);
+	if (EOK == ctl_ports_del_l(ctl, asked_port, protocol)) {
+		ports = j_find_j(ctl->me, "ports");
+		index = mp_main_find_port(ports, asked_port, protocol);
+		if (index >= 0) json_array_remove(ports, (size_t)index);
+		ctl_snap_me_publish(ctl);
+	}
+	ctl_unlock(ctl, CTL_LOCK_ME);
+	return (EOK);
+}
+
+/* Status of port 'asked' in the batch 'results' */
+static int mp_main_batch_status(json_t *results, json_t *asked)
+{
+	int port = ctl_port_get(asked, JK_PORT_INT);
+	const char *protocol = j_find_ref(asked, JK_PROTOCOL);
+	json_t *val;
+	size_t index;
+
+	json_array_foreach(results, index, val) {
+		if (ctl_port_get(val, JK_PORT_INT) == port && EOK == j_test(val, JK_PROTOCOL, protocol)) {
+			return (EOK == j_test(val, JK_STATUS, JV_OK) ? EOK : EBAD);
+		}
+	}
+	return (EBAD);
+}
+
+/* Remote machine asks to open a batch of ports: JK_ARR_PORTS of {JK_PORT_INT, JK_PROTOCOL}.
+   All the ports mapped in one IGD session, 'me' updated and published once.
+   The ports being opened by other requests are not mapped again: their results are waited for.
+   Per-port results (see mp_ports_remap_batch()) returned in 'results'.
+   Returns EOK if all the ports are opened */
+static int mp_main_do_open_ports_l(json_t *root, json_t **results)
+{
+	control_t *ctl = ctl_get();
+	mp_main_inflight_t **ops = NULL;
+	char *led = NULL;
+	json_t *asked = NULL;
+	json_t *todo = NULL;
+	json_t *ports = NULL;
+	json_t *val = NULL;
+	size_t index = 0;
+	size_t added = 0;
+	size_t num;
+	int rc = EOK;
+
+	TESTP(root, EBAD);
+	TESTP(results, EBAD);
+
+	asked = j_find_j(root, JK_ARR_PORTS);
+	TESTP_MES(asked, EBAD, "Can't find ports list");
+
+	num = j_count(asked);
+	if (0 == num || num > PORTS_BATCH_MAX) {
+		DE("Bad batch size: %zu\n", num);
+		return (EBAD);
+	}
+
+	ops = zmalloc(num * sizeof(mp_main_inflight_t *));
+	led = zmalloc(num);
+	todo = j_arr();
+	if (NULL == ops || NULL == led || NULL == todo) {
+		DE("Can't allocate batch\n");
+		rc = EBAD;
+		goto end;
+	}
+
+	pthread_mutex_lock(&g_inflight_lock);
+	json_array_foreach(asked, index, val) {
+		int port = ctl_port_get(val, JK_PORT_INT);
+		const char *protocol = j_find_ref(val, JK_PROTOCOL);
+
+		if (0 != port && NULL != protocol) {
+			/* Also a port given twice in this batch */
+			ops[index] = mp_main_inflight_find(port, protocol);
+			if (NULL != ops[index]) {
+				ops[index]->waiters++;
+				continue;
+			}
+			ops[index] = mp_main_inflight_add(port, protocol);
+			led[index] = (NULL != ops[index]);
+		}
+		/* A bad item fails the batch in mp_ports_remap_batch() */
+		json_array_append(todo, val);
+	}
+	pthread_mutex_unlock(&g_inflight_lock);
+
+	/* Already mapped ports are answered from the mirror of the router table,
+	   without a request to the router */
+	*results = (j_count(todo) > 0) ? mp_ports_remap_batch(todo) : j_arr();
+	if (NULL == *results) {
+		DE("Can't map ports\n");
+		rc = EBAD;
+	} else {
+		ctl_lock(ctl, CTL_LOCK_ME);
+		ports = j_find_j(ctl->me, "ports");
+		json_array_foreach(*results, index, val) {
+			json_t *mapping;
+
+			if (EOK != j_test(val, JK_STATUS, JV_OK)) {
+				rc = EBAD;
+				continue;
+			}
+
+			if (NULL == ports ||
+				0 != ctl_ports_find_l(ctl, ctl_port_get(val, JK_PORT_INT), j_find_ref(val, JK_PROTOCOL))) {
+				continue;
+			}
+
+			mapping = j_dup(val);
+			if (NULL == mapping) {
+				DE("Can't copy mapping\n");
+				rc = EBAD;
+				continue;
+			}
+			j_rm_key(mapping, JK_STATUS);
+
+			if (EOK != ctl_ports_add_l(ctl, mapping)) {
+				DE("Can't index the mapping\n");
+			}
+			j_arr_add(ports, mapping);
+			added++;
+		}
+
+		if (added > 0) ctl_snap_me_publish(ctl);
+		ctl_unlock(ctl, CTL_LOCK_ME);
+
+		if (NULL == ports) {
+			DE("Can't find 'ports' array\n");
+			rc = EBAD;
+		}
+	}
+
+	/* Our ports are in 'me' now: the requests waiting for them find them there */
+	json_array_foreach(asked, index, val) {
+		if (led[index]) {
+			mp_main_inflight_done(ops[index], (NULL == ports) ? EBAD : mp_main_batch_status(*results, val));
+		}
+	}
+
+	/* The ports opened by the others */
+	json_array_foreach(asked, index, val) {
+		int port_ext = 0;
+		json_t *item;
+
+		if (NULL == ops[index] || led[index]) continue;
+
+		if (EOK == mp_main_inflight_wait(ops[index])) {
+			ctl_rlock(ctl, CTL_LOCK_ME);
+			port_ext = ctl_ports_find_l(ctl, ctl_port_get(val, JK_PORT_INT), j_find_ref(val, JK_PROTOCOL));
+			ctl_unlock(ctl, CTL_LOCK_ME);
+		}
+		if (0 == port_ext) rc = EBAD;
+		if (NULL == *results) continue;
+
+		item = j_dup(val);
+		if (NULL == item) {
+			rc = EBAD;
+			continue;
+		}
+		if (0 != port_ext) j_add_int(item, JK_PORT_EXT, port_ext);
+		j_add_str(item, JK_STATUS, (0 != port_ext) ? JV_OK : JV_BAD);
+		j_arr_add(*results, item);
+	}
+
+end:
+	if (NULL != todo) j_rm(todo);
+	zfree(ops);
+	zfree(led);
+	return (rc);
+}
+
+/* Remote machine asks to close a batch of ports: JK_ARR_PORTS of {JK_PORT_INT, JK_PROTOCOL}.
+   The ports we don't know as opened are failed without a request to the router.
+   Per-port results returned in 'results'. Returns EOK if all the ports are closed */
+static int mp_main_do_close_ports_l(json_t *root, json_t **results)
+{
+	control_t *ctl = ctl_get();
+	json_t *asked = NULL;
+	json_t *todo = NULL;
+	json_t *done = NULL;
+	json_t *ports = NULL;
+	json_t *val = NULL;
+	size_t index = 0;
+	size_t removed = 0;
+	int rc = EOK;
+
+	TESTP(root, EBAD);
+	TESTP(results, EBAD);
+
+	asked = j_find_j(root, JK_ARR_PORTS);
+	TESTP_MES(asked, EBAD, "Can't find ports list");
+
+	*results = j_arr();
+	TESTP_MES(*results, EBAD, "Can't allocate JSON array");
+	todo = j_arr();
+	TESTP_MES(todo, EBAD, "Can't allocate JSON array");
+
+	ctl_rlock(ctl, CTL_LOCK_ME);
+	json_array_foreach(asked, index, val) {
+		const char *protocol = j_find_ref(val, JK_PROTOCOL);
+		int port = ctl_port_get(val, JK_PORT_INT);
+		int port_ext = (NULL != protocol) ? ctl_ports_find_l(ctl, port, protocol) : 0;
+		json_t *item = j_dup(val);
+
+		if (NULL == item) {
+			rc = EBAD;
+			continue;
+		}
+
+		if (0 == port_ext) {
+			DE("No such a open port: %d %s\n", port, protocol);
+			j_add_str(item, JK_STATUS, JV_BAD);
+			j_arr_add(*results, item);
+			rc = EBAD;
+			continue;
+		}
+
+		j_add_int(item, JK_PORT_EXT, port_ext);
+		j_arr_add(todo, item);
+	}
+	ctl_unlock(ctl, CTL_LOCK_ME);
+
+	if (0 == j_count(todo)) {
+		j_rm(todo);
+		return (rc);
+	}
+
+	done = mp_ports_unmap_batch(todo);
+	j_rm(todo);
+	TESTP_MES(done, EBAD, "Can't unmap ports");
+
+	/* The lock was released during unmapping and the array could change: find the ports again */
+	ctl_lock(ctl, CTL_LOCK_ME);
+	ports = j_find_j(ctl->me, "ports");
+	json_array_foreach(done, index, val) {
+		int port = ctl_port_get(val, JK_PORT_INT);
+		const char *protocol = j_find_ref(val, JK_PROTOCOL);
+		int pos;
+
+		if (EOK != j_test(val, JK_STATUS, JV_OK)) {
+			rc = EBAD;
+		} else if (EOK == ctl_ports_del_l(ctl, port, protocol)) {
+			pos = mp_main_find_port(ports, port, protocol);
+			if (pos >= 0) json_array_remove(ports, (size_t)pos);
+			removed++;
+		}
+		j_arr_add(*results, j_dup(val));
+	}
+
+	if (removed > 0) ctl_snap_me_publish(ctl);
+	ctl_unlock(ctl, CTL_LOCK_ME);
+
+	j_rm(done);
+	return (rc);
+}
+
+/* Open the port asked by 'root' and answer with the ticket.
+   'mosq' is of the message loop; NULL if called by a worker */
+static int mp_main_open_port_answer(struct mosquitto *mosq, json_t *root)
+{
+	int rc = mp_main_do_open_port_l(root);
+
+	/* 
+	 * When the port opened, it added ctl global control_t structure 
+	 * We don't need to know what port exactly opened, 
+	 * we just send update to all listeners
+	 */
+
+	/*** TODO: SEB: Send update to all */
+	if (EOK == rc) {
+		mp_main_ticket_responce(root, JV_STATUS_SUCCESS, "Port opening finished OK");
+		if (NULL != mosq) {
+			send_keepalive_l(mosq);
+		} else {
+			mp_main_send_keepalive();
+		}
+	} else {
+		mp_main_ticket_responce(root, JV_STATUS_FAIL, "Port opening failed");
+	}
+
+	/*** TODO: SEB: After keepalive send report of "openport" is finished */
+	return (rc);
+}
+
+/* Open / close the batch of ports asked by 'root' and answer with the ticket
+   holding the result of every port. 'mosq' is of the message loop; NULL if called by a worker */
+static int mp_main_ports_answer(struct mosquitto *mosq, json_t *root)
+{
+	json_t *results = NULL;
+	int open = (EOK == j_test(root, JK_TYPE, JV_TYPE_OPENPORTS));
+	int rc;
+
+	if (open) {
+		rc = mp_main_do_open_ports_l(root, &results);
+	} else {
+		rc = mp_main_do_close_ports_l(root, &results);
+	}
+
+	if (EOK == rc) {
+		mp_main_ticket_responce_ports(root, JV_STATUS_SUCCESS, "All ports done OK", results);
+	} else {
+		mp_main_ticket_responce_ports(root, JV_STATUS_FAIL, "Some ports failed, see the list", results);
+	}
+
+	/* Even if some ports failed, the rest could be changed */
+	if (NULL != mosq) {
+		send_keepalive_l(mosq);
+	} else {
+		mp_main_send_keepalive();
+	}
+	return (rc);
+}
+
+/* Requests which talk to the router: "openport", "openports", "closeports" */
+static int mp_main_port_answer(struct mosquitto *mosq, json_t *root)
+{
+	if (EOK == j_test(root, JK_TYPE, JV_TYPE_OPENPORT)) {
+		return (mp_main_open_port_answer(mosq, root));
+	}
+	return (mp_main_ports_answer(mosq, root));
+}
+
+/* The requests talking to the router are handled by a few workers: the router
+   can take seconds and the other messages don't wait for it */
+#define PORT_WORKERS 4
+/* When more requests wait, the message loop handles them itself */
+#define PORT_QUEUE_MAX 64
+
+typedef struct mp_main_port_req_struct {
+	struct mp_main_port_req_struct *next;
+	json_t *root;	/* The request belongs to the worker */
+} mp_main_port_req_t;
+
+static pthread_mutex_t g_port_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_port_cond = PTHREAD_COND_INITIALIZER;
+static mp_main_port_req_t *g_port_head;
+static mp_main_port_req_t *g_port_tail;
+static size_t g_port_queued;
+static int g_port_workers;
+
+static void *mp_main_port_worker(void *arg __attribute__((unused)))
+{
+	while (1) {
+		mp_main_port_req_t *req;
+
+		pthread_mutex_lock(&g_port_lock);
+		while (NULL == g_port_head) pthread_cond_wait(&g_port_cond, &g_port_lock);
+		req = g_port_head;
+		g_port_head = req->next;
+		if (NULL == g_port_head) g_port_tail = NULL;
+		g_port_queued--;
+		pthread_mutex_unlock(&g_port_lock);
+
+		mp_main_port_answer(NULL, req->root);
+		j_rm(req->root);
+		zfree(req);
+	}
+	return (NULL);
+}
+
+/* Give the request to the workers; EBAD if the queue is full or no worker runs */
+static int mp_main_port_queue(json_t *root)
+{
+	mp_main_port_req_t *req;
+
+	pthread_mutex_lock(&g_port_lock);
+
+	/* Started on the first request */
+	while (g_port_workers < PORT_WORKERS) {
+		pthread_t thread;
+		if (0 != pthread_create(&thread, NULL, mp_main_port_worker, NULL)) {
+			DE("Can't start port worker\n");
+			break;
+		}
+		pthread_detach(thread);
+		g_port_workers++;
+	}
+
+	if (0 == g_port_workers || g_port_queued >= PORT_QUEUE_MAX) {
+		pthread_mutex_unlock(&g_port_lock);
+		return (EBAD);
+	}
+
+	req = zmalloc(sizeof(mp_main_port_req_t));
+	if (NULL == req) {
+		pthread_mutex_unlock(&g_port_lock);
+		DE("Can't allocate request\n");
+		return (EBAD);
+	}
+
+	req->root = root;
+	if (NULL != g_port_tail) {
+		g_port_tail->next = req;
+	} else {
+		g_port_head = req;
+	}
+	g_port_tail = req;
+	g_port_queued++;
+	pthread_cond_signal(&g_port_cond);
+	pthread_mutex_unlock(&g_port_lock);
 	return (EOK);
 }
 
@@ -248,9 +856,12 @@ static int mp_main_parse_message_l(struct mosquitto *mosq, char *uid, json_t *ro
 		TESTP(_uid, EBAD);
 		/* Is this host already in the list? Just for information */
 
-		ctl_lock(ctl);
+		ctl_lock(ctl, CTL_LOCK_HOSTS);
 		rc = j_replace(ctl->hosts, _uid, root);
-		ctl_unlock(ctl);
+		if (EOK == rc) {
+			ctl_snap_hosts_update(ctl, _uid, root);
+		}
+		ctl_unlock(ctl, CTL_LOCK_HOSTS);
 		return (rc);
 	}
 
@@ -284,7 +895,10 @@ static int mp_main_parse_message_l(struct mosquitto *mosq, char *uid, json_t *ro
 
 
 	/** All mesages except above should be dedicated to us ***/
-	if (EOK != j_test(root, JK_DEST, j_find_ref(ctl->me, JK_UID))) {
+	ctl_rlock(ctl, CTL_LOCK_ME);
+	rc = j_test(root, JK_DEST, j_find_ref(ctl->me, JK_UID));
+	ctl_unlock(ctl, CTL_LOCK_ME);
+	if (EOK != rc) {
 		rc = 0;
 		goto end;
 	}
@@ -296,25 +910,12 @@ static int mp_main_parse_message_l(struct mosquitto *mosq, char *uid, json_t *ro
 	 */
 
 	if (EOK == j_test(root, JK_TYPE, JV_TYPE_OPENPORT)) {
-
 		DD("Got 'openport' request\n");
 
-		rc = mp_main_do_open_port_l(root);
-		/* 
-		 * When the port opened, it added ctl global control_t structure 
-		 * We don't need to know what port exactly opened, 
-		 * we just send update to all listeners
-		 */
-
-		/*** TODO: SEB: Send update to all */
-		if (EOK == rc) {
-			mp_main_ticket_responce(root, JV_STATUS_SUCCESS, "Port opening finished OK");
-			send_keepalive_l(mosq);
-		} else {
-			mp_main_ticket_responce(root, JV_STATUS_FAIL, "Port opening failed");
-		}
+		if (EOK == mp_main_port_queue(root)) return (EOK);
 
-		/*** TODO: SEB: After keepalive send report of "openport" is finished */
+		/* The workers are busy: the request is handled here */
+		rc = mp_main_open_port_answer(mosq, root);
 		goto end;
 	}
 
@@ -341,6 +942,21 @@ static int mp_main_parse_message_l(struct mosquitto *mosq, char *uid, json_t *ro
 	}
 
 
+	/*
+	 * Messages "openports" / "closeports": a batch of ports in one request.
+	 * The ticket holds the result of every port
+	 */
+
+	if (EOK == j_test(root, JK_TYPE, JV_TYPE_OPENPORTS) || EOK == j_test(root, JK_TYPE, JV_TYPE_CLOSEPORTS)) {
+		DD("Got '%s' request\n", j_find_ref(root, JK_TYPE));
+
+		/* A batch goes to the router: handled by the workers like "openport" */
+		if (EOK == mp_main_port_queue(root)) return (EOK);
+
+		rc = mp_main_ports_answer(mosq, root);
+		goto end;
+	}
+
 	/*** Message "ssh" ***/
 	/*
      * The user wants to connect to remote UID 
@@ -425,7 +1041,7 @@ static int mp_main_on_message_processor(struct mosquitto *mosq, void *topic_v, v
 		return (EOK);
 	}
 
-	root = j_str2j((char *)data_v);
+	root = j_buf2j((buf_t *)data_v);
 	TESTP_GO(root, err);
 
 	/* The client uid always 4'th param */
@@ -441,7 +1057,11 @@ err:
 
 static void mp_main_on_message_cl(struct mosquitto *mosq, void *userdata __attribute__((unused)), const struct mosquitto_message *msg)
 {
-	mp_main_on_message_processor(mosq, msg->topic, msg->payload);
+	/* Parse the payload in place: no copy */
+	buf_t *payload = buf_view(msg->payload, (size_t)msg->payloadlen);
+	TESTP(payload, );
+	mp_main_on_message_processor(mosq, msg->topic, payload);
+	buf_free(payload);
 }
 
 static void connect_callback_l(struct mosquitto *mosq, void *obj __attribute__((unused)), int result __attribute__((unused)))
@@ -449,9 +1069,7 @@ static void connect_callback_l(struct mosquitto *mosq, void *obj __attribute__((
 	control_t *ctl = ctl_get();
 	printf("connected!\n");
 	send_reveal_l(mosq);
-	ctl_lock(ctl);
-	ctl->status = ST_CONNECTED;
-	ctl_unlock(ctl);
+	ctl_status_set(ctl, ST_CONNECTED);
 }
 
 static void mp_main_on_disconnect_l_cl(struct mosquitto *mosq __attribute__((unused)), void *data __attribute__((unused)), int reason)
@@ -510,12 +1128,18 @@ static void mp_main_on_disconnect_l_cl(struct mosquitto *mosq __attribute__((unu
 		}
 	}
 
-	ctl = ctl_get_locked();
-	ctl->status = ST_DISCONNECTED;
+	ctl = ctl_get();
+	ctl_status_set(ctl, ST_DISCONNECTED);
 	//remove_all_sources_l();
+	ctl_lock(ctl, CTL_LOCK_ME);
 	j_rm(ctl->me);
 	ctl->me = j_new();
-	ctl_unlock(ctl);
+	/* The ports index must follow 'me': else a port is "already mapped" but not in me.ports */
+	if (EOK != ctl_ports_rebuild_l(ctl)) {
+		DE("Can't rebuild ports index\n");
+	}
+	ctl_snap_me_publish(ctl);
+	ctl_unlock(ctl, CTL_LOCK_ME);
 	DDD("Exit from function\n");
 }
 
@@ -544,7 +1168,8 @@ static void *mp_main_mosq_thread(void *arg)
 
 	mosquitto_lib_init();
 
-	ctl = ctl_get_locked();
+	ctl = ctl_get();
+	ctl_rlock(ctl, CTL_LOCK_ME);
 
 	memset(forum_topic, 0, TOPIC_MAX_LEN);
 	memset(personal_topic, 0, TOPIC_MAX_LEN);
@@ -555,13 +1180,13 @@ static void *mp_main_mosq_thread(void *arg)
 	snprintf(personal_topic, TOPIC_MAX_LEN, "users/%s/personal/%s",
 			 j_find_ref(ctl->me, JK_USER),
 			 j_find_ref(ctl->me, JK_UID));
-	ctl_unlock(ctl);
 
 	DD("Creating mosquitto client.. ");
-	ctl_lock(ctl);
+	ctl_lock(ctl, CTL_LOCK_MOSQ);
 	ctl->mosq = mosquitto_new(j_find_ref(ctl->me, JK_UID), true,
 							  (void *)j_find_ref(ctl->me, JK_UID));
-	ctl_unlock(ctl);
+	ctl_unlock(ctl, CTL_LOCK_MOSQ);
+	ctl_unlock(ctl, CTL_LOCK_ME);
 	DD("Done\n");
 
 	if (NULL == ctl->mosq) {
@@ -582,7 +1207,7 @@ static void *mp_main_mosq_thread(void *arg)
 
 	if (MOSQ_ERR_SUCCESS != rc) {
 		DE("Can't set certificate\n");
-		ctl->status = ST_STOP;
+		ctl_status_set(ctl, ST_STOP);
 		return (NULL);
 	}
 	DD("Done\n");
@@ -594,14 +1219,14 @@ static void *mp_main_mosq_thread(void *arg)
 	DD("Done\n");
 
 	DD("Setting last will.. ");
-	ctl_lock(ctl);
+	ctl_rlock(ctl, CTL_LOCK_ME);
 	buf = mp_requests_build_last_will(j_find_ref(ctl->me, JK_UID), j_find_ref(ctl->me, JK_NAME));
-	ctl_unlock(ctl);
+	ctl_unlock(ctl, CTL_LOCK_ME);
 
 	TESTP_MES(buf, NULL, "Can't build last will");
 
-	rc = mosquitto_will_set(ctl->mosq, forum_topic, (int)buf->size, buf->data, 1, false);
-	buf_free_force(buf);
+	rc = mosquitto_will_set(ctl->mosq, forum_topic, (int)buf->len, buf->data, 1, false);
+	buf_free(buf);
 
 	if (MOSQ_ERR_SUCCESS != rc) {
 		DE("Can't register last will\n");
@@ -630,9 +1255,9 @@ static void *mp_main_mosq_thread(void *arg)
 	}
 	DD("Done\n");
 
-	ctl_lock(ctl);
+	ctl_rlock(ctl, CTL_LOCK_ME);
 	snprintf(topic, TOPIC_MAX_LEN, "users/%s/private/%s", clientid, j_find_ref(ctl->me, JK_UID));
-	ctl_unlock(ctl);
+	ctl_unlock(ctl, CTL_LOCK_ME);
 
 	DD("Subscribing to topic 2.. ");
 	rc = mosquitto_subscribe(ctl->mosq, NULL, topic, 0);
@@ -650,10 +1275,10 @@ static void *mp_main_mosq_thread(void *arg)
 	DDD("Starting main loop\n");
 
 	//while (counter++ < 40) {
-	while (ST_STOP != ctl->status) {
-		DDD("Client status is: %d\n", ctl->status);
+	while (ST_STOP != ctl_status_get(ctl)) {
+		DDD("Client status is: %d\n", ctl_status_get(ctl));
 
-		if (ST_DISCONNECTED == ctl->status) {
+		if (ST_DISCONNECTED == ctl_status_get(ctl)) {
 			DD("Client is disconnected, trying reconnect\n");
 			rc = mosquitto_reconnect(ctl->mosq);
 			if (MOSQ_ERR_SUCCESS != rc) {
@@ -671,37 +1296,40 @@ static void *mp_main_mosq_thread(void *arg)
 				}
 			} else {
 				DD("Finished reconnect\n");
-				ctl->status = ST_CONNECTED;
+				ctl_status_set(ctl, ST_CONNECTED);
 			}
 		}
 		DDD("Finished disconnection check\n");
 
 		usleep((__useconds_t)mp_os_random_in_range(100, 300));
-		if (0 == (counter % 7) && (ST_DISCONNECTED != ctl->status)) {
+		if (0 == (counter % 7) && (ST_DISCONNECTED != ctl_status_get(ctl))) {
 			DD("Client connected, sending keepalive message\n");
 			rc = send_keepalive_l(ctl->mosq);
 			if (EOK != rc) {}
 			counter = 1;
 		}
-		if (ST_DISCONNECTED == ctl->status) {
+		if (ST_DISCONNECTED == ctl_status_get(ctl)) {
 			DD("Client in DISCONNECTED status\n");
 		}
 
 		for (i = 0; i < 200; i++) {
-			if (ST_STOP == ctl->status) break;
+			if (ST_STOP == ctl_status_get(ctl)) break;
 			usleep((__useconds_t)mp_os_random_in_range(10000, 40000));
 		}
 		counter++;
 	}
 
-	ctl_lock(ctl);
+	ctl_lock(ctl, CTL_LOCK_MOSQ);
 	rc = mosquitto_loop_stop(ctl->mosq, true);
 	mosquitto_destroy(ctl->mosq);
 	ctl->mosq = NULL;
-	ctl_unlock(ctl);
+	ctl_unlock(ctl, CTL_LOCK_MOSQ);
 	mosquitto_lib_cleanup();
+	ctl_lock(ctl, CTL_LOCK_HOSTS);
 	j_rm(ctl->hosts);
 	ctl->hosts = j_new();
+	ctl_snap_hosts_publish(ctl);
+	ctl_unlock(ctl, CTL_LOCK_HOSTS);
 	D("Exit thread\n");
 	return (NULL);
 
@@ -715,12 +1343,12 @@ static void *mp_main_mosq_thread_manager(void *arg)
 	pthread_detach(pthread_self());
 
 	ctl = ctl_get();
-	while (ST_STOP != ctl->status) {
+	while (ST_STOP != ctl_status_get(ctl)) {
 		pthread_create(&mosq_thread_id, NULL, mp_main_mosq_thread, arg);
 		pthread_join(mosq_thread_id, &status);
 	}
 	D("Exit\n");
-	ctl->status = ST_STOPPED;
+	ctl_status_set(ctl, ST_STOPPED);
 	return (NULL);
 }
 
@@ -728,8 +1356,8 @@ static int mp_main_print_info_banner()
 {
 	control_t *ctl = ctl_get();
 	printf("=======================================\n");
-	printf("Router IP:\t%s:%s\n", j_find_ref(ctl->me, JK_IP_EXT), j_find_ref(ctl->me, JK_PORT_EXT));
-	printf("Local IP:\t%s:%s\n", j_find_ref(ctl->me, JK_IP_INT), j_find_ref(ctl->me, JK_PORT_INT));
+	printf("Router IP:\t%s:%d\n", j_find_ref(ctl->me, JK_IP_EXT), ctl_port_get(ctl->me, JK_PORT_EXT));
+	printf("Local IP:\t%s:%d\n", j_find_ref(ctl->me, JK_IP_INT), ctl_port_get(ctl->me, JK_PORT_INT));
 	printf("Name of comp:\t%s\n", j_find_ref(ctl->me, JK_NAME));
 	printf("Name of user:\t%s\n", j_find_ref(ctl->me, JK_USER));
 	printf("UID of user:\t%s\n", j_find_ref(ctl->me, JK_UID));
@@ -746,8 +1374,8 @@ static void mp_main_signal_handler(int sig)
 	}
 
 	ctl = ctl_get();
-	ctl->status = ST_STOP;
-	while (ST_STOPPED != ctl->status) {
+	ctl_status_set(ctl, ST_STOP);
+	while (ST_STOPPED != ctl_status_get(ctl)) {
 		usleep(200);
 	}
 	_exit(0);
@@ -790,7 +1418,7 @@ int mp_main_complete_me_init(void)
 		TESTI_MES(rc, EBAD, "Can't generate UID\n");
 
 		rc = j_add_str(ctl->me, JK_UID, var);
-		TFREE(var);
+		TZFREE(var);
 	}
 
 	if (EOK != j_test_key(ctl->me, JK_SOURCE)) {
@@ -808,6 +1436,31 @@ int mp_main_complete_me_init(void)
 		TESTI_MES(rc, EBAD, "Can't add JK_BRIDGE");
 	}
 
+	/* SSH by default: 'mcl -s' needs it on the target */
+	if (EOK != j_test_key(ctl->me, JK_SERVICE_PORTS)) {
+		json_t *ports = j_arr();
+		json_t *ssh = j_new();
+
+		if (NULL == ports || NULL == ssh ||
+			EOK != j_add_int(ssh, JK_PORT_INT, 22) ||
+			EOK != j_add_str(ssh, JK_PROTOCOL, JV_TCP)) {
+			DE("Can't add JK_SERVICE_PORTS\n");
+			if (NULL != ssh) j_rm(ssh);
+			if (NULL != ports) j_rm(ports);
+			return (EBAD);
+		}
+
+		/* Both steal the reference, even on failure */
+		rc = j_arr_add(ports, ssh);
+		if (EOK != rc) {
+			DE("Can't add JK_SERVICE_PORTS\n");
+			j_rm(ports);
+			return (EBAD);
+		}
+		rc = j_add_j(ctl->me, JK_SERVICE_PORTS, ports);
+		TESTI_MES(rc, EBAD, "Can't add JK_SERVICE_PORTS");
+	}
+
 	printf("UID: %s\n", j_find_ref(ctl->me, JK_UID));
 	return (EOK);
 }
@@ -818,6 +1471,8 @@ int main(int argc __attribute__((unused)), char *argv[])
 	control_t *ctl = NULL;
 	pthread_t cli_thread_id;
 	pthread_t mosq_thread_id;
+	pthread_t ports_thread_id;
+	pthread_t premap_thread_id;
 	json_t *ports;
 
 	int rc = EOK;
@@ -862,11 +1517,25 @@ int main(int argc __attribute__((unused)), char *argv[])
 		}
 	}
 
+	/* 'me' is complete now; index the ports and publish it before readers started */
+	ctl_lock(ctl, CTL_LOCK_ME);
+	if (EOK != ctl_ports_rebuild_l(ctl)) {
+		DE("Can't index some of mapped ports\n");
+	}
+	ctl_snap_me_publish(ctl);
+	ctl_unlock(ctl, CTL_LOCK_ME);
+
 	mp_main_print_info_banner();
 	pthread_create(&mosq_thread_id, NULL, mp_main_mosq_thread_manager, cert);
 	pthread_create(&cli_thread_id, NULL, mp_cli_thread, NULL);
+	pthread_create(&ports_thread_id, NULL, mp_ports_mirror_thread, NULL);
+
+	if (EOK == j_test(ctl->me, JK_TARGET, JV_YES) &&
+		0 == pthread_create(&premap_thread_id, NULL, mp_main_premap_thread, NULL)) {
+		pthread_detach(premap_thread_id);
+	}
 
-	while (ctl->status != ST_STOP) {
+	while (ctl_status_get(ctl) != ST_STOP) {
 		usleep(300);
 	}
 
@@ -20,4 +20,8 @@ typedef struct host_struct
 	int bridge;				/* If this remote machine allowed to be jump server ? */
 } host_t;
 
+/* Send keepalive with the current 'me' to the peers. Callable from any thread:
+   takes CTL_LOCK_MOSQ, does nothing when not connected */
+extern void mp_main_send_keepalive(void);
+
 #endif /* _SEC_CLIENT_MOSQ_H_ */
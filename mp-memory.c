@@ -1,12 +1,221 @@
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
 
+#include "mp-memory.h"
+
+#ifndef ZMALLOC_SYSTEM
+
+/*
+ * Size class pools: objects of 16, 32, ... 2048 bytes are cut from 64K pages.
+ * Every thread keeps up to ZM_CACHE_MAX free objects of every class and takes / returns
+ * them from / to the global depot of the class by ZM_BATCH, so most of zmalloc() / zfree()
+ * calls take no lock. Pages are never returned to the system: the daemon reuses them.
+ * Bigger objects go to malloc().
+ */
+
+#define ZM_CLASSES 8
+#define ZM_MIN_SHIFT 4
+#define ZM_PAGE (64 * 1024)
+#define ZM_CACHE_MAX 64
+#define ZM_BATCH 32
+/* Class of objects allocated with malloc() */
+#define ZM_BIG ZM_CLASSES
+
+/* Header before every object; 16 bytes keep the object aligned like malloc() does */
+typedef struct zm_hdr_struct {
+	uint32_t class;
+} __attribute__((aligned(16))) zm_hdr_t;
+
+/* Free object: the link is kept in the object itself, the header stays untouched */
+typedef struct zm_obj_struct {
+	struct zm_obj_struct *next;
+} zm_obj_t;
+
+typedef struct zm_depot_struct {
+	pthread_mutex_t lock;
+	zm_obj_t *free;
+} zm_depot_t;
+
+typedef struct zm_cache_struct {
+	zm_obj_t *free[ZM_CLASSES];
+	unsigned int num[ZM_CLASSES];
+	int registered;
+} zm_cache_t;
+
+#define ZM_DEPOT_INIT {PTHREAD_MUTEX_INITIALIZER, NULL}
+static zm_depot_t zm_depot[ZM_CLASSES] = {
+	ZM_DEPOT_INIT, ZM_DEPOT_INIT, ZM_DEPOT_INIT, ZM_DEPOT_INIT,
+	ZM_DEPOT_INIT, ZM_DEPOT_INIT, ZM_DEPOT_INIT, ZM_DEPOT_INIT
+};
+
+static __thread zm_cache_t zm_cache;
+static pthread_key_t zm_key;
+static pthread_once_t zm_once = PTHREAD_ONCE_INIT;
+
+static size_t zm_class_size(unsigned int class)
+{
+	return ((size_t)1 << (class + ZM_MIN_SHIFT));
+}
+
+static unsigned int zm_class(size_t sz)
+{
+	unsigned int class;
+
+	if (sz <= zm_class_size(0)) return (0);
+	class = (unsigned int)(64 - __builtin_clzll((unsigned long long)sz - 1)) - ZM_MIN_SHIFT;
+	return (class < ZM_CLASSES ? class : ZM_BIG);
+}
+
+/* Move up to 'num' objects of 'class' from the thread cache to the depot */
+static void zm_drain(zm_cache_t *cache, unsigned int class, unsigned int num)
+{
+	zm_depot_t *depot = &zm_depot[class];
+
+	pthread_mutex_lock(&depot->lock);
+	while (num-- > 0 && NULL != cache->free[class]) {
+		zm_obj_t *obj = cache->free[class];
+		cache->free[class] = obj->next;
+		cache->num[class]--;
+		obj->next = depot->free;
+		depot->free = obj;
+	}
+	pthread_mutex_unlock(&depot->lock);
+}
+
+/* Thread exit: give all cached objects back to the depots */
+static void zm_cache_flush(void *arg)
+{
+	zm_cache_t *cache = arg;
+	unsigned int class;
+
+	for (class = 0; class < ZM_CLASSES; class++) {
+		zm_drain(cache, class, cache->num[class]);
+	}
+}
+
+static void zm_init(void)
+{
+	pthread_key_create(&zm_key, zm_cache_flush);
+}
+
+static zm_cache_t *zm_cache_get(void)
+{
+	if (0 == zm_cache.registered) {
+		pthread_once(&zm_once, zm_init);
+		pthread_setspecific(zm_key, &zm_cache);
+		zm_cache.registered = 1;
+	}
+	return (&zm_cache);
+}
+
+/* Cut a new page into objects of 'class'; the depot lock is held */
+static int zm_grow(zm_depot_t *depot, unsigned int class)
+{
+	size_t osize = sizeof(zm_hdr_t) + zm_class_size(class);
+	char *page = malloc(ZM_PAGE);
+	char *ptr;
+
+	if (NULL == page) return (-1);
+
+	for (ptr = page; ptr + osize <= page + ZM_PAGE; ptr += osize) {
+		zm_hdr_t *hdr = (zm_hdr_t *)ptr;
+		zm_obj_t *obj = (zm_obj_t *)(hdr + 1);
+		hdr->class = class;
+		obj->next = depot->free;
+		depot->free = obj;
+	}
+	return (0);
+}
+
+/* Take a batch of objects of 'class' from the depot into the thread cache */
+static int zm_refill(zm_cache_t *cache, unsigned int class)
+{
+	zm_depot_t *depot = &zm_depot[class];
+	unsigned int num;
+
+	pthread_mutex_lock(&depot->lock);
+	if (NULL == depot->free && 0 != zm_grow(depot, class)) {
+		pthread_mutex_unlock(&depot->lock);
+		return (-1);
+	}
+
+	for (num = 0; num < ZM_BATCH && NULL != depot->free; num++) {
+		zm_obj_t *obj = depot->free;
+		depot->free = obj->next;
+		obj->next = cache->free[class];
+		cache->free[class] = obj;
+		cache->num[class]++;
+	}
+	pthread_mutex_unlock(&depot->lock);
+	return (0);
+}
+
+void *zmalloc_raw(size_t sz)
+{
+	unsigned int class = zm_class(sz);
+	zm_cache_t *cache;
+	zm_obj_t *obj;
+
+	if (ZM_BIG == class) {
+		zm_hdr_t *hdr = malloc(sizeof(zm_hdr_t) + sz);
+		if (NULL == hdr) return (NULL);
+		hdr->class = ZM_BIG;
+		return (hdr + 1);
+	}
+
+	cache = zm_cache_get();
+	if (NULL == cache->free[class] && 0 != zm_refill(cache, class)) {
+		return (NULL);
+	}
+
+	obj = cache->free[class];
+	cache->free[class] = obj->next;
+	cache->num[class]--;
+	return (obj);
+}
+
+void zfree(void *ptr)
+{
+	zm_hdr_t *hdr;
+	zm_cache_t *cache;
+	zm_obj_t *obj = ptr;
+
+	if (NULL == ptr) return;
+
+	hdr = (zm_hdr_t *)ptr - 1;
+	if (ZM_BIG == hdr->class) {
+		free(hdr);
+		return;
+	}
+
+	cache = zm_cache_get();
+	obj->next = cache->free[hdr->class];
+	cache->free[hdr->class] = obj;
+	if (++cache->num[hdr->class] > ZM_CACHE_MAX) {
+		zm_drain(cache, hdr->class, ZM_BATCH);
+	}
+}
+
+#else /* ZMALLOC_SYSTEM */
+
+void *zmalloc_raw(size_t sz)
+{
+	return malloc(sz);
+}
+
+void zfree(void *ptr)
+{
+	free(ptr);
+}
+
+#endif /* ZMALLOC_SYSTEM */
 
 void *zmalloc(size_t sz)
 {
-	void *ret = malloc(sz);
+	void *ret = zmalloc_raw(sz);
 	if (NULL == ret) return NULL;
 	memset(ret, 0, sz);
 	return ret;
 }
-
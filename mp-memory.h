@@ -1,6 +1,20 @@
 #ifndef _SEC_MEMORY_H_
 #define _SEC_MEMORY_H_
 
+#include <stddef.h>
+
+/* Memory returned by zmalloc() / zmalloc_raw() must be released with zfree(), never free().
+   Small objects come from size class pools with per-thread caches;
+   build with -DZMALLOC_SYSTEM to use plain malloc (for valgrind / ASan) */
+
+/* Allocate zeroed memory */
 extern void *zmalloc(size_t sz);
+/* Allocate memory without zeroing: for objects fully initialized by the caller */
+extern void *zmalloc_raw(size_t sz);
+/* Release memory of zmalloc() / zmalloc_raw(); NULL is ignored */
+extern void zfree(void *ptr);
+
+/* Like TFREE() for zmalloc'ed memory */
+#define TZFREE(x) do { if(NULL != x) {zfree(x); x = NULL;} }while(0)
 
 #endif /* _SEC_MEMORY_H_ */
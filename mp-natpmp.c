@@ -0,0 +1,468 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <net/route.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mp-common.h"
+#include "mp-debug.h"
+#include "mp-memory.h"
+#include "mp-os.h"
+#include "mp-natpmp.h"
+
+/* Both protocols listen on the same port of the gateway */
+#define NATPMP_PORT 5351
+#define NATPMP_VERSION 0
+#define PCP_VERSION 2
+
+#define NATPMP_OP_EXTERNAL 0
+#define NATPMP_OP_MAP_UDP 1
+#define NATPMP_OP_MAP_TCP 2
+#define PCP_OP_ANNOUNCE 0
+#define PCP_OP_MAP 1
+/* Set in the opcode of an answer */
+#define NATPMP_OP_ANSWER 0x80
+
+#define NATPMP_MAP_LEN 12
+#define NATPMP_MAP_ANSWER_LEN 16
+#define NATPMP_EXTERNAL_ANSWER_LEN 12
+#define PCP_HEADER_LEN 24
+#define PCP_MAP_LEN 36
+#define PCP_NONCE_LEN 12
+/* The longest message is PCP MAP */
+#define NATPMP_MSG_LEN (PCP_HEADER_LEN + PCP_MAP_LEN)
+
+/* RFC 6886: first timeout 250 ms, doubled for every next attempt.
+   The gateway is one hop away: 3 attempts (1.75 sec) are enough */
+#define NATPMP_TIMEOUT_MS 250
+#define NATPMP_ATTEMPTS 3
+
+#define NATPMP_ROUTE_FILE "/proc/net/route"
+
+struct mp_natpmp_struct {
+	int fd;							/* UDP socket connected to the gateway */
+	int version;					/* PCP_VERSION or NATPMP_VERSION; -1 until probed */
+	struct in_addr local;			/* Our address toward the gateway; PCP wants it in every request */
+	uint8_t nonce[PCP_NONCE_LEN];	/* PCP mapping nonce, the same for all our mappings */
+	uint32_t epoch;					/* Last epoch of the gateway and when it was seen */
+	time_t epoch_at;
+	int restarted;
+	char ext_ip[INET_ADDRSTRLEN];	/* Empty until known */
+};
+
+static void mp_natpmp_put16(uint8_t *p, uint16_t v)
+{
+	p[0] = (uint8_t)(v >> 8);
+	p[1] = (uint8_t)v;
+}
+
+static void mp_natpmp_put32(uint8_t *p, uint32_t v)
+{
+	mp_natpmp_put16(p, (uint16_t)(v >> 16));
+	mp_natpmp_put16(p + 2, (uint16_t)v);
+}
+
+static uint16_t mp_natpmp_get16(const uint8_t *p)
+{
+	return ((uint16_t)((p[0] << 8) | p[1]));
+}
+
+static uint32_t mp_natpmp_get32(const uint8_t *p)
+{
+	return (((uint32_t)mp_natpmp_get16(p) << 16) | mp_natpmp_get16(p + 2));
+}
+
+static long mp_natpmp_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+int mp_natpmp_gateway(struct in_addr *gw)
+{
+	char line[256];
+	int rc = EBAD;
+	FILE *f = fopen(NATPMP_ROUTE_FILE, "r");
+
+	TESTP_MES(f, EBAD, "Can't open " NATPMP_ROUTE_FILE);
+
+	/* "Iface Destination Gateway Flags ...", the addresses are hex in network order.
+	   The title line doesn't parse and is skipped */
+	while (NULL != fgets(line, sizeof(line), f)) {
+		char iface[64];
+		unsigned int dest;
+		unsigned int gate;
+		unsigned int flags;
+
+		if (4 != sscanf(line, "%63s %x %x %x", iface, &dest, &gate, &flags)) continue;
+		if (0 == dest && (flags & RTF_GATEWAY)) {
+			gw->s_addr = gate;
+			rc = EOK;
+			break;
+		}
+	}
+
+	fclose(f);
+	if (EOK != rc) DE("No default gateway\n");
+	return (rc);
+}
+
+/*@null@*/ mp_natpmp_t *mp_natpmp_open(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	char *nonce;
+	mp_natpmp_t *nat = zmalloc(sizeof(mp_natpmp_t));
+
+	TESTP_MES(nat, NULL, "Can't allocate NAT-PMP client");
+	nat->fd = -1;
+	nat->version = -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(NATPMP_PORT);
+	if (EOK != mp_natpmp_gateway(&addr.sin_addr)) goto err;
+
+	nat->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (nat->fd < 0) {
+		DE("Can't create UDP socket\n");
+		goto err;
+	}
+
+	/* Connected: only the gateway answers come in, and the kernel picks our address toward it */
+	if (0 != connect(nat->fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+		0 != getsockname(nat->fd, (struct sockaddr *)&addr, &len)) {
+		DE("Can't connect to gateway\n");
+		goto err;
+	}
+	nat->local = addr.sin_addr;
+
+	/* PCP answers to other nonces are not ours; the nonce lives as long as the process */
+	nonce = mp_os_rand_string(PCP_NONCE_LEN);
+	TESTP_GO(nonce, err);
+	memcpy(nat->nonce, nonce, PCP_NONCE_LEN);
+	zfree(nonce);
+
+	return (nat);
+err:
+	mp_natpmp_close(nat);
+	return (NULL);
+}
+
+void mp_natpmp_close(/*@null@*/ mp_natpmp_t *nat)
+{
+	if (NULL == nat) return;
+	if (nat->fd >= 0) close(nat->fd);
+	zfree(nat);
+}
+
+int mp_natpmp_local_ip(const mp_natpmp_t *nat, char *ip, size_t size)
+{
+	TESTP(nat, EBAD);
+	TESTP(ip, EBAD);
+
+	if (NULL == inet_ntop(AF_INET, &nat->local, ip, (socklen_t)size)) {
+		DE("Can't convert local address\n");
+		return (EBAD);
+	}
+	return (EOK);
+}
+
+const char *mp_natpmp_name(const mp_natpmp_t *nat)
+{
+	if (NULL != nat && PCP_VERSION == nat->version) return ("PCP");
+	return ("NAT-PMP");
+}
+
+/* RFC 6886 3.6: the epoch grows with the gateway clock; if it went back more
+   than the clocks can drift, the gateway restarted and forgot the mappings */
+static void mp_natpmp_epoch(mp_natpmp_t *nat, uint32_t epoch)
+{
+	time_t now = time(NULL);
+
+	if (0 != nat->epoch_at) {
+		uint32_t expect = nat->epoch + (uint32_t)(now - nat->epoch_at) * 7 / 8;
+		if (epoch + 2 < expect) {
+			DD("Gateway restarted: epoch %u, expected %u\n", epoch, expect);
+			nat->restarted = 1;
+		}
+	}
+
+	nat->epoch = epoch;
+	nat->epoch_at = now;
+}
+
+/* Build request of 'version' into 'msg': MAP of 'map', or if 'map' is NULL
+   PCP ANNOUNCE / NAT-PMP external address. Returns the length */
+static size_t mp_natpmp_build(const mp_natpmp_t *nat, int version, const mp_natpmp_map_t *map, uint8_t *msg)
+{
+	uint8_t *m;
+
+	memset(msg, 0, NATPMP_MSG_LEN);
+	msg[0] = (uint8_t)version;
+
+	if (NATPMP_VERSION == version) {
+		if (NULL == map) {
+			msg[1] = NATPMP_OP_EXTERNAL;
+			return (2);
+		}
+		msg[1] = (IPPROTO_UDP == map->protocol) ? NATPMP_OP_MAP_UDP : NATPMP_OP_MAP_TCP;
+		mp_natpmp_put16(msg + 4, map->port_int);
+		mp_natpmp_put16(msg + 6, map->port_ext);
+		mp_natpmp_put32(msg + 8, map->lifetime);
+		return (NATPMP_MAP_LEN);
+	}
+
+	/* Client address is IPv4-mapped IPv6 */
+	msg[1] = (NULL == map) ? PCP_OP_ANNOUNCE : PCP_OP_MAP;
+	msg[18] = 0xff;
+	msg[19] = 0xff;
+	memcpy(msg + 20, &nat->local, 4);
+	if (NULL == map) return (PCP_HEADER_LEN);
+
+	mp_natpmp_put32(msg + 4, map->lifetime);
+	m = msg + PCP_HEADER_LEN;
+	memcpy(m, nat->nonce, PCP_NONCE_LEN);
+	m[12] = map->protocol;
+	mp_natpmp_put16(m + 16, map->port_int);
+	mp_natpmp_put16(m + 18, map->port_ext);
+	/* Suggested external address: any IPv4 (::ffff:0.0.0.0) */
+	m[30] = 0xff;
+	m[31] = 0xff;
+	return (PCP_HEADER_LEN + PCP_MAP_LEN);
+}
+
+/* Wait for an answer until 'deadline' (ms); returns its length, 0 on timeout,
+   -1 if the gateway doesn't listen (ICMP port unreachable) */
+static ssize_t mp_natpmp_recv(mp_natpmp_t *nat, uint8_t *msg, long deadline)
+{
+	struct pollfd pfd;
+	long left;
+
+	pfd.fd = nat->fd;
+	pfd.events = POLLIN;
+
+	while ((left = deadline - mp_natpmp_ms()) > 0) {
+		ssize_t len;
+
+		if (poll(&pfd, 1, (int)left) <= 0) continue;
+
+		len = recv(nat->fd, msg, NATPMP_MSG_LEN, 0);
+		if (len < 0 && ECONNREFUSED == errno) return (-1);
+		/* Shorter than the common header: not an answer */
+		if (len >= 8) return (len);
+	}
+
+	return (0);
+}
+
+/* Send one request and wait for the answer to it; returns the answer length, 0 if none */
+static ssize_t mp_natpmp_ask(mp_natpmp_t *nat, const uint8_t *req, size_t len, uint8_t *ans)
+{
+	long timeout = NATPMP_TIMEOUT_MS;
+	int attempt;
+
+	for (attempt = 0; attempt < NATPMP_ATTEMPTS; attempt++) {
+		long deadline = mp_natpmp_ms() + timeout;
+		ssize_t alen;
+
+		if (send(nat->fd, req, len, 0) < 0) return (0);
+
+		/* A late answer to the previous request of other opcode is dropped */
+		while ((alen = mp_natpmp_recv(nat, ans, deadline)) > 0) {
+			if ((NATPMP_OP_ANSWER | req[1]) == ans[1]) return (alen);
+		}
+		if (alen < 0) return (0);
+		timeout *= 2;
+	}
+
+	return (0);
+}
+
+int mp_natpmp_probe(mp_natpmp_t *nat)
+{
+	uint8_t req[NATPMP_MSG_LEN];
+	uint8_t ans[NATPMP_MSG_LEN];
+	int version = PCP_VERSION;
+
+	TESTP(nat, EBAD);
+
+	while (1) {
+		size_t len = mp_natpmp_build(nat, version, NULL, req);
+		ssize_t alen = mp_natpmp_ask(nat, req, len, ans);
+
+		if (alen <= 0) break;
+
+		/* PCP to NAT-PMP only gateway: it answers in version 0 with "unsupported version" */
+		if (PCP_VERSION == version && NATPMP_VERSION == ans[0]) {
+			version = NATPMP_VERSION;
+			continue;
+		}
+
+		if (PCP_VERSION == version && MP_NATPMP_SUCCESS == ans[3]) {
+			mp_natpmp_epoch(nat, mp_natpmp_get32(ans + 8));
+			nat->version = PCP_VERSION;
+			return (EOK);
+		}
+
+		if (NATPMP_VERSION == version && alen >= NATPMP_EXTERNAL_ANSWER_LEN && MP_NATPMP_SUCCESS == mp_natpmp_get16(ans + 2)) {
+			mp_natpmp_epoch(nat, mp_natpmp_get32(ans + 4));
+			inet_ntop(AF_INET, ans + 8, nat->ext_ip, sizeof(nat->ext_ip));
+			nat->version = NATPMP_VERSION;
+			return (EOK);
+		}
+
+		DD("Gateway answered %s probe with error\n", PCP_VERSION == version ? "PCP" : "NAT-PMP");
+		break;
+	}
+
+	nat->version = -1;
+	return (EBAD);
+}
+
+/* Parse a MAP answer and fill the pending map it answers; EBAD if it answers none */
+static int mp_natpmp_parse_map(mp_natpmp_t *nat, const uint8_t *msg, size_t len, mp_natpmp_map_t *maps, size_t num)
+{
+	uint8_t protocol;
+	uint16_t port_int;
+	uint16_t port_ext;
+	uint32_t lifetime;
+	int result;
+	size_t i;
+
+	if (PCP_VERSION == nat->version) {
+		const uint8_t *m = msg + PCP_HEADER_LEN;
+
+		if (len < PCP_HEADER_LEN + PCP_MAP_LEN || PCP_VERSION != msg[0] || (NATPMP_OP_ANSWER | PCP_OP_MAP) != msg[1]) return (EBAD);
+		if (0 != memcmp(m, nat->nonce, PCP_NONCE_LEN)) return (EBAD);
+
+		result = msg[3];
+		lifetime = mp_natpmp_get32(msg + 4);
+		mp_natpmp_epoch(nat, mp_natpmp_get32(msg + 8));
+		protocol = m[12];
+		port_int = mp_natpmp_get16(m + 16);
+		port_ext = mp_natpmp_get16(m + 18);
+		/* Assigned external address, IPv4-mapped */
+		if (MP_NATPMP_SUCCESS == result) inet_ntop(AF_INET, m + 32, nat->ext_ip, sizeof(nat->ext_ip));
+	} else {
+		if (len < NATPMP_MAP_ANSWER_LEN || NATPMP_VERSION != msg[0]) return (EBAD);
+
+		if ((NATPMP_OP_ANSWER | NATPMP_OP_MAP_UDP) == msg[1]) protocol = IPPROTO_UDP;
+		else if ((NATPMP_OP_ANSWER | NATPMP_OP_MAP_TCP) == msg[1]) protocol = IPPROTO_TCP;
+		else return (EBAD);
+
+		result = mp_natpmp_get16(msg + 2);
+		mp_natpmp_epoch(nat, mp_natpmp_get32(msg + 4));
+		port_int = mp_natpmp_get16(msg + 8);
+		port_ext = mp_natpmp_get16(msg + 10);
+		lifetime = mp_natpmp_get32(msg + 12);
+	}
+
+	for (i = 0; i < num; i++) {
+		mp_natpmp_map_t *map = &maps[i];
+
+		if (MP_NATPMP_NO_ANSWER != map->result || map->protocol != protocol || map->port_int != port_int) continue;
+
+		map->result = result;
+		if (MP_NATPMP_SUCCESS == result) {
+			map->port_ext = port_ext;
+			map->lifetime = lifetime;
+		}
+		return (EOK);
+	}
+
+	return (EBAD);
+}
+
+void mp_natpmp_map(mp_natpmp_t *nat, mp_natpmp_map_t *maps, size_t num)
+{
+	uint8_t msg[NATPMP_MSG_LEN];
+	long timeout = NATPMP_TIMEOUT_MS;
+	size_t pending = num;
+	size_t i;
+	int attempt;
+
+	for (i = 0; i < num; i++) {
+		maps[i].result = MP_NATPMP_NO_ANSWER;
+	}
+
+	if (NULL == nat || nat->version < 0) {
+		DE("NAT-PMP client is not probed\n");
+		return;
+	}
+
+	for (attempt = 0; attempt < NATPMP_ATTEMPTS && pending > 0; attempt++) {
+		long deadline;
+
+		/* The gateway answers them in any order: all are in flight at once */
+		for (i = 0; i < num; i++) {
+			size_t len;
+
+			if (MP_NATPMP_NO_ANSWER != maps[i].result) continue;
+
+			len = mp_natpmp_build(nat, nat->version, &maps[i], msg);
+			if (send(nat->fd, msg, len, 0) < 0) {
+				DE("Can't send to gateway\n");
+				return;
+			}
+		}
+
+		deadline = mp_natpmp_ms() + timeout;
+		while (pending > 0) {
+			ssize_t alen = mp_natpmp_recv(nat, msg, deadline);
+
+			if (alen < 0) return;
+			if (0 == alen) break;
+			if (EOK == mp_natpmp_parse_map(nat, msg, (size_t)alen, maps, num)) pending--;
+		}
+
+		timeout *= 2;
+	}
+
+	if (pending > 0) DE("%zu of %zu NAT-PMP requests are not answered\n", pending, num);
+}
+
+int mp_natpmp_external_ip(mp_natpmp_t *nat, char *ip, size_t size)
+{
+	uint8_t req[NATPMP_MSG_LEN];
+	uint8_t ans[NATPMP_MSG_LEN];
+	size_t len;
+	ssize_t alen;
+
+	TESTP(nat, EBAD);
+	TESTP(ip, EBAD);
+
+	/* PCP has no such request, but PCP gateways speak NAT-PMP as well.
+	   If not, the address from the last PCP MAP answer is used */
+	len = mp_natpmp_build(nat, NATPMP_VERSION, NULL, req);
+	alen = mp_natpmp_ask(nat, req, len, ans);
+	if (alen >= NATPMP_EXTERNAL_ANSWER_LEN && NATPMP_VERSION == ans[0] && MP_NATPMP_SUCCESS == mp_natpmp_get16(ans + 2)) {
+		mp_natpmp_epoch(nat, mp_natpmp_get32(ans + 4));
+		inet_ntop(AF_INET, ans + 8, nat->ext_ip, sizeof(nat->ext_ip));
+	}
+
+	if ('\0' == nat->ext_ip[0]) {
+		DE("External IP address is not known\n");
+		return (EBAD);
+	}
+
+	snprintf(ip, size, "%s", nat->ext_ip);
+	return (EOK);
+}
+
+int mp_natpmp_restarted(mp_natpmp_t *nat)
+{
+	int restarted;
+
+	TESTP(nat, 0);
+	restarted = nat->restarted;
+	nat->restarted = 0;
+	return (restarted);
+}
@@ -0,0 +1,54 @@
+#ifndef _SEC_NATPMP_H_
+#define _SEC_NATPMP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/* NAT-PMP (RFC 6886) and PCP (RFC 6887) client: a mapping is one UDP
+   request / answer with the default gateway, no discovery, no HTTP.
+   PCP is tried first; a gateway speaking only NAT-PMP answers it with
+   "unsupported version" and the client falls back to NAT-PMP */
+
+typedef struct mp_natpmp_struct mp_natpmp_t;
+
+/* The request was not answered */
+#define MP_NATPMP_NO_ANSWER (-1)
+/* NAT-PMP / PCP result codes used by the callers */
+#define MP_NATPMP_SUCCESS 0
+#define MP_NATPMP_UNSUPP_VERSION 1
+
+/* One mapping request; lifetime 0 removes the mapping */
+typedef struct mp_natpmp_map_struct {
+	uint8_t protocol;	/* IPPROTO_TCP / IPPROTO_UDP */
+	uint16_t port_int;
+	uint16_t port_ext;	/* In: suggested, 0 if any; out: assigned */
+	uint32_t lifetime;	/* In: asked, sec; out: granted */
+	int result;			/* Result code of the gateway, or MP_NATPMP_NO_ANSWER */
+} mp_natpmp_map_t;
+
+/* Default gateway from the kernel routing table: the NAT-PMP / PCP server */
+extern int mp_natpmp_gateway(struct in_addr *gw);
+
+/* Open UDP socket to the default gateway */
+extern /*@null@*/ mp_natpmp_t *mp_natpmp_open(void);
+extern void mp_natpmp_close(/*@null@*/ mp_natpmp_t *nat);
+
+/* Find out whether the gateway speaks PCP or NAT-PMP; EBAD if none of them */
+extern int mp_natpmp_probe(mp_natpmp_t *nat);
+/* Our address toward the gateway: the mappings point to it */
+extern int mp_natpmp_local_ip(const mp_natpmp_t *nat, char *ip, size_t size);
+/* "PCP" or "NAT-PMP", for logs */
+extern const char *mp_natpmp_name(const mp_natpmp_t *nat);
+
+/* Send all the requests at once and wait for the answers; the unanswered ones
+   are sent again with growing timeout. Every map gets its 'result' */
+extern void mp_natpmp_map(mp_natpmp_t *nat, mp_natpmp_map_t *maps, size_t num);
+
+/* External IP address of the gateway; EBAD if not known */
+extern int mp_natpmp_external_ip(mp_natpmp_t *nat, char *ip, size_t size);
+
+/* The gateway restarted (its epoch went back) since the last call: all the mappings are lost */
+extern int mp_natpmp_restarted(mp_natpmp_t *nat);
+
+#endif /* _SEC_NATPMP_H_ */
@@ -57,7 +57,7 @@ static char *mp_network_find_wan_interface(void)
 		if (0 == strncmp(dest, "00000000", 8)) {
 			char *ret = strdup(interface);
 			//D("Found default WAN interface: %s\n", interface);
-			free(buf);
+			zfree(buf);
 			fclose(fd);
 			return (ret);
 		}
@@ -67,7 +67,7 @@ static char *mp_network_find_wan_interface(void)
 
 	/* If we here it means nothing is found. Probably we don't have any inteface connected to WAN */
 err:
-	TFREE(buf);
+	TZFREE(buf);
 	if (fd) fclose(fd);
 	return (NULL);
 }
@@ -121,7 +121,7 @@ static char *mp_network_get_internal_ip(void)
 /* Probe network and write all values to global ctl structure */
 int mp_network_init_network_l()
 {
-	control_t *ctl = ctl_get_locked();
+	control_t *ctl = ctl_get();
 	char *var;
 
 	/* Try to read external IP from Upnp */
@@ -130,20 +130,23 @@ int mp_network_init_network_l()
 	/* If can't read from Upnp assign it to 0.0.0.0 - means "can't use Upnp" */
 	if (NULL == var) {
 		DE("Can't get my IP\n");
-		var = strdup("0.0.0.0");
 	}
 
-	if (EOK != j_add_str(ctl->me, JK_IP_EXT, var)) DE("Can't add 'JK_IP_EXT'\n");
-	TFREE(var);
+	ctl_lock(ctl, CTL_LOCK_ME);
+	if (EOK != j_add_str(ctl->me, JK_IP_EXT, var ? var : JV_NO_IP)) DE("Can't add 'JK_IP_EXT'\n");
+	TZFREE(var);
 	D("My external ip: %s\n", j_find_ref(ctl->me, JK_IP_EXT));
-	/* By default the port is "0". It will be changed when we open an port */
-	if (EOK != j_add_str(ctl->me, JK_PORT_EXT, JV_NO_PORT)) DE("Can't add 'JK_PORT_EXT'\n");
+	/* By default the port is 0. It will be changed when we open an port */
+	if (EOK != j_add_int(ctl->me, JK_PORT_EXT, JV_NO_PORT)) DE("Can't add 'JK_PORT_EXT'\n");
+	ctl_unlock(ctl, CTL_LOCK_ME);
 
 	var = mp_network_get_internal_ip();
 	TESTP(var, EBAD);
+	ctl_lock(ctl, CTL_LOCK_ME);
 	if (EOK != j_add_str(ctl->me, JK_IP_INT, var)) DE("Can't add 'JK_IP_INT'\n");
-	if (EOK != j_add_str(ctl->me, JK_PORT_INT, JV_NO_PORT)) DE("Can't add 'JK_PORT_INT'\n");
-	ctl_unlock(ctl);
+	if (EOK != j_add_int(ctl->me, JK_PORT_INT, JV_NO_PORT)) DE("Can't add 'JK_PORT_INT'\n");
+	ctl_snap_me_publish(ctl);
+	ctl_unlock(ctl, CTL_LOCK_ME);
 	TFREE(var);
 	return (0);
 }
@@ -1,12 +1,13 @@
 #ifndef _SEC_SERVER_NETWORK_H_
 #define _SEC_SERVER_NETWORK_H_
+#include <stdint.h>
 
 #define TICKET_SIZE 8
 
 typedef struct port_struct {
-	char *port_external;
-	char *port_internal;
-	char *proto;
+	uint16_t port_external;
+	uint16_t port_internal;
+	uint8_t proto; /* IPPROTO_TCP / IPPROTO_UDP */
 } port_t;
 
 extern int mp_network_init_network_l(void);
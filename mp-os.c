@@ -48,17 +48,23 @@ static char *_rand_string(size_t size, const char charset[], size_t charset_size
 
 	if (0 == size) return (NULL);
 
-	str = zmalloc(size);
+	/* Fully written below */
+	str = zmalloc_raw(size);
 	TESTP_MES(str, NULL, "Can't allocate");
 
 	fd = fopen("/dev/urandom", "r");
-	TESTP_MES(fd, NULL, "Can't open /dev/urandom");
+	if (NULL == fd) {
+		DE("Can't open /dev/urandom\n");
+		zfree(str);
+		return (NULL);
+	}
 
 	rc = fread(str, 1, size, fd);
 	fclose(fd);
 
 	if ((int)size != rc) {
 		DE("Can't read from /dev/urandom : asked %lu, read %d\n", size, rc);
+		zfree(str);
 		return (NULL);
 	}
 
@@ -109,9 +115,9 @@ char *mp_os_generate_uid(const char *name)
 	//DD("name: %s, part1: %s, part2: %s", name, part1, part2);
 	sprintf(str, "%s-%s-%s-%s", name, part1, part2, part3);
 err:
-	TFREE(part1);
-	TFREE(part2);
-	TFREE(part3);
+	TZFREE(part1);
+	TZFREE(part2);
+	TZFREE(part3);
 	return (str);
 }
 
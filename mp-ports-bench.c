@@ -0,0 +1,206 @@
+/*** Port mapping benchmark against the mock IGD: make pbench && ./ports-bench -h ***/
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "mp-common.h"
+#include "mp-debug.h"
+#include "mp-memory.h"
+#include "mp-jansson.h"
+#include "mp-dict.h"
+#include "mp-ctl.h"
+#include "mp-ports.h"
+#include "mp-main.h"
+#include "mp-igd-mock.h"
+
+/* The mock IGD listens on loopback: the mappings point here */
+#define BENCH_LOCAL "127.0.0.1"
+/* Internal ports of our mappings; the foreign ones of the mock start at 1025 */
+#define BENCH_PORT_BASE 40000
+#define BENCH_SIZES "10,100,1000,10000"
+#define BENCH_ROUNDS 100
+
+typedef struct bench_res_struct {
+	uint64_t scan_cold;	/* Session set up and the whole table read */
+	uint64_t scan_warm;	/* From the mirror */
+	uint64_t remap;
+	uint64_t lookup;
+	uint64_t unmap;
+	size_t mapped;
+	size_t requests;	/* SOAP requests the mock served */
+} bench_res_t;
+
+/* mp-main.c is not linked: nobody to send keepalive to */
+void mp_main_send_keepalive(void)
+{
+}
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+static uint64_t bench_scan(void)
+{
+	uint64_t start;
+	json_t *arr = j_arr();
+
+	TESTP(arr, 0);
+	start = bench_now();
+	mp_ports_scan_mappings(arr, BENCH_LOCAL);
+	start = bench_now() - start;
+	j_rm(arr);
+	return (start);
+}
+
+static int bench_one(const mp_igd_mock_conf_t *conf, int rounds, bench_res_t *res)
+{
+	mp_igd_mock_t *mock = mp_igd_mock_start(conf);
+	int *ports = NULL;
+	uint64_t start;
+	int i;
+
+	TESTP_MES(mock, EBAD, "Can't start mock IGD");
+	memset(res, 0, sizeof(bench_res_t));
+
+	ports = zmalloc(sizeof(int) * (size_t)rounds);
+	TESTP_MES_GO(ports, end, "Can't allocate ports");
+
+	mp_ports_igd_url(mp_igd_mock_url(mock));
+	mp_ports_reset();
+
+	res->scan_cold = bench_scan();
+	res->scan_warm = bench_scan();
+
+	start = bench_now();
+	for (i = 0; i < rounds; i++) {
+		json_t *mapping = mp_ports_remap_any(BENCH_PORT_BASE + i, JV_TCP);
+
+		if (NULL == mapping) continue;
+		ports[i] = ctl_port_get(mapping, JK_PORT_EXT);
+		res->mapped++;
+		j_rm(mapping);
+	}
+	res->remap = bench_now() - start;
+
+	start = bench_now();
+	for (i = 0; i < rounds; i++) {
+		json_t *mapping = mp_ports_if_mapped_json(BENCH_PORT_BASE + i, BENCH_LOCAL, JV_TCP);
+		if (NULL != mapping) j_rm(mapping);
+	}
+	res->lookup = bench_now() - start;
+
+	/* Leave the mock as it was: the next size starts clean */
+	start = bench_now();
+	for (i = 0; i < rounds; i++) {
+		if (0 != ports[i]) mp_ports_unmap_port(BENCH_PORT_BASE + i, ports[i], JV_TCP);
+	}
+	res->unmap = bench_now() - start;
+
+	res->requests = mp_igd_mock_requests(mock);
+end:
+	mp_ports_reset();
+	mp_igd_mock_stop(mock);
+	zfree(ports);
+	return (NULL == ports ? EBAD : EOK);
+}
+
+static void bench_usage(const char *name)
+{
+	printf("Usage: %s [-n table sizes, \"" BENCH_SIZES "\"] [-r rounds, %d] [-d delay ms] [-f fail %%] [-x drop %%]\n"
+		   "          [-2 (IGD v2)] [-k (no keep-alive)] [-v (mp-ports logs)]\n", name, BENCH_ROUNDS);
+}
+
+int main(int argc, char *argv[])
+{
+	mp_igd_mock_conf_t conf;
+	const char *sizes = BENCH_SIZES;
+	FILE *out = stdout;
+	int rounds = BENCH_ROUNDS;
+	int verbose = 0;
+	int opt;
+
+	memset(&conf, 0, sizeof(conf));
+
+	while ((opt = getopt(argc, argv, "n:r:d:f:x:2kvh")) != -1) {
+		switch (opt) {
+		case 'n':
+			sizes = optarg;
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'd':
+			conf.delay_ms = atoi(optarg);
+			break;
+		case 'f':
+			conf.fail_pct = atoi(optarg);
+			break;
+		case 'x':
+			conf.drop_pct = atoi(optarg);
+			break;
+		case '2':
+			conf.v2 = 1;
+			break;
+		case 'k':
+			conf.no_keepalive = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			bench_usage(argv[0]);
+			return (0);
+		}
+	}
+
+	if (rounds < 1) {
+		bench_usage(argv[0]);
+		return (-1);
+	}
+
+	/* mp-ports.c logs every mapping: printing would be measured too */
+	if (!verbose) {
+		out = fdopen(dup(STDOUT_FILENO), "w");
+		TESTP_MES(out, -1, "Can't dup stdout");
+		if (NULL == freopen("/dev/null", "w", stdout)) {
+			DE("Can't silence stdout\n");
+		}
+	}
+
+	fprintf(out, "IGD v%d, %d rounds, delay %d ms, fail %d%%, drop %d%%%s\n",
+			conf.v2 ? 2 : 1, rounds, conf.delay_ms, conf.fail_pct, conf.drop_pct, conf.no_keepalive ? ", no keep-alive" : "");
+	fprintf(out, "%8s %12s %12s %14s %14s %14s %8s %9s\n",
+			"entries", "scan cold ms", "scan warm us", "remap_any us", "if_mapped us", "unmap us", "mapped", "requests");
+
+	while ('\0' != *sizes) {
+		bench_res_t res;
+		char *end = NULL;
+
+		conf.entries = strtoul(sizes, &end, 10);
+		if (end == sizes) break;
+		sizes = ('\0' != *end) ? end + 1 : end;
+
+		if (EOK != bench_one(&conf, rounds, &res)) {
+			fprintf(out, "%8zu failed\n", conf.entries);
+			continue;
+		}
+
+		/* Per operation for the per-port calls */
+		fprintf(out, "%8zu %12.2f %12.2f %14.2f %14.3f %14.2f %8zu %9zu\n",
+				conf.entries,
+				(double)res.scan_cold / 1e6,
+				(double)res.scan_warm / 1e3,
+				(double)res.remap / 1e3 / rounds,
+				(double)res.lookup / 1e3 / rounds,
+				(double)res.unmap / 1e3 / rounds,
+				res.mapped, res.requests);
+		fflush(out);
+	}
+
+	return (0);
+}
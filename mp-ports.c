@@ -1,8 +1,23 @@
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <pwd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #define STATICLIB
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/upnpcommands.h>
+/* getDevicesFromMiniSSDPD() with error code */
+#define MINIUPNPC_API_VERSION_MINISSDPC 16
+#if MINIUPNPC_API_VERSION >= MINIUPNPC_API_VERSION_MINISSDPC
+	#include <miniupnpc/minissdpc.h>
+#endif
 
 #include "mp-common.h"
 #include "mp-debug.h"
@@ -11,11 +26,16 @@
 #include "mp-jansson.h"
 #include "mp-dict.h"
 #include "mp-ctl.h"
+#include "mp-soap.h"
+#include "mp-natpmp.h"
+#include "mp-config.h"
+#include "mp-main.h"
 
 /* The miniupnpc library API changed in version 14.
    After API version 14 it accepts additional param "ttl" */
 #define MINIUPNPC_API_VERSION_ADDED_TTL 14
 
+/* Ports and IPs are numbers in the code; the text form is used only to talk to miniupnpc */
 #define PORT_STR_LEN 8
 #define IP_STR_LEN 46
 #define REQ_STR_LEN 256
@@ -37,16 +57,16 @@ static int upnp_req_str_t_free(upnp_req_str_t *req)
 {
 	TESTP_MES(req, -1, "Got NULL");
 
-	TFREE(req->s_index);            /* 1 */
-	TFREE(req->map_wan_port);       /* 2 */
-	TFREE(req->map_lan_address);    /* 3 */
-	TFREE(req->map_lan_port);       /* 4 */
-	TFREE(req->map_protocol);       /* 5 */
-	TFREE(req->map_description);    /* 6 */
-	TFREE(req->map_mapping_enabled); /* 7 */
-	TFREE(req->map_remote_host);    /* 8 */
-	TFREE(req->map_lease_duration); /* 9 */
-	TFREE(req);
+	TZFREE(req->s_index);            /* 1 */
+	TZFREE(req->map_wan_port);       /* 2 */
+	TZFREE(req->map_lan_address);    /* 3 */
+	TZFREE(req->map_lan_port);       /* 4 */
+	TZFREE(req->map_protocol);       /* 5 */
+	TZFREE(req->map_description);    /* 6 */
+	TZFREE(req->map_mapping_enabled); /* 7 */
+	TZFREE(req->map_remote_host);    /* 8 */
+	TZFREE(req->map_lease_duration); /* 9 */
+	TZFREE(req);
 	return (0);
 }
 
@@ -55,32 +75,33 @@ static upnp_req_str_t *upnp_req_str_t_alloc(void)
 	upnp_req_str_t *req = zmalloc(sizeof(upnp_req_str_t));
 	TESTP_MES(req, NULL, "Can't allocate upnp_req_str_t structure");
 
-	req->s_index = zmalloc(REQ_STR_LEN);
-	TESTP_GO(req->s_index, err);
+	/* The strings are written by snprintf() / miniupnpc before read: not zeroed */
 
-	req->map_wan_port = zmalloc(REQ_STR_LEN);
+	req->s_index = zmalloc_raw(REQ_STR_LEN);
 	TESTP_GO(req->s_index, err);
-	if (NULL == req->map_wan_port) goto err;
 
-	req->map_lan_address = zmalloc(REQ_STR_LEN);
+	req->map_wan_port = zmalloc_raw(REQ_STR_LEN);
+	TESTP_GO(req->map_wan_port, err);
+
+	req->map_lan_address = zmalloc_raw(REQ_STR_LEN);
 	TESTP_GO(req->map_lan_address, err);
 
-	req->map_lan_port = zmalloc(REQ_STR_LEN);
+	req->map_lan_port = zmalloc_raw(REQ_STR_LEN);
 	TESTP_GO(req->map_lan_port, err);
 
-	req->map_protocol = zmalloc(REQ_STR_LEN);
+	req->map_protocol = zmalloc_raw(REQ_STR_LEN);
 	TESTP_GO(req->map_protocol, err);
 
-	req->map_description = zmalloc(REQ_STR_LEN);
+	req->map_description = zmalloc_raw(REQ_STR_LEN);
 	TESTP_GO(req->map_description, err);
 
-	req->map_mapping_enabled = zmalloc(REQ_STR_LEN);
+	req->map_mapping_enabled = zmalloc_raw(REQ_STR_LEN);
 	TESTP_GO(req->map_mapping_enabled, err);
 
-	req->map_remote_host = zmalloc(REQ_STR_LEN);
+	req->map_remote_host = zmalloc_raw(REQ_STR_LEN);
 	TESTP_GO(req->map_remote_host, err);
 
-	req->map_lease_duration = zmalloc(REQ_STR_LEN);
+	req->map_lease_duration = zmalloc_raw(REQ_STR_LEN);
 	TESTP_GO(req->map_lease_duration, err);
 
 	return (req);
@@ -89,575 +110,2282 @@ err:
 	return (NULL);
 }
 
-static struct UPNPDev *mp_ports_upnp_discover(void)
+/* Parse port as router returns it; returns 0 if it is not a valid port */
+static int mp_ports_str2port(const char *port)
 {
-	int error = 0;
-	return (upnpDiscover(
-			2000, // time to wait (milliseconds)
-			NULL, // multicast interface (or null defaults to 239.255.255.250)
-			NULL, // path to minissdpd socket (or null defaults to /var/run/minissdpd.sock)
-			0, // source port to use (or zero defaults to port 1900)
-			0, // 0==IPv4, 1==IPv6
-#if MINIUPNPC_API_VERSION >= MINIUPNPC_API_VERSION_ADDED_TTL
-			2, // TTL should default to 2
-#endif
-			&error)); // error condition
-}
+	char *end = NULL;
+	long val;
 
+	TESTP(port, 0);
+	val = strtol(port, &end, 10);
+	if (end == port || '\0' != *end || val < 1 || val > 65535) return (0);
+	return ((int)val);
+}
 
-/* Send upnp request to router, ask to remap "external_port" of the router
-   to "internal_port" on this machine */
-int mp_ports_remap_port(const int external_port, const int internal_port, const char *protocol)
+/* Parse IPv4 / IPv6 address; IPv4 is kept as v4-mapped IPv6 address,
+   so any two addresses are compared with one memcmp() */
+static int mp_ports_str2ip(const char *ip, struct in6_addr *addr)
 {
-	size_t index = 0;
-	int error = 0;
-	struct UPNPDev *upnp_dev = NULL;
-	char lan_address[IP_STR_LEN];
-	struct UPNPUrls upnp_urls;
-	struct IGDdatas upnp_data;
-	char wan_address[IP_STR_LEN];
-	char s_ext[PORT_STR_LEN];
-	char s_int[PORT_STR_LEN];
-	int status = -1;
-	upnp_req_str_t *req = NULL;
-
-	TESTP(protocol, EBAD);
-
-	upnp_dev = mp_ports_upnp_discover();
-	TESTP_MES(upnp_dev, -1, "UPNP discover failed\n");
+	struct in_addr v4;
 
-	status = UPNP_GetValidIGD(upnp_dev, &upnp_urls, &upnp_data, lan_address, (int)sizeof(lan_address));
+	TESTP(ip, EBAD);
+	TESTP(addr, EBAD);
 
-	if (1 != status) {
-		DE("UPNP_GetValidIGD failed\n");
-		return (-1);
-	}
+	if (1 == inet_pton(AF_INET6, ip, addr)) return (EOK);
+	if (1 != inet_pton(AF_INET, ip, &v4)) return (EBAD);
 
-	memset(s_ext, 0, PORT_STR_LEN);
-	memset(s_int, 0, PORT_STR_LEN);
-	snprintf(s_ext, PORT_STR_LEN, "%d", external_port);
-	snprintf(s_int, PORT_STR_LEN, "%d", internal_port);
-	UPNP_GetExternalIPAddress(upnp_urls.controlURL, upnp_data.first.servicetype, wan_address);
+	memset(addr, 0, sizeof(struct in6_addr));
+	addr->s6_addr[10] = 0xff;
+	addr->s6_addr[11] = 0xff;
+	memcpy(&addr->s6_addr[12], &v4, sizeof(v4));
+	return (EOK);
+}
 
-	// add a new TCP port mapping from WAN port 12345 to local host port 24680
-	error = UPNP_AddPortMapping(
-			upnp_urls.controlURL,
-			upnp_data.first.servicetype,
-			s_ext,  // external (WAN) port requested
-			s_int,  // internal (LAN) port to which packets will be redirected
-			lan_address, // internal (LAN) address to which packets will be redirected
-			"Mighty Papa Connector", // text description to indicate why or who is responsible for the port mapping
-			protocol, // protocol must be either TCP or UDP
-			NULL, // remote (peer) host address or nullptr for no restriction
-			"0"); // port map lease duration (in seconds) or zero for "as long as possible"
+/* Build mapping JSON object: {JK_PORT_INT, JK_PORT_EXT, JK_PROTOCOL} */
+static json_t *mp_ports_mapping(int internal_port, int external_port, const char *protocol)
+{
+	json_t *mapping = j_new();
+	TESTP_MES(mapping, NULL, "Can't allocate mapping");
 
-	if (0 != error) {
-		DE("Can't map port %d -> %d\n", external_port, internal_port);
-		return (EBAD);
+	if (EOK != j_add_int(mapping, JK_PORT_INT, internal_port) ||
+		EOK != j_add_int(mapping, JK_PORT_EXT, external_port) ||
+		EOK != j_add_str(mapping, JK_PROTOCOL, protocol)) {
+		DE("Can't build mapping\n");
+		j_rm(mapping);
+		return (NULL);
 	}
-	// list all port mappings
-	index = 0;
-	req = upnp_req_str_t_alloc();
-	TESTP_MES(req, -1, "Can't alloc upnp_req_str_t");
+	return (mapping);
+}
 
-	while (1) {
-		int l_ext_port;
-		int l_int_port;
+/* IGD session: the router is discovered once and its control URL and service type
+   are used by all the port operations. When the router stops answering, the session is
+   revalidated from the description URL of the last IGD (one HTTP request) and only if
+   it fails the full SSDP discovery is done again.
+   The UPnP requests are serialized by the lock, the router handles them one by one anyway. */
+typedef struct mp_igd_struct {
+	pthread_mutex_t lock;
+	int valid;
+	struct UPNPUrls urls;
+	struct IGDdatas data;
+	char lan_address[IP_STR_LEN];
+	char rootdesc[REQ_STR_LEN]; /* Description URL of the last found IGD; "" if none */
+	mp_soap_t *soap;	/* Kept connection for pipelined requests */
+	int serial;			/* The IGD doesn't handle pipelined requests: use miniupnpc only */
+	int no_any;			/* The IGD doesn't implement AddAnyPortMapping */
+	int permanent;		/* The IGD accepts only permanent leases */
+	int fixed;			/* 'rootdesc' is given by mp_ports_igd_url(): no discovery */
+} mp_igd_t;
+
+static mp_igd_t g_igd = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+#define IGD_URL (g_igd.urls.controlURL)
+#define IGD_SERVICE (g_igd.data.first.servicetype)
+
+/* How many times a request is sent if the router doesn't answer */
+#define IGD_ATTEMPTS 2
+/* Requests in flight on the kept connection */
+#define IGD_PIPELINE 8
+
+/* UPnP IGD error codes */
+#define UPNP_ERR_INVALID_ACTION 401
+#define UPNP_ERR_NOT_IMPLEMENTED 602
+#define UPNP_ERR_INDEX_INVALID 713 /* The end of the mapping table */
+#define UPNP_ERR_NO_SUCH_ENTRY 714
+#define UPNP_ERR_CONFLICT 718
+#define UPNP_ERR_ONLY_PERMANENT 725
+
+/* Mirror of the router mapping table: (external port, protocol) -> mapping.
+   Loaded once from the router, updated by our own add / delete requests
+   and reloaded by mp_ports_mirror_thread() every MIRROR_REFRESH_SEC seconds,
+   or sooner if the router answers don't match the mirror (drift).
+   Queries are answered from the mirror, no request is sent to the router.
+   Lock order: g_igd.lock, then g_mirror.lock */
+HTYPE_INIT(igd_map, htype_port_t, port_map_t, htype_port_hash, htype_port_eq)
+
+/* Secondary index of the mirror: (internal port, protocol, local ip) -> external port.
+   "Is this port of this host mapped?" is one lookup, not a walk over the mirror */
+typedef struct mp_lan_key_struct {
+	struct in6_addr ip;
+	uint16_t port;
+	uint8_t protocol;
+} mp_lan_key_t;
+
+static inline uint32_t mp_lan_key_hash(const mp_lan_key_t *key, uint64_t seed)
+{
+	uint8_t buf[sizeof(key->ip) + 3];
+
+	/* Not the struct itself: its padding is not part of the key */
+	memcpy(buf, &key->ip, sizeof(key->ip));
+	buf[sizeof(key->ip)] = (uint8_t)(key->port >> 8);
+	buf[sizeof(key->ip) + 1] = (uint8_t)key->port;
+	buf[sizeof(key->ip) + 2] = key->protocol;
+	return ((uint32_t)htable_hash_wy(buf, sizeof(buf), seed));
+}
 
-#ifndef S_SPLINT_S /* For splint parser: it doesn't recognize %zu */
-		snprintf(req->s_index, PORT_STR_LEN, "%zu", index);
-#endif
-		error = UPNP_GetGenericPortMappingEntry(
-				upnp_urls.controlURL,
-				upnp_data.first.servicetype,
-				req->s_index,
-				req->map_wan_port,
-				req->map_lan_address,
-				req->map_lan_port,
-				req->map_protocol,
-				req->map_description,
-				req->map_mapping_enabled,
-				req->map_remote_host,
-				req->map_lease_duration);
-
-		if (UPNPCOMMAND_SUCCESS != error) {
-			upnp_req_str_t_free(req);
-			return (0);
-		}
+static inline int mp_lan_key_eq(const mp_lan_key_t *a, const mp_lan_key_t *b)
+{
+	return (a->port == b->port && a->protocol == b->protocol && 0 == memcmp(&a->ip, &b->ip, sizeof(a->ip)));
+}
 
-		index++;
+typedef struct mp_lan_val_struct {
+	uint16_t port_external;
+	uint16_t dups;	/* More mappings with the same key in the mirror; only the first one indexed */
+} mp_lan_val_t;
+
+HTYPE_INIT(igd_lan, mp_lan_key_t, mp_lan_val_t, mp_lan_key_hash, mp_lan_key_eq)
+
+/* Bitmap of external ports known to be taken, one per protocol */
+#define PORT_BITMAP_WORDS (65536 / 64)
+#define PORT_BIT_TEST(bits, port) ((bits)[(port) / 64] & (1ULL << ((port) % 64)))
+#define PORT_BIT_SET(bits, port) ((bits)[(port) / 64] |= (1ULL << ((port) % 64)))
+#define PORT_BIT_CLEAR(bits, port) ((bits)[(port) / 64] &= ~(1ULL << ((port) % 64)))
+
+typedef struct mp_mirror_struct {
+	pthread_rwlock_t lock;
+	igd_map_t *map;	/* NULL until loaded */
+	igd_lan_t *lan;	/* Index of 'map' by (internal port, protocol, local ip); set together with 'map' */
+	/* External ports mapped in the mirror, or refused by the router as taken;
+	   index 0 is TCP, 1 is UDP */
+	uint64_t taken[2][PORT_BITMAP_WORDS];
+	time_t loaded;	/* When the mirror was loaded from the router */
+	int drift;		/* Set when the router doesn't match the mirror: reload it */
+} mp_mirror_t;
+
+static mp_mirror_t g_mirror = {.lock = PTHREAD_RWLOCK_INITIALIZER};
+
+#define MIRROR_REFRESH_SEC 60
+#define MIRROR_RETRY_SEC 10
+
+/* External ports are allocated above the well known ones */
+#define PORT_ALLOC_MIN 1025
+#define PORT_ALLOC_RANGE (65536 - PORT_ALLOC_MIN)
+/* How many free candidates tried before giving up */
+#define PORT_ALLOC_TRIES 8
+
+#define MP_PORTS_DESC "Mighty Papa Connector"
+
+/* Lease of our mappings: a mapping forgotten by the router (or by us) goes away by itself.
+   A mapping is renewed RENEW_BEFORE_SEC before its lease runs out, together with
+   all the mappings running out in the next RENEW_BATCH_SEC, so they cost one batch */
+#define MP_PORTS_LEASE_SEC 3600
+#define RENEW_BEFORE_SEC 600
+#define RENEW_BATCH_SEC 300
+
+/* Mappings we keep: (external port, protocol) -> mapping, 'expires' is our lease.
+   The mirror thread renews them and re-creates the ones the router lost.
+   Protected by g_igd.lock */
+static igd_map_t *g_owned;
+
+static time_t mp_ports_renew_l(json_t *moved);
+static void mp_ports_me_moved(json_t *moved);
+
+/* One port of a batch */
+typedef struct mp_ports_batch_struct {
+	htype_port_t want;	/* (internal port, protocol) to map; (external port, protocol) to unmap */
+	int port_int;
+	int port_ext;
+	int todo;			/* The request should be sent */
+	int reserved;		/* 'port_ext' is a candidate the batch marked as taken */
+	int port_old;		/* Renewal: the external port before the batch */
+	int error;			/* UPnP error code; UPNPCOMMAND_HTTP_ERROR while not answered */
+} mp_ports_batch_t;
+
+/* Port mapping backend: UPnP IGD (SOAP over HTTP) or NAT-PMP / PCP (one UDP datagram
+   per mapping). The one answering first is picked, see mp_ports_backend_probe_l().
+   Called with g_igd.lock held; the errors are UPnP error codes */
+typedef struct mp_ports_backend_struct {
+	const char *name;
+	int (*session_l)(void);	/* Make sure the session is valid */
+	int (*load_l)(void);	/* Reload the mirror */
+	int (*map_l)(htype_port_t want, int *port);	/* Map 'want' to a port from the allocator */
+	int (*unmap_l)(htype_port_t key, int port_int);
+	void (*map_batch_l)(mp_ports_batch_t *items, size_t num);	/* Only the items to do are sent */
+	void (*unmap_batch_l)(mp_ports_batch_t *items, size_t num);
+	int (*external_ip_l)(char *ip, size_t size);	/* EOK / EBAD */
+} mp_ports_backend_t;
+
+/* NULL until probed, and again when the backend stops answering. Protected by g_igd.lock */
+static const mp_ports_backend_t *g_backend;
+static mp_natpmp_t *g_nat;
+
+static int mp_ports_backend_l(void);
+
+/* The description URL of the found IGD is kept on disk with the default gateway
+   it was found behind: restarted on the same network, we don't discover at all */
+#define IGD_CACHE_FILE "igd"
+#define MINISSDPD_SOCK "/var/run/minissdpd.sock"
+/* minissdpd matches the prefix: IGD v1 and v2 */
+#define IGD_DEVICE_TYPE "urn:schemas-upnp-org:device:InternetGatewayDevice:"
+#define SSDP_ADDR "239.255.255.250"
+#define SSDP_PORT 1900
+/* The devices answer after random delay of up to MX sec; 1 is the least allowed */
+#define SSDP_MX 1
+/* Like upnpDiscover(), but it is the upper bound: the first IGD answering is taken */
+#define SSDP_WAIT_MS 2000
+/* Answers of the same device to both searches are tried once */
+#define SSDP_TRIED_MAX 8
+
+/*@null@*/ static char *mp_ports_igd_cache_name(void)
+{
+	struct passwd *pw = getpwuid(getuid());
+	char *name;
+	size_t len;
+
+	TESTP_MES(pw, NULL, "Can't get home directory");
+	len = strlen(pw->pw_dir) + sizeof(CONFIG_DIR_NAME) + sizeof(IGD_CACHE_FILE) + 1;
+	name = zmalloc(len);
+	TESTP_MES(name, NULL, "Can't allocate file name");
+	snprintf(name, len, "%s/%s/%s", pw->pw_dir, CONFIG_DIR_NAME, IGD_CACHE_FILE);
+	return (name);
+}
 
-		l_ext_port = atoi(req->map_wan_port);
-		l_int_port = atoi(req->map_lan_port);
+static int mp_ports_igd_gateway(char *ip, size_t size)
+{
+	struct in_addr gw;
 
-		if (l_ext_port == external_port && l_int_port == internal_port) {
-			DDD("Asked mapping done\n");
-		}
+	if (EOK != mp_natpmp_gateway(&gw)) return (EBAD);
+	if (NULL == inet_ntop(AF_INET, &gw, ip, (socklen_t)size)) return (EBAD);
+	return (EOK);
+}
+
+/* Cached description URL, if it was found behind the current default gateway.
+   'url' is REQ_STR_LEN long */
+static int mp_ports_igd_cache_load(char *url)
+{
+	char gateway[IP_STR_LEN];
+	char cached[IP_STR_LEN];
+	char line[IP_STR_LEN + REQ_STR_LEN];
+	char *name;
+	FILE *f;
+	int rc = EBAD;
+
+	if (EOK != mp_ports_igd_gateway(gateway, sizeof(gateway))) return (EBAD);
+
+	name = mp_ports_igd_cache_name();
+	TESTP(name, EBAD);
+	f = fopen(name, "r");
+	zfree(name);
+	/* Not found yet on this host */
+	if (NULL == f) return (EBAD);
+
+	/* "<gateway> <description URL>" */
+	if (NULL != fgets(line, sizeof(line), f) &&
+		2 == sscanf(line, "%45s %255s", cached, url) &&
+		0 == strcmp(cached, gateway)) {
+		rc = EOK;
 	}
 
-	upnp_req_str_t_free(req);
-	return (-1);
+	fclose(f);
+	return (rc);
 }
 
-/* Send upnp request to router, ask to remap "internal_port"
-   to any external port on the router */
-json_t *mp_ports_remap_any(const char *internal_port, const char *protocol)
+static void mp_ports_igd_cache_save(const char *url)
 {
-	//size_t index = 0;
-	struct UPNPDev *upnp_dev = NULL;
-	char lan_address[IP_STR_LEN];
-	struct UPNPUrls upnp_urls;
-	struct IGDdatas upnp_data;
-	char wan_address[IP_STR_LEN];
-	char s_ext[PORT_STR_LEN];
-	//char s_int[PORT_STR_LEN];
-	char reservedPort[PORT_STR_LEN];
-	int status = -1;
-	//upnp_req_str_t *req = NULL;
-	int i_port = 0;
-	int i = 0;
-	json_t *root = NULL;
+	char gateway[IP_STR_LEN];
+	char *name;
+	FILE *f;
 
-	TESTP_MES(internal_port, NULL, "Got NULL\n");
-	TESTP_MES(protocol, NULL, "Got NULL\n");
+	if (NULL == url || EOK != mp_ports_igd_gateway(gateway, sizeof(gateway))) return;
 
-	upnp_dev = mp_ports_upnp_discover();
-	TESTP_MES(upnp_dev, NULL, "UPNP discover failed\n");
+	name = mp_ports_igd_cache_name();
+	if (NULL == name) return;
+	f = fopen(name, "w");
+	if (NULL == f) {
+		DE("Can't write %s\n", name);
+	} else {
+		fprintf(f, "%s %s\n", gateway, url);
+		fclose(f);
+	}
+	zfree(name);
+}
 
-	status = UPNP_GetValidIGD(upnp_dev, &upnp_urls, &upnp_data, lan_address, (int)sizeof(lan_address));
+/* The cached IGD doesn't answer: next time we discover */
+static void mp_ports_igd_cache_drop(void)
+{
+	char *name = mp_ports_igd_cache_name();
 
-	if (1 != status) {
-		DE("UPNP_GetValidIGD failed\n");
-		return (NULL);
-	}
+	if (NULL == name) return;
+	unlink(name);
+	zfree(name);
+}
 
-	memset(s_ext, 0, PORT_STR_LEN);
-	memset(reservedPort, 0, PORT_STR_LEN);
-	//memset(s_int, 0, PORT_STR_LEN);
-	//snprintf(s_int, PORT_STR_LEN, "%d", internal_port);
-	status = UPNP_GetExternalIPAddress(upnp_urls.controlURL, upnp_data.first.servicetype, wan_address);
-	if (0 != status) {
-		DE("UPNP_GetExternalIPAddress returned error\n");
-		return (NULL);
-	}
+/* Set up the session from description URL 'url'.
+   1 if it is a connected IGD, like UPNP_GetValidIGD(); the URLs are allocated then */
+static int mp_ports_igd_try(const char *url, struct UPNPUrls *urls, struct IGDdatas *data, char *lan, int lan_size)
+{
+	if (1 != UPNP_GetIGDFromUrl(url, urls, data, lan, lan_size)) return (0);
+	if ('\0' != data->first.servicetype[0] && UPNPIGD_IsConnected(urls, data)) return (1);
 
-	for (i = 0; i < 3; i++) {
-		int error;
+	DD("%s is not a connected IGD\n", url);
+	FreeUPNPUrls(urls);
+	return (0);
+}
 
-		while (i_port <= 1024 || i_port >= 65535) {
-			i_port = rand();
+/* LOCATION header of SSDP answer */
+static int mp_ports_ssdp_location(const char *answer, char *url, size_t size)
+{
+	const char *line = answer;
+
+	while (NULL != line) {
+		if (0 == strncasecmp(line, "LOCATION:", 9)) {
+			const char *start = line + 9;
+			size_t len;
+
+			while (' ' == *start || '\t' == *start) start++;
+			len = strcspn(start, "\r\n");
+			if (0 == len || len >= size) return (EBAD);
+			memcpy(url, start, len);
+			url[len] = '\0';
+			return (EOK);
 		}
+		line = strchr(line, '\n');
+		if (NULL != line) line++;
+	}
+	return (EBAD);
+}
 
-		error = mp_ports_remap_port(i_port, atoi(internal_port), protocol);
+static long mp_ports_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
 
-		if (0 == error) {
-			snprintf(reservedPort, PORT_STR_LEN, "%d", i_port);
-			DD("Mapped port: %s -> %s\n", reservedPort, internal_port);
-			break;
-		}
+/* SSDP search taking the first IGD that answers: upnpDiscover() waits out the
+   whole time for more devices, even when minissdpd already knows the router */
+static int mp_ports_ssdp_first(struct UPNPUrls *urls, struct IGDdatas *data, char *lan, int lan_size)
+{
+	static const char *types[] = {IGD_DEVICE_TYPE "1", IGD_DEVICE_TYPE "2"};
+	char tried[SSDP_TRIED_MAX][REQ_STR_LEN];
+	size_t tried_num = 0;
+	struct sockaddr_in addr;
+	unsigned char ttl = 2;
+	long deadline;
+	int found = 0;
+	size_t i;
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (fd < 0) {
+		DE("Can't open SSDP socket\n");
+		return (0);
 	}
 
-	/* If there was an error we try to generate some random port and map it */
-	root = j_new();
-	j_add_str(root, JK_PORT_EXT, reservedPort);
-	j_add_str(root, JK_PORT_INT, internal_port);
-	j_add_str(root, JK_PROTOCOL, protocol);
-	return (root);
-#if 0 /* SEB DEADCODE 04/05/2020 10:10  */
-	/* The port is remapped */
-	mapping = port_map_t_alloc();
-	if (NULL == mapping) {
-		DE("Can't allocate port_map_t\n");
-		//upnp_req_str_t_free(req);
-		return (NULL);
+	if (0 != setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl))) {
+		DE("Can't set SSDP TTL\n");
 	}
 
-	mapping->port_internal = internal_port;
-	mapping->port_external = strndup(reservedPort, PORT_STR_LEN);
-	//upnp_req_str_t_free(req);
-#endif /* SEB DEADCODE 04/05/2020 10:10 */
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(SSDP_PORT);
+	inet_pton(AF_INET, SSDP_ADDR, &addr.sin_addr);
+
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		char req[REQ_STR_LEN];
+		int len = snprintf(req, sizeof(req),
+						   "M-SEARCH * HTTP/1.1\r\n"
+						   "HOST: " SSDP_ADDR ":%d\r\n"
+						   "ST: %s\r\n"
+						   "MAN: \"ssdp:discover\"\r\n"
+						   "MX: %d\r\n\r\n", SSDP_PORT, types[i], SSDP_MX);
+
+		if (sendto(fd, req, (size_t)len, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			DE("Can't send SSDP search\n");
+		}
+	}
 
-	return (root);
-}
+	deadline = mp_ports_ms() + SSDP_WAIT_MS;
+	while (!found) {
+		struct pollfd pfd = {.fd = fd, .events = POLLIN};
+		char answer[1500];
+		char url[REQ_STR_LEN];
+		long left = deadline - mp_ports_ms();
+		ssize_t got;
+		int rc;
+
+		if (left <= 0) break;
+		rc = poll(&pfd, 1, (int)left);
+		if (rc < 0 && EINTR == errno) continue;
+		if (rc <= 0) break;
+
+		got = recv(fd, answer, sizeof(answer) - 1, 0);
+		if (got <= 0) continue;
+		answer[got] = '\0';
+		if (EOK != mp_ports_ssdp_location(answer, url, sizeof(url))) continue;
+
+		for (i = 0; i < tried_num && 0 != strcmp(tried[i], url); i++) ;
+		if (i < tried_num) continue;
+		if (tried_num < SSDP_TRIED_MAX) {
+			snprintf(tried[tried_num], sizeof(tried[tried_num]), "%s", url);
+			tried_num++;
+		}
 
-#if 0 /* SEB 28/04/2020 16:46  */
-r = UPNP_AddAnyPortMapping(urls->controlURL, data->first.servicetype,
-						   eport, iport, iaddr, description,
-						   proto, remoteHost, leaseDuration, reservedPort);
-if(r==UPNPCOMMAND_SUCCESS)
-eport = reservedPort;
-else
-printf("AddAnyPortMapping(%s, %s, %s) failed with code %d (%s)\n",
-	   eport, iport, iaddr, r, strupnperror(r));
+		DDD("SSDP answer: %s\n", url);
+		found = mp_ports_igd_try(url, urls, data, lan, lan_size);
+	}
 
-#endif /* SEB 28/04/2020 16:46 */
+	close(fd);
+	return (found);
+}
 
-int mp_ports_unmap_port(const char *internal_port, const char *external_port, const char *protocol)
+/* Find the IGD, the cheapest way first: the cached description URL if we are behind
+   the same gateway, minissdpd (no network traffic), SSDP taking the first IGD answering.
+   1 if found, like UPNP_GetValidIGD(); the URLs are allocated then */
+static int mp_ports_igd_find(struct UPNPUrls *urls, struct IGDdatas *data, char *lan, int lan_size)
 {
-	int error = 0;
+	char url[REQ_STR_LEN];
+	int status = 0;
+#if MINIUPNPC_API_VERSION >= MINIUPNPC_API_VERSION_MINISSDPC
 	struct UPNPDev *upnp_dev;
+	int error = 0;
+#endif
 
-	char lan_address[IP_STR_LEN];
-	struct UPNPUrls upnp_urls;
-	struct IGDdatas upnp_data;
-	int status;
-
-	TESTP(internal_port, EBAD);
-	TESTP(external_port, EBAD);
-	TESTP(protocol, EBAD);
-
-	DD("internal_port = %s, external_port = %s,  protocol = %s\n", internal_port, external_port, protocol);
-	upnp_dev = mp_ports_upnp_discover();
-	TESTP_MES(upnp_dev, -1, "UPNP discover failed\n");
+	if (EOK == mp_ports_igd_cache_load(url)) {
+		if (1 == mp_ports_igd_try(url, urls, data, lan, lan_size)) {
+			DD("IGD from cache: %s\n", url);
+			return (1);
+		}
+		DD("Cached IGD %s doesn't answer\n", url);
+		mp_ports_igd_cache_drop();
+	}
 
-	status = UPNP_GetValidIGD(upnp_dev, &upnp_urls, &upnp_data, lan_address, (int)sizeof(lan_address));
-	if (1 != status) {
-		DE("Can't get valid IGD\n");
-		return (-1);
+#if MINIUPNPC_API_VERSION >= MINIUPNPC_API_VERSION_MINISSDPC
+	upnp_dev = getDevicesFromMiniSSDPD(IGD_DEVICE_TYPE, MINISSDPD_SOCK, &error);
+	if (NULL != upnp_dev) {
+		status = UPNP_GetValidIGD(upnp_dev, urls, data, lan, lan_size);
+		freeUPNPDevlist(upnp_dev);
+		/* Status 2 and 3: an UPnP device found but it is not usable; URLs are allocated */
+		if (1 != status && 0 != status) FreeUPNPUrls(urls);
+		if (1 == status) DD("IGD from minissdpd\n");
 	}
+#endif
 
-	// remove port mapping from WAN port 12345 to local host port 24680
-	error = UPNP_DeletePortMapping(
-			upnp_urls.controlURL,
-			upnp_data.first.servicetype,
-			external_port,  // external (WAN) port requested
-			protocol, // protocol must be either TCP or UDP
-			NULL); // remote (peer) host address or nullptr for no restriction
+	if (1 != status) status = mp_ports_ssdp_first(urls, data, lan, lan_size);
+	if (1 != status) return (0);
 
-	freeUPNPDevlist(upnp_dev);
+	mp_ports_igd_cache_save(urls->rootdescURL);
+	return (1);
+}
 
+/* Forget the session; the description URL is kept for cheap revalidation */
+static void mp_ports_igd_drop_l(void)
+{
+	if (g_igd.valid) {
+		FreeUPNPUrls(&g_igd.urls);
+		g_igd.valid = 0;
+	}
+	mp_soap_close(g_igd.soap);
+	g_igd.soap = NULL;
+}
 
-	if (0 != error) {
-		DE("Can't delete port %s\n", external_port);
-		return (EBAD);
+/* New IGD found: remember it, forget what was learned about the old one */
+static void mp_ports_igd_found_l(void)
+{
+	if (NULL != g_igd.urls.rootdescURL) {
+		snprintf(g_igd.rootdesc, sizeof(g_igd.rootdesc), "%s", g_igd.urls.rootdescURL);
 	}
 
-	return (0);
+	DD("Found IGD: %s, local address %s\n", g_igd.rootdesc, g_igd.lan_address);
+	g_igd.valid = 1;
+	g_igd.serial = 0;
+	g_igd.no_any = 0;
+	g_igd.permanent = 0;
 }
 
-/* 
- * Test if the port mapping exists. 
- * external_port: port opened on router 
- * internal_port: to wich internal port the external port redirected 
- * local_host - IP address of expected machine; if NULL - not checked 
- * Return: 
- * 0 it all right 
- * 1 if port mapped but local host is different 
- * 2 if port mapped but internal port is different 
- * 3 if port not mapped at all 
- * -1 on an error 
- */
-int mp_ports_if_mapped(int external_port, int internal_port, char *local_host, char *protocol)
+/* Make sure the session is valid: reuse it, or revalidate from the last
+   description URL, or discover the router */
+static int mp_ports_igd_get_l(void)
 {
-	struct UPNPDev *upnp_dev;
-	char lan_address[IP_STR_LEN];
-	struct UPNPUrls upnp_urls;
-	struct IGDdatas upnp_data;
-
-	// get the external (WAN) IP address
-	char wan_address[IP_STR_LEN];
-	char s_ext[PORT_STR_LEN];
-	char s_int[PORT_STR_LEN];
 	int status;
-	upnp_req_str_t *req = NULL;
-	size_t index = 0;
 
-	upnp_dev = mp_ports_upnp_discover();
-	TESTP_MES(upnp_dev, -1, "UPNP discover failed\n");
-	status = UPNP_GetValidIGD(upnp_dev, &upnp_urls, &upnp_data, lan_address, (int)sizeof(lan_address));
+	if (g_igd.valid) return (EOK);
+
+	if ('\0' != g_igd.rootdesc[0]) {
+		status = UPNP_GetIGDFromUrl(g_igd.rootdesc, &g_igd.urls, &g_igd.data,
+									g_igd.lan_address, (int)sizeof(g_igd.lan_address));
+		if (1 == status) {
+			DD("IGD revalidated: %s\n", g_igd.rootdesc);
+			g_igd.valid = 1;
+			g_igd.serial = 0;
+			g_igd.no_any = 0;
+			g_igd.permanent = 0;
+			return (EOK);
+		}
+		if (g_igd.fixed) {
+			DE("IGD at %s doesn't answer\n", g_igd.rootdesc);
+			return (EBAD);
+		}
+		DD("IGD at %s is gone, discover again\n", g_igd.rootdesc);
+		g_igd.rootdesc[0] = '\0';
+		mp_ports_igd_cache_drop();
+	}
 
-	if (1 != status) {
-		DE("Error on UPNP_GetValidIGD: status = %d\n", status);
-		return (-1);
+	if (1 != mp_ports_igd_find(&g_igd.urls, &g_igd.data, g_igd.lan_address, (int)sizeof(g_igd.lan_address))) {
+		DE("No UPnP IGD found\n");
+		return (EBAD);
 	}
 
-	memset(s_ext, 0, PORT_STR_LEN);
-	memset(s_int, 0, PORT_STR_LEN);
+	mp_ports_igd_found_l();
+	return (EOK);
+}
 
-	snprintf(s_ext, PORT_STR_LEN, "%d", external_port);
-	snprintf(s_int, PORT_STR_LEN, "%d", internal_port);
-	UPNP_GetExternalIPAddress(upnp_urls.controlURL, upnp_data.first.servicetype, wan_address);
+/* Run UPnP command 'cmd' using IGD_URL and IGD_SERVICE, the result is set into 'error'.
+   If the router doesn't answer, the session revalidated and the command sent again.
+   Must be called with g_igd.lock held */
+#define IGD_CALL_L(error, cmd) do { \
+		int _attempt; \
+		error = UPNPCOMMAND_UNKNOWN_ERROR; \
+		for (_attempt = 0; _attempt < IGD_ATTEMPTS; _attempt++) { \
+			if (EOK != mp_ports_igd_get_l()) break; \
+			error = (cmd); \
+			if (UPNPCOMMAND_HTTP_ERROR != error) break; \
+			DD("IGD doesn't answer, revalidate the session\n"); \
+			mp_ports_igd_drop_l(); \
+		} \
+	} while (0)
+
+/* Lease to ask for a new mapping, sec */
+static int mp_ports_lease_l(void)
+{
+	return (g_igd.permanent ? 0 : MP_PORTS_LEASE_SEC);
+}
 
-	// list all port mappings
-	req = upnp_req_str_t_alloc();
-	TESTP_MES(req, -1, "Can't allocate upnp_req_str_t");
+/* The IGD refused finite lease: switch to permanent ones.
+   Returns 1 if switched now, so the request should be sent again */
+static int mp_ports_lease_refused_l(int error)
+{
+	if (UPNP_ERR_ONLY_PERMANENT != error || g_igd.permanent) return (0);
+	DD("IGD accepts only permanent leases\n");
+	g_igd.permanent = 1;
+	return (1);
+}
 
-	while (1) {
-		int error;
-		int l_ext_port;
-		int l_int_port;
+/* Read mapping entry number 'index' of the router table into 'req' */
+static int mp_ports_get_entry_l(size_t index, upnp_req_str_t *req)
+{
+	int error;
 
-#ifndef S_SPLINT_S /* For splint: it has a problem with %zu */
-		snprintf(req->s_index, PORT_STR_LEN, "%zu", index);
+#ifndef S_SPLINT_S /* For splint parser: it doesn't recognize %zu */
+	snprintf(req->s_index, PORT_STR_LEN, "%zu", index);
 #endif
-		error = UPNP_GetGenericPortMappingEntry(
-				upnp_urls.controlURL,
-				upnp_data.first.servicetype,
-				//std::to_string(index).c_str()   ,
-				req->s_index,
-				req->map_wan_port,
-				req->map_lan_address,
-				req->map_lan_port,
-				req->map_protocol,
-				req->map_description,
-				req->map_mapping_enabled,
-				req->map_remote_host,
-				req->map_lease_duration);
-
-		if (error) {
-			/* No more ports, and asked port not found in the list */
-			upnp_req_str_t_free(req);
-			/* Port not mapped at all */
-			return (3);
-		}
-
-		if (0 != strcmp(req->map_protocol, protocol)) {
-			continue;
-		}
-
-		index++;
+	IGD_CALL_L(error, UPNP_GetGenericPortMappingEntry(
+			IGD_URL,
+			IGD_SERVICE,
+			req->s_index,
+			req->map_wan_port,
+			req->map_lan_address,
+			req->map_lan_port,
+			req->map_protocol,
+			req->map_description,
+			req->map_mapping_enabled,
+			req->map_remote_host,
+			req->map_lease_duration));
+	return (error);
+}
 
-		l_ext_port = atoi(req->map_wan_port);
-		l_int_port = atoi(req->map_lan_port);
+static const char *mp_ports_proto_str(uint8_t protocol)
+{
+	return (IPPROTO_UDP == protocol ? JV_UDP : JV_TCP);
+}
 
-		/* port mapped but internal port is different */
-		if (l_ext_port == external_port && l_int_port != internal_port) {
-			upnp_req_str_t_free(req);
-			return (2);
-		}
+/* Parse the router table entry; returns EBAD if it is not a valid TCP / UDP mapping */
+static int mp_ports_entry2map(const upnp_req_str_t *req, htype_port_t *key, port_map_t *map)
+{
+	int internal_port = mp_ports_str2port(req->map_lan_port);
+	long lease;
 
-		/* Check case 1: port mapped but local port is different */
-		if (l_ext_port == external_port && l_int_port == internal_port) {
-			D("Asked mapping done: ext port %s -> %s:%s\n", req->map_wan_port, req->map_lan_address, req->map_lan_port);
+	if (EOK != ctl_port_key(mp_ports_str2port(req->map_wan_port), req->map_protocol, key) ||
+		0 == internal_port ||
+		EOK != mp_ports_str2ip(req->map_lan_address, &map->local_ip)) {
+		return (EBAD);
+	}
 
-			if ((0 != local_host) && (0 != strncmp(req->map_lan_port, local_host, REQ_STR_LEN))) {
-				upnp_req_str_t_free(req);
-				return (1);
-			}
+	map->port_external = key->port;
+	map->port_internal = (uint16_t)internal_port;
+	map->protocol = key->protocol;
+	/* Some IGDs return the original lease, not the remaining one: it is the latest end */
+	lease = strtol(req->map_lease_duration, NULL, 10);
+	map->expires = (lease > 0) ? time(NULL) + lease : 0;
+	snprintf(map->description, sizeof(map->description), "%s", req->map_description);
+	return (EOK);
+}
 
-			/* If we here it means that local_host is the same as asked, or it is NULL and should not be testes*/
-			upnp_req_str_t_free(req);
-			return (0);
-		}
+/* Add router table entry to the mirror; invalid entries are skipped */
+static int mp_ports_mirror_add(igd_map_t *fresh, const upnp_req_str_t *req, size_t index)
+{
+	htype_port_t key;
+	port_map_t map;
+	port_map_t *slot;
+
+	memset(&map, 0, sizeof(map));
+	if (EOK != mp_ports_entry2map(req, &key, &map)) {
+		DD("Skip router entry %zu: %s -> %s:%s %s\n", index,
+		   req->map_wan_port, req->map_lan_address, req->map_lan_port, req->map_protocol);
+		return (EOK);
 	}
 
-	upnp_req_str_t_free(req);
-	return (-1);
+	slot = igd_map_put(fresh, &key, NULL);
+	TESTP_MES(slot, EBAD, "Can't add entry to mirror");
+	*slot = map;
+	return (EOK);
 }
 
-/* 
- * Test if the port mapping exists. 
- * internal_port: to wich internal port the external port redirected 
- * local_host - IP address of expected machine; if NULL - not checked 
- * Return:
- * port_map_t structure on success (mapping found) 
- * The structure will contain nothing if no mapping found
- * NULL on an error 
- */
-json_t *mp_ports_if_mapped_json(const char *internal_port, const char *local_host, const char *protocol)
+/* Read the router table with miniupnpc, one request after another */
+static int mp_ports_mirror_read_serial_l(igd_map_t *fresh, upnp_req_str_t *req)
 {
-	struct UPNPDev *upnp_dev;
-	char lan_address[IP_STR_LEN];
-	struct UPNPUrls upnp_urls;
-	struct IGDdatas upnp_data;
-
-	char wan_address[IP_STR_LEN];
-	char s_ext[PORT_STR_LEN];
-	int status;
-	json_t *mapping = NULL;
-	upnp_req_str_t *req = NULL;
 	size_t index = 0;
+	int error;
 
-	upnp_dev = mp_ports_upnp_discover();
-	TESTP_MES(upnp_dev, NULL, "UPNP discover failed\n");
-	status = UPNP_GetValidIGD(upnp_dev, &upnp_urls, &upnp_data, lan_address, (int)sizeof(lan_address));
+	while (UPNPCOMMAND_SUCCESS == (error = mp_ports_get_entry_l(index, req))) {
+		if (EOK != mp_ports_mirror_add(fresh, req, index)) return (EBAD);
+		index++;
+	}
 
-	if (1 != status) {
-		DE("Error on UPNP_GetValidIGD: status = %d\n", status);
-		return (NULL);
+	/* The table ends with an error code (713, SpecifiedArrayIndexInvalid);
+	   an error below 0 is transport error, the table was not read */
+	if (error < 0) {
+		DE("Can't read router table: error = %d\n", error);
+		return (EBAD);
 	}
+	return (EOK);
+}
 
-	memset(s_ext, 0, PORT_STR_LEN);
-	UPNP_GetExternalIPAddress(upnp_urls.controlURL, upnp_data.first.servicetype, wan_address);
+/* Read the router table over the kept connection, IGD_PIPELINE requests in flight */
+static int mp_ports_mirror_read_pipelined_l(igd_map_t *fresh, upnp_req_str_t *req)
+{
+	char args[64];
+	size_t sent = 0;
+	size_t index = 0;
+	int end = 0;
 
-	// list all port mappings
-	req = upnp_req_str_t_alloc();
-	TESTP_MES(req, NULL, "Can't allocate upnp_req_str_t");
+	if (NULL == g_igd.soap) g_igd.soap = mp_soap_open(IGD_URL, IGD_SERVICE);
+	TESTP(g_igd.soap, EBAD);
 
-	while (1) {
-		int error;
+	while (!end || mp_soap_in_flight(g_igd.soap) > 0) {
+		buf_t *body;
+		int status = 0;
 
-#ifndef S_SPLINT_S /* FOr splint: it has a problem with %zu */
-		snprintf(req->s_index, PORT_STR_LEN, "%zu", index);
-#endif
-		error = UPNP_GetGenericPortMappingEntry(
-				upnp_urls.controlURL,
-				upnp_data.first.servicetype,
-				//std::to_string(index).c_str()   ,
-				req->s_index,
-				req->map_wan_port,
-				req->map_lan_address,
-				req->map_lan_port,
-				req->map_protocol,
-				req->map_description,
-				req->map_mapping_enabled,
-				req->map_remote_host,
-				req->map_lease_duration);
-
-		if (error) {
-			/* No more ports, and asked port not found in the list */
-			upnp_req_str_t_free(req);
-			/* Port not mapped at all */
-			return (NULL);
+		/* Keep the pipe full until the end of the table seen */
+		while (!end && mp_soap_in_flight(g_igd.soap) < IGD_PIPELINE) {
+			snprintf(args, sizeof(args), "<NewPortMappingIndex>%zu</NewPortMappingIndex>", sent);
+			if (EOK != mp_soap_send(g_igd.soap, "GetGenericPortMappingEntry", args)) return (EBAD);
+			sent++;
 		}
 
-		index++;
+		body = mp_soap_recv(g_igd.soap, &status);
+		TESTP(body, EBAD);
 
-		/* Check case 1: port mapped but local port is different */
-		if (0 == strncmp(req->map_lan_port, internal_port, strlen(internal_port)) &&
-			0 == strncmp(req->map_protocol, protocol, strlen(protocol)) &&
-			0 == strncmp(req->map_lan_address, local_host, strlen(protocol))) {
-			D("Asked mapping is already exists: ext port %s -> %s:%s\n", req->map_wan_port, req->map_lan_address, req->map_lan_port);
-
-			mapping = j_new();
-			if (NULL == mapping) {
-				DE("Can't allocate port_map_t\n");
-				upnp_req_str_t_free(req);
-				return (NULL);
+		if (200 != status) {
+			int error = mp_soap_error(body);
+			buf_free(body);
+			/* The end of the table; the answers still in flight are the same error */
+			if (UPNP_ERR_INDEX_INVALID == error) {
+				end = 1;
+				continue;
 			}
+			DE("Unexpected answer to GetGenericPortMappingEntry: HTTP %d, error %d\n", status, error);
+			return (EBAD);
+		}
 
-			j_add_str(mapping, JK_PORT_INT, req->map_lan_port);
-			j_add_str(mapping, JK_PORT_EXT, req->map_wan_port);
-			j_add_str(mapping, JK_PROTOCOL, req->map_protocol);
-
-			upnp_req_str_t_free(req);
-			return (mapping);
+		mp_soap_arg(body, "NewExternalPort", req->map_wan_port, REQ_STR_LEN);
+		mp_soap_arg(body, "NewInternalClient", req->map_lan_address, REQ_STR_LEN);
+		mp_soap_arg(body, "NewInternalPort", req->map_lan_port, REQ_STR_LEN);
+		mp_soap_arg(body, "NewProtocol", req->map_protocol, REQ_STR_LEN);
+		if (EOK != mp_soap_arg(body, "NewLeaseDuration", req->map_lease_duration, REQ_STR_LEN)) {
+			req->map_lease_duration[0] = '\0';
 		}
+		if (EOK != mp_soap_arg(body, "NewPortMappingDescription", req->map_description, REQ_STR_LEN)) {
+			req->map_description[0] = '\0';
+		}
+		buf_free(body);
+
+		if (EOK != mp_ports_mirror_add(fresh, req, index)) return (EBAD);
+		index++;
 	}
 
-	upnp_req_str_t_free(req);
-	return (mapping);
+	return (EOK);
 }
 
-/* Scan existing mappings to this machine and add them to the given array 'arr' */
-json_t *mp_ports_scan_mappings(json_t *arr, const char *local_host)
+static void mp_ports_lan_key(const struct in6_addr *ip, int port, uint8_t protocol, mp_lan_key_t *key)
 {
-	struct UPNPDev *upnp_dev;
-	char lan_address[IP_STR_LEN];
-	struct UPNPUrls upnp_urls;
-	struct IGDdatas upnp_data;
+	memset(key, 0, sizeof(*key));
+	key->ip = *ip;
+	key->port = (uint16_t)port;
+	key->protocol = protocol;
+}
 
-	char wan_address[IP_STR_LEN];
-	char s_ext[PORT_STR_LEN];
-	int status;
-	json_t *mapping = NULL;
-	upnp_req_str_t *req = NULL;
-	size_t index = 0;
+/* Add mapping 'map' to the index */
+static int mp_ports_lan_add(igd_lan_t *lan, const port_map_t *map)
+{
+	mp_lan_key_t key;
+	mp_lan_val_t *val;
+	int added = 0;
+
+	mp_ports_lan_key(&map->local_ip, map->port_internal, map->protocol, &key);
+	val = igd_lan_put(lan, &key, &added);
+	TESTP_MES(val, EBAD, "Can't add mapping to the index");
+	if (added) {
+		val->port_external = map->port_external;
+	} else if (val->port_external != map->port_external) {
+		val->dups++;
+	}
+	return (EOK);
+}
 
+/* Remove mapping 'map' from the index; 'mirror' is the mirror without it already */
+static void mp_ports_lan_del(igd_lan_t *lan, igd_map_t *mirror, const port_map_t *map)
+{
+	mp_lan_key_t key;
+	mp_lan_val_t *val;
+	igd_map_slot_t *slot;
+	size_t index;
+
+	mp_ports_lan_key(&map->local_ip, map->port_internal, map->protocol, &key);
+	val = igd_lan_find(lan, &key);
+	if (NULL == val) return;
+
+	if (0 == val->dups) {
+		igd_lan_del(lan, &key, NULL);
+		return;
+	}
 
-	upnp_dev = mp_ports_upnp_discover();
-	TESTP_MES(upnp_dev, NULL, "UPNP discover failed\n");
-	status = UPNP_GetValidIGD(upnp_dev, &upnp_urls, &upnp_data, lan_address, (int)sizeof(lan_address));
+	val->dups--;
+	if (val->port_external != map->port_external) return;
 
-	if (1 != status) {
-		DE("Error on UPNP_GetValidIGD: status = %d\n", status);
-		return (NULL);
+	/* The indexed mapping is gone, a duplicate takes its place. Duplicates are rare:
+	   another program on the host mapped the same internal port */
+	htype_each(mirror, index, slot) {
+		if (slot->val.port_internal == map->port_internal && slot->val.protocol == map->protocol &&
+			0 == memcmp(&slot->val.local_ip, &map->local_ip, sizeof(map->local_ip))) {
+			val->port_external = slot->val.port_external;
+			return;
+		}
 	}
+	igd_lan_del(lan, &key, NULL);
+}
 
-	memset(s_ext, 0, PORT_STR_LEN);
-	UPNP_GetExternalIPAddress(upnp_urls.controlURL, upnp_data.first.servicetype, wan_address);
+/* Index of the whole mirror 'map'; NULL on an error */
+static igd_lan_t *mp_ports_lan_build(igd_map_t *map)
+{
+	igd_lan_t *lan = igd_lan_alloc(map->members * 2);
+	igd_map_slot_t *slot;
+	size_t index;
+
+	TESTP_MES(lan, NULL, "Can't allocate mirror index");
+	htype_each(map, index, slot) {
+		if (EOK != mp_ports_lan_add(lan, &slot->val)) {
+			igd_lan_free(lan);
+			return (NULL);
+		}
+	}
+	return (lan);
+}
 
-	// list all port mappings
-	req = upnp_req_str_t_alloc();
-	TESTP_MES(req, NULL, "Can't allocate upnp_req_str_t");
+/* Read the whole router table into a new mirror; replaces the old one.
+   The table is read over the kept connection with pipelined requests;
+   if the router doesn't handle it, the session falls back to serial miniupnpc requests */
+static int mp_ports_upnp_load_l(void)
+{
+	upnp_req_str_t *req = NULL;
+	igd_map_t *fresh = NULL;
+	igd_map_t *old = NULL;
+	igd_lan_t *lan = NULL;
+	igd_lan_t *old_lan = NULL;
+	igd_map_slot_t *slot;
+	size_t index;
+	int rc = EBAD;
 
-	while (1) {
-		int error;
+	if (EOK != mp_ports_igd_get_l()) return (EBAD);
 
-#ifndef S_SPLINT_S /* FOr splint: it has a problem with %zu */
-		snprintf(req->s_index, PORT_STR_LEN, "%zu", index);
-#endif
-		error = UPNP_GetGenericPortMappingEntry(
-				upnp_urls.controlURL,
-				upnp_data.first.servicetype,
-				//std::to_string(index).c_str()   ,
-				req->s_index,
-				req->map_wan_port,
-				req->map_lan_address,
-				req->map_lan_port,
-				req->map_protocol,
-				req->map_description,
-				req->map_mapping_enabled,
-				req->map_remote_host,
-				req->map_lease_duration);
-
-		if (error) {
-			/* No more ports, and asked port not found in the list */
-			upnp_req_str_t_free(req);
-			/* Port not mapped at all */
-			return (NULL);
+	req = upnp_req_str_t_alloc();
+	TESTP_MES(req, EBAD, "Can't allocate upnp_req_str_t");
+
+	if (0 == g_igd.serial) {
+		/* The router could close the kept connection while it was idle: one more try on a new one */
+		int reused = (NULL != g_igd.soap);
+		int attempt;
+
+		for (attempt = 0; attempt < 1 + reused && EOK != rc; attempt++) {
+			igd_map_free(fresh);
+			fresh = igd_map_alloc(0);
+			TESTP_GO(fresh, err);
+			rc = mp_ports_mirror_read_pipelined_l(fresh, req);
+			if (EOK != rc) {
+				mp_soap_close(g_igd.soap);
+				g_igd.soap = NULL;
+			}
 		}
 
-		index++;
+		if (EOK != rc) {
+			DD("IGD doesn't handle pipelined requests, switch to serial mode\n");
+			g_igd.serial = 1;
+		}
+	}
 
-		/* A mapping found */
-		if (0 == strncmp(req->map_lan_address, local_host, strlen(local_host))) {
-			D("Asked mapping is already exists: ext port %s -> %s:%s\n", req->map_wan_port, req->map_lan_address, req->map_lan_port);
-
-			mapping = j_new();
-			if (NULL == mapping) {
-				DE("Can't allocate port_map_t\n");
-				upnp_req_str_t_free(req);
-				return (NULL);
-			}
+	if (EOK != rc) {
+		igd_map_free(fresh);
+		fresh = igd_map_alloc(0);
+		TESTP_GO(fresh, err);
+		rc = mp_ports_mirror_read_serial_l(fresh, req);
+	}
 
-			j_add_str(mapping, JK_PORT_INT, req->map_lan_port);
-			j_add_str(mapping, JK_PORT_EXT, req->map_wan_port);
-			j_add_str(mapping, JK_PROTOCOL, req->map_protocol);
-			j_arr_add(arr, mapping);
+	if (EOK != rc) goto err;
+	upnp_req_str_t_free(req);
 
-		}
+	lan = mp_ports_lan_build(fresh);
+	if (NULL == lan) {
+		igd_map_free(fresh);
+		return (EBAD);
+	}
+
+	pthread_rwlock_wrlock(&g_mirror.lock);
+	old = g_mirror.map;
+	old_lan = g_mirror.lan;
+	g_mirror.map = fresh;
+	g_mirror.lan = lan;
+	g_mirror.loaded = time(NULL);
+	g_mirror.drift = 0;
+	memset(g_mirror.taken, 0, sizeof(g_mirror.taken));
+	htype_each(fresh, index, slot) {
+		PORT_BIT_SET(g_mirror.taken[IPPROTO_UDP == slot->key.protocol], slot->key.port);
 	}
+	pthread_rwlock_unlock(&g_mirror.lock);
 
+	igd_map_free(old);
+	igd_lan_free(old_lan);
+	DD("Mirror loaded: %zu mappings\n", fresh->members);
+	return (EOK);
+err:
 	upnp_req_str_t_free(req);
-	return (mapping);
+	igd_map_free(fresh);
+	return (EBAD);
 }
 
-/* Test if internal port already mapped.
-   If it mapped, the external port returned */
-char *mp_ports_get_external_ip()
+/* Reload the mirror with the backend. The backend that doesn't answer is dropped:
+   the next call probes them again, maybe the router was replaced */
+static int mp_ports_mirror_load_l(void)
+{
+	if (EOK != mp_ports_backend_l()) return (EBAD);
+	if (EOK == g_backend->load_l()) return (EOK);
+
+	DD("%s doesn't answer, probe the backends again\n", g_backend->name);
+	g_backend = NULL;
+	return (EBAD);
+}
+
+/* Take the mirror read lock; the mirror loaded from the router if it was never loaded.
+   Returns EBAD (the lock is not taken) if the mirror can't be loaded */
+static int mp_ports_mirror_rlock(void)
+{
+	int rc = EOK;
+
+	pthread_rwlock_rdlock(&g_mirror.lock);
+	if (NULL != g_mirror.map) return (EOK);
+	pthread_rwlock_unlock(&g_mirror.lock);
+
+	pthread_mutex_lock(&g_igd.lock);
+	/* Someone could load it while we waited */
+	pthread_rwlock_rdlock(&g_mirror.lock);
+	if (NULL == g_mirror.map) {
+		pthread_rwlock_unlock(&g_mirror.lock);
+		rc = mp_ports_mirror_load_l();
+		if (EOK == rc) pthread_rwlock_rdlock(&g_mirror.lock);
+	}
+	pthread_mutex_unlock(&g_igd.lock);
+	return (rc);
+}
+
+/* Update the mirror after our own request. 'map' NULL means the mapping was removed */
+static void mp_ports_mirror_set_l(htype_port_t key, const port_map_t *map)
+{
+	port_map_t *slot;
+	uint64_t *taken = g_mirror.taken[IPPROTO_UDP == key.protocol];
+
+	pthread_rwlock_wrlock(&g_mirror.lock);
+	if (NULL == map) {
+		PORT_BIT_CLEAR(taken, key.port);
+	} else {
+		PORT_BIT_SET(taken, key.port);
+	}
+
+	if (NULL != g_mirror.map) {
+		port_map_t old;
+
+		if (0 == igd_map_del(g_mirror.map, &key, &old)) {
+			mp_ports_lan_del(g_mirror.lan, g_mirror.map, &old);
+		}
+		if (NULL != map) {
+			slot = igd_map_put(g_mirror.map, &key, NULL);
+			if (NULL != slot) *slot = *map;
+			if (NULL == slot || EOK != mp_ports_lan_add(g_mirror.lan, map)) g_mirror.drift = 1;
+		}
+	}
+	pthread_rwlock_unlock(&g_mirror.lock);
+}
+
+static void mp_ports_mirror_drift(void)
+{
+	DD("Router table differs from the mirror\n");
+	pthread_rwlock_wrlock(&g_mirror.lock);
+	g_mirror.drift = 1;
+	pthread_rwlock_unlock(&g_mirror.lock);
+}
+
+/* The router refused the external port as taken: the allocator must skip it */
+static void mp_ports_mirror_conflict(htype_port_t key)
+{
+	DD("Router table differs from the mirror: port %d is taken\n", key.port);
+	pthread_rwlock_wrlock(&g_mirror.lock);
+	PORT_BIT_SET(g_mirror.taken[IPPROTO_UDP == key.protocol], key.port);
+	g_mirror.drift = 1;
+	pthread_rwlock_unlock(&g_mirror.lock);
+}
+
+/* External port mapped to 'want' (internal port, protocol) on 'local_ip'; 0 if none.
+   The mirror lock must be held */
+static int mp_ports_mirror_ext_l(htype_port_t want, const struct in6_addr *local_ip)
+{
+	mp_lan_key_t key;
+	mp_lan_val_t *val;
+
+	mp_ports_lan_key(local_ip, want.port, want.protocol, &key);
+	val = igd_lan_find(g_mirror.lan, &key);
+	return (NULL != val ? val->port_external : 0);
+}
+
+static int mp_ports_mirror_loaded(void)
+{
+	int loaded;
+
+	pthread_rwlock_rdlock(&g_mirror.lock);
+	loaded = (NULL != g_mirror.map);
+	pthread_rwlock_unlock(&g_mirror.lock);
+	return (loaded);
+}
+
+/* External port allocator. The candidates come in fixed order: the internal port itself,
+   then the ports going from a point derived from (internal port, protocol), so different
+   services don't compete for the same ports. Ports known to be taken are skipped.
+   'cursor' keeps the position between calls, 0 to start. Returns 0 if no free port left */
+static int mp_ports_next_free(htype_port_t want, uint32_t *cursor)
+{
+	uint64_t *taken = g_mirror.taken[IPPROTO_UDP == want.protocol];
+	/* No seed: the same service starts from the same point after restart */
+	uint32_t start = htype_port_hash(&want, 0) % PORT_ALLOC_RANGE;
+	int port = 0;
+
+	pthread_rwlock_rdlock(&g_mirror.lock);
+	if (0 == *cursor) {
+		*cursor = 1;
+		if (want.port >= PORT_ALLOC_MIN && !PORT_BIT_TEST(taken, want.port)) {
+			port = want.port;
+		}
+	}
+
+	while (0 == port && *cursor <= PORT_ALLOC_RANGE) {
+		uint32_t candidate = PORT_ALLOC_MIN + (start + *cursor - 1) % PORT_ALLOC_RANGE;
+		(*cursor)++;
+		if (candidate != want.port && !PORT_BIT_TEST(taken, candidate)) {
+			port = (int)candidate;
+		}
+	}
+	pthread_rwlock_unlock(&g_mirror.lock);
+	return (port);
+}
+
+/* Keep the mirror fresh: reload it on schedule or when drift detected.
+   Keep our mappings alive: renew the leases, re-create the mappings the router lost.
+   The router is asked here, not in the message path */
+void *mp_ports_mirror_thread(void *arg __attribute__((unused)))
+{
+	control_t *ctl = ctl_get();
+	time_t retry = 0;
+	time_t renew = 0;
+	pthread_detach(pthread_self());
+
+	while (ST_STOP != ctl_status_get(ctl)) {
+		int reload;
+
+		pthread_rwlock_rdlock(&g_mirror.lock);
+		reload = g_mirror.drift || time(NULL) - g_mirror.loaded >= MIRROR_REFRESH_SEC;
+		pthread_rwlock_unlock(&g_mirror.lock);
+
+		/* Don't hammer the router (or SSDP, if there is no router) when it doesn't answer */
+		if (reload && time(NULL) >= retry) {
+			int rc;
+
+			pthread_mutex_lock(&g_igd.lock);
+			rc = mp_ports_mirror_load_l();
+			pthread_mutex_unlock(&g_igd.lock);
+
+			if (EOK != rc) {
+				DE("Can't refresh mirror of router table\n");
+				retry = time(NULL) + MIRROR_RETRY_SEC;
+			} else {
+				/* Fresh table: look for the lost mappings now */
+				renew = 0;
+			}
+		}
+
+		if (time(NULL) >= renew) {
+			json_t *moved = j_arr();
+
+			pthread_mutex_lock(&g_igd.lock);
+			renew = mp_ports_renew_l(moved);
+			pthread_mutex_unlock(&g_igd.lock);
+
+			if (NULL != moved) {
+				mp_ports_me_moved(moved);
+				j_rm(moved);
+			}
+		}
+		sleep(1);
+	}
+
+	D("Exit\n");
+	return (NULL);
+}
+
+/* Add / remove (if 'map' is NULL) mapping we keep */
+static void mp_ports_owned_set_l(htype_port_t key, const port_map_t *map)
+{
+	port_map_t *slot;
+
+	if (NULL == map) {
+		if (NULL != g_owned) igd_map_del(g_owned, &key, NULL);
+		return;
+	}
+
+	if (NULL == g_owned) g_owned = igd_map_alloc(0);
+	slot = (NULL != g_owned) ? igd_map_put(g_owned, &key, NULL) : NULL;
+	if (NULL == slot) {
+		DE("Can't keep the mapping for renewal\n");
+		return;
+	}
+	*slot = *map;
+}
+
+/* Our mapping is added (or renewed) on the router for 'lease' sec (0 is permanent):
+   put it into the mirror and keep it for renewal */
+static void mp_ports_mirror_added_l(htype_port_t key, int internal_port, int lease)
+{
+	port_map_t map;
+
+	memset(&map, 0, sizeof(map));
+	map.port_external = key.port;
+	map.port_internal = (uint16_t)internal_port;
+	map.protocol = key.protocol;
+	map.expires = (lease > 0) ? time(NULL) + lease : 0;
+	snprintf(map.description, sizeof(map.description), "%s", MP_PORTS_DESC);
+	if (EOK != mp_ports_str2ip(g_igd.lan_address, &map.local_ip)) {
+		DE("Bad local address of IGD session: %s\n", g_igd.lan_address);
+	}
+	mp_ports_mirror_set_l(key, &map);
+	mp_ports_owned_set_l(key, &map);
+}
+
+/* Returns UPnP error code, UPNPCOMMAND_SUCCESS if the port mapped */
+static int mp_ports_remap_port_l(const int external_port, const int internal_port, const char *protocol)
+{
+	int error = 0;
+	char s_ext[PORT_STR_LEN];
+	char s_int[PORT_STR_LEN];
+	char s_lease[PORT_STR_LEN];
+	htype_port_t key;
+
+	if (EOK != ctl_port_key(external_port, protocol, &key) || internal_port < 1 || internal_port > 65535) {
+		DE("Bad mapping: %d -> %d %s\n", external_port, internal_port, protocol);
+		return (UPNPCOMMAND_INVALID_ARGS);
+	}
+
+	snprintf(s_ext, PORT_STR_LEN, "%d", external_port);
+	snprintf(s_int, PORT_STR_LEN, "%d", internal_port);
+
+	do {
+		snprintf(s_lease, PORT_STR_LEN, "%d", mp_ports_lease_l());
+		IGD_CALL_L(error, UPNP_AddPortMapping(
+				IGD_URL,
+				IGD_SERVICE,
+				s_ext,  // external (WAN) port requested
+				s_int,  // internal (LAN) port to which packets will be redirected
+				g_igd.lan_address, // internal (LAN) address to which packets will be redirected
+				MP_PORTS_DESC, // text description to indicate why or who is responsible for the port mapping
+				protocol, // protocol must be either TCP or UDP
+				NULL, // remote (peer) host address or nullptr for no restriction
+				s_lease)); // port map lease duration (in seconds) or zero for "as long as possible"
+	} while (mp_ports_lease_refused_l(error));
+
+	if (0 != error) {
+		DE("Can't map port %d -> %d: error %d\n", external_port, internal_port, error);
+		/* The mirror said the port is free */
+		if (UPNP_ERR_CONFLICT == error) mp_ports_mirror_conflict(key);
+		return (error);
+	}
+
+	DDD("Asked mapping done\n");
+	mp_ports_mirror_added_l(key, internal_port, mp_ports_lease_l());
+	return (UPNPCOMMAND_SUCCESS);
+}
+
+/* IGD v2 AddAnyPortMapping: the router itself picks a free port if 'port' is taken,
+   so one request is enough even on a busy router. The reserved port written back into 'port'.
+   Returns UPnP error code */
+static int mp_ports_remap_any_l(int *port, const int internal_port, const char *protocol)
 {
-	struct UPNPDev *upnp_dev = NULL;
+	int error = 0;
+	char s_ext[PORT_STR_LEN];
+	char s_int[PORT_STR_LEN];
+	char s_lease[PORT_STR_LEN];
+	char reserved[PORT_STR_LEN];
+	htype_port_t key;
+
+	snprintf(s_ext, PORT_STR_LEN, "%d", *port);
+	snprintf(s_int, PORT_STR_LEN, "%d", internal_port);
+	reserved[0] = '\0';
+
+	do {
+		snprintf(s_lease, PORT_STR_LEN, "%d", mp_ports_lease_l());
+		IGD_CALL_L(error, UPNP_AddAnyPortMapping(
+				IGD_URL,
+				IGD_SERVICE,
+				s_ext,
+				s_int,
+				g_igd.lan_address,
+				MP_PORTS_DESC,
+				protocol,
+				NULL,
+				s_lease,
+				reserved));
+	} while (mp_ports_lease_refused_l(error));
+
+	if (UPNP_ERR_INVALID_ACTION == error || UPNP_ERR_NOT_IMPLEMENTED == error) {
+		DD("IGD doesn't implement AddAnyPortMapping\n");
+		g_igd.no_any = 1;
+	}
+
+	if (0 != error) return (error);
+
+	if (EOK != ctl_port_key(mp_ports_str2port(reserved), protocol, &key)) {
+		DE("IGD reserved bad port: %s\n", reserved);
+		mp_ports_mirror_drift();
+		return (UPNPCOMMAND_UNKNOWN_ERROR);
+	}
+
+	mp_ports_mirror_added_l(key, internal_port, mp_ports_lease_l());
+	*port = key.port;
+	return (UPNPCOMMAND_SUCCESS);
+}
+
+/* Send upnp request to router, ask to remap "external_port" of the router
+   to "internal_port" on this machine.
+   Always UPnP: NAT-PMP / PCP gateway takes the external port only as a suggestion */
+int mp_ports_remap_port(const int external_port, const int internal_port, const char *protocol)
+{
+	int rc;
+
+	TESTP(protocol, EBAD);
+
+	pthread_mutex_lock(&g_igd.lock);
+	rc = mp_ports_remap_port_l(external_port, internal_port, protocol);
+	pthread_mutex_unlock(&g_igd.lock);
+	return (UPNPCOMMAND_SUCCESS == rc ? EOK : EBAD);
+}
+
+/* Valid backend session and loaded mirror: the allocator works on the ports known from the mirror */
+static int mp_ports_session_l(void)
+{
+	if (EOK != mp_ports_backend_l()) return (EBAD);
+
+	if (!mp_ports_mirror_loaded() && EOK != mp_ports_mirror_load_l()) {
+		DE("Can't load router table, the ports taken are unknown\n");
+	}
+	return (EOK);
+}
+
+/* Map 'want' (internal port, protocol) to an external port from the allocator.
+   Returns UPnP error code; the mapped port written into 'port' */
+static int mp_ports_alloc_l(htype_port_t want, int *port)
+{
+	const char *protocol = mp_ports_proto_str(want.protocol);
+	uint32_t cursor = 0;
+	int error = UPNPCOMMAND_UNKNOWN_ERROR;
+	int i;
+
+	*port = mp_ports_next_free(want, &cursor);
+
+	/* Only IGD v2 has AddAnyPortMapping */
+	if (0 != *port && 0 == g_igd.no_any && NULL != strstr(IGD_SERVICE, "Connection:2")) {
+		error = mp_ports_remap_any_l(port, want.port, protocol);
+	}
+
+	for (i = 0; UPNPCOMMAND_SUCCESS != error && 0 != *port && i < PORT_ALLOC_TRIES; i++) {
+		error = mp_ports_remap_port_l(*port, want.port, protocol);
+		/* Taken by someone we don't know about: it is marked now, take the next one.
+		   Any other error will be the same for another port */
+		if (UPNP_ERR_CONFLICT != error) break;
+		*port = mp_ports_next_free(want, &cursor);
+	}
+	return (error);
+}
 
-	struct UPNPUrls upnp_urls;
-	struct IGDdatas upnp_data;
+/* Send upnp request to router, ask to remap "internal_port"
+   to any external port on the router.
+   The port is taken from the allocator, see mp_ports_next_free().
+   Returns NULL if no port could be mapped */
+json_t *mp_ports_remap_any(int internal_port, const char *protocol)
+{
+	htype_port_t want;
+	int port = 0;
+	int error = UPNPCOMMAND_UNKNOWN_ERROR;
+
+	TESTP_MES(protocol, NULL, "Got NULL\n");
+	if (EOK != ctl_port_key(internal_port, protocol, &want)) return (NULL);
+
+	pthread_mutex_lock(&g_igd.lock);
+	if (EOK == mp_ports_session_l()) {
+		error = g_backend->map_l(want, &port);
+	}
+	pthread_mutex_unlock(&g_igd.lock);
+
+	if (UPNPCOMMAND_SUCCESS != error) {
+		DE("Can't map any port to %d %s: error %d\n", internal_port, protocol, error);
+		return (NULL);
+	}
+
+	DD("Mapped port: %d -> %d\n", port, internal_port);
+	return (mp_ports_mapping(internal_port, port, protocol));
+}
+
+#if 0 /* SEB 28/04/2020 16:46  */
+r = UPNP_AddAnyPortMapping(urls->controlURL, data->first.servicetype,
+						   eport, iport, iaddr, description,
+						   proto, remoteHost, leaseDuration, reservedPort);
+if(r==UPNPCOMMAND_SUCCESS)
+eport = reservedPort;
+else
+printf("AddAnyPortMapping(%s, %s, %s) failed with code %d (%s)\n",
+	   eport, iport, iaddr, r, strupnperror(r));
+
+#endif /* SEB 28/04/2020 16:46 */
+
+/* Remove mapping of external port 'key' from the router and the mirror. Returns UPnP error code */
+static int mp_ports_unmap_port_l(htype_port_t key)
+{
+	int error = 0;
+	char s_ext[PORT_STR_LEN];
+
+	snprintf(s_ext, PORT_STR_LEN, "%d", key.port);
+
+	// remove port mapping from WAN port 12345 to local host port 24680
+	IGD_CALL_L(error, UPNP_DeletePortMapping(
+			IGD_URL,
+			IGD_SERVICE,
+			s_ext,  // external (WAN) port requested
+			mp_ports_proto_str(key.protocol), // protocol must be either TCP or UDP
+			NULL)); // remote (peer) host address or nullptr for no restriction
+
+	/* Removed, or it was not there at all: anyway it is not mapped now */
+	if (0 == error || UPNP_ERR_NO_SUCH_ENTRY == error) {
+		mp_ports_mirror_set_l(key, NULL);
+		mp_ports_owned_set_l(key, NULL);
+	}
+	if (UPNP_ERR_NO_SUCH_ENTRY == error) mp_ports_mirror_drift();
+	return (error);
+}
+
+int mp_ports_unmap_port(int internal_port, int external_port, const char *protocol)
+{
+	int error = 0;
+	htype_port_t key;
+
+	TESTP(protocol, EBAD);
+	if (EOK != ctl_port_key(external_port, protocol, &key)) return (EBAD);
+
+	DD("internal_port = %d, external_port = %d,  protocol = %s\n", internal_port, external_port, protocol);
+
+	pthread_mutex_lock(&g_igd.lock);
+	error = (EOK == mp_ports_backend_l()) ? g_backend->unmap_l(key, internal_port) : UPNPCOMMAND_UNKNOWN_ERROR;
+	pthread_mutex_unlock(&g_igd.lock);
+
+	if (0 != error) {
+		DE("Can't delete port %d\n", external_port);
+		return (EBAD);
+	}
+
+	return (0);
+}
+
+/*** Batch requests ***/
+
+/* Build SOAP arguments of the request for one batch item */
+typedef void (*mp_ports_args_f)(const mp_ports_batch_t *item, char *args, size_t size);
+
+static void mp_ports_add_args(const mp_ports_batch_t *item, char *args, size_t size)
+{
+	snprintf(args, size,
+			 "<NewRemoteHost></NewRemoteHost>"
+			 "<NewExternalPort>%d</NewExternalPort>"
+			 "<NewProtocol>%s</NewProtocol>"
+			 "<NewInternalPort>%d</NewInternalPort>"
+			 "<NewInternalClient>%s</NewInternalClient>"
+			 "<NewEnabled>1</NewEnabled>"
+			 "<NewPortMappingDescription>%s</NewPortMappingDescription>"
+			 "<NewLeaseDuration>%d</NewLeaseDuration>",
+			 item->port_ext, mp_ports_proto_str(item->want.protocol), item->port_int, g_igd.lan_address, MP_PORTS_DESC,
+			 mp_ports_lease_l());
+}
+
+static void mp_ports_del_args(const mp_ports_batch_t *item, char *args, size_t size)
+{
+	snprintf(args, size,
+			 "<NewRemoteHost></NewRemoteHost>"
+			 "<NewExternalPort>%d</NewExternalPort>"
+			 "<NewProtocol>%s</NewProtocol>",
+			 item->port_ext, mp_ports_proto_str(item->want.protocol));
+}
+
+static size_t mp_ports_batch_pending(const mp_ports_batch_t *items, size_t num, size_t from)
+{
+	while (from < num && UPNPCOMMAND_HTTP_ERROR != items[from].error) from++;
+	return (from);
+}
+
+/* Send 'action' for every not answered item over the kept connection, IGD_PIPELINE requests in flight.
+   The items left without answer (the connection broken) keep UPNPCOMMAND_HTTP_ERROR:
+   the caller sends them again with serial miniupnpc requests */
+static void mp_ports_pipeline_l(const char *action, mp_ports_batch_t *items, size_t num, mp_ports_args_f args_f)
+{
+	char args[512];
+	size_t sent = mp_ports_batch_pending(items, num, 0);
+	size_t recv = sent;
+	size_t answered = 0;
+	int reused = (NULL != g_igd.soap);
+
+	if (g_igd.serial || sent == num) return;
+
+	if (NULL == g_igd.soap) g_igd.soap = mp_soap_open(IGD_URL, IGD_SERVICE);
+	if (NULL == g_igd.soap) return;
+
+	while (recv < num) {
+		buf_t *body;
+		int status = 0;
+
+		while (sent < num && mp_soap_in_flight(g_igd.soap) < IGD_PIPELINE) {
+			args_f(&items[sent], args, sizeof(args));
+			if (EOK != mp_soap_send(g_igd.soap, action, args)) goto broken;
+			sent = mp_ports_batch_pending(items, num, sent + 1);
+		}
+
+		body = mp_soap_recv(g_igd.soap, &status);
+		if (NULL == body) goto broken;
+
+		/* Not a SOAP fault is UPNPCOMMAND_UNKNOWN_ERROR */
+		items[recv].error = (200 == status) ? UPNPCOMMAND_SUCCESS : mp_soap_error(body);
+		buf_free(body);
+		answered++;
+		recv = mp_ports_batch_pending(items, num, recv + 1);
+	}
+	return;
+
+broken:
+	mp_soap_close(g_igd.soap);
+	g_igd.soap = NULL;
+	/* A new connection and not a single answer: the router doesn't handle pipelined requests */
+	if (!reused && 0 == answered) {
+		DD("IGD doesn't handle pipelined requests, switch to serial mode\n");
+		g_igd.serial = 1;
+	}
+}
+
+/* Read batch items from JSON array of {JK_PORT_INT, JK_PORT_EXT, JK_PROTOCOL}.
+   'ext' set: the item keyed by the external port. Returns the number of items, 0 on an error */
+static size_t mp_ports_batch_read(json_t *ports, mp_ports_batch_t *items, int ext)
+{
+	json_t *val;
+	size_t index;
+
+	json_array_foreach(ports, index, val) {
+		mp_ports_batch_t *item = &items[index];
+
+		item->port_int = ctl_port_get(val, JK_PORT_INT);
+		item->port_ext = ctl_port_get(val, JK_PORT_EXT);
+		item->port_old = 0;
+		item->todo = 0;
+		item->reserved = 0;
+		item->error = UPNPCOMMAND_HTTP_ERROR;
+		if (EOK != ctl_port_key(ext ? item->port_ext : item->port_int, j_find_ref(val, JK_PROTOCOL), &item->want)) {
+			DE("Bad port in batch, item %zu\n", index);
+			return (0);
+		}
+	}
+	return (index);
+}
+
+/* Build the batch result: array of {JK_PORT_INT, JK_PORT_EXT, JK_PROTOCOL, JK_STATUS};
+   JK_PORT_EXT is set only for the done items */
+static json_t *mp_ports_batch_result(const mp_ports_batch_t *items, size_t num)
+{
+	json_t *arr = j_arr();
+	size_t i;
+
+	TESTP_MES(arr, NULL, "Can't allocate JSON array");
+
+	for (i = 0; i < num; i++) {
+		const mp_ports_batch_t *item = &items[i];
+		int done = (UPNPCOMMAND_SUCCESS == item->error);
+		json_t *res = mp_ports_mapping(item->port_int, done ? item->port_ext : 0, mp_ports_proto_str(item->want.protocol));
+
+		if (NULL == res || EOK != j_add_str(res, JK_STATUS, done ? JV_OK : JV_BAD)) {
+			DE("Can't build batch result\n");
+			j_rm(res);
+			j_rm(arr);
+			return (NULL);
+		}
+		if (!done) j_rm_key(res, JK_PORT_EXT);
+		j_arr_add(arr, res);
+	}
+	return (arr);
+}
+
+/* Send AddPortMapping for the batch items to do and finish them one by one:
+   the conflicts go to the allocator, not answered requests are sent again with miniupnpc */
+static void mp_ports_add_batch_l(mp_ports_batch_t *items, size_t num)
+{
+	size_t i;
+
+	mp_ports_pipeline_l("AddPortMapping", items, num, mp_ports_add_args);
+
+	for (i = 0; i < num; i++) {
+		mp_ports_batch_t *item = &items[i];
+		const char *protocol = mp_ports_proto_str(item->want.protocol);
+		htype_port_t key;
+
+		if (!item->todo) continue;
+
+		key.port = (uint16_t)item->port_ext;
+		key.protocol = item->want.protocol;
+
+		/* Sent with finite lease: mp_ports_remap_port_l() sends it again as permanent */
+		if (UPNP_ERR_ONLY_PERMANENT == item->error) {
+			mp_ports_lease_refused_l(item->error);
+			item->error = UPNPCOMMAND_HTTP_ERROR;
+		}
+
+		/* Not answered: send it again, one by one */
+		if (UPNPCOMMAND_HTTP_ERROR == item->error) {
+			item->error = mp_ports_remap_port_l(item->port_ext, item->port_int, protocol);
+		} else if (UPNPCOMMAND_SUCCESS == item->error) {
+			mp_ports_mirror_added_l(key, item->port_int, mp_ports_lease_l());
+		} else if (UPNP_ERR_CONFLICT == item->error) {
+			mp_ports_mirror_conflict(key);
+		}
+
+		/* Taken by someone we don't know about: the allocator takes it from here */
+		if (UPNP_ERR_CONFLICT == item->error) {
+			item->error = mp_ports_alloc_l(item->want, &item->port_ext);
+		} else if (UPNPCOMMAND_SUCCESS != item->error && item->reserved) {
+			/* Release the candidate */
+			mp_ports_mirror_set_l(key, NULL);
+		}
+
+		if (UPNPCOMMAND_SUCCESS != item->error) {
+			DE("Can't map port %d %s: error %d\n", item->port_int, protocol, item->error);
+		}
+	}
+}
+
+/* Send DeletePortMapping for the batch items; not answered requests are sent again with miniupnpc */
+static void mp_ports_del_batch_l(mp_ports_batch_t *items, size_t num)
+{
+	size_t i;
+
+	mp_ports_pipeline_l("DeletePortMapping", items, num, mp_ports_del_args);
+
+	for (i = 0; i < num; i++) {
+		mp_ports_batch_t *item = &items[i];
+
+		if (UPNPCOMMAND_HTTP_ERROR == item->error) {
+			item->error = mp_ports_unmap_port_l(item->want);
+		} else if (UPNPCOMMAND_SUCCESS == item->error || UPNP_ERR_NO_SUCH_ENTRY == item->error) {
+			mp_ports_mirror_set_l(item->want, NULL);
+			mp_ports_owned_set_l(item->want, NULL);
+			if (UPNP_ERR_NO_SUCH_ENTRY == item->error) mp_ports_mirror_drift();
+		}
+
+		/* Not there at all: anyway it is not mapped now */
+		if (UPNP_ERR_NO_SUCH_ENTRY == item->error) item->error = UPNPCOMMAND_SUCCESS;
+	}
+}
+
+/* Map a batch of internal ports: JSON array of {JK_PORT_INT, JK_PROTOCOL}.
+   All the ports get their external ports from the allocator and the requests are
+   sent at once (pipelined over one IGD session, or NAT-PMP datagrams):
+   a batch costs about one round trip to the router.
+   Already mapped ports are answered from the mirror.
+   Returns array of {JK_PORT_INT, JK_PORT_EXT, JK_PROTOCOL, JK_STATUS}, NULL on an error */
+json_t *mp_ports_remap_batch(json_t *ports)
+{
+	mp_ports_batch_t *items = NULL;
+	json_t *res = NULL;
+	struct in6_addr lan_ip;
+	size_t num;
+	size_t i;
+
+	TESTP(ports, NULL);
+	num = j_count(ports);
+	if (0 == num || num > PORTS_BATCH_MAX) {
+		DE("Bad batch size: %zu\n", num);
+		return (NULL);
+	}
 
+	items = zmalloc(num * sizeof(mp_ports_batch_t));
+	TESTP_MES(items, NULL, "Can't allocate batch");
+	if (num != mp_ports_batch_read(ports, items, 0)) goto end;
+
+	pthread_mutex_lock(&g_igd.lock);
+	if (EOK != mp_ports_session_l() || EOK != mp_ports_str2ip(g_igd.lan_address, &lan_ip)) {
+		pthread_mutex_unlock(&g_igd.lock);
+		for (i = 0; i < num; i++) items[i].error = UPNPCOMMAND_UNKNOWN_ERROR;
+		res = mp_ports_batch_result(items, num);
+		goto end;
+	}
+
+	/* Pick the candidates; they are marked as taken, so the items don't compete for the same port */
+	for (i = 0; i < num; i++) {
+		mp_ports_batch_t *item = &items[i];
+		uint32_t cursor = 0;
+		htype_port_t key;
+
+		pthread_rwlock_rdlock(&g_mirror.lock);
+		item->port_ext = (NULL != g_mirror.map) ? mp_ports_mirror_ext_l(item->want, &lan_ip) : 0;
+		pthread_rwlock_unlock(&g_mirror.lock);
+		if (0 != item->port_ext) {
+			item->error = UPNPCOMMAND_SUCCESS;
+			continue;
+		}
+
+		item->port_ext = mp_ports_next_free(item->want, &cursor);
+		if (0 == item->port_ext) {
+			item->error = UPNPCOMMAND_UNKNOWN_ERROR;
+			continue;
+		}
+		key.port = (uint16_t)item->port_ext;
+		key.protocol = item->want.protocol;
+		pthread_rwlock_wrlock(&g_mirror.lock);
+		PORT_BIT_SET(g_mirror.taken[IPPROTO_UDP == key.protocol], key.port);
+		pthread_rwlock_unlock(&g_mirror.lock);
+		item->todo = 1;
+		item->reserved = 1;
+	}
+
+	g_backend->map_batch_l(items, num);
+	pthread_mutex_unlock(&g_igd.lock);
+
+	res = mp_ports_batch_result(items, num);
+end:
+	zfree(items);
+	return (res);
+}
+
+/* Remove a batch of mappings: JSON array of {JK_PORT_INT, JK_PORT_EXT, JK_PROTOCOL}.
+   The requests are sent at once, like in mp_ports_remap_batch().
+   Returns array of {JK_PORT_INT, JK_PORT_EXT, JK_PROTOCOL, JK_STATUS}, NULL on an error */
+json_t *mp_ports_unmap_batch(json_t *ports)
+{
+	mp_ports_batch_t *items = NULL;
+	json_t *res = NULL;
+	size_t num;
+	size_t i;
+
+	TESTP(ports, NULL);
+	num = j_count(ports);
+	if (0 == num || num > PORTS_BATCH_MAX) {
+		DE("Bad batch size: %zu\n", num);
+		return (NULL);
+	}
+
+	items = zmalloc(num * sizeof(mp_ports_batch_t));
+	TESTP_MES(items, NULL, "Can't allocate batch");
+	if (num != mp_ports_batch_read(ports, items, 1)) goto end;
+
+	pthread_mutex_lock(&g_igd.lock);
+	if (EOK == mp_ports_backend_l()) {
+		for (i = 0; i < num; i++) items[i].todo = 1;
+		g_backend->unmap_batch_l(items, num);
+	}
+	pthread_mutex_unlock(&g_igd.lock);
+
+	for (i = 0; i < num; i++) {
+		if (UPNPCOMMAND_SUCCESS != items[i].error) {
+			DE("Can't delete port %d: error %d\n", items[i].port_ext, items[i].error);
+		}
+	}
+
+	res = mp_ports_batch_result(items, num);
+end:
+	zfree(items);
+	return (res);
+}
+
+/*** Lease renewal ***/
+
+/* Renew our mappings which leases run out soon and re-create the ones the router lost
+   (rebooted, or the lease ran out while we couldn't reach it).
+   The mappings moved to another external port (the old one is taken by someone else now)
+   are added to 'moved' as {JK_PORT_INT, JK_PORT_EXT, JK_PROTOCOL}.
+   Returns when it should run again */
+static time_t mp_ports_renew_l(json_t *moved)
+{
+	time_t now = time(NULL);
+	time_t next = now + MIRROR_REFRESH_SEC;
+	time_t next_batch = next;
+	mp_ports_batch_t *items = NULL;
+	igd_map_slot_t *slot;
+	size_t index;
+	size_t num = 0;
+	size_t i;
+	int due = 0;
+
+	if (NULL == g_owned || 0 == g_owned->members) return (next);
+
+	items = zmalloc(g_owned->members * sizeof(mp_ports_batch_t));
+	TESTP_MES(items, now + MIRROR_RETRY_SEC, "Can't allocate renewal batch");
+
+	pthread_rwlock_rdlock(&g_mirror.lock);
+	htype_each(g_owned, index, slot) {
+		port_map_t *own = &slot->val;
+		port_map_t *map = (NULL != g_mirror.map) ? igd_map_find(g_mirror.map, &slot->key) : NULL;
+		/* Not in the router table, or it is someone else's mapping now */
+		int lost = (NULL != g_mirror.map &&
+					(NULL == map || map->port_internal != own->port_internal ||
+					 0 != memcmp(&map->local_ip, &own->local_ip, sizeof(own->local_ip))));
+		time_t renew = own->expires - RENEW_BEFORE_SEC;
+
+		if (!lost && (0 == own->expires || renew > now + RENEW_BATCH_SEC)) {
+			if (0 != own->expires && renew < next) next = renew;
+			continue;
+		}
+
+		if (lost) {
+			DD("Mapping %d -> %d %s is lost, re-create it\n", own->port_external, own->port_internal,
+			   mp_ports_proto_str(own->protocol));
+			due = 1;
+		} else if (renew <= now) {
+			due = 1;
+		} else if (renew < next_batch) {
+			next_batch = renew;
+		}
+
+		items[num].want.port = own->port_internal;
+		items[num].want.protocol = own->protocol;
+		items[num].port_int = own->port_internal;
+		items[num].port_ext = own->port_external;
+		items[num].port_old = own->port_external;
+		items[num].todo = 1;
+		items[num].reserved = 0;
+		items[num].error = UPNPCOMMAND_HTTP_ERROR;
+		num++;
+	}
+	pthread_rwlock_unlock(&g_mirror.lock);
+
+	/* Nothing runs out yet: the ones close to it are renewed together later */
+	if (!due) {
+		if (next_batch < next) next = next_batch;
+		goto end;
+	}
+
+	if (EOK != mp_ports_backend_l()) {
+		next = now + MIRROR_RETRY_SEC;
+		goto end;
+	}
+
+	DD("Renew %zu mappings\n", num);
+	g_backend->map_batch_l(items, num);
+
+	for (i = 0; i < num; i++) {
+		mp_ports_batch_t *item = &items[i];
+		htype_port_t old;
+		json_t *mapping;
+
+		/* Still kept: tried again later */
+		if (UPNPCOMMAND_SUCCESS != item->error) {
+			if (now + MIRROR_RETRY_SEC < next) next = now + MIRROR_RETRY_SEC;
+			continue;
+		}
+
+		if (item->port_ext == item->port_old) continue;
+
+		old.port = (uint16_t)item->port_old;
+		old.protocol = item->want.protocol;
+		mp_ports_owned_set_l(old, NULL);
+		D("Mapping of %d %s moved: %d -> %d\n", item->port_int, mp_ports_proto_str(old.protocol),
+		  item->port_old, item->port_ext);
+
+		mapping = mp_ports_mapping(item->port_int, item->port_ext, mp_ports_proto_str(old.protocol));
+		if (NULL == mapping || EOK != j_arr_add(moved, mapping)) {
+			DE("Can't report moved mapping\n");
+			if (NULL != mapping) j_rm(mapping);
+		}
+	}
+end:
+	zfree(items);
+	return (next);
+}
+
+/* Our mappings moved to other external ports: fix 'me' and tell the others */
+static void mp_ports_me_moved(json_t *moved)
+{
+	control_t *ctl = ctl_get();
+	json_t *ports = NULL;
+	json_t *val = NULL;
+	json_t *port = NULL;
+	size_t i;
+	size_t j;
+
+	if (0 == j_count(moved)) return;
+
+	ctl_lock(ctl, CTL_LOCK_ME);
+	ports = j_find_j(ctl->me, "ports");
+	json_array_foreach(moved, i, val) {
+		json_array_foreach(ports, j, port) {
+			if (ctl_port_get(port, JK_PORT_INT) == ctl_port_get(val, JK_PORT_INT) &&
+				EOK == j_test(port, JK_PROTOCOL, j_find_ref(val, JK_PROTOCOL))) {
+				j_add_int(port, JK_PORT_EXT, ctl_port_get(val, JK_PORT_EXT));
+			}
+		}
+	}
+	ctl_ports_rebuild_l(ctl);
+	ctl_snap_me_publish(ctl);
+	ctl_unlock(ctl, CTL_LOCK_ME);
+
+	mp_main_send_keepalive();
+}
+
+/*** Backends ***/
+
+/* UPnP IGD */
+
+static int mp_ports_upnp_unmap_l(htype_port_t key, int port_int __attribute__((unused)))
+{
+	return (mp_ports_unmap_port_l(key));
+}
+
+static int mp_ports_upnp_external_ip_l(char *ip, size_t size)
+{
+	/* miniupnpc writes up to 16 bytes */
+	char wan_address[IP_STR_LEN];
+	int error;
+
+	IGD_CALL_L(error, UPNP_GetExternalIPAddress(IGD_URL, IGD_SERVICE, wan_address));
+	if (0 != error) return (EBAD);
+
+	snprintf(ip, size, "%s", wan_address);
+	return (EOK);
+}
+
+static const mp_ports_backend_t g_backend_upnp = {
+	.name = "UPnP IGD",
+	.session_l = mp_ports_igd_get_l,
+	.load_l = mp_ports_upnp_load_l,
+	.map_l = mp_ports_alloc_l,
+	.unmap_l = mp_ports_upnp_unmap_l,
+	.map_batch_l = mp_ports_add_batch_l,
+	.unmap_batch_l = mp_ports_del_batch_l,
+	.external_ip_l = mp_ports_upnp_external_ip_l,
+};
+
+/* NAT-PMP / PCP */
+
+static int mp_ports_natpmp_session_l(void)
+{
+	return (NULL != g_nat ? EOK : EBAD);
+}
+
+/* NAT-PMP / PCP can't list the gateway table: the mirror holds only our own mappings.
+   The gateway answers with its epoch; if it restarted, our mappings are gone:
+   the mirror is emptied and the renewal re-creates them */
+static int mp_ports_natpmp_load_l(void)
+{
+	igd_map_t *fresh = NULL;
+	igd_map_t *old = NULL;
+	igd_lan_t *lan = NULL;
+	igd_lan_t *old_lan = NULL;
+	int restarted;
+
+	if (EOK != mp_natpmp_probe(g_nat)) return (EBAD);
+	restarted = mp_natpmp_restarted(g_nat);
+
+	if (restarted || !mp_ports_mirror_loaded()) {
+		fresh = igd_map_alloc(0);
+		TESTP_MES(fresh, EBAD, "Can't allocate mirror");
+		lan = igd_lan_alloc(0);
+		if (NULL == lan) {
+			DE("Can't allocate mirror index\n");
+			igd_map_free(fresh);
+			return (EBAD);
+		}
+	}
+
+	pthread_rwlock_wrlock(&g_mirror.lock);
+	if (NULL != fresh) {
+		old = g_mirror.map;
+		old_lan = g_mirror.lan;
+		g_mirror.map = fresh;
+		g_mirror.lan = lan;
+		memset(g_mirror.taken, 0, sizeof(g_mirror.taken));
+	}
+	g_mirror.loaded = time(NULL);
+	g_mirror.drift = 0;
+	pthread_rwlock_unlock(&g_mirror.lock);
+
+	if (restarted) DD("Gateway restarted, our mappings are lost\n");
+	igd_map_free(old);
+	igd_lan_free(old_lan);
+	return (EOK);
+}
+
+/* Send the batch items to do to the gateway at once; 'lifetime' 0 removes the mappings.
+   The gateway picks the external port itself, the allocator candidate is only a suggestion */
+static void mp_ports_natpmp_batch_l(mp_ports_batch_t *items, size_t num, uint32_t lifetime)
+{
+	mp_natpmp_map_t *maps = zmalloc(num * sizeof(mp_natpmp_map_t));
+	size_t *at = zmalloc(num * sizeof(size_t));
+	size_t todo = 0;
+	size_t i;
+
+	if (NULL == maps || NULL == at) {
+		DE("Can't allocate NAT-PMP batch\n");
+		goto end;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (!items[i].todo) continue;
+
+		maps[todo].protocol = items[i].want.protocol;
+		maps[todo].port_int = (uint16_t)items[i].port_int;
+		/* The mapping is removed by the internal port */
+		maps[todo].port_ext = (0 == lifetime) ? 0 : (uint16_t)items[i].port_ext;
+		maps[todo].lifetime = lifetime;
+		at[todo++] = i;
+	}
+
+	mp_natpmp_map(g_nat, maps, todo);
+
+	for (i = 0; i < todo; i++) {
+		mp_ports_batch_t *item = &items[at[i]];
+		mp_natpmp_map_t *map = &maps[i];
+		htype_port_t key;
+
+		key.port = (uint16_t)item->port_ext;
+		key.protocol = item->want.protocol;
+
+		if (MP_NATPMP_SUCCESS != map->result) {
+			item->error = (MP_NATPMP_NO_ANSWER == map->result) ? UPNPCOMMAND_HTTP_ERROR : UPNPCOMMAND_UNKNOWN_ERROR;
+			/* Release the candidate */
+			if (item->reserved) mp_ports_mirror_set_l(key, NULL);
+			DE("Gateway refused port %d %s: result %d\n", item->port_int, mp_ports_proto_str(key.protocol), map->result);
+			continue;
+		}
+		item->error = UPNPCOMMAND_SUCCESS;
+
+		if (0 == lifetime) {
+			mp_ports_mirror_set_l(key, NULL);
+			mp_ports_owned_set_l(key, NULL);
+			continue;
+		}
+
+		/* Another port assigned: the candidate (or the old port on renewal) is not ours */
+		if (map->port_ext != item->port_ext && (item->reserved || 0 != item->port_old)) {
+			mp_ports_mirror_set_l(key, NULL);
+		}
+		key.port = map->port_ext;
+		item->port_ext = map->port_ext;
+		mp_ports_mirror_added_l(key, item->port_int, (int)map->lifetime);
+	}
+end:
+	zfree(maps);
+	zfree(at);
+}
+
+static void mp_ports_natpmp_add_batch_l(mp_ports_batch_t *items, size_t num)
+{
+	mp_ports_natpmp_batch_l(items, num, MP_PORTS_LEASE_SEC);
+}
+
+static void mp_ports_natpmp_del_batch_l(mp_ports_batch_t *items, size_t num)
+{
+	mp_ports_natpmp_batch_l(items, num, 0);
+}
+
+static int mp_ports_natpmp_map_l(htype_port_t want, int *port)
+{
+	mp_ports_batch_t item;
+	uint32_t cursor = 0;
+
+	memset(&item, 0, sizeof(item));
+	item.want = want;
+	item.port_int = want.port;
+	item.port_ext = mp_ports_next_free(want, &cursor);
+	item.todo = 1;
+	item.error = UPNPCOMMAND_HTTP_ERROR;
+
+	mp_ports_natpmp_add_batch_l(&item, 1);
+	*port = item.port_ext;
+	return (item.error);
+}
+
+static int mp_ports_natpmp_unmap_l(htype_port_t key, int port_int)
+{
+	mp_ports_batch_t item;
+
+	memset(&item, 0, sizeof(item));
+	item.want = key;
+	item.port_int = port_int;
+	item.port_ext = key.port;
+	item.todo = 1;
+	item.error = UPNPCOMMAND_HTTP_ERROR;
+
+	mp_ports_natpmp_del_batch_l(&item, 1);
+	return (item.error);
+}
+
+static int mp_ports_natpmp_external_ip_l(char *ip, size_t size)
+{
+	return (mp_natpmp_external_ip(g_nat, ip, size));
+}
+
+static const mp_ports_backend_t g_backend_natpmp = {
+	.name = "NAT-PMP / PCP",
+	.session_l = mp_ports_natpmp_session_l,
+	.load_l = mp_ports_natpmp_load_l,
+	.map_l = mp_ports_natpmp_map_l,
+	.unmap_l = mp_ports_natpmp_unmap_l,
+	.map_batch_l = mp_ports_natpmp_add_batch_l,
+	.unmap_batch_l = mp_ports_natpmp_del_batch_l,
+	.external_ip_l = mp_ports_natpmp_external_ip_l,
+};
+
+/* Probe */
+
+/* UPnP discovery running in its own thread while NAT-PMP / PCP is probed.
+   The one of the prober and the thread finishing last frees it */
+typedef struct mp_igd_probe_struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int done;			/* The discovery finished */
+	int left;			/* The prober doesn't wait for the result */
+	int status;			/* UPNP_GetValidIGD() status; URLs are allocated if not 0 */
+	struct UPNPUrls urls;
+	struct IGDdatas data;
 	char lan_address[IP_STR_LEN];
-	char *wan_address = NULL;
-	int status = -1;
+	char rootdesc[REQ_STR_LEN];	/* Given IGD: no SSDP discovery */
+} mp_igd_probe_t;
+
+static void mp_ports_igd_probe_free(mp_igd_probe_t *probe)
+{
+	if (0 != probe->status) FreeUPNPUrls(&probe->urls);
+	pthread_mutex_destroy(&probe->lock);
+	pthread_cond_destroy(&probe->cond);
+	zfree(probe);
+}
+
+static void *mp_ports_igd_probe_thread(void *arg)
+{
+	mp_igd_probe_t *probe = arg;
+	int left;
+
+	if ('\0' != probe->rootdesc[0]) {
+		probe->status = UPNP_GetIGDFromUrl(probe->rootdesc, &probe->urls, &probe->data,
+										   probe->lan_address, (int)sizeof(probe->lan_address));
+	} else {
+		probe->status = mp_ports_igd_find(&probe->urls, &probe->data,
+										  probe->lan_address, (int)sizeof(probe->lan_address));
+	}
+
+	pthread_mutex_lock(&probe->lock);
+	probe->done = 1;
+	left = probe->left;
+	pthread_cond_signal(&probe->cond);
+	pthread_mutex_unlock(&probe->lock);
+
+	if (left) mp_ports_igd_probe_free(probe);
+	return (NULL);
+}
+
+/* The discovered IGD becomes the UPnP session */
+static int mp_ports_igd_probe_take_l(mp_igd_probe_t *probe)
+{
+	if (1 != probe->status) {
+		DD("No usable IGD: status = %d\n", probe->status);
+		return (EBAD);
+	}
 
-	upnp_dev = mp_ports_upnp_discover();
-	TESTP_MES(upnp_dev, NULL, "UPNP discover failed\n");
+	mp_ports_igd_drop_l();
+	g_igd.urls = probe->urls;
+	g_igd.data = probe->data;
+	snprintf(g_igd.lan_address, sizeof(g_igd.lan_address), "%s", probe->lan_address);
+	/* The URLs belong to the session now */
+	probe->status = 0;
+	mp_ports_igd_found_l();
+	return (EOK);
+}
 
-	status = UPNP_GetValidIGD(upnp_dev, &upnp_urls, &upnp_data, lan_address, (int)sizeof(lan_address));
-	freeUPNPDevlist(upnp_dev);
+/* Pick the backend: UPnP discovery (up to 2 sec of SSDP) and NAT-PMP / PCP (one round trip
+   to the gateway) run at the same time. NAT-PMP / PCP wins if the gateway speaks it:
+   then the prober doesn't wait for UPnP. Otherwise UPnP is taken, if found */
+static int mp_ports_backend_probe_l(void)
+{
+	mp_igd_probe_t *probe = zmalloc(sizeof(mp_igd_probe_t));
+	pthread_t thread;
+
+	TESTP_MES(probe, EBAD, "Can't allocate IGD probe");
+	pthread_mutex_init(&probe->lock, NULL);
+	pthread_cond_init(&probe->cond, NULL);
+	if (g_igd.fixed) snprintf(probe->rootdesc, sizeof(probe->rootdesc), "%s", g_igd.rootdesc);
+
+	if (0 != pthread_create(&thread, NULL, mp_ports_igd_probe_thread, probe)) {
+		DE("Can't start UPnP discovery\n");
+		mp_ports_igd_probe_free(probe);
+		probe = NULL;
+	} else {
+		pthread_detach(thread);
+	}
+
+	/* The IGD is given: it is the one to use */
+	if (!g_igd.fixed && NULL == g_nat) g_nat = mp_natpmp_open();
+	if (NULL != g_nat && EOK == mp_natpmp_probe(g_nat) &&
+		EOK == mp_natpmp_local_ip(g_nat, g_igd.lan_address, sizeof(g_igd.lan_address))) {
+		g_backend = &g_backend_natpmp;
+	} else {
+		mp_natpmp_close(g_nat);
+		g_nat = NULL;
+	}
+
+	if (NULL != probe) {
+		pthread_mutex_lock(&probe->lock);
+		if (NULL != g_backend && !probe->done) {
+			probe->left = 1;
+			pthread_mutex_unlock(&probe->lock);
+			probe = NULL;
+		} else {
+			while (!probe->done) pthread_cond_wait(&probe->cond, &probe->lock);
+			pthread_mutex_unlock(&probe->lock);
+		}
+	}
 
-	if (1 != status) {
-		DE("Error on UPNP_GetValidIGD: status = %d\n", status);
+	/* Found anyway: the UPnP session is kept for mp_ports_remap_port() */
+	if (NULL != probe) {
+		if (EOK == mp_ports_igd_probe_take_l(probe) && NULL == g_backend) g_backend = &g_backend_upnp;
+		mp_ports_igd_probe_free(probe);
+	}
+
+	if (NULL == g_backend) {
+		DE("No port mapping on the gateway: neither NAT-PMP / PCP nor UPnP IGD answered\n");
+		return (EBAD);
+	}
+
+	D("Port mapping backend: %s\n", g_backend == &g_backend_natpmp ? mp_natpmp_name(g_nat) : g_backend->name);
+	return (EOK);
+}
+
+/* Pick the backend if not yet and make sure its session is valid */
+static int mp_ports_backend_l(void)
+{
+	if (NULL == g_backend && EOK != mp_ports_backend_probe_l()) return (EBAD);
+	return (g_backend->session_l());
+}
+
+/* Use the IGD with description URL 'url' and don't look for others; NULL: discover again */
+void mp_ports_igd_url(const char *url)
+{
+	pthread_mutex_lock(&g_igd.lock);
+	mp_ports_igd_drop_l();
+	g_backend = NULL;
+	snprintf(g_igd.rootdesc, sizeof(g_igd.rootdesc), "%s", NULL == url ? "" : url);
+	g_igd.fixed = (NULL != url);
+	pthread_mutex_unlock(&g_igd.lock);
+}
+
+/* Forget the backend, the session, the mirror and our mappings (they stay on the router):
+   the next call starts from scratch */
+void mp_ports_reset(void)
+{
+	igd_map_t *old;
+	igd_lan_t *old_lan;
+
+	pthread_mutex_lock(&g_igd.lock);
+	mp_ports_igd_drop_l();
+	g_backend = NULL;
+	mp_natpmp_close(g_nat);
+	g_nat = NULL;
+	igd_map_free(g_owned);
+	g_owned = NULL;
+
+	pthread_rwlock_wrlock(&g_mirror.lock);
+	old = g_mirror.map;
+	old_lan = g_mirror.lan;
+	g_mirror.map = NULL;
+	g_mirror.lan = NULL;
+	g_mirror.loaded = 0;
+	g_mirror.drift = 0;
+	memset(g_mirror.taken, 0, sizeof(g_mirror.taken));
+	pthread_rwlock_unlock(&g_mirror.lock);
+	pthread_mutex_unlock(&g_igd.lock);
+
+	igd_map_free(old);
+	igd_lan_free(old_lan);
+}
+
+/* 
+ * Test if the port mapping exists. 
+ * external_port: port opened on router 
+ * internal_port: to wich internal port the external port redirected 
+ * local_host - IP address of expected machine; if NULL - not checked 
+ * Return: 
+ * 0 it all right 
+ * 1 if port mapped but local host is different 
+ * 2 if port mapped but internal port is different 
+ * 3 if port not mapped at all 
+ * -1 on an error 
+ */
+int mp_ports_if_mapped(int external_port, int internal_port, const char *local_host, const char *protocol)
+{
+	htype_port_t key;
+	port_map_t *map;
+	struct in6_addr local_ip;
+	int rc = 3;
+
+	TESTP(protocol, -1);
+	if (NULL != local_host && EOK != mp_ports_str2ip(local_host, &local_ip)) {
+		DE("Bad local host address: %s\n", local_host);
+		return (-1);
+	}
+
+	if (EOK != ctl_port_key(external_port, protocol, &key)) return (-1);
+	if (EOK != mp_ports_mirror_rlock()) return (-1);
+
+	map = igd_map_find(g_mirror.map, &key);
+	if (NULL == map) {
+		/* Port not mapped at all */
+		rc = 3;
+	} else if (map->port_internal != internal_port) {
+		/* port mapped but internal port is different */
+		rc = 2;
+	} else if (NULL != local_host && 0 != memcmp(&map->local_ip, &local_ip, sizeof(local_ip))) {
+		/* Check case 1: port mapped but local port is different */
+		rc = 1;
+	} else {
+		D("Asked mapping done: ext port %d -> %d\n", external_port, internal_port);
+		rc = 0;
+	}
+
+	pthread_rwlock_unlock(&g_mirror.lock);
+	return (rc);
+}
+
+/* 
+ * Test if the port mapping exists. 
+ * internal_port: to wich internal port the external port redirected 
+ * local_host - IP address of expected machine; if NULL - not checked 
+ * Return:
+ * port_map_t structure on success (mapping found) 
+ * The structure will contain nothing if no mapping found
+ * NULL on an error 
+ */
+json_t *mp_ports_if_mapped_json(int internal_port, const char *local_host, const char *protocol)
+{
+	json_t *mapping = NULL;
+	htype_port_t want;
+	int port_ext;
+	struct in6_addr local_ip;
+
+	TESTP(local_host, NULL);
+	TESTP(protocol, NULL);
+	if (EOK != mp_ports_str2ip(local_host, &local_ip)) {
+		DE("Bad local host address: %s\n", local_host);
+		return (NULL);
+	}
+
+	if (EOK != ctl_port_key(internal_port, protocol, &want)) return (NULL);
+	if (EOK != mp_ports_mirror_rlock()) return (NULL);
+
+	port_ext = mp_ports_mirror_ext_l(want, &local_ip);
+	pthread_rwlock_unlock(&g_mirror.lock);
+
+	if (0 != port_ext) {
+		D("Asked mapping is already exists: ext port %d -> %s:%d\n", port_ext, local_host, internal_port);
+		mapping = mp_ports_mapping(internal_port, port_ext, protocol);
+	}
+	return (mapping);
+}
+
+/* Scan existing mappings to this machine and add them to the given array 'arr' */
+json_t *mp_ports_scan_mappings(json_t *arr, const char *local_host)
+{
+	json_t *mapping = NULL;
+	igd_map_slot_t *slot;
+	size_t index;
+	struct in6_addr local_ip;
+
+	TESTP(arr, NULL);
+	TESTP(local_host, NULL);
+	if (EOK != mp_ports_str2ip(local_host, &local_ip)) {
+		DE("Bad local host address: %s\n", local_host);
 		return (NULL);
 	}
 
+	/* Listing the host's mappings is a walk over the mirror anyway: one pass does both.
+	   The mirror is replaced only under g_igd.lock, it can be tested before the read lock */
+	pthread_mutex_lock(&g_igd.lock);
+	if (NULL == g_mirror.map && EOK != mp_ports_mirror_load_l()) {
+		pthread_mutex_unlock(&g_igd.lock);
+		return (NULL);
+	}
+	pthread_rwlock_rdlock(&g_mirror.lock);
+
+	htype_each(g_mirror.map, index, slot) {
+		port_map_t own = slot->val;
+
+		if (0 != memcmp(&own.local_ip, &local_ip, sizeof(local_ip))) continue;
+
+		/* A mapping found */
+		D("Asked mapping is already exists: ext port %d -> %s:%d\n", own.port_external, local_host, own.port_internal);
+		mapping = mp_ports_mapping(own.port_internal, own.port_external, mp_ports_proto_str(own.protocol));
+		if (NULL == mapping) break;
+		j_arr_add(arr, mapping);
+
+		/* The mappings we made before the restart are given to the others: keep them alive.
+		   The ones of other programs on this host are left alone */
+		if (0 != strcmp(own.description, MP_PORTS_DESC)) continue;
+		/* The lease the router reports can be the original one: renew it at once */
+		if (0 != own.expires) own.expires = time(NULL);
+		mp_ports_owned_set_l(slot->key, &own);
+	}
+
+	pthread_rwlock_unlock(&g_mirror.lock);
+	pthread_mutex_unlock(&g_igd.lock);
+	return (mapping);
+}
+
+/* Test if internal port already mapped.
+   If it mapped, the external port returned */
+char *mp_ports_get_external_ip()
+{
+	char *wan_address = NULL;
+	int status = -1;
+
 	wan_address = zmalloc(IP_STR_LEN);
 	TESTP_MES(wan_address, NULL, "Can't allocate wan_address\n");
 
-	status = UPNP_GetExternalIPAddress(upnp_urls.controlURL, upnp_data.first.servicetype, wan_address);
+	pthread_mutex_lock(&g_igd.lock);
+	if (EOK == mp_ports_backend_l()) status = g_backend->external_ip_l(wan_address, IP_STR_LEN);
+	pthread_mutex_unlock(&g_igd.lock);
+
 	if (0 != status) {
 		DE("Error: can't get IP address\n");
-		FreeUPNPUrls(&upnp_urls);
+		zfree(wan_address);
 		return (NULL);
 	}
 	DDD("Got my IP: %s\n", wan_address);
-	FreeUPNPUrls(&upnp_urls);
 	return (wan_address);
 }
 
@@ -669,30 +2397,20 @@ json_t *mp_ports_ssh_port_for_uid(const char *uid)
 {
 	json_t *root = NULL;
 	json_t *val = NULL;
-	json_t *host = NULL;
+	json_t *endpoint = NULL;
 	control_t *ctl = ctl_get();
-	const char *key;
 
-	json_object_foreach(ctl->hosts, key, host) {
-		if (EOK == strcmp(key, uid)) {
-			json_t *ports = NULL;
-			json_t *port;
-			int index;
-			/* Found host */
-			ports = j_find_j(host, "ports");
-
-			json_array_foreach(ports, index, port) {
-
-				/* For now we search for intenal port 22 and protocol TCP */
-				if (EOK == j_test(port, JK_PORT_INT, "22") && EOK == j_test(port, JK_PROTOCOL, "TCP")) {
-					root = j_new();
-					/* We need external port */
-					j_cp(port, root, JK_PORT_EXT);
-					/* And IP */
-					j_cp(host, root, JK_IP_EXT);
-				} /* if */
-			} /* End of json_array_foreach */
-		}
+	/* Indexed lookup, no walk over all hosts.
+	   For now we search for intenal port 22 and protocol TCP */
+	endpoint = ctl_host_service(ctl, uid, 22, JV_TCP);
+	if (NULL != endpoint) {
+		/* The endpoint is shared with the index: give the caller own copy */
+		root = j_new();
+		/* We need external port */
+		j_cp(endpoint, root, JK_PORT_EXT);
+		/* And IP */
+		j_cp(endpoint, root, JK_IP_EXT);
+		json_decref(endpoint);
 	}
 #if 0
 
@@ -783,7 +2501,7 @@ int main(int argi, char **argc)
 		return (0);
 	}
 
-	mapping = mp_ports_remap_any("22", "TCP");
+	mapping = mp_ports_remap_any(22, "TCP");
 	if (NULL != mapping) {
 		j_rm(mapping);
 		D("Port mapped\n");
@@ -1,26 +1,49 @@
 #ifndef _SEC_REMAP_PORT_H_
 #define _SEC_REMAP_PORT_H_
 
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
 #include "mp-jansson.h"
 
+/* The description is kept to tell our mappings from the others; longer ones are cut */
+#define PORT_DESC_LEN 32
+
 typedef struct port_map_struct {
-	char *port_external;
-	char *port_internal;
-	char *local_ip;
-	char *router_ip;
-	char *protocol;
+	uint16_t port_external;
+	uint16_t port_internal;
+	struct in6_addr local_ip; /* IPv4 kept as v4-mapped address */
+	struct in6_addr router_ip;
+	uint8_t protocol; /* IPPROTO_TCP / IPPROTO_UDP */
+	time_t expires; /* When the lease runs out; 0 if the mapping is permanent */
+	char description[PORT_DESC_LEN]; /* NewPortMappingDescription */
 } port_map_t;
 
 extern int mp_ports_remap_port(const int external_port, const int internal_port, const char *protocol /* "TCP", "UDP" */);
-extern int mp_ports_unmap_port(const char *internal_port, const char *external_port,  const char *protocol);
-extern int mp_ports_if_mapped(int external_port, int internal_port, char *local_host, char *protocol);
+extern int mp_ports_unmap_port(int internal_port, int external_port, const char *protocol);
+extern int mp_ports_if_mapped(int external_port, int internal_port, const char *local_host, const char *protocol);
 extern int test_if_port_mapped(int internal_port);
+/* Returned string released with zfree() */
 extern char *mp_ports_get_external_ip(void);
 
-extern json_t *mp_ports_if_mapped_json(const char *internal_port, const char *local_host, const char *protocol);
+extern json_t *mp_ports_if_mapped_json(int internal_port, const char *local_host, const char *protocol);
 extern json_t *mp_ports_scan_mappings(json_t *arr, const char *local_host);
-extern json_t *mp_ports_remap_any(const char *internal_port, const char *protocol /* "TCP", "UDP" */);
+extern json_t *mp_ports_remap_any(int internal_port, const char *protocol /* "TCP", "UDP" */);
+
+/* Max number of ports in one batch request */
+#define PORTS_BATCH_MAX 1024
+/* Map / unmap many ports at once; see mp-ports.c */
+extern json_t *mp_ports_remap_batch(json_t *ports);
+extern json_t *mp_ports_unmap_batch(json_t *ports);
 
 extern json_t *mp_ports_ssh_port_for_uid(const char *uid);
 
+/* Keeps the local mirror of the router mapping table fresh; run it as a thread */
+extern void *mp_ports_mirror_thread(void *arg);
+
+/* Use the given IGD, no discovery (NULL: discover again); for the mock IGD, see mp-igd-mock.h */
+extern void mp_ports_igd_url(const char *url);
+/* Forget the session, the mirror and our mappings: the next call starts from scratch */
+extern void mp_ports_reset(void);
+
 #endif /* _SEC_REMAP_PORT_H_ */
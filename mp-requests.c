@@ -103,7 +103,7 @@ err:
 
 /* "ssh-done" responce: this client opened a port and informes
    about it. This is responce to "ssh" requiest */
-/*@unused@*/ buf_t *mp_requests_build_ssh_done(const char *uid, const char *ip, const char *port)
+/*@unused@*/ buf_t *mp_requests_build_ssh_done(const char *uid, const char *ip, int port)
 {
 	buf_t *buf = NULL;
 	json_t *root = j_new();
@@ -118,7 +118,7 @@ err:
 	/* This is my external IP */
 	if (EOK != j_add_str(root, JK_IP_EXT, ip)) goto err;
 	/* This is my external port */
-	if (EOK != j_add_str(root, JK_PORT_EXT, port)) goto err;
+	if (EOK != j_add_int(root, JK_PORT_EXT, port)) goto err;
 
 	buf = j_2buf(root);
 
@@ -135,7 +135,7 @@ err:
    already tried to open a port and failed.
    Another scenario: the remote client "uid" succeeded to open
    port, but we cannot connect. In this case we move on to "sshr" requiest */
-/*@unused@*/ buf_t *mp_requests_build_sshr(const char *uid, const char *ip, const char *port)
+/*@unused@*/ buf_t *mp_requests_build_sshr(const char *uid, const char *ip, int port)
 {
 	buf_t *buf = NULL;
 	json_t *root = NULL;
@@ -152,7 +152,7 @@ err:
 	/* This is my external IP */
 	if (EOK != j_add_str(root, JK_IP_EXT, ip)) goto err;
 	/* This is my external port */
-	if (EOK != j_add_str(root, JK_PORT_EXT, port)) goto err;
+	if (EOK != j_add_int(root, JK_PORT_EXT, port)) goto err;
 
 	buf = j_2buf(root);
 
@@ -164,7 +164,7 @@ err:
 /* sshr-done: we opened reversed channel to the client "uid".
    The remote client "uid" may use "localport" on its side
    to establish connection */
-/*@unused@*/ buf_t *mp_requests_build_sshr_done(const char *uid, const char *localport, const char *status)
+/*@unused@*/ buf_t *mp_requests_build_sshr_done(const char *uid, int localport, const char *status)
 {
 	buf_t *buf = NULL;
 	json_t *root = NULL;
@@ -178,7 +178,7 @@ err:
 	//if (EOK != j_add_str(root, JK_UID, uid)) goto err;
 	if (EOK != j_add_str(root, JK_DEST, uid)) goto err;
 	/* This is my external IP */
-	if (EOK != j_add_str(root, JK_PORT_INT, localport)) goto err;
+	if (EOK != j_add_int(root, JK_PORT_INT, localport)) goto err;
 	/* Operation status */
 	if (EOK != j_add_str(root, JK_STATUS, status)) goto err;
 
@@ -190,26 +190,31 @@ err:
 }
 
 /* SEB:TODO: I should just send ctl->me structure as keepalive */
+/* The published snapshot of 'me' encoded: no need to lock ctl->me */
 buf_t *mp_requests_build_keepalive()
 {
-	control_t *ctl = ctl_get();
-	return (j_2buf(ctl->me));
+	buf_t *buf = NULL;
+	ctl_snap_t *snap = ctl_snap_get_me(ctl_get());
+	TESTP_MES(snap, NULL, "No snapshot of 'me'");
+	buf = j_2buf(snap->j);
+	ctl_snap_put(snap);
+	return (buf);
 }
 
 /* SEB:TODO: We should form this request in mp-shell */
-buf_t *mp_requests_open_port(const char *uid, const char *port, const char *protocol)
+buf_t *mp_requests_open_port(const char *uid, int port, const char *protocol)
 {
 	buf_t *buf = NULL;
 	json_t *root = NULL;
 
 	TESTP_MES(uid, NULL, "Got NULL");
-	TESTP_MES(port, NULL, "Got NULL");
+	TESTP_MES(protocol, NULL, "Got NULL");
 
 	root = j_new();
 	TESTP_MES(root, NULL, "Can't create json\n");
 
 	if (EOK != j_add_str(root, JK_TYPE, JV_TYPE_OPENPORT)) goto err;
-	if (EOK != j_add_str(root, JK_PORT_INT, port)) goto err;
+	if (EOK != j_add_int(root, JK_PORT_INT, port)) goto err;
 	if (EOK != j_add_str(root, JK_PROTOCOL, protocol)) goto err;
 	//if (EOK != j_add_str(root, JK_UID, uid)) goto err;
 	if (EOK != j_add_str(root, JK_DEST, uid)) goto err;
@@ -221,19 +226,19 @@ err:
 	return (buf);
 }
 
-buf_t *mp_requests_close_port(const char *uid, const char *port, const char *protocol)
+buf_t *mp_requests_close_port(const char *uid, int port, const char *protocol)
 {
 	buf_t *buf = NULL;
 	json_t *root = NULL;
 
 	TESTP_MES(uid, NULL, "Got NULL");
-	TESTP_MES(port, NULL, "Got NULL");
+	TESTP_MES(protocol, NULL, "Got NULL");
 
 	root = j_new();
 	TESTP_MES(root, NULL, "Can't create json\n");
 
 	if (EOK != j_add_str(root, JK_TYPE, JV_TYPE_CLOSEPORT)) goto err;
-	if (EOK != j_add_str(root, JK_PORT_INT, port)) goto err;
+	if (EOK != j_add_int(root, JK_PORT_INT, port)) goto err;
 	if (EOK != j_add_str(root, JK_PROTOCOL, protocol)) goto err;
 	//if (EOK != j_add_str(root, JK_UID, uid)) goto err;
 	if (EOK != j_add_str(root, JK_DEST, uid)) goto err;
@@ -11,6 +11,9 @@
 #include "mp-os.h"
 #include "mp-dict.h"
 #include "buf_t.h"
+#include "mp-memory.h"
+#include "mp-ctl.h"
+#include "mp-ports.h"
 #include "libfort/src/fort.h"
 
 #define SERVER_PATH     "/tmp/server"
@@ -21,7 +24,8 @@ json_t *execute_requiest(json_t *root)
 {
 	int sd = -1;
 	ssize_t rc = -1;
-	char buffer[CLI_BUF_LEN];
+	char *tail = NULL;
+	json_t *resp = NULL;
 	struct sockaddr_un serveraddr;
 
 	buf_t *buf = j_2buf(root);
@@ -52,7 +56,7 @@ json_t *execute_requiest(json_t *root)
 	DDD("Connected\n");
 
 	// memset(buf, '0', CLI_BUF_LEN);
-	rc = send(sd, buf->data, buf->size, 0);
+	rc = send(sd, buf->data, buf->len, 0);
 	if (rc < 0) {
 		DE("Failed\n");
 		perror("send() failed");
@@ -61,28 +65,123 @@ json_t *execute_requiest(json_t *root)
 
 	DDD("Sent\n");
 
-	rc = recv(sd, buffer, CLI_BUF_LEN, 0);
+	/* The same buffer reused for the answer; the server closes the connection when all sent */
+	buf_clean(buf);
+	do {
+		tail = buf_reserve(buf, CLI_BUF_LEN);
+		if (NULL == tail) {
+			rc = -1;
+			break;
+		}
+		rc = recv(sd, tail, CLI_BUF_LEN, 0);
+	} while (rc > 0 && EOK == buf_commit(buf, (size_t)rc));
+
 	if (rc < 0) {
 		DE("Failed\n");
 		perror("recv() failed");
-		return (NULL);
-	} else if (rc == 0) {
+	} else if (0 == buf->len) {
 		printf("The server closed the connection\n");
-		return (NULL);
+	} else {
+		DDD("Received\n");
+		resp = j_buf2j(buf);
 	}
 
-	DDD("Received\n");;
-
-	buffer[rc] = '\0';
+	buf_free(buf);
 	if (sd != -1) close(sd);
-	return (j_str2j(buffer));
+	return (resp);
+}
+
+/* Port given in command line; returns 0 if it is not a valid port */
+static int mp_shell_str2port(const char *port)
+{
+	char *end = NULL;
+	long val = strtol(port, &end, 10);
+
+	if (end == port || '\0' != *end || val < 1 || val > 65535) {
+		printf("Bad port: %s\n", port);
+		return (0);
+	}
+	return ((int)val);
+}
+
+/* Parse ports given to -o / -c: "22,80/UDP,8000-8010";
+   a port without "/protocol" gets 'protocol'.
+   Returns array of {JK_PORT_INT, JK_PROTOCOL}, NULL on an error */
+static json_t *mp_shell_parse_ports(const char *spec, const char *protocol)
+{
+	json_t *arr = NULL;
+	char *copy = NULL;
+	char *save = NULL;
+	char *tok;
+
+	TESTP(spec, NULL);
+	TESTP(protocol, NULL);
+
+	copy = strdup(spec);
+	TESTP_MES(copy, NULL, "Can't copy ports");
+	arr = j_arr();
+	TESTP_MES_GO(arr, err, "Can't allocate JSON array");
+
+	for (tok = strtok_r(copy, ",", &save); NULL != tok; tok = strtok_r(NULL, ",", &save)) {
+		const char *proto = protocol;
+		char *slash = strchr(tok, '/');
+		char *dash = NULL;
+		int first;
+		int last;
+		int port;
+		htype_port_t key;
+
+		if (NULL != slash) {
+			*slash = '\0';
+			proto = slash + 1;
+		}
+
+		dash = strchr(tok, '-');
+		if (NULL != dash) *dash = '\0';
+		first = mp_shell_str2port(tok);
+		last = (NULL != dash) ? mp_shell_str2port(dash + 1) : first;
+		if (0 == first || 0 == last || last < first) goto err;
+
+		if (EOK != ctl_port_key(first, proto, &key)) {
+			printf("Bad protocol: %s; use TCP or UDP\n", proto);
+			goto err;
+		}
+
+		if ((size_t)j_count(arr) + (size_t)(last - first + 1) > PORTS_BATCH_MAX) {
+			printf("Too many ports, max %d in one request\n", PORTS_BATCH_MAX);
+			goto err;
+		}
+
+		for (port = first; port <= last; port++) {
+			json_t *item = j_new();
+			TESTP_GO(item, err);
+			if (EOK != j_add_int(item, JK_PORT_INT, port) ||
+				EOK != j_add_str(item, JK_PROTOCOL, proto) ||
+				EOK != j_arr_add(arr, item)) {
+				j_rm(item);
+				goto err;
+			}
+		}
+	}
+
+	if (0 == j_count(arr)) {
+		printf("No ports given\n");
+		goto err;
+	}
+
+	TFREE(copy);
+	return (arr);
+err:
+	TFREE(copy);
+	if (arr) j_rm(arr);
+	return (NULL);
 }
 
 static int mp_shell_ask_openport(json_t *args)
 {
 	int rc = EBAD;
 	const char *uid = NULL;
-	const char *port = NULL;
+	int port = 0;
 	const char *protocol = NULL;
 	json_t *resp = NULL;
 	json_t *root = NULL;
@@ -98,8 +197,11 @@ static int mp_shell_ask_openport(json_t *args)
 	uid = j_find_ref(args, JK_UID);
 	TESTP_MES_GO(uid, err, "Can't find uid");
 
-	port = j_find_ref(args, JK_PORT_INT);
-	TESTP_MES_GO(port, err, "Can't find port");
+	port = ctl_port_get(args, JK_PORT_INT);
+	if (0 == port) {
+		DE("Can't find port\n");
+		goto err;
+	}
 
 	protocol = j_find_ref(args, JK_PROTOCOL);
 	TESTP_MES_GO(protocol, err, "Can't find protocol");
@@ -110,7 +212,7 @@ static int mp_shell_ask_openport(json_t *args)
 	TESTI_MES_GO(rc, err, "Can't add 'JK_COMMAND' field");
 	rc = j_add_str(root, JK_UID, uid);
 	TESTI_MES_GO(rc, err, "Can't add 'uid' field");
-	rc = j_add_str(root, JK_PORT_INT, port);
+	rc = j_add_int(root, JK_PORT_INT, port);
 	TESTI_MES_GO(rc, err, "Can't add 'port' field");
 	rc = j_add_str(root, JK_PROTOCOL, protocol);
 	TESTI_MES_GO(rc, err, "Can't add 'protocol' field");
@@ -127,6 +229,7 @@ static int mp_shell_ask_openport(json_t *args)
 	printf("Please wait. Port remapping may take up to 10 seconds. Or more, who knows, kid.\n");
 	resp = execute_requiest(root);
 	j_rm(root);
+	root = NULL;
 	TESTP_GO(resp, err);
 	if (j_test(resp, JK_STATUS, JV_OK)) {
 		rc = EOK;
@@ -134,6 +237,7 @@ static int mp_shell_ask_openport(json_t *args)
 err:
 	if (root) j_rm(root);
 	if (resp) j_rm(resp);
+	TZFREE(ticket);
 	return (rc);
 }
 
@@ -141,7 +245,7 @@ static int mp_shell_ask_closeport(json_t *args)
 {
 	int rc = EBAD;
 	const char *uid = NULL;
-	const char *port = NULL;
+	int port = 0;
 	const char *protocol = NULL;
 	json_t *resp = NULL;
 	json_t *root = NULL;
@@ -157,8 +261,11 @@ static int mp_shell_ask_closeport(json_t *args)
 	uid = j_find_ref(args, JK_UID);
 	TESTP_MES_GO(uid, err, "Can't find uid");
 
-	port = j_find_ref(args, JK_PORT_INT);
-	TESTP_MES_GO(port, err, "Can't find port");
+	port = ctl_port_get(args, JK_PORT_INT);
+	if (0 == port) {
+		DE("Can't find port\n");
+		goto err;
+	}
 
 	protocol = j_find_ref(args, JK_PROTOCOL);
 	TESTP_MES_GO(protocol, err, "Can't find protocol");
@@ -167,7 +274,7 @@ static int mp_shell_ask_closeport(json_t *args)
 	TESTI_MES_GO(rc, err, "Can't add 'JK_COMMAND' field");
 	rc = j_add_str(root, JK_UID, uid);
 	TESTI_MES_GO(rc, err, "Can't add 'uid' field");
-	rc = j_add_str(root, JK_PORT_INT, port);
+	rc = j_add_int(root, JK_PORT_INT, port);
 	TESTI_MES_GO(rc, err, "Can't add 'port' field");
 	rc = j_add_str(root, JK_PROTOCOL, protocol);
 	TESTI_MES_GO(rc, err, "Can't add 'protocol' field");
@@ -182,6 +289,7 @@ static int mp_shell_ask_closeport(json_t *args)
 	printf("Please wait. Port remapping may take up to 10 seconds. Or more, who knows, kid.\n");
 	resp = execute_requiest(root);
 	j_rm(root);
+	root = NULL;
 	TESTP_GO(resp, err);
 	if (j_test(resp, JK_STATUS, JV_OK)) {
 		rc = EOK;
@@ -189,6 +297,59 @@ static int mp_shell_ask_closeport(json_t *args)
 err:
 	if (root) j_rm(root);
 	if (resp) j_rm(resp);
+	TZFREE(ticket);
+	return (rc);
+}
+
+/* Open / close a batch of ports on remote machine in one request: 'type' is
+   JV_TYPE_OPENPORTS or JV_TYPE_CLOSEPORTS, 'ports' is array of {JK_PORT_INT, JK_PROTOCOL}
+   (the reference is stolen). The result of every port comes in the ticket */
+static int mp_shell_ask_ports(json_t *args, const char *type, json_t *ports)
+{
+	int rc = EBAD;
+	const char *uid = NULL;
+	json_t *resp = NULL;
+	json_t *root = NULL;
+	char *ticket = NULL;
+	size_t num;
+
+	TESTP(ports, EBAD);
+	num = (size_t)j_count(ports);
+
+	root = j_new();
+	TESTP_GO(root, err);
+
+	uid = j_find_ref(args, JK_UID);
+	TESTP_MES_GO(uid, err, "Can't find uid");
+
+	rc = j_add_str(root, JK_COMMAND, type);
+	TESTI_MES_GO(rc, err, "Can't add 'JK_COMMAND' field");
+	rc = j_add_str(root, JK_TYPE, type);
+	TESTI_MES_GO(rc, err, "Can't add 'JK_TYPE' field");
+	rc = j_add_str(root, JK_UID, uid);
+	TESTI_MES_GO(rc, err, "Can't add 'uid' field");
+	rc = j_add_str(root, JK_DEST, uid);
+	TESTI_MES_GO(rc, err, "Can't add 'dest' field");
+	rc = j_add_j(root, JK_ARR_PORTS, ports);
+	ports = NULL;
+	TESTI_MES_GO(rc, err, "Can't add ports list");
+
+	ticket = mp_os_rand_string(TICKET_SIZE);
+	TESTP_GO(ticket, err);
+	rc = j_add_str(root, JK_TICKET, ticket);
+	TESTI_MES_GO(rc, err, "Can't add 'ticket' field");
+
+	printf("Please wait. Asked %zu ports, the result of every port will be in ticket %s\n", num, ticket);
+	resp = execute_requiest(root);
+	j_rm(root);
+	root = NULL;
+	TESTP_GO(resp, err);
+	rc = (EOK == j_test(resp, JK_STATUS, JV_OK)) ? EOK : EBAD;
+err:
+	if (ports) j_rm(ports);
+	if (root) j_rm(root);
+	if (resp) j_rm(resp);
+	TZFREE(ticket);
 	return (rc);
 }
 
@@ -240,11 +401,18 @@ static int mp_shell_ssh(json_t *args)
 	return (EOK);
 }
 
+/* Field of a host for the table; a host may miss a field, i.e. no name */
+static const char *mp_shell_str(json_t *host, const char *key)
+{
+	const char *val = j_find_ref(host, key);
+	return (NULL != val ? val : "-");
+}
+
 static int mp_shell_get_hosts()
 {
 	json_t *resp = NULL;
 	json_t *root = j_new();
-	const char *key;
+	size_t index = 0;
 	json_t *val = NULL;
 	ft_table_t *table = NULL;
 
@@ -257,7 +425,7 @@ static int mp_shell_get_hosts()
 	resp = execute_requiest(root);
 	j_rm(root);
 
-	if (NULL == resp || 0 == j_count(resp)) {
+	if (NULL == resp || 0 == json_array_size(resp)) {
 		printf("No host in the list\n");
 		j_rm(resp);
 		return (0);
@@ -269,14 +437,14 @@ static int mp_shell_get_hosts()
 	ft_set_cell_prop(table, 0, FT_ANY_COLUMN, FT_CPROP_ROW_TYPE, FT_ROW_HEADER);
 	ft_write_ln(table, "UID", "External IP", "Internal IP", "Name");
 
-	json_object_foreach(resp, key, val) {
-
-		ft_write_ln(table, j_find_ref(val, JK_UID), j_find_ref(val, JK_IP_EXT),
-					j_find_ref(val, JK_IP_INT), j_find_ref(val, JK_NAME));
+	/* The daemon sends the hosts ordered by name */
+	json_array_foreach(resp, index, val) {
+		ft_write_ln(table, mp_shell_str(val, JK_UID), mp_shell_str(val, JK_IP_EXT),
+					mp_shell_str(val, JK_IP_INT), mp_shell_str(val, JK_NAME));
 	}
 	printf("%s\n", ft_to_string(table));
 	ft_destroy_table(table);
-
+	j_rm(resp);
 
 	return (0);
 }
@@ -312,13 +480,96 @@ static int mp_shell_get_ports()
 	ft_write_ln(table, "External", "Internal", "Protocol");
 
 	json_array_foreach(resp, index, val) {
-		ft_write_ln(table, j_find_ref(val, JK_PORT_EXT),
-					j_find_ref(val, JK_PORT_INT),
-					j_find_ref(val, JK_PROTOCOL));
+		ft_printf_ln(table, "%d|%d|%s", ctl_port_get(val, JK_PORT_EXT),
+					 ctl_port_get(val, JK_PORT_INT),
+					 j_find_ref(val, JK_PROTOCOL));
+	}
+
+	printf("%s\n", ft_to_string(table));
+	ft_destroy_table(table);
+	return (0);
+}
+
+/* Print one lock histogram as "bucket:count" for not empty buckets;
+   bucket N is time < 2^N usec */
+static void mp_shell_hist2str(json_t *hist, char *out, size_t size)
+{
+	size_t index;
+	json_t *val;
+	size_t off = 0;
+
+	out[0] = '\0';
+	json_array_foreach(hist, index, val) {
+		json_int_t cnt = json_integer_value(val);
+		if (0 == cnt) continue;
+		off += snprintf(out + off, size - off, "%s<%luus:%lld", off ? " " : "", 1UL << index, (long long)cnt);
+		if (off >= size) break;
+	}
+}
+
+/* Show lock profiler statistics */
+static int mp_shell_get_lockstat()
+{
+	json_t *resp = NULL;
+	json_t *root = j_new();
+	json_t *sites;
+	size_t index = 0;
+	json_t *val = NULL;
+	ft_table_t *table = NULL;
+
+	TESTP_MES(root, -1, "Can't allocate JSON object\n");
+	if (EOK != j_add_str(root, JK_COMMAND, JV_COMMAND_LOCKSTAT)) {
+		DE("Can't add 'command'\n");
+		return (EBAD);
+	}
+
+	resp = execute_requiest(root);
+	j_rm(root);
+	TESTP_MES(resp, EBAD, "No response\n");
+
+	if (EOK != j_test(resp, JK_STATUS, JV_OK)) {
+		printf("Can't get lock statistics: %s\n", j_find_ref(resp, JK_REASON));
+		j_rm(resp);
+		return (EBAD);
+	}
+
+	sites = j_find_j(resp, JK_PROF_SITES);
+	ft_set_default_border_style(FT_PLAIN_STYLE);
+	table = ft_create_table();
+	ft_set_cell_prop(table, 0, FT_ANY_COLUMN, FT_CPROP_ROW_TYPE, FT_ROW_HEADER);
+	ft_write_ln(table, "Site", "Lock", "Count", "Wait avg/max us", "Hold avg/max us", "Wait histogram", "Hold histogram");
+
+	json_array_foreach(sites, index, val) {
+		json_int_t line = 0, count = 0, wait_total = 0, wait_max = 0, hold_total = 0, hold_max = 0;
+		char site[128];
+		char lock[32];
+		char counts[32];
+		char wait[64];
+		char hold[64];
+		char wait_hist[256];
+		char hold_hist[256];
+
+		j_find_int(val, JK_PROF_LINE, &line);
+		j_find_int(val, JK_PROF_COUNT, &count);
+		j_find_int(val, JK_PROF_WAIT_TOTAL, &wait_total);
+		j_find_int(val, JK_PROF_WAIT_MAX, &wait_max);
+		j_find_int(val, JK_PROF_HOLD_TOTAL, &hold_total);
+		j_find_int(val, JK_PROF_HOLD_MAX, &hold_max);
+		if (0 == count) count = 1;
+
+		snprintf(site, sizeof(site), "%s:%lld", j_find_ref(val, JK_PROF_FUNC), (long long)line);
+		snprintf(lock, sizeof(lock), "%s/%s", j_find_ref(val, JK_PROF_LOCK), j_find_ref(val, JK_PROF_MODE));
+		snprintf(counts, sizeof(counts), "%lld", (long long)count);
+		snprintf(wait, sizeof(wait), "%lld/%lld", (long long)(wait_total / count), (long long)wait_max);
+		snprintf(hold, sizeof(hold), "%lld/%lld", (long long)(hold_total / count), (long long)hold_max);
+		mp_shell_hist2str(j_find_j(val, JK_PROF_WAIT_HIST), wait_hist, sizeof(wait_hist));
+		mp_shell_hist2str(j_find_j(val, JK_PROF_HOLD_HIST), hold_hist, sizeof(hold_hist));
+		ft_write_ln(table, site, lock, counts, wait, hold, wait_hist, hold_hist);
 	}
 
 	printf("%s\n", ft_to_string(table));
 	ft_destroy_table(table);
+	j_rm(resp);
 	return (0);
 }
 
@@ -363,8 +614,8 @@ static int mp_shell_get_remote_ports()
 		json_t *port;
 		host_ports = j_find_j(val, "ports");
 		json_array_foreach(host_ports, index, port) {
-			ft_write_ln(table, j_find_ref(val, JK_UID), j_find_ref(port, JK_PORT_EXT),
-						j_find_ref(port, JK_PORT_INT), j_find_ref(port, JK_PROTOCOL));
+			ft_printf_ln(table, "%s|%d|%d|%s", j_find_ref(val, JK_UID), ctl_port_get(port, JK_PORT_EXT),
+						 ctl_port_get(port, JK_PORT_INT), j_find_ref(port, JK_PROTOCOL));
 		}
 	}
 	printf("%s\n", ft_to_string(table));
@@ -388,11 +639,12 @@ static void mp_shell_usage(char *name)
 	ft_write_ln(table, "-l", "list connected machines");
 	ft_write_ln(table, "-m", "print ports mapped from router to this machine");
 	ft_write_ln(table, "-r", "print ports mapped on another hosts");
-	ft_write_ln(table, "-o X", "open port X on the remote machine");
-	ft_write_ln(table, "-c X", "close port X on the remote machine");
+	ft_write_ln(table, "-o X", "open ports X on the remote machine: 22 or 22,80/UDP,8000-8010");
+	ft_write_ln(table, "-c X", "close ports X on the remote machine, like -o");
 	ft_write_ln(table, "-u uid", "uid of the remote machine");
-	ft_write_ln(table, "-p", "TCP or UDP - protocol");
+	ft_write_ln(table, "-p", "TCP or UDP - protocol of ports without /protocol, TCP by default");
 	ft_write_ln(table, "-s", "open ssh connection to remote machine");
+	ft_write_ln(table, "-L", "print lock contention statistics (needs -DCTL_LOCK_PROF)");
 	printf("%s\n", ft_to_string(table));
 	ft_destroy_table(table);
 
@@ -401,7 +653,9 @@ static void mp_shell_usage(char *name)
 		   "Open port 22 for TCP on machine user-939-466-331\n"
 		   "%s -c 5001 -u user-939-466-331 -p UDP\n"
 		   "Close port 5001 for UDP user-939-466-331\n"
-		   , name, name);
+		   "%s -o 22,53/UDP,8000-8010 -u user-939-466-331\n"
+		   "Open 13 ports on machine user-939-466-331 in one request\n"
+		   , name, name, name);
 }
 
 int main(int argc, char *argv[])
@@ -419,6 +673,7 @@ int main(int argc, char *argv[])
 	 * p - protocol, UDP or TCP  (for -o)
 	 * u - uid (uid of the target)
 	 * s - open ssh channel 
+	 * L - show lock profiler statistics
 	*/
 
 	if (argc < 2) {
@@ -429,7 +684,7 @@ int main(int argc, char *argv[])
 	args = j_new();
 	TESTP_MES(args, -1, "Can't allocate JSON object\n");
 
-	while ((opt = getopt(argc, argv, ":limro:u:s:p:x:c:h")) != -1) {
+	while ((opt = getopt(argc, argv, ":limrLo:u:s:p:x:c:h")) != -1) {
 		switch (opt) {
 		case 'i': /* Show this machine info */
 			j_add_str(args, JK_SHOW_INFO, JV_YES);
@@ -439,12 +694,12 @@ int main(int argc, char *argv[])
 			break;
 		case 'o': /* Open port comand (open the port on remote machine UID */
 			j_add_str(args, JK_TYPE, JV_TYPE_OPENPORT);
-			j_add_str(args, JK_PORT_INT, optarg);
+			j_add_str(args, JK_PORTS_SPEC, optarg);
 			D("Optarg is %s\n", optarg);
 			break;
 		case 'c': /* Close port comand (open the port on remote machine UID */
 			j_add_str(args, JK_TYPE, JV_TYPE_CLOSEPORT);
-			j_add_str(args, JK_PORT_INT, optarg);
+			j_add_str(args, JK_PORTS_SPEC, optarg);
 			D("Optarg is %s\n", optarg);
 			break;
 		case 'u': /* UID of remote machine */
@@ -463,6 +718,9 @@ int main(int argc, char *argv[])
 		case 'r': /* TODO: Show ports mapped on a remote machine (if UID given) / on all remotes (if UID is not specified) */
 			j_add_str(args, JK_SHOW_RPORTS, JV_YES);
 			break;
+		case 'L': /* Show lock contention statistics */
+			j_add_str(args, JK_SHOW_LOCKS, JV_YES);
+			break;
 		case 'h': /* Print help */
 			mp_shell_usage(argv[0]);
 			break;
@@ -477,6 +735,28 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/* -o / -c: one port goes as before, several in one batch request */
+	if (EOK == j_test_key(args, JK_PORTS_SPEC)) {
+		const char *protocol = j_find_ref(args, JK_PROTOCOL);
+		int open = (EOK == j_test(args, JK_TYPE, JV_TYPE_OPENPORT));
+		json_t *ports = mp_shell_parse_ports(j_find_ref(args, JK_PORTS_SPEC), protocol ? protocol : JV_TCP);
+
+		if (NULL == ports) {
+			mp_shell_usage(argv[0]);
+			return (EBAD);
+		}
+
+		if (1 == j_count(ports)) {
+			json_t *port = json_array_get(ports, 0);
+			j_cp(port, args, JK_PORT_INT);
+			j_cp(port, args, JK_PROTOCOL);
+			j_rm(ports);
+		} else {
+			j_rm_key(args, JK_TYPE);
+			mp_shell_ask_ports(args, open ? JV_TYPE_OPENPORTS : JV_TYPE_CLOSEPORTS, ports);
+		}
+	}
+
 	if (0 == j_test(args, JK_SHOW_HOSTS, JV_YES)) {
 		mp_shell_get_hosts(args);
 	}
@@ -502,6 +782,10 @@ int main(int argc, char *argv[])
 		mp_shell_ask_closeport(args);
 	}
 
+	if (0 == j_test(args, JK_SHOW_LOCKS, JV_YES)) {
+		mp_shell_get_lockstat();
+	}
+
 	if (0 == j_test(args, JK_SHOW_RPORTS, JV_YES)) {
 		D("Founf RPORTS command\n");
 		mp_shell_get_remote_ports(args);
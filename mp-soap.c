@@ -0,0 +1,441 @@
+#define _GNU_SOURCE /* memmem() */
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "mp-common.h"
+#include "mp-debug.h"
+#include "mp-memory.h"
+#include "mp-soap.h"
+
+#define SOAP_HOST_LEN 128
+#define SOAP_PORT_LEN 8
+#define SOAP_PATH_LEN 256
+/* Size of one request; the arguments of IGD actions are short */
+#define SOAP_REQ_LEN 2048
+/* Size of one read from the socket */
+#define SOAP_IO_LEN 4096
+/* HTTP header bigger than this is not an IGD answer */
+#define SOAP_HEADER_MAX 8192
+/* Neither; the biggest IGD answer is a few KB of XML */
+#define SOAP_BODY_MAX (1024 * 1024)
+/* The router answers in milliseconds; if it is silent for this long, it is gone */
+#define SOAP_TIMEOUT_SEC 3
+
+struct mp_soap_struct {
+	int fd;
+	int closing;				/* The router closes the connection after the current answer */
+	size_t in_flight;			/* Requests sent and not answered yet */
+	char host[SOAP_HOST_LEN];	/* "host:port" as in the URL, for Host header */
+	char path[SOAP_PATH_LEN];
+	char service[SOAP_PATH_LEN];
+	buf_t *in;					/* Received bytes; 'off' of them are parsed already */
+	size_t off;
+	buf_t *out;					/* Request being sent */
+};
+
+/* Split "http://host:port/path"; port is "80" if not given */
+static int mp_soap_parse_url(mp_soap_t *soap, const char *url, char *name, char *port)
+{
+	const char *auth;
+	const char *end;
+	const char *colon;
+	size_t len;
+
+	if (0 != strncmp(url, "http://", 7)) {
+		DE("Not supported URL: %s\n", url);
+		return (EBAD);
+	}
+
+	auth = url + 7;
+	end = strchr(auth, '/');
+	if (NULL == end) end = auth + strlen(auth);
+
+	len = (size_t)(end - auth);
+	if (0 == len || len >= SOAP_HOST_LEN) {
+		DE("Bad host in URL: %s\n", url);
+		return (EBAD);
+	}
+	memcpy(soap->host, auth, len);
+	soap->host[len] = '\0';
+	snprintf(soap->path, sizeof(soap->path), "%s", '\0' == *end ? "/" : end);
+
+	/* IPv6 address is in brackets: "[fe80::1]:5000" */
+	if ('[' == *auth) {
+		colon = memchr(auth, ']', len);
+		if (NULL == colon) {
+			DE("Bad IPv6 host in URL: %s\n", url);
+			return (EBAD);
+		}
+		snprintf(name, SOAP_HOST_LEN, "%.*s", (int)(colon - auth - 1), auth + 1);
+		colon++;
+	} else {
+		colon = memchr(auth, ':', len);
+		if (NULL == colon) colon = end;
+		snprintf(name, SOAP_HOST_LEN, "%.*s", (int)(colon - auth), auth);
+	}
+
+	if (colon < end && ':' == *colon) {
+		snprintf(port, SOAP_PORT_LEN, "%.*s", (int)(end - colon - 1), colon + 1);
+	} else {
+		snprintf(port, SOAP_PORT_LEN, "80");
+	}
+	return (EOK);
+}
+
+static int mp_soap_connect(const char *name, const char *port)
+{
+	struct addrinfo hints;
+	struct addrinfo *res = NULL;
+	struct addrinfo *ai;
+	struct timeval tv = {SOAP_TIMEOUT_SEC, 0};
+	int one = 1;
+	int fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (0 != getaddrinfo(name, port, &hints, &res)) {
+		DE("Can't resolve %s:%s\n", name, port);
+		return (-1);
+	}
+
+	for (ai = res; NULL != ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0) continue;
+
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		/* Pipelined requests are small: don't let Nagle hold them */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		if (0 == connect(fd, ai->ai_addr, ai->ai_addrlen)) break;
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+	if (fd < 0) DE("Can't connect to %s:%s\n", name, port);
+	return (fd);
+}
+
+mp_soap_t *mp_soap_open(const char *control_url, const char *service_type)
+{
+	mp_soap_t *soap = NULL;
+	char name[SOAP_HOST_LEN];
+	char port[SOAP_PORT_LEN];
+
+	TESTP(control_url, NULL);
+	TESTP(service_type, NULL);
+
+	soap = zmalloc(sizeof(mp_soap_t));
+	TESTP_MES(soap, NULL, "Can't allocate mp_soap_t");
+	soap->fd = -1;
+	snprintf(soap->service, sizeof(soap->service), "%s", service_type);
+
+	if (EOK != mp_soap_parse_url(soap, control_url, name, port)) goto err;
+
+	soap->in = buf_new(NULL, SOAP_IO_LEN);
+	TESTP_GO(soap->in, err);
+	soap->out = buf_new(NULL, SOAP_REQ_LEN);
+	TESTP_GO(soap->out, err);
+
+	soap->fd = mp_soap_connect(name, port);
+	if (soap->fd < 0) goto err;
+
+	DD("Connected to IGD %s%s\n", soap->host, soap->path);
+	return (soap);
+err:
+	mp_soap_close(soap);
+	return (NULL);
+}
+
+void mp_soap_close(mp_soap_t *soap)
+{
+	if (NULL == soap) return;
+	if (soap->fd >= 0) close(soap->fd);
+	if (soap->in) buf_free(soap->in);
+	if (soap->out) buf_free(soap->out);
+	zfree(soap);
+}
+
+size_t mp_soap_in_flight(const mp_soap_t *soap)
+{
+	TESTP(soap, 0);
+	return (soap->in_flight);
+}
+
+int mp_soap_send(mp_soap_t *soap, const char *action, const char *args)
+{
+	char body[SOAP_REQ_LEN];
+	char head[SOAP_REQ_LEN];
+	int body_len;
+	int head_len;
+	size_t sent = 0;
+
+	TESTP(soap, EBAD);
+	TESTP(action, EBAD);
+	TESTP(args, EBAD);
+
+	if (soap->closing) {
+		DD("The router closes the connection, can't send more\n");
+		return (EBAD);
+	}
+
+	body_len = snprintf(body, sizeof(body),
+						"<?xml version=\"1.0\"?>\r\n"
+						"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+						"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+						"<s:Body><u:%s xmlns:u=\"%s\">%s</u:%s></s:Body></s:Envelope>\r\n",
+						action, soap->service, args, action);
+
+	head_len = snprintf(head, sizeof(head),
+						"POST %s HTTP/1.1\r\n"
+						"Host: %s\r\n"
+						"Content-Type: text/xml; charset=\"utf-8\"\r\n"
+						"SOAPAction: \"%s#%s\"\r\n"
+						"Content-Length: %d\r\n"
+						"Connection: keep-alive\r\n\r\n",
+						soap->path, soap->host, soap->service, action, body_len);
+
+	if (body_len < 0 || head_len < 0 || body_len >= (int)sizeof(body) || head_len >= (int)sizeof(head)) {
+		DE("SOAP request %s is too long\n", action);
+		return (EBAD);
+	}
+
+	/* One write per request: the router gets header and body in one segment */
+	buf_clean(soap->out);
+	if (EOK != buf_add(soap->out, head, (size_t)head_len) ||
+		EOK != buf_add(soap->out, body, (size_t)body_len)) {
+		return (EBAD);
+	}
+
+	while (sent < soap->out->len) {
+		ssize_t rc = send(soap->fd, soap->out->data + sent, soap->out->len - sent, MSG_NOSIGNAL);
+		if (rc <= 0) {
+			DE("Can't send SOAP request %s\n", action);
+			return (EBAD);
+		}
+		sent += (size_t)rc;
+	}
+
+	soap->in_flight++;
+	return (EOK);
+}
+
+/* Find header 'name' in the header block; returns pointer to its value */
+static const char *mp_soap_header(const char *head, const char *end, const char *name)
+{
+	size_t len = strlen(name);
+	const char *line = head;
+
+	while (line < end) {
+		const char *eol = memmem(line, (size_t)(end - line), "\r\n", 2);
+		if (NULL == eol) eol = end;
+		if ((size_t)(eol - line) > len && ':' == line[len] && 0 == strncasecmp(line, name, len)) {
+			line += len + 1;
+			while (' ' == *line || '\t' == *line) line++;
+			return (line);
+		}
+		line = eol + 2;
+	}
+	return (NULL);
+}
+
+/* Decode chunked body starting at 'p'; returns EAGN if not all of it received yet.
+   'used' set to the end of the body */
+static int mp_soap_dechunk(const char *p, const char *end, buf_t *body, const char **used)
+{
+	while (1) {
+		const char *eol = memmem(p, (size_t)(end - p), "\r\n", 2);
+		char *num_end = NULL;
+		unsigned long chunk;
+
+		if (NULL == eol) return (EAGN);
+		chunk = strtoul(p, &num_end, 16);
+		/* Hex size, then optional ";extension" up to the end of the line */
+		if (num_end == p || num_end > eol || (num_end != eol && ';' != *num_end && ' ' != *num_end)) {
+			DE("Bad chunk size\n");
+			return (EBAD);
+		}
+		if (chunk > SOAP_BODY_MAX || body->len + chunk > SOAP_BODY_MAX) {
+			DE("Too big HTTP body\n");
+			return (EBAD);
+		}
+		p = eol + 2;
+
+		if (0 == chunk) {
+			/* Optional trailer headers, then empty line */
+			eol = memmem(p, (size_t)(end - p), "\r\n", 2);
+			while (NULL != eol && eol != p) {
+				p = eol + 2;
+				eol = memmem(p, (size_t)(end - p), "\r\n", 2);
+			}
+			if (NULL == eol) return (EAGN);
+			*used = eol + 2;
+			return (EOK);
+		}
+
+		if ((size_t)(end - p) < chunk + 2) return (EAGN);
+		if (EOK != buf_add(body, p, chunk)) return (EBAD);
+		p += chunk + 2;
+	}
+}
+
+/* Parse one answer from the received bytes. Returns EAGN if it is not complete yet */
+static int mp_soap_parse(mp_soap_t *soap, int *status, buf_t **body)
+{
+	const char *start = soap->in->data + soap->off;
+	const char *end = soap->in->data + soap->in->len;
+	const char *head_end;
+	const char *val;
+	const char *used = NULL;
+	int minor = 0;
+	int rc;
+
+	head_end = memmem(start, (size_t)(end - start), "\r\n\r\n", 4);
+	if (NULL == head_end) {
+		if ((size_t)(end - start) > SOAP_HEADER_MAX) {
+			DE("Too long HTTP header\n");
+			return (EBAD);
+		}
+		return (EAGN);
+	}
+
+	if (2 != sscanf(start, "HTTP/1.%d %d", &minor, status)) {
+		DE("Bad HTTP status line\n");
+		return (EBAD);
+	}
+
+	/* HTTP/1.0 closes the connection unless asked to keep it */
+	val = mp_soap_header(start, head_end, "Connection");
+	if ((NULL != val && 0 == strncasecmp(val, "close", 5)) ||
+		(0 == minor && (NULL == val || 0 != strncasecmp(val, "keep-alive", 10)))) {
+		soap->closing = 1;
+	}
+
+	*body = buf_new(NULL, 0);
+	TESTP(*body, EBAD);
+	head_end += 4;
+
+	val = mp_soap_header(start, head_end, "Transfer-Encoding");
+	if (NULL != val && 0 == strncasecmp(val, "chunked", 7)) {
+		rc = mp_soap_dechunk(head_end, end, *body, &used);
+	} else if (NULL != (val = mp_soap_header(start, head_end, "Content-Length"))) {
+		char *num_end = NULL;
+		size_t len = strtoul(val, &num_end, 10);
+		rc = EAGN;
+		if (num_end == val || len > SOAP_BODY_MAX) {
+			DE("Bad Content-Length\n");
+			rc = EBAD;
+		} else if ((size_t)(end - head_end) >= len) {
+			rc = (0 == len || EOK == buf_add(*body, head_end, len)) ? EOK : EBAD;
+			used = head_end + len;
+		}
+	} else {
+		/* No length: the body ends when the router closes the connection */
+		DD("Answer without length, the connection can't be reused\n");
+		soap->closing = 1;
+		rc = EBAD;
+	}
+
+	if (EOK != rc) {
+		buf_free(*body);
+		*body = NULL;
+		return (rc);
+	}
+
+	soap->off = (size_t)(used - soap->in->data);
+	return (EOK);
+}
+
+buf_t *mp_soap_recv(mp_soap_t *soap, int *status)
+{
+	buf_t *body = NULL;
+
+	TESTP(soap, NULL);
+	TESTP(status, NULL);
+
+	if (0 == soap->in_flight) {
+		DE("No request in flight\n");
+		return (NULL);
+	}
+
+	while (1) {
+		int rc = mp_soap_parse(soap, status, &body);
+		ssize_t got;
+		char *tail;
+
+		if (EOK == rc) break;
+		if (EBAD == rc) return (NULL);
+
+		/* Drop parsed answers from the head before reading more */
+		if (soap->off > 0) {
+			memmove(soap->in->data, soap->in->data + soap->off, soap->in->len - soap->off + 1);
+			soap->in->len -= soap->off;
+			soap->off = 0;
+		}
+
+		tail = buf_reserve(soap->in, SOAP_IO_LEN);
+		TESTP(tail, NULL);
+		got = recv(soap->fd, tail, SOAP_IO_LEN, 0);
+		if (got <= 0) {
+			DD("IGD closed the connection or doesn't answer\n");
+			return (NULL);
+		}
+		buf_commit(soap->in, (size_t)got);
+	}
+
+	soap->in_flight--;
+	if (soap->off == soap->in->len) {
+		buf_clean(soap->in);
+		soap->off = 0;
+	}
+	return (body);
+}
+
+int mp_soap_arg(const buf_t *body, const char *name, char *val, size_t size)
+{
+	size_t len;
+	const char *p;
+
+	TESTP(body, EBAD);
+	TESTP(name, EBAD);
+	TESTP(val, EBAD);
+
+	val[0] = '\0';
+	len = strlen(name);
+	p = body->data;
+
+	/* "<name>" or "<prefix:name>" */
+	while (NULL != (p = strstr(p, name))) {
+		const char *v = p + len;
+		const char *v_end;
+
+		if (p > body->data && ('<' == p[-1] || ':' == p[-1]) && '>' == *v) {
+			v++;
+			v_end = strchr(v, '<');
+			if (NULL == v_end) return (EBAD);
+			snprintf(val, size, "%.*s", (int)(v_end - v), v);
+			return (EOK);
+		}
+		p = v;
+	}
+	return (EBAD);
+}
+
+int mp_soap_error(const buf_t *body)
+{
+	char code[SOAP_PORT_LEN];
+
+	if (EOK != mp_soap_arg(body, "errorCode", code, sizeof(code))) return (-1);
+	return (atoi(code));
+}
@@ -0,0 +1,31 @@
+#ifndef _SEC_SOAP_H_
+#define _SEC_SOAP_H_
+
+#include <stddef.h>
+#include "buf_t.h"
+
+/* UPnP SOAP over one persistent HTTP/1.1 connection to the IGD.
+   Requests can be pipelined: send several with mp_soap_send(), then
+   read the answers in the same order with mp_soap_recv().
+   On any error the connection is unusable: close it and fall back
+   to the miniupnpc serial calls. */
+
+typedef struct mp_soap_struct mp_soap_t;
+
+/* Connect to IGD control URL ("http://host:port/path") */
+extern /*@null@*/ mp_soap_t *mp_soap_open(const char *control_url, const char *service_type);
+extern void mp_soap_close(/*@null@*/ mp_soap_t *soap);
+
+/* Send request of 'action'; 'args' is XML of the arguments, like "<NewPortMappingIndex>0</NewPortMappingIndex>" */
+extern int mp_soap_send(mp_soap_t *soap, const char *action, const char *args);
+/* Read the next answer; returns the body (release with buf_free()) and sets the HTTP status in 'status' */
+extern /*@null@*/ buf_t *mp_soap_recv(mp_soap_t *soap, int *status);
+/* Number of requests sent and not answered yet */
+extern size_t mp_soap_in_flight(const mp_soap_t *soap);
+
+/* Copy value of element 'name' of the answer into 'val'; EBAD if there is no such element */
+extern int mp_soap_arg(const buf_t *body, const char *name, char *val, size_t size);
+/* UPnP error code of a SOAP fault answer; -1 if it is not a fault */
+extern int mp_soap_error(const buf_t *body);
+
+#endif /* _SEC_SOAP_H_ */
@@ -17,6 +17,11 @@
 #include "mp-common.h"
 #include "mp-jansson.h"
 #include "mp-dict.h"
+#include "mp-ctl.h"
+#include "buf_t.h"
+
+/* Size of one read / write of the forwarded stream */
+#define MP_SSH_IO_LEN 16384
 
 #ifndef INADDR_NONE
 #define INADDR_NONE (in_addr_t)-1
@@ -79,7 +84,8 @@ int mp_ssh_direct_forward(const char *server_ip,
 	struct timeval tv;
 	ssize_t len = 0;
 	ssize_t wr = 0;
-	char buf[16384];
+	buf_t *io = NULL;
+	char *tail = NULL;
 
 	int sockopt = -1;
 	int sock = -1;
@@ -254,6 +260,9 @@ int mp_ssh_direct_forward(const char *server_ip,
 	/* Must use non-blocking IO hereafter due to the current libssh2 API */
 	libssh2_session_set_blocking(session, 0);
 
+	/* One buffer for both directions, reused for every chunk */
+	io = buf_new(NULL, MP_SSH_IO_LEN);
+	TESTP_MES_GO(io, shutdown, "Can't allocate IO buffer");
 
 	while (1) {
 		FD_ZERO(&fds);
@@ -266,7 +275,10 @@ int mp_ssh_direct_forward(const char *server_ip,
 			goto shutdown;
 		}
 		if (rc && FD_ISSET(forwardsock, &fds)) {
-			len = recv(forwardsock, buf, sizeof(buf), 0);
+			buf_clean(io);
+			tail = buf_reserve(io, MP_SSH_IO_LEN);
+			TESTP_MES_GO(tail, shutdown, "Can't reserve IO buffer");
+			len = recv(forwardsock, tail, MP_SSH_IO_LEN, 0);
 			if (len < 0) {
 				perror("read");
 				goto shutdown;
@@ -275,9 +287,13 @@ int mp_ssh_direct_forward(const char *server_ip,
 				   sport);
 				goto shutdown;
 			}
+			if (EOK != buf_commit(io, (size_t)len)) {
+				DE("Can't commit %zd bytes to IO buffer\n", len);
+				goto shutdown;
+			}
 			wr = 0;
 			while (wr < len) {
-				i = libssh2_channel_write(channel, buf + wr, len - wr);
+				i = libssh2_channel_write(channel, io->data + wr, len - wr);
 
 				if (LIBSSH2_ERROR_EAGAIN == i) {
 					continue;
@@ -290,16 +306,23 @@ int mp_ssh_direct_forward(const char *server_ip,
 			}
 		}
 		while (1) {
-			len = libssh2_channel_read(channel, buf, sizeof(buf));
+			buf_clean(io);
+			tail = buf_reserve(io, MP_SSH_IO_LEN);
+			TESTP_MES_GO(tail, shutdown, "Can't reserve IO buffer");
+			len = libssh2_channel_read(channel, tail, MP_SSH_IO_LEN);
 
 			if (LIBSSH2_ERROR_EAGAIN == len) break;
 			else if (len < 0) {
 				DE("libssh2_channel_read: %d", (int)len);
 				goto shutdown;
 			}
+			if (EOK != buf_commit(io, (size_t)len)) {
+				DE("Can't commit %zd bytes to IO buffer\n", len);
+				goto shutdown;
+			}
 			wr = 0;
 			while (wr < len) {
-				i = send(forwardsock, buf + wr, len - wr, 0);
+				i = send(forwardsock, io->data + wr, len - wr, 0);
 				if (i <= 0) {
 					perror("write");
 					goto shutdown;
@@ -316,6 +339,7 @@ int mp_ssh_direct_forward(const char *server_ip,
 	}
 
 shutdown:
+	if (NULL != io) buf_free(io);
 	close(forwardsock);
 	close(listensock);
 	if (channel) libssh2_channel_free(channel);
@@ -337,9 +361,7 @@ void *ssh_thread(void *arg)
 
 	char *local_listenip = "127.0.0.1";
 	char *server_ip = NULL;
-	char *remote_destport_src = NULL;
 	unsigned int remote_destport = 0;
-	char *local_listenport_str = NULL;
 	unsigned int local_listenport = 0;
 	char *pub_key_name = NULL;
 	char *priv_key_name = NULL;
@@ -365,13 +387,17 @@ void *ssh_thread(void *arg)
 	j_print(root, "In ssh_thread: arguments are: ");
 	server_ip = j_find_ref(root, JK_SSH_SERVER);
 	TESTP(server_ip, NULL);
-	remote_destport_src = j_find_ref(root, JK_SSH_DESTPORT);
-	TESTP(remote_destport_src, NULL);
-	remote_destport = atoi(remote_destport_src);
+	remote_destport = (unsigned int)ctl_port_get(root, JK_SSH_DESTPORT);
+	if (0 == remote_destport) {
+		DE("Can't find remote port\n");
+		return (NULL);
+	}
 
-	local_listenport_str = j_find_ref(root, JK_SSH_LOCALPORT);
-	TESTP(local_listenport_str, NULL);
-	local_listenport = atoi(local_listenport_str);
+	local_listenport = (unsigned int)ctl_port_get(root, JK_SSH_LOCALPORT);
+	if (0 == local_listenport) {
+		DE("Can't find local port\n");
+		return (NULL);
+	}
 
 	pub_key_name = j_find_ref(root, JK_SSH_PUBKEY);
 	TESTP(pub_key_name, NULL);